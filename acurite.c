@@ -7,9 +7,12 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/stat.h>
 
 #include "ook.h"
+#include "protocols.h"
+#include "metrics.h"
 
 #define ACURITE_MSGTYPE_5N1_WINDSPEED_WINDDIR_RAINFALL  0x31
 #define ACURITE_MSGTYPE_5N1_WINDSPEED_TEMP_HUMIDITY     0x38
@@ -53,242 +56,168 @@ struct report {
     uint32_t rain:14;     // mm
 };
 static const uint8_t chanMap[] = { 3, 0, 2, 1};
-		
 
-static bool isStart( uint32_t high_ns, uint32_t low_ns) {
-    return high_ns >= 600000 && high_ns <= 700000 && low_ns >= 500000 && low_ns <= 600000;
-}
-static bool isOne( uint32_t high_ns, uint32_t low_ns) {
-    return high_ns >= 400000 && high_ns <= 500000 && low_ns >= 100000 && low_ns <= 220000;
-}
-static bool isZero( uint32_t high_ns, uint32_t low_ns) {
-    return high_ns >= 200000 && high_ns <= 300000 && low_ns >= 300000 && low_ns <= 400000;
-}
-static bool isStop( uint32_t high_ns, uint32_t low_ns) {
-    return high_ns >= 200000 && high_ns <= 300000 && low_ns >= 500000;
-}
+// Copies of a message which didn't check out alone, see acurite_vote_frames()
+static struct ook_vote vote;
 
 static struct report decode_acurite( const struct ook_burst *burst) {
-    enum { IDLE=0, STARTS, CONTENT } state = IDLE;
-    unsigned idleGarbage = 0;
-    unsigned falseStarts = 0;
-
     uint8_t data[8];
-    uint32_t bits = 0;
-    
-    for ( uint32_t p = 0; p < burst->pulses; p++) {
-	switch( state) {
-	  case IDLE:
-	    if ( isStart( burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds) ) {
-		state = STARTS;
-	    } else {
-		idleGarbage++;
-	    }
-	    break;
-	  case STARTS:
-	    if ( isStart(burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds)) continue;
-	    if ( !isOne(burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds) &&
-		 !isZero(burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds)) {
-		state = IDLE;
-		falseStarts++;
-		continue;
-	    }
-	    state = CONTENT;
-	    bits = 0;
-	    memset( data, 0, sizeof data);
-	    
-	    // FALLTHROUGH!!!!!!!
-	  case CONTENT:
-	    if ( isOne(burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds) ) {
-		if ( bits < 8*sizeof(data)) {
-		    uint8_t byte = bits/8;
-		    uint8_t bit = 1 << (7 - bits%8);
-		    
-		    data[byte] |= bit;
-		}
-		bits++;
-	    } else if ( isZero(burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds)) {
-		bits++;
-	    } else if ( isStop(burst->pulse[p].hiNanoseconds, burst->pulse[p].lowNanoseconds)) {
-		if (verbose) {
-		    fprintf(stderr, "At stop we have %d bits, ", bits);
-		    for ( uint8_t i = 0; i < bits/8; i++) fprintf(stderr, "%02x", data[i]);
-		    fprintf(stderr, "\n");
-		}
-		
-		state = IDLE;
-
-		if ( bits % 8 != 0 ) {
-		    if (verbose) fprintf(stderr, "Not an integral number of bytes: %d bits\n", bits);
-		    continue;
-		}
-		if ( bits > 8 * sizeof(data)) {
-		    if (verbose) fprintf(stderr, "Bits overran buffer: %d bits\n", bits);
-		    continue;
-		}
-
-		uint8_t sum = 0;
-		for ( uint8_t i = 0; i < bits/8 - 1; i++) sum += data[i]; 
-		
-		if ( sum != data[ bits/8 - 1 ] ) {
-		    if (verbose) fprintf(stderr, "CRC invalid: %02x != %02x\n", sum, data[ bits/8 -1]);
-		    continue;
-		}
-
-		if ( bits < 56) {
-		    if ( verbose) fprintf(stderr, "Too short to be an acurite message: %d bits\n", bits);
-		    continue;
-		}
-
-		uint8_t battery = (data[2]>>6) & 1;
-		uint8_t message = (data[2]) & 0x3f;
-		uint8_t mParity = (data[2]>>7) & 1;
-		
-		if ( mParity != ( (__builtin_popcount( message) + battery) & 1)) {
-		    if ( verbose) fprintf(stderr, "parity error in message code\n");
-		    continue;
-		}
-
-		switch( message) {
-		  case 4:       // 592TXR
-		      {
-			  if ( bits != 56) {
-			      if ( verbose) fprintf(stderr, "592TXR message is not 56 bits\n");
-			      continue;
-			  }
-
-			  uint8_t channel = chanMap[ (data[0]>>6) & 0x03];
-			  uint16_t id = (( data[0] & 0x3f)<<8) | data[1];
-
-			  uint8_t humidity = data[3] & 0x7f;
-			  uint8_t hParity = (data[3]>>7) & 1;
-			  if ( hParity != (__builtin_popcount( humidity) & 1)) {
-			      if ( verbose) fprintf(stderr, "parity error in humidity\n");
-			      continue;
-			  }
-
-			  uint8_t tempHigh = data[4] & 0x7f;
-			  uint8_t tempLow = data[5] & 0x7f;
-			  uint16_t temperatureRaw = (tempHigh<<7) | tempLow;
-			  uint16_t temperature10 = temperatureRaw - 1000;
-			  uint8_t tHighParity = (data[4]>>7) & 1;
-			  uint8_t tLowParity = (data[5]>>7) & 1;
-
-			  if ( tHighParity != (__builtin_popcount( tempHigh) & 1) ||
-			       tLowParity != (__builtin_popcount( tempLow) & 1)) {
-			      if ( verbose) fprintf(stderr, "parity error in temperature\n");
-			      continue;
-			  }
-			  if ( verbose) fprintf(stderr, "  chan=%d id=%d bat=%d msg=%d temperature=%.1f hum=%d\n", channel, id, battery, message, temperature10/10.0,  humidity);
-			  struct report good = { .valid = 1,
-						 .channel = channel,
-						 .id = id,
-						 .batteryLow = !battery,
-						 .temperature = temperature10,
-						 .humidity = humidity};
-			  return good;
-		      }
-		  case ACURITE_MSGTYPE_5N1_WINDSPEED_TEMP_HUMIDITY:
-		  case ACURITE_MSGTYPE_5N1_WINDSPEED_WINDDIR_RAINFALL:
-		      {
-			  if ( bits != 64) {
-			      if ( verbose) fprintf(stderr, "5-n-1 message is not 64 bits\n");
-			      continue;
-			  }
-
-			  uint8_t channel = chanMap[ (data[0]>>6) & 0x03];
-			  // uint8_t resend = (data[0])>>4 & 0x03; 
-			  uint16_t id = (( data[0] & 0x0f)<<8) | data[1];
-
-			  uint16_t pulsesPerFourSeconds = ((data[3]<<3) & 0xf8) | ((data[4]>>4) & 0x07);
-			  float windKmPerHour = pulsesPerFourSeconds * 0.8278 + 1.00;
-			  float windSpeedMetersPerSecond = pulsesPerFourSeconds == 0 ? 0.0 : windKmPerHour * 0.27778;
-
-			  static bool stashedTemperatureValid = false;
-			  static float stashedTemperature = 0;
-			  static uint8_t stashedHumidity = 0;
-
-			  static bool stashedDirectionValid = false;
-			  static uint8_t stashedDirection = 0;
-			  static uint16_t stashedRain = 0;
-			  
-			  switch (message) {
-			    case ACURITE_MSGTYPE_5N1_WINDSPEED_TEMP_HUMIDITY:
-				{
-				    uint16_t tempRaw = ((data[4]<<7) & 0x780) | (data[5] & 0x7F);
-				    float temperatureF = (tempRaw - 400) * 0.1;
-				    float temperature = (temperatureF - 32.0)*(100.0/180.0);
-					
-				    uint8_t humidity = (data[6] & 0x7f);
-				    if ( verbose) fprintf(stderr, "  msg=%d chan=%d id=%d wind speed = %.1fm/s temp=%.1f hum=%d\n", message, channel, id, windSpeedMetersPerSecond, temperature, humidity);
-
-				    stashedTemperatureValid = true;
-				    stashedTemperature = temperature;
-				    stashedHumidity = humidity;
-
-				    if ( stashedDirectionValid) {
-					struct report good = { .valid = 1,
-							       .channel = channel,
-							       .id = id,
-							       .batteryLow = !battery,
-							       .temperature = temperature*10.0,
-							       .humidity = humidity,
-							       .windValid = true,
-							       .wind10 = windSpeedMetersPerSecond * 10.0,
-							       .direction = stashedDirection,
-							       .rainValid = true,
-							       .rain = stashedRain,
-					};
-					stashedDirectionValid = false;  // we used it
-					return good;
-				    } else {
-					continue;
-				    }
-				}
-			    case ACURITE_MSGTYPE_5N1_WINDSPEED_WINDDIR_RAINFALL:
-				{
-				    uint8_t direction = acurite_5n1_winddirections[ data[4] & 0x0f];
-				    float rainInches = ( ((data[5]<<7)&0x3f80) & (data[6] & 0x7f) ) / 100.0;
-				    float rainmm = rainInches * 25.4;
-
-				    stashedDirectionValid = true;
-				    stashedDirection = direction;
-				    stashedRain = rainmm;
-				    
-				    if ( verbose) fprintf(stderr, "  msg=%d chan=%d id=%d wind speed = %.1fm/s windDir=%.1fdeg rain=%.1fmm\n", message, channel, id, windSpeedMetersPerSecond, direction*22.5, rainmm);
-				    if ( stashedTemperatureValid) {
-					struct report good = { .valid = 1,
-							       .channel = channel,
-							       .id = id,
-							       .batteryLow = !battery,
-							       .temperature = stashedTemperature*10.0,
-							       .humidity = stashedHumidity,
-							       .windValid = true,
-							       .wind10 = windSpeedMetersPerSecond * 10.0,
-							       .direction = direction,
-							       .rainValid = true,
-							       .rain = rainmm,
-					};
-					stashedTemperatureValid = false;  // we used it
-					return good;
-				    } else {
-					continue;
-				    }
-				}
-			    default:
-			      fprintf(stderr,"5n1 got stupid message: %d\n", message);
-			      continue;
-			  }
-			  continue;
-		      }
-		  default:
-		    if ( verbose) fprintf(stderr, "Unknown acurite message code: %d\n", message);
-		    continue;
-		}
-	    } else {
-		if ( verbose) fprintf(stderr, "Message fell apart in content.\n");
-		state = IDLE;
-	    }
+    uint32_t position = 0;
+    int bits;
+    int checked = 0;
+    int voted = 0;
+
+    for (;;) {
+	bits = acurite_next_frame( burst, &position, data, verbose);
+	if ( bits > 0) {
+	    checked++;
+	    ook_vote_reset( &vote);
+	} else {
+	    // no copy was good alone, see if they are together, with any from just before
+	    if ( checked || voted++) break;
+	    bits = acurite_vote_frames( burst, &vote, data, verbose);
+	    if ( bits <= 0) break;
+	    ook_vote_reset( &vote);
+	}
+
+	uint8_t battery = (data[2]>>6) & 1;
+	uint8_t message = (data[2]) & 0x3f;
+
+	switch( message) {
+	  case 4:       // 592TXR
+	      {
+		  if ( bits != 56) {
+		      if ( verbose) fprintf(stderr, "592TXR message is not 56 bits\n");
+		      continue;
+		  }
+
+		  uint8_t channel = chanMap[ (data[0]>>6) & 0x03];
+		  uint16_t id = (( data[0] & 0x3f)<<8) | data[1];
+
+		  uint8_t humidity = data[3] & 0x7f;
+		  uint8_t hParity = (data[3]>>7) & 1;
+		  if ( hParity != (__builtin_popcount( humidity) & 1)) {
+		      if ( verbose) fprintf(stderr, "parity error in humidity\n");
+		      continue;
+		  }
+
+		  uint8_t tempHigh = data[4] & 0x7f;
+		  uint8_t tempLow = data[5] & 0x7f;
+		  uint16_t temperatureRaw = (tempHigh<<7) | tempLow;
+		  uint16_t temperature10 = temperatureRaw - 1000;
+		  uint8_t tHighParity = (data[4]>>7) & 1;
+		  uint8_t tLowParity = (data[5]>>7) & 1;
+
+		  if ( tHighParity != (__builtin_popcount( tempHigh) & 1) ||
+		       tLowParity != (__builtin_popcount( tempLow) & 1)) {
+		      if ( verbose) fprintf(stderr, "parity error in temperature\n");
+		      continue;
+		  }
+		  if ( verbose) fprintf(stderr, "  chan=%d id=%d bat=%d msg=%d temperature=%.1f hum=%d\n", channel, id, battery, message, temperature10/10.0,  humidity);
+		  struct report good = { .valid = 1,
+					 .channel = channel,
+					 .id = id,
+					 .batteryLow = !battery,
+					 .temperature = temperature10,
+					 .humidity = humidity};
+		  return good;
+	      }
+	  case ACURITE_MSGTYPE_5N1_WINDSPEED_TEMP_HUMIDITY:
+	  case ACURITE_MSGTYPE_5N1_WINDSPEED_WINDDIR_RAINFALL:
+	      {
+		  if ( bits != 64) {
+		      if ( verbose) fprintf(stderr, "5-n-1 message is not 64 bits\n");
+		      continue;
+		  }
+
+		  uint8_t channel = chanMap[ (data[0]>>6) & 0x03];
+		  // uint8_t resend = (data[0])>>4 & 0x03; 
+		  uint16_t id = (( data[0] & 0x0f)<<8) | data[1];
+
+		  uint16_t pulsesPerFourSeconds = ((data[3]<<3) & 0xf8) | ((data[4]>>4) & 0x07);
+		  float windKmPerHour = pulsesPerFourSeconds * 0.8278 + 1.00;
+		  float windSpeedMetersPerSecond = pulsesPerFourSeconds == 0 ? 0.0 : windKmPerHour * 0.27778;
+
+		  static bool stashedTemperatureValid = false;
+		  static float stashedTemperature = 0;
+		  static uint8_t stashedHumidity = 0;
+
+		  static bool stashedDirectionValid = false;
+		  static uint8_t stashedDirection = 0;
+		  static uint16_t stashedRain = 0;
+		  
+		  switch (message) {
+		    case ACURITE_MSGTYPE_5N1_WINDSPEED_TEMP_HUMIDITY:
+			{
+			    uint16_t tempRaw = ((data[4]<<7) & 0x780) | (data[5] & 0x7F);
+			    float temperatureF = (tempRaw - 400) * 0.1;
+			    float temperature = (temperatureF - 32.0)*(100.0/180.0);
+				
+			    uint8_t humidity = (data[6] & 0x7f);
+			    if ( verbose) fprintf(stderr, "  msg=%d chan=%d id=%d wind speed = %.1fm/s temp=%.1f hum=%d\n", message, channel, id, windSpeedMetersPerSecond, temperature, humidity);
+
+			    stashedTemperatureValid = true;
+			    stashedTemperature = temperature;
+			    stashedHumidity = humidity;
+
+			    if ( stashedDirectionValid) {
+				struct report good = { .valid = 1,
+						       .channel = channel,
+						       .id = id,
+						       .batteryLow = !battery,
+						       .temperature = temperature*10.0,
+						       .humidity = humidity,
+						       .windValid = true,
+						       .wind10 = windSpeedMetersPerSecond * 10.0,
+						       .direction = stashedDirection,
+						       .rainValid = true,
+						       .rain = stashedRain,
+				};
+				stashedDirectionValid = false;  // we used it
+				return good;
+			    } else {
+				continue;
+			    }
+			}
+		    case ACURITE_MSGTYPE_5N1_WINDSPEED_WINDDIR_RAINFALL:
+			{
+			    uint8_t direction = acurite_5n1_winddirections[ data[4] & 0x0f];
+			    float rainInches = ( ((data[5]<<7)&0x3f80) & (data[6] & 0x7f) ) / 100.0;
+			    float rainmm = rainInches * 25.4;
+
+			    stashedDirectionValid = true;
+			    stashedDirection = direction;
+			    stashedRain = rainmm;
+			    
+			    if ( verbose) fprintf(stderr, "  msg=%d chan=%d id=%d wind speed = %.1fm/s windDir=%.1fdeg rain=%.1fmm\n", message, channel, id, windSpeedMetersPerSecond, direction*22.5, rainmm);
+			    if ( stashedTemperatureValid) {
+				struct report good = { .valid = 1,
+						       .channel = channel,
+						       .id = id,
+						       .batteryLow = !battery,
+						       .temperature = stashedTemperature*10.0,
+						       .humidity = stashedHumidity,
+						       .windValid = true,
+						       .wind10 = windSpeedMetersPerSecond * 10.0,
+						       .direction = direction,
+						       .rainValid = true,
+						       .rain = rainmm,
+				};
+				stashedTemperatureValid = false;  // we used it
+				return good;
+			    } else {
+				continue;
+			    }
+			}
+		    default:
+		      fprintf(stderr,"5n1 got stupid message: %d\n", message);
+		      continue;
+		  }
+		  continue;
+	      }
+	  default:
+	    if ( verbose) fprintf(stderr, "Unknown acurite message code: %d\n", message);
+	    continue;
 	}
     }
 
@@ -335,23 +264,54 @@ static void writeReport( const struct report *report, const char *template) {
 static void showHelp( FILE *f)
 {
     fprintf(f, 
-	    "Usage: acurite [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface]\n"
+	    "Usage: acurite [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-R ring] [-B bytes]\n"
 	    "  -h | -? | --help                      display usage and exit\n"
 	    "  -v | --verbose                        verbose logging\n"
 	    "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
 	    "  -p port | --multicast-port port       multicast port, default 3636\n"
 	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -R name | --ring name                 read bursts from ookd's shared memory ring instead, e.g. /ookd-ring\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving faster than we decode them\n"
 	    "  -r path | --recent path               path to most recent data, /tmp/current-weather, appends channel, identifier, and .json.\n"
+	    "  -s name | --stats-shm name            publish latency metrics in shared memory with this name, for ookstats\n"
 	    );
 }
 
 
+// What the handlers need from main()
+static struct metrics *metrics = 0;
+static const char *recentFileName = "/tmp/current-weather";
+
+static void handleBurst( struct ook_burst *burst, int sock, void *ctx)
+{
+    metricsBurstReceived( metrics, burst);
+    metricsReceiveStats( metrics, sock);
+
+    if ( verbose) fprintf(stderr, "Considering a %u pulse burst...\n", burst->pulses);
+    struct report r = decode_acurite( burst);
+
+    if ( r.valid) {
+	metricsBurstDecoded( metrics, burst);
+	writeReport( &r, recentFileName);
+	metricsBurstOutput( metrics, burst);
+    }
+    
+    fflush(stdout);
+}
+
+static void stopOnSignal( int signum, void *ctx)
+{
+    ook_loop_stop( ctx);
+}
+
 int main( int argc, char **argv)
 {
     const char *multicastAddress = "236.0.0.1";
     const char *multicastPort = "3636";
     const char *multicastInterface = "127.0.0.1";
-    const char *recentFileName = "/tmp/current-weather";
+    const char *ringName = 0;
+    int receiveBuffer = 0;
+    const char *statsShmName = 0;
 
     // Handle options
     for(;;) {
@@ -362,11 +322,14 @@ int main( int argc, char **argv)
 	    { "multicast-address", required_argument, 0, 'a'},
 	    { "multicast-port", required_argument, 0, 'p' },
 	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "receive-buffer", required_argument, 0, 'B' },
 	    { "recent", required_argument, 0, 'r' },
+	    { "stats-shm", required_argument, 0, 's' },
 	    { 0,0,0,0}
 	};
 
-	int c = getopt_long( argc, argv, "vh?f:a:p:i:r:", options, &optionIndex );
+	int c = getopt_long( argc, argv, "vh?f:a:p:i:r:s:R:B:", options, &optionIndex );
 	if ( c == -1) break;
 
 	switch(c) {
@@ -386,9 +349,22 @@ int main( int argc, char **argv)
 	  case 'i':
 	    multicastInterface = optarg;
 	    break;
+	  case 'R':
+	    ringName = optarg;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	  case 'r':
 	    recentFileName = optarg;
 	    break;
+	  case 's':
+	    statsShmName = optarg;
+	    break;
 	  default:
 	    fprintf(stderr,"Illegal option\n");
 	    showHelp(stderr);
@@ -398,39 +374,38 @@ int main( int argc, char **argv)
 
     if ( verbose) fprintf(stderr,"Recent file is %s\n", recentFileName);
 
-    // Parse our multicast address
-    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
-    if ( sock < 0) {
-	fprintf(stderr,"Failed to open multicast interface\n");
-	exit(1);
+    if ( statsShmName) {
+	metrics = metricsOpen( statsShmName);
+	if ( !metrics) exit(1);
     }
 
-    for (;;) {
-	struct ook_burst *burst;
-	struct sockaddr_storage addr;
-	socklen_t addrLen = sizeof(addr);
-
-	int e = ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
-	if ( e < 0) {
-	    fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
-	    break;
-	}
-	if ( e == 0) {
-	    fprintf(stderr,"Corrupt burst\n");
-	    continue;
+    // Bursts come from ookd's ring if we share its host and were asked to, otherwise multicast
+    struct ook_ring *ring = 0;
+    int sock = -1;
+    if ( ringName) {
+	ring = ook_ring_attach( ringName);
+	if ( !ring) exit(1);
+    } else {
+	sock = ook_open( multicastAddress, multicastPort, multicastInterface);
+	if ( sock < 0) {
+	    fprintf(stderr,"Failed to open multicast interface\n");
+	    exit(1);
 	}
+	if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) exit(1);
+    }
 
-	if ( verbose) fprintf(stderr, "Considering a %u pulse burst...\n", burst->pulses);
-	struct report r = decode_acurite( burst);
+    struct ook_loop *loop = ook_loop_new();
+    if ( !loop) exit(1);
+    if ( (ring ? ook_loop_add_ring( loop, ring, handleBurst, 0, verbose)
+	       : ook_loop_add_socket( loop, sock, handleBurst, 0, verbose)) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGINT, stopOnSignal, loop) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGTERM, stopOnSignal, loop) < 0) exit(1);
 
-	if ( r.valid) {
-	    writeReport( &r, recentFileName);
-	}
-	
-	fflush(stdin);
-	free(burst);
-    }
+    ook_loop_run( loop);
 
-    close(sock);
+    ook_loop_free( loop);
+    if ( sock >= 0) close(sock);
+    ook_ring_detach( ring);
+    metricsClose( metrics, statsShmName);
     return 0;
 }
@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "checksum.h"
+
+#define LANES8 0x0101010101010101ULL
+#define LANES16 0x0001000100010001ULL
+
+void crc8Init( struct crc8 *c, uint8_t polynomial)
+{
+    for ( int b = 0; b < 256; b++) {
+	uint8_t crc = b;
+	for ( int i = 0; i < 8; i++) crc = (crc & 0x80) ? (crc << 1) ^ polynomial : crc << 1;
+	c->table[0][b] = crc;
+    }
+    // another zero byte after it is one more trip through the table
+    for ( int k = 1; k < 8; k++) {
+	for ( int b = 0; b < 256; b++) c->table[k][b] = c->table[0][ c->table[k-1][b]];
+    }
+}
+
+uint8_t crc8Update( const struct crc8 *c, uint8_t crc, const uint8_t *data, size_t len)
+{
+    const uint8_t (*t)[256] = c->table;
+
+    for ( ; len >= 8; data += 8, len -= 8) {
+	crc = t[7][crc ^ data[0]] ^ t[6][data[1]] ^ t[5][data[2]] ^ t[4][data[3]] ^
+	    t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    while ( len--) crc = t[0][crc ^ *data++];
+    return crc;
+}
+
+void crc16Init( struct crc16 *c, uint16_t polynomial)
+{
+    for ( int b = 0; b < 256; b++) {
+	uint16_t crc = b << 8;
+	for ( int i = 0; i < 8; i++) crc = (crc & 0x8000) ? (crc << 1) ^ polynomial : crc << 1;
+	c->table[0][b] = crc;
+    }
+    for ( int k = 1; k < 4; k++) {
+	for ( int b = 0; b < 256; b++) {
+	    uint16_t prev = c->table[k-1][b];
+	    c->table[k][b] = (prev << 8) ^ c->table[0][prev >> 8];
+	}
+    }
+}
+
+uint16_t crc16Update( const struct crc16 *c, uint16_t crc, const uint8_t *data, size_t len)
+{
+    const uint16_t (*t)[256] = c->table;
+
+    for ( ; len >= 4; data += 4, len -= 4) {
+	uint16_t x = crc ^ (data[0] << 8 | data[1]);
+	crc = t[3][x >> 8] ^ t[2][x & 0xff] ^ t[1][data[2]] ^ t[0][data[3]];
+    }
+    while ( len--) crc = (crc << 8) ^ t[0][(crc >> 8) ^ *data++];
+    return crc;
+}
+
+// Eight bytes are added at once by pairing them into 16 bit lanes, which can't overflow, and
+// then adding the lanes with a multiply, the total ends up in the top lane.
+uint32_t checksumBytes( uint32_t sum, const uint8_t *data, size_t len)
+{
+    for ( ; len >= 8; data += 8, len -= 8) {
+	uint64_t v;
+	memcpy( &v, data, 8);
+	uint64_t pairs = (v & (0xff*LANES16)) + ((v >> 8) & (0xff*LANES16));
+	sum += (pairs * LANES16) >> 48;
+    }
+    while ( len--) sum += *data++;
+    return sum;
+}
+
+// The same with the nibbles, both of a byte fit in its own lane
+uint32_t checksumNibbles( uint32_t sum, const uint8_t *data, size_t len)
+{
+    for ( ; len >= 8; data += 8, len -= 8) {
+	uint64_t v;
+	memcpy( &v, data, 8);
+	uint64_t bytes = (v & (0x0f*LANES8)) + ((v >> 4) & (0x0f*LANES8));
+	sum += (bytes * LANES8) >> 56;
+    }
+    for ( ; len--; data++) sum += (*data >> 4) + (*data & 0x0f);
+    return sum;
+}
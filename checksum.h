@@ -0,0 +1,60 @@
+#ifndef CHECKSUM_IS_IN
+#define CHECKSUM_IS_IN
+
+/*
+** The checks the decoders' frames carry, shared so each is written once and
+** fast. A decoder trying bit flips on a failed frame, see ook_flip_search(),
+** checks it again for every try, so these are table driven and take several
+** bytes a step: slicing by 8 for CRC8, by 4 for CRC16, and sums of 8 bytes at
+** once in a 64 bit word. None of it needs more than the base architecture.
+**
+** Everything is incremental, pass back what the last call returned to carry on
+** with more data, and start from 0 or the check's initial value.
+**
+** CRCs are the most significant bit first kind, not reflected and with no
+** final xor, as Fine Offset's is.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct crc8 {
+    uint8_t table[8][256];         // [k][b] is the CRC of byte b followed by k zero bytes
+};
+
+struct crc16 {
+    uint16_t table[4][256];
+};
+
+/*
+** Make the tables for a polynomial, e.g. 0x31 for Fine Offset's CRC8 or 0x1021 for CCITT's CRC16,
+** without its top bit.
+*/
+void crc8Init( struct crc8 *c, uint8_t polynomial);
+void crc16Init( struct crc16 *c, uint16_t polynomial);
+
+/*
+** Carry crc on over len more bytes of data.
+*/
+uint8_t crc8Update( const struct crc8 *c, uint8_t crc, const uint8_t *data, size_t len);
+uint16_t crc16Update( const struct crc16 *c, uint16_t crc, const uint8_t *data, size_t len);
+
+/*
+** Add len bytes of data to sum, the whole sum, take what the check keeps of it, e.g. & 0xff.
+*/
+uint32_t checksumBytes( uint32_t sum, const uint8_t *data, size_t len);
+
+/*
+** Add both nibbles of each of len bytes to sum.
+*/
+uint32_t checksumNibbles( uint32_t sum, const uint8_t *data, size_t len);
+
+/*
+** 1 if an odd number of bits are set.
+*/
+static inline int checksumParity( uint32_t v)
+{
+    return __builtin_parity( v);
+}
+
+#endif
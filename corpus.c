@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "corpus.h"
+
+// A tar file is 512 byte blocks. Each member is a header block followed by
+// its contents padded out to a whole block. Two zero blocks end the archive.
+#define TAR_BLOCK 512
+#define TAR_NAME 0
+#define TAR_NAME_LEN 100
+#define TAR_SIZE 124
+#define TAR_SIZE_LEN 12
+#define TAR_MTIME 136
+#define TAR_MTIME_LEN 12
+#define TAR_CHECKSUM 148
+#define TAR_CHECKSUM_LEN 8
+#define TAR_TYPEFLAG 156
+
+static int64_t octal( const unsigned char *field, size_t len)
+{
+    int64_t v = 0;
+    size_t i = 0;
+
+    while ( i < len && field[i] == ' ') i++;
+    if ( i == len || field[i] < '0' || field[i] > '7') return -1;
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; i++) v = v*8 + (field[i]-'0');
+    return v;
+}
+
+static int headerOk( const unsigned char *h)
+{
+    int64_t expected = octal( h+TAR_CHECKSUM, TAR_CHECKSUM_LEN);
+    int64_t sum = 0;
+
+    // the checksum field itself counts as spaces
+    for ( int i = 0; i < TAR_BLOCK; i++) {
+	sum += ( i >= TAR_CHECKSUM && i < TAR_CHECKSUM+TAR_CHECKSUM_LEN) ? ' ' : h[i];
+    }
+    return sum == expected;
+}
+
+static int isZeroBlock( const unsigned char *h)
+{
+    for ( int i = 0; i < TAR_BLOCK; i++) if ( h[i]) return 0;
+    return 1;
+}
+
+int corpusLoad( const char *fileName, struct corpus *c)
+{
+    memset( c, 0, sizeof(*c));
+
+    FILE *f = fopen( fileName, "r");
+    if ( !f) {
+	fprintf(stderr, "Failed to open corpus '%s': %s\n", fileName, strerror(errno));
+	return -1;
+    }
+
+    size_t allocated = 0;
+    for (;;) {
+	if ( c->fileLen == allocated) {
+	    allocated = allocated ? 2*allocated : 65536;
+	    unsigned char *bigger = realloc( c->file, allocated);
+	    if ( !bigger) {
+		fprintf(stderr, "Failed to allocate for corpus '%s'\n", fileName);
+		goto Fail;
+	    }
+	    c->file = bigger;
+	}
+	size_t n = fread( c->file + c->fileLen, 1, allocated - c->fileLen, f);
+	c->fileLen += n;
+	if ( n == 0) break;
+    }
+    if ( ferror(f)) {
+	fprintf(stderr, "Failed to read corpus '%s': %s\n", fileName, strerror(errno));
+	goto Fail;
+    }
+    fclose(f);
+    f = 0;
+
+    size_t entriesAllocated = 0;
+    size_t off = 0;
+    while ( off + TAR_BLOCK <= c->fileLen) {
+	const unsigned char *h = c->file + off;
+	if ( isZeroBlock(h)) break;
+
+	if ( !headerOk(h)) {
+	    fprintf(stderr, "Bad tar header checksum at offset %zu of '%s'\n", off, fileName);
+	    goto Fail;
+	}
+	int64_t size = octal( h+TAR_SIZE, TAR_SIZE_LEN);
+	if ( size < 0 || off + TAR_BLOCK + size > c->fileLen) {
+	    fprintf(stderr, "Bad tar member size at offset %zu of '%s'\n", off, fileName);
+	    goto Fail;
+	}
+	const unsigned char *data = h + TAR_BLOCK;
+	off += TAR_BLOCK + (size + TAR_BLOCK - 1)/TAR_BLOCK*TAR_BLOCK;
+
+	// Only regular files are bursts, skip pax headers and the like
+	if ( h[TAR_TYPEFLAG] != '0' && h[TAR_TYPEFLAG] != 0) continue;
+
+	struct ook_burst *burst = 0;
+	if ( ook_decode( data, size, &burst) <= 0) {
+	    c->corrupt++;
+	    continue;
+	}
+
+	if ( c->count == entriesAllocated) {
+	    entriesAllocated = entriesAllocated ? 2*entriesAllocated : 256;
+	    struct corpusEntry *bigger = realloc( c->entry, entriesAllocated*sizeof(c->entry[0]));
+	    if ( !bigger) {
+		free(burst);
+		fprintf(stderr, "Failed to allocate for corpus '%s'\n", fileName);
+		goto Fail;
+	    }
+	    c->entry = bigger;
+	}
+
+	struct corpusEntry *e = &c->entry[c->count++];
+	memcpy( e->name, h+TAR_NAME, TAR_NAME_LEN);
+	e->name[TAR_NAME_LEN] = 0;
+	e->data = data;
+	e->len = size;
+	e->burst = burst;
+	int64_t mtime = octal( h+TAR_MTIME, TAR_MTIME_LEN);
+	e->timeNs = mtime > 0 ? mtime * 1000000000ULL : 0;
+    }
+
+    if ( c->corrupt) fprintf(stderr, "Skipped %zu corrupt bursts in '%s'\n", c->corrupt, fileName);
+    return 0;
+
+  Fail:
+    if ( f) fclose(f);
+    corpusFree(c);
+    return -1;
+}
+
+void corpusFree( struct corpus *c)
+{
+    for ( size_t i = 0; i < c->count; i++) free( c->entry[i].burst);
+    free( c->entry);
+    free( c->file);
+    memset( c, 0, sizeof(*c));
+}
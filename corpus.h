@@ -0,0 +1,47 @@
+#ifndef CORPUS_IS_IN
+#define CORPUS_IS_IN
+
+/*
+** Read a corpus of recorded bursts, the tar files written by ooklog (see
+** go/src/ook/files.go). Each regular file in the tar is one burst in
+** the ookd datagram format.
+**
+** The whole file is read into memory so bursts can be replayed through
+** decoders without any I/O in the way.
+**
+** It will print errors to stderr for unreadable or corrupt files.
+*/
+
+#include <stddef.h>
+
+#include "ook.h"
+
+struct corpusEntry {
+    char name[101];                // name of the tar member, e.g. 0001-1628642380000.burst
+    const unsigned char *data;     // the encoded burst, points into the corpus
+    size_t len;
+    struct ook_burst *burst;       // the decoded burst
+    uint64_t timeNs;               // realtime the member was written, when ooklog heard it, to the second
+};
+
+struct corpus {
+    unsigned char *file;           // the whole tar file
+    size_t fileLen;
+    size_t count;                  // entries in entry[]
+    struct corpusEntry *entry;
+    size_t corrupt;                // members skipped because they did not decode
+};
+
+/*
+** Read a tar file of bursts.
+**
+**   Returns <0 on failure, in which case there is nothing to free.
+*/
+int corpusLoad( const char *fileName, struct corpus *c);
+
+/*
+** Release everything corpusLoad() allocated.
+*/
+void corpusFree( struct corpus *c);
+
+#endif
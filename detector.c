@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "detector.h"
+#include "dsp.h"
+
+static const float riseThreshold = 0.250;
+static const float dropThreshold = 0.100;
+static const unsigned lowLengthLimit = 2000;
+static const unsigned powerBlock = 1024;    // samples given to the power kernel at once
+
+// The fixed point path works in the kernel's integer power, I^2+Q^2 with I and Q
+// from -128 to 127, so 1.0 is 128*128. The low pass filter carries 15 more bits
+// of fraction and alpha has 30. Both are finer than a float's 24 bit mantissa,
+// and the thresholds convert exactly, so it crosses them where the float path does.
+#define POWER_ONE (128*128)
+#define LOWPASS_FRACTION 15
+#define ALPHA_FRACTION 30
+
+// The noise floor is the power while idle low passed over about 1<<NOISE_SHIFT samples, 4mS at 250kHz
+#define NOISE_FRACTION 8
+#define NOISE_SHIFT 10
+
+static uint32_t toLowPassFixed( float f)
+{
+    return (uint32_t)( f * POWER_ONE * (1<<LOWPASS_FRACTION));
+}
+
+void detectorInit( struct detector *d, uint32_t sampleRate, float alpha, burst_handler handler, void *ctx)
+{
+    memset( d, 0, sizeof(*d));
+    d->sampleRate = sampleRate;
+    d->alpha = alpha;
+    d->alphaFixed = (uint32_t)( alpha * (1<<ALPHA_FRACTION));
+    d->handler = handler;
+    d->ctx = ctx;
+    d->state = IDLE;
+}
+
+// Pulses a burst can hold, longer ones are cut short
+#define BURST_PULSES (512*8)
+
+void detectorFree( struct detector *d)
+{
+    if ( d->burst) free( d->burst);
+    d->burst = 0;
+    if ( d->spare) free( d->spare);
+    d->spare = 0;
+}
+
+int detectorReserve( struct detector *d)
+{
+    if ( !d->spare) d->spare = ook_allocate_burst( BURST_PULSES);
+    if ( !d->spare) {
+	fprintf(stderr,"Failed to allocate burst\n");
+	return -1;
+    }
+    memset( d->spare->pulse, 0, d->spare->allocatedPulses*sizeof(d->spare->pulse[0]));
+    return 0;
+}
+
+uint64_t detectorSamplesToNs( const struct detector *d, uint64_t s)
+{
+    return s*(1000000000/d->sampleRate);  // that math could be better, but for 250000 is is exactly 4000, so ok.
+}
+
+uint64_t detectorNsToSamples( const struct detector *d, uint64_t ns)
+{
+    return ns/(1000000000/d->sampleRate);
+}
+
+void detectorSearchQuiet( struct detector *d, unsigned slot, uint64_t from)
+{
+    struct quietSearch *q = &d->quiet[slot];
+    q->active = 1;
+    q->from = from;
+    q->candidate = -1;
+    q->found = -1;
+    q->useNoise = 0;
+}
+
+static void recordPulse( struct detector *d, unsigned n, uint64_t rise, uint64_t drop, uint64_t end,
+			 unsigned cw, unsigned ccw, unsigned crazy, uint64_t power, unsigned peak, unsigned terminal)
+{
+    unsigned hiLen = drop-rise;
+    unsigned lowLen = end-drop;
+
+    // The frequency calculation could be a lot better. There is a lot of noise
+    // in there which leads to misinterpretations of cw and ccw. There is a significant
+    // variance in the pulse to pulse results of the same transmitter.
+    long frequency;
+    if ( d->fixedPoint) {
+	int64_t quarters = (int)cw-(int)ccw;
+	if ( quarters > 0) quarters += 2*crazy;
+	if ( quarters < 0) quarters -= 2*crazy;
+	int64_t n = quarters * d->sampleRate, den = 4*(int64_t)hiLen;
+	frequency = den ? n / den : 0;
+	int64_t twiceRemainder = den ? 2*(n % den) : 0;
+	if ( twiceRemainder < 0) twiceRemainder = -twiceRemainder;
+	if ( twiceRemainder > den || (twiceRemainder == den && (frequency & 1))) {
+	    frequency += n < 0 ? -1 : 1;      // nearest, ties to even like lrint()
+	}
+	// This is the exact quotient rounded. The float path's single precision is off by a
+	// thousandth of a Hz or so, which rounds the other way when it is that close to a half,
+	// e.g. 113 quarters in 399 samples at 250kHz, 17700.501Hz, which it makes 17700.
+    } else {
+	float cycles = ((int)cw-(int)ccw)/4.0;
+	if ( cycles > 0) cycles += crazy/2.0;  // figure we are going fast enough to sometimes skip
+	if ( cycles < 0) cycles -= crazy/2.0;  // .. might ought to check that.
+	frequency = lrint( cycles/(hiLen/(float)d->sampleRate));
+    }
+
+    if ( !d->burst) {
+	// first pulse of new burst, in the last one's memory if we have it
+	if ( d->spare) {
+	    d->burst = d->spare;
+	    d->spare = 0;
+	    memset( &d->burst->times, 0, sizeof(d->burst->times));
+	    memset( &d->burst->fragment, 0, sizeof(d->burst->fragment));
+	    memset( &d->burst->sequence, 0, sizeof(d->burst->sequence));
+	    d->burst->pulses = 0;
+	} else {
+	    d->burst = ook_allocate_burst( BURST_PULSES);
+	}
+	if ( !d->burst) {
+	    fprintf(stderr,"Failed to allocate burst\n");
+	    exit(-1);
+	} else {
+	    d->burst->positionNanoseconds = detectorSamplesToNs( d, rise);
+	    uint32_t noise = d->noiseFixed >> NOISE_FRACTION;
+	    d->burst->noiseFloor = noise ? noise : 1;    // 0 would say the pulses have no power
+	}
+    }
+
+    if ( ook_add_pulse(d->burst, detectorSamplesToNs(d, hiLen), detectorSamplesToNs(d, lowLen), frequency)) {
+	fprintf(stderr,"Failed to add pulse to burst! Too long?\n");
+    } else {
+	struct ook_pulse *p = &d->burst->pulse[d->burst->pulses-1];
+	p->peakPower = peak;
+	p->meanPower = hiLen ? power / hiLen : peak;
+    }
+
+    if ( terminal) {
+	d->handler( d->burst, end, d->ctx);
+	d->spare = d->burst;
+	d->burst = 0;
+    } else if ( d->progress) {
+	d->progress( d->burst, end, d->ctx);
+    }
+}
+
+// 1 on the quiet sample
+static int watchForQuiet( struct quietSearch *q, uint64_t at, int aboveRise, int belowDrop)
+{
+    if ( at < q->from) return 0;
+
+    if ( aboveRise) {
+	q->candidate = -1;
+    } else if ( q->candidate < 0 && belowDrop) {
+	q->candidate = at;      // anything high drops here, nothing can rise until the next reset
+    }
+
+    if ( q->candidate >= 0 && at - q->candidate > lowLengthLimit) {
+	q->found = at;          // anything low has been low too long and is now idle
+	q->active = 0;
+	return 1;
+    }
+    return 0;
+}
+
+// On the quiet sample note the noise floor state, or impose the one given
+static uint32_t quietNoise( struct quietSearch *q, uint32_t noiseFixed)
+{
+    if ( q->useNoise) return q->noiseFixed;
+    q->noiseFixed = noiseFixed;
+    return noiseFixed;
+}
+
+// The body of findPulses(), inlined once with fixed 0 and once with 1 so each
+// copy has only the arithmetic it uses in its inner loop.
+static inline __attribute__((always_inline))
+void scanSamples( struct detector *d, const unsigned char *data, uint32_t len, const int fixed)
+{
+    enum motionType { NONE, CRAZY, CW, CCW };
+    static const unsigned char motion[16] = {   // indexed by 4*oldquadrant+newquadrant
+	NONE, CCW, CRAZY, CW,
+	CW, NONE, CCW, CRAZY,
+	CRAZY, CW, NONE, CCW,
+	CCW, CRAZY, CW, NONE
+    };
+
+    const int showAll = 0;
+    const float alpha = d->alpha;
+    const int searching = d->quiet[0].active || d->quiet[1].active;
+
+    // The per sample state lives in locals so it stays in registers, the calls
+    // below would otherwise make the compiler reload it every sample.
+    float lowPassPowerSquared = d->lowPassPowerSquared;
+    uint32_t lowPassFixed = d->lowPassFixed;
+    const int64_t alphaFixed = d->alphaFixed;
+    const uint32_t riseFixed = toLowPassFixed( riseThreshold), dropFixed = toLowPassFixed( dropThreshold);
+    unsigned quadrant = d->quadrant;
+    unsigned crazyMotion = d->crazyMotion, cwMotion = d->cwMotion, ccwMotion = d->ccwMotion;
+    uint32_t noiseFixed = d->noiseFixed;
+    uint64_t highPower = d->highPower;
+    unsigned highPeak = d->highPeak;
+
+    // The power and quadrant of each sample don't depend on the state, they are
+    // done a block at a time by the vectorized kernels.
+    uint16_t power[powerBlock];
+    uint8_t quadrants[powerBlock];
+    const uint32_t samples = len/2;
+
+    for ( uint32_t block = 0; block < samples; block += powerBlock) {
+	uint32_t n = samples - block < powerBlock ? samples - block : powerBlock;
+	dspPowerQuadrant( data + 2*block, n, power, quadrants);
+
+	for ( uint32_t j = 0; j < n; j++) {
+	    uint64_t at = d->sampleCounter + block + j;
+	    unsigned newQuadrant = quadrants[j];
+
+	    d->totalPower += power[j];
+	    d->powerSamples++;
+
+	    if ( d->powerSamples >= 100000) {
+		float averagePower = sqrt( d->totalPower/(float)POWER_ONE/d->powerSamples);
+		if ( d->verbose) fprintf(stderr,"average power is %5.2f\n", averagePower);
+		metricsSet( d->metrics, METRIC_AVERAGE_POWER, averagePower*1000000);
+		d->powerSamples = 0;
+		d->totalPower = 0;
+	    }
+
+	    if ( d->state==HIGH) {
+		if (showAll) fprintf(stderr,"%u->%u %5u ", quadrant, newQuadrant, power[j]);
+		switch( motion[4*quadrant + newQuadrant]) {
+		  case CRAZY:
+		    if ( showAll) fprintf(stderr," crazy\n");
+		    crazyMotion++;
+		    break;
+		  case CW:
+		    if ( showAll) fprintf(stderr," cw\n");
+		    cwMotion++;
+		    break;
+		  case CCW:
+		    if ( showAll) fprintf(stderr," ccw\n");
+		    ccwMotion++;
+		    break;
+		  default:
+		    if ( showAll) fprintf(stderr,"\n");
+		    break;
+		}
+		highPower += power[j];
+		if ( power[j] > highPeak) highPeak = power[j];
+	    } else if ( d->state==IDLE) {
+		// to nearest, truncating would leave it short of the floor by up to 1<<NOISE_SHIFT,
+		// and from the first idle sample rather than 0, so it starts close
+		if ( !noiseFixed) noiseFixed = (uint32_t)power[j] << NOISE_FRACTION;
+		int32_t towards = ((int32_t)power[j] << NOISE_FRACTION) - (int32_t)noiseFixed;
+		int32_t step = ((towards < 0 ? -towards : towards) + (1 << (NOISE_SHIFT-1))) >> NOISE_SHIFT;
+		noiseFixed += towards < 0 ? -step : step;
+	    }
+	    quadrant = newQuadrant;
+
+	    int aboveRise, belowDrop;
+	    if ( fixed) {
+		int32_t towards = ((int32_t)power[j] << LOWPASS_FRACTION) - (int32_t)lowPassFixed;
+		lowPassFixed += (alphaFixed*towards + (1LL<<(ALPHA_FRACTION-1))) >> ALPHA_FRACTION;
+		aboveRise = lowPassFixed > riseFixed;
+		belowDrop = lowPassFixed < dropFixed;
+	    } else {
+		float powerSquared = power[j] * (1.0f/POWER_ONE);
+		lowPassPowerSquared = alpha*powerSquared + (1.0-alpha)*lowPassPowerSquared;
+		aboveRise = lowPassPowerSquared > riseThreshold;
+		belowDrop = lowPassPowerSquared < dropThreshold;
+	    }
+
+	    if ( d->state==HIGH && belowDrop) {
+		d->dropSample = at;
+		d->state = LOW;
+		metricsCount( d->metrics, METRIC_HIGH_TO_LOW, 1);
+	    } else if ( (d->state==IDLE || d->state==LOW) && aboveRise) {
+		if ( d->state==LOW) {  // if IDLE, the pulse was already pushed
+		    d->noiseFixed = noiseFixed;    // a new burst takes it as of now
+		    recordPulse( d, d->pulseNumber++, d->riseSample, d->dropSample, at,
+				 cwMotion, ccwMotion, crazyMotion, highPower, highPeak, 0);
+		}
+		metricsCount( d->metrics, d->state==LOW ? METRIC_LOW_TO_HIGH : METRIC_IDLE_TO_HIGH, 1);
+		d->state = HIGH;
+		d->riseSample = at;
+		d->dropSample = 0;
+		cwMotion = 0;
+		ccwMotion = 0;
+		crazyMotion = 0;
+		highPower = 0;
+		highPeak = 0;
+	    } else if ( d->state==LOW && at - d->dropSample > lowLengthLimit ) {
+		d->state = IDLE;
+		metricsCount( d->metrics, METRIC_LOW_TO_IDLE, 1);
+		d->noiseFixed = noiseFixed;
+		recordPulse( d, d->pulseNumber, d->riseSample, d->dropSample, at,
+			     cwMotion, ccwMotion, crazyMotion, highPower, highPeak, 1);
+		d->pulseNumber = 0;
+		// ok to leave counters and timers, they get set on transition to HIGH
+	    }
+
+	    if ( searching) {
+		for ( int s = 0; s < 2; s++) {
+		    if ( d->quiet[s].active && watchForQuiet( &d->quiet[s], at, aboveRise, belowDrop)) {
+			noiseFixed = quietNoise( &d->quiet[s], noiseFixed);
+		    }
+		}
+	    }
+	}
+    }
+
+    d->lowPassPowerSquared = lowPassPowerSquared;
+    d->lowPassFixed = lowPassFixed;
+    d->quadrant = quadrant;
+    d->crazyMotion = crazyMotion;
+    d->cwMotion = cwMotion;
+    d->ccwMotion = ccwMotion;
+    d->noiseFixed = noiseFixed;
+    d->highPower = highPower;
+    d->highPeak = highPeak;
+    d->sampleCounter += samples;
+}
+
+void findPulses( struct detector *d, const unsigned char *data, uint32_t len)
+{
+    if ( d->fixedPoint) scanSamples( d, data, len, 1);
+    else scanSamples( d, data, len, 0);
+}
@@ -0,0 +1,106 @@
+#ifndef DETECTOR_IS_IN
+#define DETECTOR_IS_IN
+
+/*
+** The pulse detector. It watches a stream of 8 bit IQ samples for the carrier
+** turning on and off and gathers the pulses into bursts.
+**
+** All of the state lives in a struct detector so several can run at once, e.g.
+** on different parts of a capture file.
+*/
+
+#include <stdint.h>
+
+#include "ook.h"
+#include "metrics.h"
+
+// Called for each completed burst. endSample is the sample where the burst
+// was judged complete. The burst belongs to the detector, copy what you need.
+typedef void (*burst_handler)( struct ook_burst *burst, uint64_t endSample, void *ctx);
+
+// Looks for a place where any detector, whatever state it was in, must have gone idle.
+// Used to find where independently started detectors agree, see detectorSearchQuiet().
+struct quietSearch {
+    int active;
+    uint64_t from;           // first sample considered
+    int64_t candidate;       // earliest drop since the last rise, -1 if none
+    int64_t found;           // the quiet sample, -1 if not yet found
+    uint32_t noiseFixed;     // the noise floor state on the quiet sample, the one thing detectors may
+    int useNoise;            // .. still disagree on there, set this to impose it instead of noting it
+};
+
+struct detector {
+    uint32_t sampleRate;
+    float alpha;                   // weight of a new sample in the power low pass filter
+    int verbose;
+    int fixedPoint;                // integer only math, for CPUs without floating point
+    struct metrics *metrics;       // optional, state transitions and power are counted here
+
+    burst_handler handler;
+    burst_handler progress;        // optional, called with the burst so far as each pulse but the last is added
+    void *ctx;
+
+    uint64_t sampleCounter;        // samples consumed before the current buffer
+
+    float lowPassPowerSquared;
+    uint32_t lowPassFixed;         // the same in the fixed point path, see detector.c
+    uint32_t alphaFixed;
+    uint64_t totalPower;           // for the average power, sum of I^2+Q^2 in kernel units
+    int powerSamples;
+    uint32_t noiseFixed;           // power while idle, low passed, in kernel units with NOISE_FRACTION bits more
+    uint64_t highPower;            // sum and strongest of the power while high, for the pulse's quality
+    unsigned highPeak;
+
+    enum { IDLE, HIGH, LOW} state;
+    int quadrant;                  // range 0-3
+
+    unsigned crazyMotion;          // these three are signal rotation during pulse high period
+    unsigned cwMotion;
+    unsigned ccwMotion;
+
+    uint64_t riseSample;           // absolute sample numbers
+    uint64_t dropSample;
+    unsigned pulseNumber;
+
+    struct ook_burst *burst;       // the burst being accumulated, if any
+    struct ook_burst *spare;       // a finished one, reused for the next instead of allocating
+
+    struct quietSearch quiet[2];
+};
+
+/*
+** Prepare a detector, it starts idle at sample 0.
+*/
+void detectorInit( struct detector *d, uint32_t sampleRate, float alpha, burst_handler handler, void *ctx);
+
+/*
+** Release anything the detector holds. A partial burst is discarded.
+*/
+void detectorFree( struct detector *d);
+
+/*
+** Allocate the memory the next burst will need now, and touch all of it, so it
+** is never faulted in while samples are waiting. The detector keeps reusing it.
+**
+**   Returns <0 on failure.
+*/
+int detectorReserve( struct detector *d);
+
+/*
+** Feed IQ data to the detector. len is in bytes, two per sample.
+*/
+void findPulses( struct detector *d, const unsigned char *data, uint32_t len);
+
+/*
+** Start looking for the first sample at or after 'from' where every detector
+** fed the same signal must be idle. After that sample detectors which started in
+** different places behave identically, once they have the same noise floor,
+** which is slow to forget where it started. Up to two searches may run at once.
+** Check d->quiet[slot].found for the answer.
+*/
+void detectorSearchQuiet( struct detector *d, unsigned slot, uint64_t from);
+
+uint64_t detectorSamplesToNs( const struct detector *d, uint64_t s);
+uint64_t detectorNsToSamples( const struct detector *d, uint64_t ns);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "dsp.h"
+
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+struct dspKernels {
+    const char *name;
+    int (*supported)( void);
+    void (*powerQuadrant)( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant);
+};
+
+static int always( void) { return 1; }
+
+#if defined(__x86_64__) || defined(__i386__)
+static int haveSSE2( void) { return __builtin_cpu_supports("sse2"); }
+static int haveAVX2( void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+#if defined(__arm__) && defined(__linux__)
+static int haveNEON( void) { return (getauxval( AT_HWCAP) & HWCAP_NEON) != 0; }
+#elif defined(__aarch64__) || defined(__arm64__)
+#define haveNEON always           // part of the base architecture
+#endif
+
+// Best first. The Makefile builds exactly these for each machine.
+static const struct dspKernels kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", haveAVX2, dspPowerQuadrant_avx2 },
+    { "sse2", haveSSE2, dspPowerQuadrant_sse2 },
+#endif
+#if defined(__arm__) || defined(__aarch64__) || defined(__arm64__)
+    { "neon", haveNEON, dspPowerQuadrant_neon },
+#endif
+    { "scalar", always, dspPowerQuadrant_scalar },
+};
+
+static const struct dspKernels *current = 0;
+
+static const struct dspKernels *chosen( void)
+{
+    const struct dspKernels *k = __atomic_load_n( &current, __ATOMIC_RELAXED);
+    if ( k) return k;
+
+    // Several threads may get here at once, they all pick the same one.
+    for ( k = kernels; !k->supported(); k++);
+    __atomic_store_n( &current, k, __ATOMIC_RELAXED);
+    return k;
+}
+
+void dspPowerQuadrant( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant)
+{
+    chosen()->powerQuadrant( data, samples, power, quadrant);
+}
+
+const char *dspKernelName( void)
+{
+    return chosen()->name;
+}
+
+int dspSelect( const char *name)
+{
+    for ( unsigned i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+	if ( strcmp( kernels[i].name, name) == 0) {
+	    if ( !kernels[i].supported()) {
+		fprintf(stderr,"This CPU does not support the %s kernels\n", name);
+		return -1;
+	    }
+	    __atomic_store_n( &current, &kernels[i], __ATOMIC_RELAXED);
+	    return 0;
+	}
+    }
+    fprintf(stderr,"There are no %s kernels in this build\n", name);
+    return -1;
+}
@@ -0,0 +1,43 @@
+#ifndef DSP_IS_IN
+#define DSP_IS_IN
+
+/*
+** The inner signal processing kernels. dspkernel.c is compiled once for each
+** instruction set the build machine's family has (scalar, SSE2 and AVX2 on x86,
+** NEON on ARM) and the best one the running CPU supports is chosen the first time
+** a kernel is used, so one binary runs well across machines.
+**
+** Every version gives bit identical results, they only differ in speed.
+**
+** It will print errors to stderr for programmer misuse or misconfiguration.
+*/
+
+#include <stdint.h>
+
+/*
+** The squared magnitude of each 8 bit IQ sample, I^2+Q^2 with I and Q from -128
+** to 127, so 0 to 32768, and the quadrant it is in, 0 to 3 counterclockwise from
+** I>=0,Q>=0. data holds 2*samples bytes.
+*/
+void dspPowerQuadrant( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant);
+
+/*
+** The name of the kernels in use, e.g. "avx2".
+*/
+const char *dspKernelName( void);
+
+/*
+** Use a particular version of the kernels, e.g. "scalar" to compare them. It must
+** be one this binary has and the CPU supports.
+**
+**   Returns <0 on failure.
+*/
+int dspSelect( const char *name);
+
+// One of these is compiled from dspkernel.c for each version.
+void dspPowerQuadrant_scalar( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant);
+void dspPowerQuadrant_sse2( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant);
+void dspPowerQuadrant_avx2( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant);
+void dspPowerQuadrant_neon( const unsigned char *data, uint32_t samples, uint16_t *power, uint8_t *quadrant);
+
+#endif
@@ -0,0 +1,31 @@
+#include <stddef.h>
+
+#include "dsp.h"
+
+/*
+** Compiled several times, with DSP_VARIANT naming the version and the compiler
+** flags for its instruction set, see the Makefile. The loops are written for
+** the auto-vectorizer, integer math keeps every version exact.
+*/
+
+#ifndef DSP_VARIANT
+#define DSP_VARIANT scalar
+#endif
+
+#define DSP_NAME_(name,variant) name##_##variant
+#define DSP_NAME(name,variant) DSP_NAME_(name,variant)
+
+void DSP_NAME(dspPowerQuadrant,DSP_VARIANT)( const unsigned char *restrict data, uint32_t samples,
+					     uint16_t *restrict power, uint8_t *restrict quadrant)
+{
+    for ( size_t i = 0; i < samples; i++) {
+	int I = data[2*i] - 128;
+	int Q = data[2*i+1] - 128;
+	power[i] = I*I + Q*Q;
+
+	// I>=0,Q>=0 is 0, I<0,Q>=0 is 1, I<0,Q<0 is 2, I>=0,Q<0 is 3
+	uint8_t iNegative = data[2*i] < 128;
+	uint8_t qNegative = data[2*i+1] < 128;
+	quadrant[i] = (iNegative ^ qNegative) | (qNegative << 1);
+    }
+}
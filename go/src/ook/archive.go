@@ -0,0 +1,189 @@
+package ook
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"log"
+	"sort"
+)
+
+// Archives of bursts, as ookd --archive writes them, see ook_archive_create() in ook.h for the layout.
+const (
+	archiveMagic      = 0x414B4F4F // 'OOKA'
+	archiveSync       = 0x534B4F4F // 'OOKS'
+	archiveIndexMagic = 0x494B4F4F // 'OOKI'
+	archiveVersion    = 1
+	archiveSyncBytes  = 16
+	archiveMaxRecord  = 1 << 24
+	archiveBuffer     = 1 << 20 // records up to this long can be backed out of if they are corrupt
+)
+
+var archiveSyncMarker = []byte{0xff, 0xff, 0xff, 0xff, 'O', 'O', 'K', 'S'}
+
+// An entry of an archive's index, the file beside it with .idx on its name
+type ArchiveEntry struct {
+	Time   uint64 // realtime of capture in nanoseconds, or the position if ookd didn't know it
+	Offset uint64 // of the burst's record in the archive
+	Pulses uint32
+	Length uint32 // of the encoded burst, after the record's length
+}
+
+type archiveReader struct {
+	r *bufio.Reader
+}
+
+func checkArchiveHeader(r io.Reader, magic uint32) error {
+	header := struct{ Magic, Version uint32 }{}
+	if err := binary.Read(r, binary.LittleEndian, &header); err != nil {
+		return err
+	}
+	if header.Magic != magic {
+		return fmt.Errorf("Not a burst archive")
+	}
+	if header.Version != archiveVersion {
+		return fmt.Errorf("Archive is version %d, we only know %d", header.Version, archiveVersion)
+	}
+	return nil
+}
+
+// Skip to the next sync marker, past whatever is corrupt
+func (ar *archiveReader) resync() error {
+	ar.r.Discard(1)
+	for {
+		if _, err := ar.r.Peek(len(archiveSyncMarker)); err != nil {
+			return io.EOF
+		}
+		buffered, _ := ar.r.Peek(ar.r.Buffered())
+		if i := bytes.Index(buffered, archiveSyncMarker); i >= 0 {
+			ar.r.Discard(i)
+			return nil
+		}
+		ar.r.Discard(len(buffered) - len(archiveSyncMarker) + 1)
+	}
+}
+
+// A record is only good if its extensions exactly fill what follows the pulses, as ook_decode() insists
+func extensionsFit(data []byte, pulses int) bool {
+	rest := data[16+12*pulses:]
+	for len(rest) > 0 {
+		if len(rest) < 8 || uint64(binary.LittleEndian.Uint32(rest[4:8])) > uint64(len(rest)-8) {
+			return false
+		}
+		rest = rest[8+binary.LittleEndian.Uint32(rest[4:8]):]
+	}
+	return true
+}
+
+func (ar *archiveReader) Read() (*Burst, error) {
+	for {
+		head, err := ar.r.Peek(8)
+		if err == io.EOF && len(head) == 0 {
+			return nil, io.EOF
+		}
+		if err != nil {
+			log.Printf("Archive ends in a torn record")
+			return nil, io.EOF
+		}
+
+		length := binary.LittleEndian.Uint32(head[0:4])
+		if length == 0xffffffff {
+			if binary.LittleEndian.Uint32(head[4:8]) != archiveSync {
+				log.Printf("Skipping corrupt part of archive")
+				if err := ar.resync(); err != nil {
+					return nil, err
+				}
+				continue
+			}
+			if _, err := ar.r.Discard(archiveSyncBytes); err != nil {
+				return nil, io.EOF
+			}
+			continue
+		}
+		if length > archiveMaxRecord || length < 16 {
+			log.Printf("Skipping corrupt part of archive")
+			if err := ar.resync(); err != nil {
+				return nil, err
+			}
+			continue
+		}
+
+		// Look before we take it, so a corrupt record can be skipped over byte by byte
+		var record []byte
+		if 4+int(length) <= archiveBuffer {
+			if record, err = ar.r.Peek(4 + int(length)); err != nil {
+				log.Printf("Skipping corrupt part of archive")
+				if err := ar.resync(); err != nil {
+					return nil, err
+				}
+				continue
+			}
+		} else {
+			record = make([]byte, 4+length)
+			if _, err := io.ReadFull(ar.r, record); err != nil {
+				log.Printf("Archive ends in a torn record")
+				return nil, io.EOF
+			}
+		}
+
+		burst, _, err := DecodeBurst(record[4:])
+		if err == nil && !extensionsFit(record[4:], len(burst.Pulses)) {
+			err = fmt.Errorf("Bad extensions")
+		}
+		if err != nil {
+			log.Printf("Skipping corrupt part of archive: %s", err.Error())
+			if err := ar.resync(); err != nil {
+				return nil, err
+			}
+			continue
+		}
+		if 4+int(length) <= archiveBuffer {
+			ar.r.Discard(4 + int(length))
+		}
+		return burst, nil
+	}
+}
+
+func (ar *archiveReader) Close() {
+}
+
+// Read an archive's index. Bursts written after a crash may be missing from it, OpenFile()
+// on the archive itself will still find them.
+func ReadArchiveIndex(source io.Reader) ([]ArchiveEntry, error) {
+	r := bufio.NewReader(source)
+	if err := checkArchiveHeader(r, archiveIndexMagic); err != nil {
+		return nil, err
+	}
+
+	entries := []ArchiveEntry{}
+	for {
+		e := ArchiveEntry{}
+		if err := binary.Read(r, binary.LittleEndian, &e); err != nil {
+			break // a torn entry at the end is dropped
+		}
+		entries = append(entries, e)
+	}
+
+	sort.SliceStable(entries, func(i, j int) bool { return entries[i].Time < entries[j].Time })
+	return entries, nil
+}
+
+// The index of the first entry captured at or after t, len(entries) if none were
+func FindArchiveEntry(entries []ArchiveEntry, t uint64) int {
+	return sort.Search(len(entries), func(i int) bool { return entries[i].Time >= t })
+}
+
+// Read the burst of an index entry from its archive
+func ReadArchiveBurst(archive io.ReaderAt, e ArchiveEntry) (*Burst, error) {
+	record := make([]byte, 4+e.Length)
+	if _, err := archive.ReadAt(record, int64(e.Offset)); err != nil {
+		return nil, err
+	}
+	if binary.LittleEndian.Uint32(record[0:4]) != e.Length {
+		return nil, fmt.Errorf("Archive record at %d does not match its index", e.Offset)
+	}
+	burst, _, err := DecodeBurst(record[4:])
+	return burst, err
+}
@@ -2,6 +2,8 @@ package ook
 
 import (
 	"archive/tar"
+	"bufio"
+	"encoding/binary"
 	"fmt"
 	"io"
 	"time"
@@ -73,12 +75,8 @@ func (tr *tarReader) Read () (*Burst, error) {
 
 	buf := make( []byte, header.Size )
 	
-	n,err := tr.r.Read( buf)
-	if n != int(header.Size) {
-		return nil,fmt.Errorf("Short read in tarReader")
-	}
-	if err != nil {
-		return nil,err
+	if _,err := io.ReadFull( tr.r, buf); err != nil {
+		return nil,fmt.Errorf("Short read in tarReader: %s", err.Error())
 	}
 
 	burst,used,err := DecodeBurst(buf)
@@ -96,6 +94,14 @@ func (tr *tarReader) Close() {
 	// worry about that later
 }
 
+// Open a file of bursts, either an archive or the tar files ooklog writes
 func OpenFile( source io.Reader) (Reader,error) {
-	return &tarReader{ r: tar.NewReader(source) }, nil
+	r := bufio.NewReaderSize( source, archiveBuffer)
+	if magic,err := r.Peek(4); err == nil && binary.LittleEndian.Uint32(magic) == archiveMagic {
+		if err := checkArchiveHeader( r, archiveMagic); err != nil {
+			return nil,err
+		}
+		return &archiveReader{ r: r }, nil
+	}
+	return &tarReader{ r: tar.NewReader(r) }, nil
 }
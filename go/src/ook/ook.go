@@ -68,7 +68,7 @@ func DecodeBurst(data []byte) (*Burst, int, error) {
 	if err := binary.Read(buf, binary.LittleEndian, &version); err != nil {
 		return nil, 0, err
 	}
-	if version != uint32(0x36360001) {
+	if version != uint32(0x36360001) && version != uint32(0x36360002) { // 2 has extensions after the pulses
 		return nil, 0, fmt.Errorf("Bad version in burst packet")
 	}
 
@@ -79,6 +79,10 @@ func DecodeBurst(data []byte) (*Burst, int, error) {
 		return nil, 0, err
 	}
 
+	if uint64(count) > uint64(buf.Len())/12 { // don't allocate for pulses which can't be there
+		return nil, 0, fmt.Errorf("Burst packet is too short for its %d pulses", count)
+	}
+
 	pulses := make([]Pulse, 0, count)
 	for i := 0; i < int(count); i++ {
 		hi := uint32(0)
@@ -102,6 +106,119 @@ func DecodeBurst(data []byte) (*Burst, int, error) {
 	return &Burst{Position: time.Duration(position), Pulses: pulses}, 0, nil
 }
 
+// Bursts too big for one datagram are sent in segments, each with this extension after its pulses
+const extensionSegment = 3
+
+// The same limits as the C library's, so one bad datagram can't ask for gigabytes
+const (
+	maxSegments = 4096    // OOK_MAX_SEGMENTS
+	maxPulses   = 1 << 20 // OOK_MAX_PULSES
+	maxPartials = 8       // bursts being put back together at once, the oldest is dropped for another
+)
+
+type segment struct {
+	Id          uint32
+	Index       uint32
+	Count       uint32
+	FirstPulse  uint32
+	TotalPulses uint32
+}
+
+// Find the segment extension of a datagram, nil if it is a whole burst
+func decodeSegment(data []byte, pulses int) *segment {
+	buf := bytes.NewBuffer(data[16+12*pulses:])
+	for buf.Len() >= 8 {
+		tag := uint32(0)
+		length := uint32(0)
+		binary.Read(buf, binary.LittleEndian, &tag)
+		binary.Read(buf, binary.LittleEndian, &length)
+		if int(length) > buf.Len() {
+			return nil
+		}
+		if tag == extensionSegment && length >= 20 {
+			seg := &segment{}
+			binary.Read(buf, binary.LittleEndian, seg)
+			return seg
+		}
+		buf.Next(int(length))
+	}
+	return nil
+}
+
+type segmentPiece struct {
+	have       bool
+	firstPulse uint32
+	pulses     uint32
+}
+
+type partialBurst struct {
+	burst    *Burst
+	pieces   []segmentPiece
+	received uint32
+	started  time.Time
+}
+
+// Each segment must start where the one before it ended and the last end the burst, or a
+// sender which overlapped them would leave pulses of the burst empty.
+func (p *partialBurst) tiled() bool {
+	next := uint32(0)
+	for _, piece := range p.pieces {
+		if piece.firstPulse != next {
+			return false
+		}
+		next += piece.pulses
+	}
+	return next == uint32(len(p.burst.Pulses))
+}
+
+// Put segments back together, keyed by sender and id. Returns the burst once it is all here.
+func reassemble(partials map[string]*partialBurst, from string, seg *segment, b *Burst) *Burst {
+	for k, p := range partials {
+		if time.Since(p.started) > time.Second {
+			delete(partials, k)
+		}
+	}
+
+	if seg.Index >= seg.Count || seg.Count > maxSegments || seg.TotalPulses > maxPulses ||
+		uint64(seg.FirstPulse)+uint64(len(b.Pulses)) > uint64(seg.TotalPulses) {
+		return nil
+	}
+
+	key := fmt.Sprintf("%s/%d", from, seg.Id)
+	p := partials[key]
+	if p == nil || len(p.pieces) != int(seg.Count) || len(p.burst.Pulses) != int(seg.TotalPulses) {
+		if p == nil && len(partials) >= maxPartials {
+			oldest := ""
+			for k, o := range partials {
+				if oldest == "" || o.started.Before(partials[oldest].started) {
+					oldest = k
+				}
+			}
+			delete(partials, oldest)
+		}
+		p = &partialBurst{
+			burst:   &Burst{Position: b.Position, Pulses: make([]Pulse, seg.TotalPulses)},
+			pieces:  make([]segmentPiece, seg.Count),
+			started: time.Now(),
+		}
+		partials[key] = p
+	}
+
+	if !p.pieces[seg.Index].have {
+		copy(p.burst.Pulses[seg.FirstPulse:], b.Pulses)
+		p.pieces[seg.Index] = segmentPiece{true, seg.FirstPulse, uint32(len(b.Pulses))}
+		p.received++
+	}
+	if p.received < seg.Count {
+		return nil
+	}
+	delete(partials, key)
+	if !p.tiled() {
+		return nil
+	}
+	return p.burst
+}
+
 func ListenTo(iface *net.Interface, addr *net.UDPAddr, burstChannel chan *Burst) error {
 	conn, err := net.ListenMulticastUDP("udp", iface, addr)
 	if err != nil {
@@ -112,9 +229,10 @@ func ListenTo(iface *net.Interface, addr *net.UDPAddr, burstChannel chan *Burst)
 		defer conn.Close()
 
 		buf := make([]byte, 65536)
+		partials := map[string]*partialBurst{}
 
 		for {
-			count, err := conn.Read(buf)
+			count, from, err := conn.ReadFromUDP(buf)
 			if err != nil {
 				log.Fatalf("Bad read in ListenTo: %s", err.Error())
 			}
@@ -125,6 +243,14 @@ func ListenTo(iface *net.Interface, addr *net.UDPAddr, burstChannel chan *Burst)
 			}
 			_ = used
 
+			if burst != nil {
+				if seg := decodeSegment(buf[0:count], len(burst.Pulses)); seg != nil {
+					if burst = reassemble(partials, from.String(), seg, burst); burst == nil {
+						continue
+					}
+				}
+			}
+
 			burstChannel <- burst
 		}
 	}
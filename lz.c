@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static inline uint32_t hash4( const uint8_t *p)
+{
+    uint32_t v;
+    memcpy( &v, p, 4);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length continued past its nibble, 255s then the rest
+static inline uint8_t *putLength( uint8_t *op, size_t n)
+{
+    for ( ; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+size_t lzCompress( const uint8_t *in, size_t len, uint8_t *out, size_t outMax)
+{
+    if ( outMax < LZ_BOUND(len)) return 0;   // then we needn't check as we go
+
+    uint32_t table[1<<HASH_BITS];            // where each hash was last seen, +1 so 0 is never
+    memset( table, 0, sizeof(table));
+
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;              // start of the literals not yet written
+    const uint8_t *end = in + len;
+    uint8_t *op = out;
+
+    while ( len >= MIN_MATCH && ip <= end - MIN_MATCH) {
+	uint32_t h = hash4( ip);
+	uint32_t seen = table[h];
+	table[h] = ip - in + 1;
+
+	const uint8_t *ref = seen ? in + seen - 1 : 0;
+	if ( !ref || ip - ref > MAX_OFFSET || memcmp( ref, ip, MIN_MATCH) != 0) {
+	    ip++;
+	    continue;
+	}
+
+	size_t match = MIN_MATCH;
+	while ( ip + match < end && ref[match] == ip[match]) match++;
+
+	size_t literals = ip - anchor;
+	uint8_t *token = op++;
+	*token = ((literals < 15 ? literals : 15) << 4) | (match - MIN_MATCH < 15 ? match - MIN_MATCH : 15);
+	if ( literals >= 15) op = putLength( op, literals - 15);
+	memcpy( op, anchor, literals);
+	op += literals;
+
+	uint16_t offset = ip - ref;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if ( match - MIN_MATCH >= 15) op = putLength( op, match - MIN_MATCH - 15);
+
+	ip += match;
+	anchor = ip;
+    }
+
+    size_t literals = end - anchor;
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if ( literals >= 15) op = putLength( op, literals - 15);
+    memcpy( op, anchor, literals);
+    op += literals;
+
+    return op - out;
+}
+
+long lzDecompress( const uint8_t *in, size_t len, uint8_t *out, size_t outMax)
+{
+    const uint8_t *ip = in;
+    const uint8_t *iend = in + len;
+    uint8_t *op = out;
+    uint8_t *oend = out + outMax;
+
+// Read a length continued past its nibble
+#define GET_LENGTH(N) ({ size_t n = (N); if ( n == 15) { uint8_t b; do { if ( ip >= iend) return -1; b = *ip++; n += b; } while ( b == 255); } n; })
+
+    for (;;) {
+	if ( ip >= iend) return -1;
+	uint8_t token = *ip++;
+
+	size_t literals = GET_LENGTH( token >> 4);
+	if ( literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) return -1;
+	memcpy( op, ip, literals);
+	ip += literals;
+	op += literals;
+
+	if ( ip == iend) break;      // the last sequence has no match
+
+	if ( iend - ip < 2) return -1;
+	size_t offset = ip[0] | (ip[1] << 8);
+	ip += 2;
+	size_t match = GET_LENGTH( token & 15) + MIN_MATCH;
+
+	if ( offset == 0 || offset > (size_t)(op - out) || match > (size_t)(oend - op)) return -1;
+	const uint8_t *ref = op - offset;
+	while ( match--) *op++ = *ref++;    // may overlap, e.g. a run
+    }
+
+    return op - out;
+}
@@ -0,0 +1,37 @@
+#ifndef LZ_IS_IN
+#define LZ_IS_IN
+
+/*
+** A small LZ77 codec, in the style of LZ4, for batches of encoded bursts.
+** Pulse trains are full of repeats, the same few widths over and over, so even
+** this greedy single pass does well on them, and it needs no library.
+**
+** The compressed form is a series of sequences, each a token byte with the
+** literal count in its high nibble and the match length less 4 in its low
+** nibble, either of which is continued by 255s and a final smaller byte when
+** it is 15. Then the literals, then a two byte little endian offset back to
+** the match. The last sequence is only literals.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The most lzCompress() can make of len bytes, when nothing matches
+#define LZ_BOUND(len) ((len) + (len)/255 + 16)
+
+/*
+** Compress len bytes of in into out, which has room for outMax.
+**
+**   Returns the compressed length, 0 if it didn't fit
+*/
+size_t lzCompress( const uint8_t *in, size_t len, uint8_t *out, size_t outMax);
+
+/*
+** Decompress len bytes of in into out, which has room for outMax. Corrupt input
+** is caught, never read or written past either end.
+**
+**   Returns the decompressed length, -1 for corrupt input or if it didn't fit
+*/
+long lzDecompress( const uint8_t *in, size_t len, uint8_t *out, size_t outMax);
+
+#endif
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0     // Darwin, we use SO_NOSIGPIPE instead
+#endif
+
+struct metrics *metricsOpen( const char *shmName)
+{
+    struct metrics *m = 0;
+
+    if ( shmName) {
+	int fd = shm_open( shmName, O_RDWR|O_CREAT, 0644);
+	if ( fd < 0) {
+	    fprintf(stderr, "Failed to open shared memory '%s': %s\n", shmName, strerror(errno));
+	    return 0;
+	}
+	if ( ftruncate( fd, sizeof(*m)) < 0) {
+	    fprintf(stderr, "Failed to size shared memory '%s': %s\n", shmName, strerror(errno));
+	    close(fd);
+	    return 0;
+	}
+	m = mmap( 0, sizeof(*m), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);   // the mapping keeps it
+	if ( m == MAP_FAILED) {
+	    fprintf(stderr, "Failed to map shared memory '%s': %s\n", shmName, strerror(errno));
+	    return 0;
+	}
+	memset( m, 0, sizeof(*m));   // it may be left over from an earlier run
+    } else {
+	m = calloc( sizeof(*m), 1);
+	if ( !m) return 0;
+    }
+
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now);
+    m->startedNs = now.tv_sec*1000000000ULL + now.tv_nsec;
+    m->version = METRICS_VERSION;
+    __atomic_store_n( &m->magic, METRICS_MAGIC, __ATOMIC_RELEASE);   // readers check this last
+    return m;
+}
+
+const struct metrics *metricsAttach( const char *shmName)
+{
+    int fd = shm_open( shmName, O_RDONLY, 0);
+    if ( fd < 0) {
+	fprintf(stderr, "Failed to open shared memory '%s': %s\n", shmName, strerror(errno));
+	return 0;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st) < 0 || st.st_size < sizeof(struct metrics)) {
+	fprintf(stderr, "Shared memory '%s' is not a metrics block\n", shmName);
+	close(fd);
+	return 0;
+    }
+
+    const struct metrics *m = mmap( 0, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( m == MAP_FAILED) {
+	fprintf(stderr, "Failed to map shared memory '%s': %s\n", shmName, strerror(errno));
+	return 0;
+    }
+
+    if ( __atomic_load_n( &m->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || m->version != METRICS_VERSION) {
+	fprintf(stderr, "Shared memory '%s' is not a version %d metrics block\n", shmName, METRICS_VERSION);
+	munmap( (void *)m, sizeof(*m));
+	return 0;
+    }
+    return m;
+}
+
+void metricsClose( struct metrics *m, const char *shmName)
+{
+    if ( !m) return;
+
+    if ( shmName) {
+	munmap( m, sizeof(*m));
+	shm_unlink( shmName);
+    } else {
+	free(m);
+    }
+}
+
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+} counterInfo[METRIC_COUNTERS] = {
+    [METRIC_SAMPLES] = { "ookd_samples_total", "", "IQ samples processed by the detector." },
+    [METRIC_BUFFERS] = { "ookd_buffers_total", "", "Sample buffers received from the radio or replay." },
+    [METRIC_SAMPLES_DROPPED] = { "ookd_dropped_samples_total", "", "Samples the radio should have delivered by now but did not." },
+    [METRIC_IDLE_TO_HIGH] = { "ookd_detector_transitions_total", "{from=\"idle\",to=\"high\"}", "Detector state transitions." },
+    [METRIC_LOW_TO_HIGH] = { "ookd_detector_transitions_total", "{from=\"low\",to=\"high\"}", 0 },
+    [METRIC_HIGH_TO_LOW] = { "ookd_detector_transitions_total", "{from=\"high\",to=\"low\"}", 0 },
+    [METRIC_LOW_TO_IDLE] = { "ookd_detector_transitions_total", "{from=\"low\",to=\"idle\"}", 0 },
+    [METRIC_BURSTS_SENT] = { "ookd_bursts_total", "{result=\"sent\"}", "Completed bursts." },
+    [METRIC_BURSTS_SKIPPED] = { "ookd_bursts_total", "{result=\"skipped\"}", 0 },
+    [METRIC_FRAGMENTS_SENT] = { "ookd_fragments_total", "", "Burst fragments streamed." },
+    [METRIC_BYTES_SENT] = { "ookd_sent_bytes_total", "", "Bytes of encoded bursts multicast." },
+    [METRIC_DATAGRAMS_SENT] = { "ookd_datagrams_total", "", "Datagrams multicast, bursts too big for one are split." },
+    [METRIC_RING_BURSTS] = { "ookd_ring_bursts_total", "", "Bursts published in the shared memory ring." },
+    [METRIC_ENCODE_FAILURES] = { "ookd_failures_total", "{stage=\"encode\"}", "Bursts lost to failures." },
+    [METRIC_SEND_FAILURES] = { "ookd_failures_total", "{stage=\"send\"}", 0 },
+    [METRIC_DATAGRAMS_RECEIVED] = { "ookd_client_datagrams_total", "{result=\"received\"}", "Datagrams a client received, or knows it missed." },
+    [METRIC_DATAGRAMS_CORRUPT] = { "ookd_client_datagrams_total", "{result=\"corrupt\"}", 0 },
+    [METRIC_DATAGRAMS_LOST] = { "ookd_client_datagrams_total", "{result=\"lost\"}", 0 },
+    [METRIC_DATAGRAMS_LATE] = { "ookd_client_datagrams_total", "{result=\"late\"}", 0 },
+    [METRIC_DATAGRAMS_DUPLICATE] = { "ookd_client_datagrams_total", "{result=\"duplicate\"}", 0 },
+    [METRIC_DATAGRAMS_OVERFLOWED] = { "ookd_client_datagrams_total", "{result=\"overflowed\"}", 0 },
+    [METRIC_BURSTS_INCOMPLETE] = { "ookd_client_incomplete_bursts_total", "", "Bursts sent in segments a client gave up on with some missing." },
+    [METRIC_CLOCK_RESETS] = { "ookd_sample_clock_resets_total", "", "Times the fit of the sample clock to the system clock started over." },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    double scale;                     // multiply values by this for the exposition units
+} gaugeInfo[METRIC_GAUGES] = {
+    [METRIC_AVERAGE_POWER] = { "ookd_average_power", "Average signal magnitude over the last 100000 samples, 0 to 1.4.", 1e-6 },
+    [METRIC_RADIO_BUFFERS] = { "ookd_radio_buffers", "Buffers queued with the radio.", 1 },
+    [METRIC_RADIO_BUFFER_BYTES] = { "ookd_radio_buffer_bytes", "Length of each radio buffer.", 1 },
+    [METRIC_CLOCK_ERROR_PPB] = { "ookd_sample_clock_error_ppm", "How far the radio's sample rate is from nominal, by the system clock.", 1e-3 },
+    [METRIC_CLOCK_UNCERTAINTY_NS] = { "ookd_sample_clock_uncertainty_seconds", "Scatter of buffer arrivals about the sample clock's fit.", 1e-9 },
+    [METRIC_CLOCK_POINTS] = { "ookd_sample_clock_points", "Buffer arrivals the sample clock's fit is made from.", 1 },
+};
+
+static const struct {
+    const char *name;
+    const char *labels;               // inside the braces, before le
+    const char *help;                 // only on the first of a name
+    double scale;
+} histogramInfo[METRIC_HISTOGRAMS] = {
+    [METRIC_BUFFER_NS] = { "ookd_buffer_processing_seconds", "", "Time to process each sample buffer.", 1e-9 },
+    [METRIC_BURST_PULSES] = { "ookd_burst_pulses", "", "Pulses in each completed burst.", 1 },
+    [METRIC_BUFFER_LATE_NS] = { "ookd_buffer_lateness_seconds", "", "How late each sample buffer was handled, by the sample clock.", 1e-9 },
+    [METRIC_LATENCY_DETECT] = { "ook_stage_latency_seconds", "stage=\"detect\",", "Time each stage added to a burst's trip from the air to a reading.", 1e-9 },
+    [METRIC_LATENCY_ENCODE] = { "ook_stage_latency_seconds", "stage=\"encode\",", 0, 1e-9 },
+    [METRIC_LATENCY_SEND] = { "ook_stage_latency_seconds", "stage=\"send\",", 0, 1e-9 },
+    [METRIC_LATENCY_RECEIVE] = { "ook_stage_latency_seconds", "stage=\"receive\",", 0, 1e-9 },
+    [METRIC_LATENCY_DECODE] = { "ook_stage_latency_seconds", "stage=\"decode\",", 0, 1e-9 },
+    [METRIC_LATENCY_OUTPUT] = { "ook_stage_latency_seconds", "stage=\"output\",", 0, 1e-9 },
+    [METRIC_LATENCY_TOTAL] = { "ook_stage_latency_seconds", "stage=\"total\",", 0, 1e-9 },
+};
+
+void metricsFormat( const struct metrics *m, FILE *f)
+{
+    for ( int c = 0; c < METRIC_COUNTERS; c++) {
+	if ( counterInfo[c].help) {
+	    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", counterInfo[c].name, counterInfo[c].help, counterInfo[c].name);
+	}
+	fprintf(f, "%s%s %llu\n", counterInfo[c].name, counterInfo[c].labels,
+		(unsigned long long)__atomic_load_n( &m->counter[c], __ATOMIC_RELAXED));
+    }
+
+    for ( int g = 0; g < METRIC_GAUGES; g++) {
+	fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n", gaugeInfo[g].name, gaugeInfo[g].help, gaugeInfo[g].name,
+		gaugeInfo[g].name, (int64_t)__atomic_load_n( &m->gauge[g], __ATOMIC_RELAXED) * gaugeInfo[g].scale);
+    }
+
+    for ( int h = 0; h < METRIC_HISTOGRAMS; h++) {
+	const struct metricsHistogram *hist = &m->histogram[h];
+	const char *name = histogramInfo[h].name;
+	const char *labels = histogramInfo[h].labels;
+	uint64_t cumulative = 0;
+	char plain[64];
+
+	// the labels without the trailing comma, for _sum and _count
+	snprintf( plain, sizeof(plain), "%s%.*s%s", *labels ? "{" : "", *labels ? (int)strlen(labels)-1 : 0, labels, *labels ? "}" : "");
+
+	if ( histogramInfo[h].help) {
+	    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, histogramInfo[h].help, name);
+	}
+	for ( int b = 0; b < METRICS_BUCKETS-1; b++) {
+	    cumulative += __atomic_load_n( &hist->bucket[b], __ATOMIC_RELAXED);
+	    fprintf(f, "%s_bucket{%sle=\"%g\"} %llu\n", name, labels, (double)(1ULL<<b) * histogramInfo[h].scale, (unsigned long long)cumulative);
+	}
+	cumulative += __atomic_load_n( &hist->bucket[METRICS_BUCKETS-1], __ATOMIC_RELAXED);
+	fprintf(f, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+	fprintf(f, "%s_sum%s %g\n", name, plain, __atomic_load_n( &hist->sum, __ATOMIC_RELAXED) * histogramInfo[h].scale);
+	fprintf(f, "%s_count%s %llu\n", name, plain, (unsigned long long)cumulative);
+    }
+
+    fprintf(f, "# HELP ookd_start_time_seconds When ookd started, seconds since the epoch.\n"
+	    "# TYPE ookd_start_time_seconds gauge\n"
+	    "ookd_start_time_seconds %.3f\n", m->startedNs/1e9);
+}
+
+static const char *formatNs( char *buf, size_t len, double ns)
+{
+    if ( ns < 1e3) snprintf( buf, len, "%.0fns", ns);
+    else if ( ns < 1e6) snprintf( buf, len, "%.1fus", ns/1e3);
+    else if ( ns < 1e9) snprintf( buf, len, "%.1fms", ns/1e6);
+    else snprintf( buf, len, "%.2fs", ns/1e9);
+    return buf;
+}
+
+// The upper bound of the bucket holding the p quantile, in the histogram's units
+static double quantile( const uint64_t *bucket, uint64_t count, double p)
+{
+    uint64_t want = count*p + 0.5;
+    uint64_t cumulative = 0;
+
+    if ( want < 1) want = 1;
+    for ( int b = 0; b < METRICS_BUCKETS; b++) {
+	cumulative += bucket[b];
+	if ( cumulative >= want) return (double)(1ULL<<b);
+    }
+    return (double)(1ULL<<(METRICS_BUCKETS-1));
+}
+
+void metricsFormatLatency( const struct metrics **m, int count, FILE *f)
+{
+    fprintf(f, "%-8s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50<=", "p90<=", "p99<=");
+
+    for ( int h = METRIC_LATENCY_DETECT; h <= METRIC_LATENCY_TOTAL; h++) {
+	uint64_t bucket[METRICS_BUCKETS] = {0};
+	uint64_t n = 0;
+	double sum = 0;
+
+	for ( int i = 0; i < count; i++) {
+	    const struct metricsHistogram *hist = &m[i]->histogram[h];
+	    for ( int b = 0; b < METRICS_BUCKETS; b++) bucket[b] += __atomic_load_n( &hist->bucket[b], __ATOMIC_RELAXED);
+	    n += __atomic_load_n( &hist->count, __ATOMIC_RELAXED);
+	    sum += __atomic_load_n( &hist->sum, __ATOMIC_RELAXED);
+	}
+
+	// the stage name is in the labels, stage="xxx",
+	const char *labels = histogramInfo[h].labels;
+	int nameLen = strlen(labels) - strlen("stage=\"\",");
+	char mean[16], p50[16], p90[16], p99[16];
+
+	if ( n == 0) {
+	    fprintf(f, "%-8.*s %10d %10s %10s %10s %10s\n", nameLen, labels+7, 0, "-", "-", "-", "-");
+	} else {
+	    fprintf(f, "%-8.*s %10llu %10s %10s %10s %10s\n", nameLen, labels+7, (unsigned long long)n,
+		    formatNs( mean, sizeof(mean), sum/n),
+		    formatNs( p50, sizeof(p50), quantile( bucket, n, 0.50)),
+		    formatNs( p90, sizeof(p90), quantile( bucket, n, 0.90)),
+		    formatNs( p99, sizeof(p99), quantile( bucket, n, 0.99)));
+	}
+    }
+}
+
+void metricsBurstReceived( struct metrics *m, const struct ook_burst *burst)
+{
+    const struct ook_times *t = &burst->times;
+
+    // realtime clocks on different machines can disagree, don't record nonsense
+    if ( t->sentRealtimeNs && t->receivedRealtimeNs >= t->sentRealtimeNs) {
+	metricsObserve( m, METRIC_LATENCY_RECEIVE, t->receivedRealtimeNs - t->sentRealtimeNs);
+    }
+}
+
+void metricsBurstDecoded( struct metrics *m, struct ook_burst *burst)
+{
+    struct ook_times *t = &burst->times;
+
+    t->decodedMonotonicNs = ook_now( CLOCK_MONOTONIC);
+    if ( t->receivedMonotonicNs) {
+	metricsObserve( m, METRIC_LATENCY_DECODE, t->decodedMonotonicNs - t->receivedMonotonicNs);
+    }
+}
+
+void metricsBurstOutput( struct metrics *m, const struct ook_burst *burst)
+{
+    const struct ook_times *t = &burst->times;
+
+    if ( t->decodedMonotonicNs) {
+	metricsObserve( m, METRIC_LATENCY_OUTPUT, ook_now( CLOCK_MONOTONIC) - t->decodedMonotonicNs);
+    }
+
+    uint64_t now = ook_now( CLOCK_REALTIME);
+    if ( t->endRealtimeNs && now >= t->endRealtimeNs) {
+	metricsObserve( m, METRIC_LATENCY_TOTAL, now - t->endRealtimeNs);
+    }
+}
+
+void metricsReceiveStats( struct metrics *m, int sock)
+{
+    struct ook_stats s;
+    if ( !m || sock < 0 || ook_get_stats( sock, &s) < 0) return;
+
+    // the library keeps the totals, just copy them
+    __atomic_store_n( &m->counter[METRIC_DATAGRAMS_RECEIVED], s.datagrams, __ATOMIC_RELAXED);
+    __atomic_store_n( &m->counter[METRIC_DATAGRAMS_CORRUPT], s.corrupt, __ATOMIC_RELAXED);
+    __atomic_store_n( &m->counter[METRIC_DATAGRAMS_LOST], s.lost, __ATOMIC_RELAXED);
+    __atomic_store_n( &m->counter[METRIC_DATAGRAMS_LATE], s.late, __ATOMIC_RELAXED);
+    __atomic_store_n( &m->counter[METRIC_DATAGRAMS_DUPLICATE], s.duplicates, __ATOMIC_RELAXED);
+    __atomic_store_n( &m->counter[METRIC_DATAGRAMS_OVERFLOWED], s.overflows, __ATOMIC_RELAXED);
+    __atomic_store_n( &m->counter[METRIC_BURSTS_INCOMPLETE], s.incomplete, __ATOMIC_RELAXED);
+}
+
+struct server {
+    int sock;
+    const struct metrics *m;
+};
+
+static void serveOne( int fd, const struct metrics *m)
+{
+    char request[1024];
+    ssize_t got = recv( fd, request, sizeof(request)-1, 0);
+    if ( got <= 0) return;
+    request[got] = 0;
+
+    char *body = 0;
+    size_t bodyLen = 0;
+    const char *status = "404 Not Found";
+
+    if ( strncmp( request, "GET /metrics", 12) == 0 || strncmp( request, "GET / ", 6) == 0) {
+	FILE *f = open_memstream( &body, &bodyLen);
+	if ( !f) return;
+	metricsFormat( m, f);
+	fclose(f);
+	status = "200 OK";
+    }
+
+    char header[256];
+    int headerLen = snprintf( header, sizeof(header),
+			      "HTTP/1.0 %s\r\n"
+			      "Content-Type: text/plain; version=0.0.4\r\n"
+			      "Content-Length: %zu\r\n"
+			      "Connection: close\r\n\r\n", status, bodyLen);
+    if ( send( fd, header, headerLen, MSG_NOSIGNAL) == headerLen && bodyLen) {
+	send( fd, body, bodyLen, MSG_NOSIGNAL);
+    }
+    free(body);
+}
+
+static void *serverThread( void *arg)
+{
+    struct server *s = (struct server *)arg;
+
+    for (;;) {
+	int fd = accept( s->sock, 0, 0);
+	if ( fd < 0) {
+	    if ( errno == EINTR || errno == ECONNABORTED) continue;
+	    fprintf(stderr, "Metrics server failed to accept: %s\n", strerror(errno));
+	    break;
+	}
+
+	// don't let a stuck scraper hold us up forever
+	struct timeval timeout = { .tv_sec = 5 };
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+	int yes = 1;
+	setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+
+	serveOne( fd, s->m);
+	close(fd);
+    }
+
+    close( s->sock);
+    free(s);
+    return 0;
+}
+
+int metricsServe( const struct metrics *m, const char *address, const char *port)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *ai = 0;
+
+    int err = getaddrinfo( address, port, &hints, &ai);
+    if ( err) {
+	fprintf(stderr, "Illegal metrics address (addr=%s port=%s):%s\n", address, port, gai_strerror(err));
+	return -1;
+    }
+
+    int sock = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if ( sock < 0) {
+	fprintf(stderr, "Failed to create metrics socket: %s\n", strerror(errno));
+	freeaddrinfo(ai);
+	return -1;
+    }
+
+    int yes = 1;
+    setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    if ( bind( sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen( sock, 8) < 0) {
+	fprintf(stderr, "Failed to listen for metrics on %s:%s: %s\n", address, port, strerror(errno));
+	freeaddrinfo(ai);
+	close(sock);
+	return -1;
+    }
+    freeaddrinfo(ai);
+
+    struct server *s = calloc( sizeof(*s), 1);
+    if ( !s) {
+	close(sock);
+	return -1;
+    }
+    s->sock = sock;
+    s->m = m;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init( &attr);
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create( &thread, &attr, serverThread, s);
+    pthread_attr_destroy( &attr);
+    if ( err) {
+	fprintf(stderr, "Failed to start metrics server: %s\n", strerror(err));
+	close(sock);
+	free(s);
+	return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+#ifndef METRICS_IS_IN
+#define METRICS_IS_IN
+
+/*
+** Counters and histograms describing what ookd is up to. They live in one
+** struct metrics which can be placed in POSIX shared memory, so other processes
+** (e.g. ookstats) can read it, and can be served in the Prometheus text format
+** over HTTP.
+**
+** Updates are relaxed atomic adds, safe from any thread and cheap enough to
+** do per buffer, but not per sample.
+**
+** It will print errors to stderr for programmer misuse or misconfiguration.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ook.h"
+
+#define METRICS_MAGIC 0x4F4F4B4D       // 'OOKM'
+#define METRICS_VERSION 9
+#define METRICS_BUCKETS 32             // bucket i counts values <= 2^i, the last is everything else
+
+enum metricCounter {
+    METRIC_SAMPLES,                    // IQ samples given to the detector
+    METRIC_BUFFERS,                    // buffers from the radio or replay
+    METRIC_SAMPLES_DROPPED,            // samples the radio should have delivered but didn't
+    METRIC_IDLE_TO_HIGH,               // detector state transitions
+    METRIC_LOW_TO_HIGH,
+    METRIC_HIGH_TO_LOW,
+    METRIC_LOW_TO_IDLE,
+    METRIC_BURSTS_SENT,
+    METRIC_BURSTS_SKIPPED,             // too few pulses, see --min-packet
+    METRIC_FRAGMENTS_SENT,             // see --stream-port
+    METRIC_BYTES_SENT,
+    METRIC_DATAGRAMS_SENT,             // more than bursts when they are split, see --mtu
+    METRIC_RING_BURSTS,                // published in the shared memory ring, see --ring
+    METRIC_ENCODE_FAILURES,
+    METRIC_SEND_FAILURES,
+
+    // A client's counts from ook_get_stats(), see metricsReceiveStats()
+    METRIC_DATAGRAMS_RECEIVED,
+    METRIC_DATAGRAMS_CORRUPT,
+    METRIC_DATAGRAMS_LOST,             // gaps in ookd's numbering, on the network or failing to send
+    METRIC_DATAGRAMS_LATE,
+    METRIC_DATAGRAMS_DUPLICATE,
+    METRIC_DATAGRAMS_OVERFLOWED,       // our kernel threw away, we weren't reading fast enough
+    METRIC_BURSTS_INCOMPLETE,          // segmented bursts given up on
+
+    METRIC_CLOCK_RESETS,               // the sample clock's fit started over, see sampleclock.h
+    METRIC_COUNTERS
+};
+
+enum metricGauge {
+    METRIC_AVERAGE_POWER,              // millionths, over the last 100000 samples
+    METRIC_RADIO_BUFFERS,              // current radio buffering, see --buffers
+    METRIC_RADIO_BUFFER_BYTES,
+    METRIC_CLOCK_ERROR_PPB,            // signed, the sample clock's rate less nominal
+    METRIC_CLOCK_UNCERTAINTY_NS,       // of the bursts' capture times
+    METRIC_CLOCK_POINTS,               // in the fit
+    METRIC_GAUGES
+};
+
+enum metricHistogram {
+    METRIC_BUFFER_NS,                  // time to process each buffer
+    METRIC_BURST_PULSES,               // pulses in each completed burst
+    METRIC_BUFFER_LATE_NS,             // how late each buffer was handled by the sample clock, see realtime.h
+
+    // Latency of each stage a burst goes through, the time since the previous one.
+    // ookd records the first three, clients the rest. See struct ook_times.
+    METRIC_LATENCY_DETECT,             // burst over on the air to the detector handing it over
+    METRIC_LATENCY_ENCODE,
+    METRIC_LATENCY_SEND,
+    METRIC_LATENCY_RECEIVE,            // sent by ookd to received by the client, across machines
+    METRIC_LATENCY_DECODE,
+    METRIC_LATENCY_OUTPUT,             // decoded to the reading written out
+    METRIC_LATENCY_TOTAL,              // burst over on the air to the reading written out
+    METRIC_HISTOGRAMS
+};
+
+struct metricsHistogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t bucket[METRICS_BUCKETS];
+};
+
+struct metrics {
+    uint32_t magic;                    // METRICS_MAGIC once initialized
+    uint32_t version;                  // METRICS_VERSION, readers must check it
+    uint64_t startedNs;                // CLOCK_REALTIME when ookd started
+    uint64_t counter[METRIC_COUNTERS];
+    uint64_t gauge[METRIC_GAUGES];
+    struct metricsHistogram histogram[METRIC_HISTOGRAMS];
+};
+
+/*
+** Make a zeroed metrics block. If shmName is set (e.g. "/ookd") it is created
+** in shared memory with that name, otherwise it is private memory.
+**
+**   NULL is returned for failure
+*/
+struct metrics *metricsOpen( const char *shmName);
+
+/*
+** Map an existing shared memory metrics block read only, as made by metricsOpen().
+**
+**   NULL is returned for failure
+*/
+const struct metrics *metricsAttach( const char *shmName);
+
+/*
+** Release a metrics block, removing its shared memory name if it has one.
+** It is ok to pass in NULL.
+*/
+void metricsClose( struct metrics *m, const char *shmName);
+
+/*
+** Write the metrics in the Prometheus text exposition format.
+*/
+void metricsFormat( const struct metrics *m, FILE *f);
+
+/*
+** Write a table of the latency histograms of one or more metrics blocks, e.g.
+** ookd's and a client's, with counts, means and percentiles.
+*/
+void metricsFormatLatency( const struct metrics **m, int count, FILE *f);
+
+/*
+** Client side latency stages. Call these as a burst from ook_decode_from_socket()
+** arrives, when you have decoded it, and when you have finished acting on it.
+** The receive and total stages need ookd's times, bursts without them, e.g. from
+** an older ookd, only get the decode and output stages recorded.
+*/
+void metricsBurstReceived( struct metrics *m, const struct ook_burst *burst);
+void metricsBurstDecoded( struct metrics *m, struct ook_burst *burst);
+void metricsBurstOutput( struct metrics *m, const struct ook_burst *burst);
+
+/*
+** Copy ook_get_stats() of the socket bursts are read from into the client counters.
+** Call it after each burst. It does nothing for a negative socket, e.g. reading a ring.
+*/
+void metricsReceiveStats( struct metrics *m, int sock);
+
+/*
+** Serve the metrics over HTTP on address:port from a background thread.
+** Any GET of / or /metrics gets metricsFormat() output.
+**
+**   Returns <0 on failure.
+*/
+int metricsServe( const struct metrics *m, const char *address, const char *port);
+
+// These do nothing if m is NULL, so code can be instrumented unconditionally.
+
+static inline void metricsCount( struct metrics *m, enum metricCounter c, uint64_t n)
+{
+    if ( m) __atomic_fetch_add( &m->counter[c], n, __ATOMIC_RELAXED);
+}
+
+static inline void metricsSet( struct metrics *m, enum metricGauge g, uint64_t v)
+{
+    if ( m) __atomic_store_n( &m->gauge[g], v, __ATOMIC_RELAXED);
+}
+
+static inline void metricsObserve( struct metrics *m, enum metricHistogram h, uint64_t v)
+{
+    if ( !m) return;
+
+    unsigned b = v <= 1 ? 0 : 64 - __builtin_clzll( v-1);   // smallest b with v <= 2^b
+    if ( b >= METRICS_BUCKETS) b = METRICS_BUCKETS-1;
+
+    struct metricsHistogram *hist = &m->histogram[h];
+    __atomic_fetch_add( &hist->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add( &hist->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add( &hist->count, 1, __ATOMIC_RELAXED);
+}
+
+#endif
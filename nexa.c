@@ -6,175 +6,20 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "ook.h"
-
-/* Nexa protocol specification was used from http://tech.jolowe.se/home-automation-rf-protocols/ */
-
-#define SYNC_BIT_LEN 11
-#define PAUSE_BIT_LEN 41
-#define PHYSICAL_1_BIT_LEN 2
-#define PHYSICAL_0_BIT_LEN 6
-#define TRANSMITTER_CODE_LEN 26
-
-#define UPPER_LIMIT_OF_PHYSICAL_BITS 4096
-
-#define PULSE_LENGTH_NANOSEC 250000
+#include "protocols.h"
+#include "metrics.h"
 
 #define STATSD_HOST "127.0.0.1"
 #define STATSD_PORT 8125
 
 int verbose = 0;
 
-struct nexa_p
-{
-    /* transmitter unique code, and it is this code that the reciever "learns" to recognize */
-    uint32_t transmitter_code:TRANSMITTER_CODE_LEN;
-    
-    /* 1 - on, 0 - off */
-    uint8_t group_code:1;
-    
-    /* 1 - on, 0 - off */
-    uint8_t on_off:1;
-    
-    /* Channel bits. Proove/Anslut = 00, Nexa = 11 */
-    uint8_t channel_bits:2;
-    
-    /* Unit bits. Device to be turned on or off.
-     Proove/Anslut Unit #1 = 00, #2 = 01, #3 = 10.
-     Nexa Unit #1 = 11, #2 = 10, #3 = 01 */
-    uint8_t unit_bits:2;
-};
-
-/*
- Returns 1 if the data pointer points to a "sync" bit, 0 otherwise
- */
-int is_sync_bit(unsigned char** data)
-{
-    if((*data)[0] == 1) {
-        for(int i = 1; i < SYNC_BIT_LEN; ++i) {
-            if((*data)[i] != 0) {
-                return 0;
-            }
-        }
-    }
-    
-    *data += SYNC_BIT_LEN;
-    return 1;
-}
-
-/*
- Returns 1 if the data pointer points to a "pause" bit, 0 otherwise
- */
-int is_pause_bit(unsigned char** data)
-{
-    if((*data)[0] == 1) {
-        for(int i = 1; i < PAUSE_BIT_LEN; ++i) {
-            if((*data)[i] != 0) {
-                return 0;
-            }
-        }
-    }
-    
-    *data += PAUSE_BIT_LEN;
-    return 1;
-}
-
-/*
- Decodes physical bit from the pulses sequence
- Returns bit value (1 or 0)
- */
-int decode_physical_bit(unsigned char** data)
-{
-    if((*data)[0] == 1) {
-        for(int i = 1; i < PHYSICAL_0_BIT_LEN; ++i) {
-            if((*data)[i] != 0) {
-                *data += PHYSICAL_1_BIT_LEN;
-                return 1;
-            }
-        }
-    }
-    
-    *data += PHYSICAL_0_BIT_LEN;
-    return 0;
-}
-
-/*
- Decodes logical bit from the pair of 2 physical bits
- Returns bit value on success (1 or 0), -1 on error
- */
-int decode_logical_bit(unsigned char** data)
-{
-    int first_bit = decode_physical_bit(data);
-    int second_bit = decode_physical_bit(data);
-    
-    if(first_bit && !second_bit) {
-        return 1;
-    } else if(!first_bit && second_bit) {
-        return 0;
-    } else if(verbose) {
-        fprintf(stderr, "incorrect physical bit sequence %d %d\n", first_bit, second_bit);
-    }
-    
-    return -1;
-}
-
-/*
- Decodes set of physical bits to the Nexa control packet structure
- Returns a filled struct on success, NULL on error
- */
-struct nexa_p* decode_nexa_p(unsigned char* data)
-{
-    if(is_sync_bit(&data)) {
-        struct nexa_p* packet = (struct nexa_p*)malloc(sizeof(struct nexa_p));
-        memset(packet, 0, sizeof(struct nexa_p));
-        
-        for(int i = 0; i < TRANSMITTER_CODE_LEN; ++i) {
-            uint8_t decoded_bit = decode_logical_bit(&data);
-
-            if(decoded_bit == 1) {
-                packet->transmitter_code |= (1 << i);
-            }
-        }
-        
-        if(decode_logical_bit(&data) == 0) {
-            packet->group_code = 1; // inversed by protocol
-        }
-        
-        if(decode_logical_bit(&data) == 0) {
-            packet->on_off = 1; // inversed by protocol
-        }
-        
-        if(decode_logical_bit(&data) == 1) {
-            packet->channel_bits |= 1;
-        }
-        if(decode_logical_bit(&data) == 1) {
-            packet->channel_bits |= (1 << 1);
-        }
-        
-        if(decode_logical_bit(&data) == 1) {
-            packet->unit_bits |= 1;
-        }
-        if(decode_logical_bit(&data) == 1) {
-            packet->unit_bits |= (1 << 1);
-        }
-        
-        if(is_pause_bit(&data)) {
-            return packet;
-        } else if(verbose) {
-            fprintf(stderr, "no pause bit\n");
-            free(packet);
-        }
-    } else if(verbose) {
-        fprintf(stderr, "no sync bit\n");
-    }
-    
-    return NULL;
-}
-
 /*
  Sends "1" to the gauge metric of StatsD server
  Returns 0 on success, -1 on error
@@ -209,24 +54,88 @@ int send_statsd_gauge(const char* metricName)
 static void showHelp( FILE *f)
 {
     fprintf(f,
-            "Usage: nexa [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-f transmittercode] [-m metricname]\n"
+            "Usage: nexa [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-R ring] [-B bytes] [-f transmittercode] [-m metricname] [-S streamport]\n"
             "  -h | -? | --help                      display usage and exit\n"
             "  -v | --verbose                        verbose logging\n"
             "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
             "  -p port | --multicast-port port       multicast port, default 3636\n"
             "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+            "  -R name | --ring name                 read bursts from ookd's shared memory ring instead, e.g. /ookd-ring\n"
+            "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving faster than we decode them\n"
             "  -f code | --filter-transmitter-code   transmitter code to filter output with, disabled by default\n"
             "  -m name | --metric-name               name of the gauge metric to send to StatsD server, disabled by default\n"
+            "  -s name | --stats-shm name            publish latency metrics in shared memory with this name, for ookstats\n"
+            "  -S port | --stream-port port          listen to the bursts ookd streams to this port, and act on the\n"
+            "                                        first frame of a burst before the repeats are over\n"
             );
 }
 
+// What the handlers need from main()
+static struct metrics *metrics = 0;
+static int32_t filterTransmitterCode = -1;
+static const char *metricName = NULL;
+
+// When streaming, bursts arrive in pieces. Each is tried once it could hold a
+// frame, and the rest of a burst is ignored once one decodes. Burst ids start
+// again when ookd does, so the id is only ours while the sequence source is.
+static struct ook_reassembly *reassembly = 0;
+static int handled = 0;
+static uint32_t handledBurstId = 0;
+static uint32_t handledSource = 0;
+
+static void handleBurst( struct ook_burst *received, int sock, void *ctx)
+{
+    struct ook_burst *burst = received;
+    int complete = 1;
+    if ( reassembly) {
+        burst = ook_reassemble( reassembly, received, &complete);
+        if ( burst && burst->sequence.source != handledSource) handled = 0;
+        if ( !burst || (handled && burst->fragment.burstId == handledBurstId) ||
+             (!complete && burst->pulses < NEXA_FRAME_PULSES)) {
+            return;
+        }
+    }
+    metricsBurstReceived( metrics, burst);
+    metricsReceiveStats( metrics, sock);
+    
+    struct nexa_p packet;
+    if(nexa_decode(burst, &packet, verbose)) {
+        handled = 1;
+        handledBurstId = burst->fragment.burstId;
+        handledSource = burst->sequence.source;
+        metricsBurstDecoded( metrics, burst);
+        if(filterTransmitterCode == -1 || packet.transmitter_code == filterTransmitterCode) {
+            if(verbose) {
+                fprintf(stderr, "transmitter code: %d: %s\n", packet.transmitter_code,
+                    packet.on_off ? "ON" : "OFF");
+            }
+            
+            if(metricName) {
+                send_statsd_gauge(metricName);
+            }
+            metricsBurstOutput( metrics, burst);
+        }
+    } else if ( complete) {
+        fprintf(stderr, "decoding error\n");
+    }
+        
+    fflush(stdout);
+}
+
+static void stopOnSignal( int signum, void *ctx)
+{
+    ook_loop_stop( ctx);
+}
+
 int main( int argc, char **argv)
 {
     const char *multicastAddress = "236.0.0.1";
     const char *multicastPort = "3636";
     const char *multicastInterface = "127.0.0.1";
-    int32_t filterTransmitterCode = -1;
-    const char *metricName = NULL;
+    const char *ringName = 0;
+    int receiveBuffer = 0;
+    const char *statsShmName = 0;
+    const char *streamPort = 0;
     
     // Handle options
     for(;;) {
@@ -237,12 +146,16 @@ int main( int argc, char **argv)
             { "multicast-address", required_argument, 0, 'a'},
             { "multicast-port", required_argument, 0, 'p' },
             { "multicast-interface", required_argument, 0, 'i' },
+            { "ring", required_argument, 0, 'R' },
+            { "receive-buffer", required_argument, 0, 'B' },
             { "filter-transmitter-code", required_argument, 0, 'f' },
             { "metric-name", required_argument, 0, 'm' },
+            { "stats-shm", required_argument, 0, 's' },
+            { "stream-port", required_argument, 0, 'S' },
             { 0,0,0,0}
         };
         
-        int c = getopt_long( argc, argv, "vh?f:a:p:i:m:", options, &optionIndex );
+        int c = getopt_long( argc, argv, "vh?f:a:p:i:m:s:S:R:B:", options, &optionIndex );
         if ( c == -1) break;
         
         switch(c) {
@@ -262,12 +175,28 @@ int main( int argc, char **argv)
             case 'i':
                 multicastInterface = optarg;
                 break;
+            case 'R':
+                ringName = optarg;
+                break;
+            case 'B':
+                receiveBuffer = atoi(optarg);
+                if ( receiveBuffer < 1) {
+                    fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case 'f':
                 filterTransmitterCode = atoi(optarg);
                 break;
             case 'm':
                 metricName = optarg;
                 break;
+            case 's':
+                statsShmName = optarg;
+                break;
+            case 'S':
+                streamPort = optarg;
+                break;
             default:
                 fprintf(stderr,"Illegal option\n");
                 showHelp(stderr);
@@ -275,64 +204,47 @@ int main( int argc, char **argv)
         }
     }
 
-    // Parse our multicast address
-    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
-    if ( sock < 0) {
-        fprintf(stderr,"Failed to open multicast interface\n");
+    if ( statsShmName) {
+        metrics = metricsOpen( statsShmName);
+        if ( !metrics) exit(1);
+    }
+
+    // Bursts come from ookd's ring if we share its host and were asked to, otherwise multicast
+    struct ook_ring *ring = 0;
+    int sock = -1;
+    if ( ringName && streamPort) {
+        fprintf(stderr,"The ring only has whole bursts, it can't be used with --stream-port\n");
         exit(1);
     }
-    
-    unsigned char *data = (unsigned char *)malloc(UPPER_LIMIT_OF_PHYSICAL_BITS * sizeof(unsigned char));
-    
-    for (;;) {
-        struct ook_burst *burst;
-        struct sockaddr_storage addr;
-        socklen_t addrLen = sizeof(addr);
-        
-        int e = ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
-        if ( e < 0) {
-            fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
-            break;
-        }
-        if ( e == 0) {
-            fprintf(stderr,"Corrupt burst\n");
-            continue;
-        }
-        
-        size_t bits = 0;
-        memset(data, 0, UPPER_LIMIT_OF_PHYSICAL_BITS * sizeof(unsigned char));
-        
-        for ( int i = 0; i < burst->pulses; i++) {
-            data[bits++] = 1;
-            
-            uint8_t zeros = burst->pulse[i].lowNanoseconds / PULSE_LENGTH_NANOSEC;
-            while(zeros--) {
-                data[bits++] = 0;
-            }
-        }
-        
-        struct nexa_p* packet = decode_nexa_p(data);
-        if(packet) {
-            if(filterTransmitterCode == -1 || packet->transmitter_code == filterTransmitterCode) {
-                if(verbose) {
-                    fprintf(stderr, "transmitter code: %d: %s\n", packet->transmitter_code,
-                        packet->on_off ? "ON" : "OFF");
-                }
-                
-                if(metricName) {
-                    send_statsd_gauge(metricName);
-                }
-            }
-        } else {
-            fprintf(stderr, "decoding error\n");
-        }
-            
-        fflush(stdin);
-        free(packet);
-        free(burst);
+    if ( ringName) {
+        ring = ook_ring_attach( ringName);
+        if ( !ring) exit(1);
+    } else {
+        sock = ook_open( multicastAddress, streamPort ? streamPort : multicastPort, multicastInterface);
+        if ( sock < 0) {
+            fprintf(stderr,"Failed to open multicast interface\n");
+            exit(1);
+        }
+        if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) exit(1);
     }
-    
-    free(data);
-    close(sock);
+
+    if ( streamPort) {
+        reassembly = ook_reassembly_new();
+        if ( !reassembly) exit(1);
+    }
+    struct ook_loop *loop = ook_loop_new();
+    if ( !loop) exit(1);
+    if ( (ring ? ook_loop_add_ring( loop, ring, handleBurst, 0, verbose)
+               : ook_loop_add_socket( loop, sock, handleBurst, 0, verbose)) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGINT, stopOnSignal, loop) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGTERM, stopOnSignal, loop) < 0) exit(1);
+
+    ook_loop_run( loop);
+
+    ook_loop_free( loop);
+    ook_reassembly_free( reassembly);
+    if ( sock >= 0) close(sock);
+    ook_ring_detach( ring);
+    metricsClose( metrics, statsShmName);
     return 0;
 }
@@ -3,11 +3,68 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+
+#include "ring.h"
+
+// The version signature starting each datagram. Extensions came in with version 2, a datagram
+// without any is still sent as version 1, which is all the ook library before them understands.
+#define OOK_VERSION_PLAIN 0x36360001
+#define OOK_VERSION_EXTENDED 0x36360002
+
+#define OOK_EXTENSION_TIMES 1
+#define OOK_EXTENSION_FRAGMENT 2
+#define OOK_EXTENSION_SEGMENT 3
+#define OOK_EXTENSION_SEQUENCE 4
+#define OOK_EXTENSION_QUALITY 5
+#define OOK_EXTENSION_CLOCK 6
+
+#define OOK_PULSE_BYTES 12         // on the wire, the quality extension adds 4 more for each
+
+// Limits of ook_loop_run()
+#define OOK_LOOP_SOURCES 16
+#define OOK_LOOP_SIGNALS 65            // signal numbers up to this
+#define OOK_LOOP_TICK_NS 10000000ULL   // timers are rounded up to this
+#define OOK_LOOP_SLOTS 256             // in the timer wheel, a turn is 2.56s
+#define OOK_LOOP_RING_POLL_MS 10       // a ring alongside other inputs is looked at this often
+#define OOK_LOOP_RING_WAIT_MS 100      // and a lone ring waited on at most this long before signals are
+
+// Segments of bursts still arriving are kept this long, in a table this big, see ook_decode_from_socket()
+#define OOK_SEGMENT_TIMEOUT_NS 1000000000ULL
+#define OOK_SEGMENT_SLOTS 8
+
+// Sockets and senders ook_get_stats() keeps count of, and how far out of order a datagram can be
+// and still be taken back out of the lost count
+#define OOK_STATS_SOCKETS 8
+#define OOK_SOURCE_SLOTS 16
+#define OOK_SEQUENCE_WINDOW 64
+
+static void forgetSocket( int sock);
+
+uint64_t ook_now( clockid_t clock)
+{
+    struct timespec t;
+    clock_gettime( clock, &t);
+    return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
 
 struct ook_burst *ook_allocate_burst( uint32_t maximumPulses)
 {
@@ -17,6 +74,10 @@ struct ook_burst *ook_allocate_burst( uint32_t maximumPulses)
     r = malloc(need);
     if ( r) {
 	r->positionNanoseconds = 0;
+	memset( &r->times, 0, sizeof(r->times));
+	memset( &r->fragment, 0, sizeof(r->fragment));
+	memset( &r->sequence, 0, sizeof(r->sequence));
+	r->noiseFloor = 0;
 	r->pulses = 0;
 	r->allocatedPulses = maximumPulses;
     }
@@ -30,43 +91,190 @@ int ook_add_pulse( struct ook_burst *burst, uint32_t hiNs, uint32_t lowNs, int32
 	burst->pulse[burst->pulses].hiNanoseconds = hiNs;
 	burst->pulse[burst->pulses].lowNanoseconds = lowNs;
 	burst->pulse[burst->pulses].frequencyOffsetHz = freqOffsetHz;
+	burst->pulse[burst->pulses].peakPower = 0;
+	burst->pulse[burst->pulses].meanPower = 0;
 	burst->pulses++;
 	return 0;
     }
     return -1;
 }
 
-int ook_encode( struct ook_burst *burst, void **dataReturn, size_t *sizeReturn)
+uint8_t ook_pulse_confidence( const struct ook_burst *burst, uint32_t pulse)
+{
+    if ( !burst->noiseFloor || pulse >= burst->pulses) return 255;
+
+    uint32_t mean = burst->pulse[pulse].meanPower;
+    if ( mean <= burst->noiseFloor) return 0;
+
+    float eighthsOfDb = 80.0f * log10f( (float)mean / burst->noiseFloor);
+    return eighthsOfDb >= 255 ? 255 : (uint8_t)eighthsOfDb;
+}
+
+// One datagram of a burst too big for one, see ook_encode_segment()
+struct segment {
+    uint32_t id;                   // the same for every segment of a burst, unique per sender
+    uint32_t index;                // 0..count-1
+    uint32_t count;                // 0 if the datagram is the whole burst
+    uint32_t firstPulse;           // where this segment's pulses go in the whole burst
+    uint32_t totalPulses;
+};
+
+// Bytes for the header and the extensions a datagram of this burst will carry, less its pulses
+static size_t encodedOverhead( const struct ook_burst *burst, int segmented)
+{
+    return 16 + (burst->times.captureRealtimeNs ? 40 : 0) + (burst->fragment.flags ? 24 : 0) + (segmented ? 28 : 0) +
+	(burst->sequence.source ? 16 : 0) + (burst->noiseFloor ? 12 : 0) + (burst->times.uncertaintyNs ? 12 : 0);
+}
+
+// Bytes each pulse takes in a datagram, with its share of the quality extension
+static size_t encodedPulseBytes( const struct ook_burst *burst)
+{
+    return OOK_PULSE_BYTES + (burst->noiseFloor ? 4 : 0);
+}
+
+// Encode n pulses starting at first, with seg's extension if it is set, and with no extensions at all if plain
+static int encodePulses( const struct ook_burst *burst, uint32_t first, uint32_t n, const struct segment *seg,
+			 int plain, void **dataReturn, size_t *sizeReturn)
 {
-    size_t maxSize = sizeof(*burst) + sizeof(burst->pulse[0])*burst->pulses + 64 /* some packet overhead */;
+    size_t maxSize = encodedOverhead( burst, seg != 0) + encodedPulseBytes( burst)*n;
     void *data = malloc( maxSize);
     if ( data == 0) return -1;
 
     void *thumb = data;
     size_t left = maxSize;
 
+#define OPUT_U16(V) { if ( left < 2) goto Overflow; memcpy( thumb, &(V), 2); thumb+=2; left-=2; }
 #define OPUT_U32(V) { if ( left < 4) goto Overflow; memcpy( thumb, &(V), 4); thumb+=4; left-=4; }
 #define OPUT_I32(V) { if ( left < 4) goto Overflow; memcpy( thumb, &(V), 4); thumb+=4; left-=4; }
 #define OPUT_U64(V) { if ( left < 8) goto Overflow; memcpy( thumb, &(V), 8); thumb+=8; left-=8; }
 
-    uint32_t vers = 0x36360001; 
+    uint32_t vers = plain || encodedOverhead( burst, seg != 0) == 16 ? OOK_VERSION_PLAIN : OOK_VERSION_EXTENDED;
     OPUT_U32( vers);  // version signature
     OPUT_U64( burst->positionNanoseconds);
-    OPUT_U32( burst->pulses);
-    for ( int i = 0; i < burst->pulses; i++) {
+    OPUT_U32( n);
+    for ( uint32_t i = first; i < first+n; i++) {
 	OPUT_U32( burst->pulse[i].hiNanoseconds);
 	OPUT_U32( burst->pulse[i].lowNanoseconds);
 	OPUT_I32( burst->pulse[i].frequencyOffsetHz);
     }
+    if ( plain) goto Done;
+
+    // Extensions follow the pulses, each a tag, a length, and that many bytes.
+    if ( burst->times.captureRealtimeNs) {
+	uint32_t tag = OOK_EXTENSION_TIMES;
+	uint32_t len = 32;
+	OPUT_U32( tag);
+	OPUT_U32( len);
+	OPUT_U64( burst->times.captureMonotonicNs);
+	OPUT_U64( burst->times.captureRealtimeNs);
+	OPUT_U64( burst->times.endRealtimeNs);
+	OPUT_U64( burst->times.sentRealtimeNs);
+    }
+    if ( burst->fragment.flags) {
+	uint32_t tag = OOK_EXTENSION_FRAGMENT;
+	uint32_t len = 16;
+	OPUT_U32( tag);
+	OPUT_U32( len);
+	OPUT_U32( burst->fragment.flags);
+	OPUT_U32( burst->fragment.burstId);
+	OPUT_U32( burst->fragment.sequence);
+	OPUT_U32( burst->fragment.firstPulse);
+    }
+    if ( seg) {
+	uint32_t tag = OOK_EXTENSION_SEGMENT;
+	uint32_t len = 20;
+	OPUT_U32( tag);
+	OPUT_U32( len);
+	OPUT_U32( seg->id);
+	OPUT_U32( seg->index);
+	OPUT_U32( seg->count);
+	OPUT_U32( seg->firstPulse);
+	OPUT_U32( seg->totalPulses);
+    }
+    if ( burst->sequence.source) {
+	uint32_t tag = OOK_EXTENSION_SEQUENCE;
+	uint32_t len = 8;
+	uint32_t number = burst->sequence.number + (seg ? seg->index : 0);
+	OPUT_U32( tag);
+	OPUT_U32( len);
+	OPUT_U32( burst->sequence.source);
+	OPUT_U32( number);
+    }
+    if ( burst->noiseFloor) {
+	// after those, the socket filter expects them where they are
+	uint32_t tag = OOK_EXTENSION_QUALITY;
+	uint32_t len = 4 + 4*n;
+	OPUT_U32( tag);
+	OPUT_U32( len);
+	OPUT_U32( burst->noiseFloor);
+	for ( uint32_t i = first; i < first+n; i++) {
+	    OPUT_U16( burst->pulse[i].peakPower);
+	    OPUT_U16( burst->pulse[i].meanPower);
+	}
+    }
+    if ( burst->times.uncertaintyNs) {
+	uint32_t tag = OOK_EXTENSION_CLOCK;
+	uint32_t len = 4;
+	OPUT_U32( tag);
+	OPUT_U32( len);
+	OPUT_U32( burst->times.uncertaintyNs);
+    }
 
+  Done:
     *dataReturn = data;
     *sizeReturn = thumb-data;
     return 0;
 
   Overflow:
+    free(data);
     return -1;
 }
 
+int ook_encode( struct ook_burst *burst, void **dataReturn, size_t *sizeReturn)
+{
+    return encodePulses( burst, 0, burst->pulses, 0, 0, dataReturn, sizeReturn);
+}
+
+int ook_encode_plain( struct ook_burst *burst, void **dataReturn, size_t *sizeReturn)
+{
+    return encodePulses( burst, 0, burst->pulses, 0, 1, dataReturn, sizeReturn);
+}
+
+// Pulses in each segment, 0 if not even one fits
+static uint32_t pulsesPerSegment( const struct ook_burst *burst, size_t maxDatagram)
+{
+    size_t overhead = encodedOverhead( burst, 1);
+    if ( maxDatagram < overhead) return 0;
+    return (maxDatagram - overhead) / encodedPulseBytes( burst);
+}
+
+uint32_t ook_segments( const struct ook_burst *burst, size_t maxDatagram)
+{
+    if ( encodedOverhead( burst, 0) + burst->pulses*encodedPulseBytes( burst) <= maxDatagram) return 1;
+
+    uint32_t per = pulsesPerSegment( burst, maxDatagram);
+    if ( per == 0) return 0;
+
+    uint32_t count = (burst->pulses + per - 1) / per;
+    return count > OOK_MAX_SEGMENTS ? 0 : count;
+}
+
+int ook_encode_segment( struct ook_burst *burst, size_t maxDatagram, uint32_t id, uint32_t index,
+			void **dataReturn, size_t *sizeReturn)
+{
+    uint32_t count = ook_segments( burst, maxDatagram);
+    if ( index >= count) return -1;
+    if ( count == 1) return ook_encode( burst, dataReturn, sizeReturn);
+
+    uint32_t per = pulsesPerSegment( burst, maxDatagram);
+    struct segment seg = { .id = id, .index = index, .count = count,
+			   .firstPulse = index*per, .totalPulses = burst->pulses };
+    uint32_t n = burst->pulses - seg.firstPulse;
+    if ( n > per) n = per;
+
+    return encodePulses( burst, seg.firstPulse, n, &seg, 0, dataReturn, sizeReturn);
+}
+
 int ook_open( const char *address, const char *port, const char *interface)
 {
     int sock = -1;
@@ -122,6 +330,11 @@ int ook_open( const char *address, const char *port, const char *interface)
 		  fprintf(stderr,"Failed to join multicast group: %s\n", strerror(errno));
 		  goto Fail;
 	      }
+#ifdef IP_MULTICAST_ALL
+	      // Linux would also hand us every other group joined on this port, e.g. by ookfuse
+	      int all = 0;
+	      setsockopt( sock, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all));
+#endif
 	  }
 	  break;
       case AF_INET6:
@@ -143,6 +356,10 @@ int ook_open( const char *address, const char *port, const char *interface)
 		  fprintf(stderr,"Failed to join multicast group: %s\n", strerror(errno));
 		  goto Fail;
 	      }
+#ifdef IPV6_MULTICAST_ALL
+	      int all = 0;
+	      setsockopt( sock, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &all, sizeof(all));
+#endif
 	  }
 	  break;
       default:
@@ -151,6 +368,13 @@ int ook_open( const char *address, const char *port, const char *interface)
 	break;
     }
 
+#ifdef SO_RXQ_OVFL
+    // have the kernel tell us how many datagrams it dropped for want of buffer, see ook_get_stats()
+    int overflow = 1;
+    setsockopt( sock, SOL_SOCKET, SO_RXQ_OVFL, &overflow, sizeof(overflow));
+#endif
+    forgetSocket( sock);     // counts for an earlier socket with this number are not ours
+
     freeaddrinfo( multicast_ai);
     freeaddrinfo( interface_ai);
     
@@ -165,32 +389,25 @@ int ook_open( const char *address, const char *port, const char *interface)
 }
 
 
-int ook_decode_from_socket( int sock, struct ook_burst **burstReturn, struct sockaddr *from, socklen_t *fromLen, int verbose)
+// Decode a datagram, seg->count is left 0 unless it is a segment of a bigger burst
+static int decodeDatagram( const void *data, size_t len, struct ook_burst **burstReturn, struct segment *seg)
 {
     struct ook_burst *burst = 0;
-    unsigned char buf[65536];
-    int e=0;
-
-    do {
-	e = recvfrom( sock, buf, sizeof(buf), 0, from, fromLen);
-	if ( e == -1 && (errno == EAGAIN || errno == EINTR)) continue;
-	if ( e == -1) return -1;
-    } while(0);
-
-    if ( verbose) fprintf(stderr,"Received %u bytes\n", e);
-
-    uint32_t left = e;
-    unsigned char *thumb = buf;
+    memset( seg, 0, sizeof(*seg));
+    size_t left = len;
+    const unsigned char *thumb = data;
 
+#define OGET_U16() ({ uint16_t v; if ( left<2) goto Fail; memcpy(&v,thumb,2); thumb+=2; left -= 2; v; })
 #define OGET_U32() ({ uint32_t v; if ( left<4) goto Fail; memcpy(&v,thumb,4); thumb+=4; left -= 4; v; })
 #define OGET_I32() ({ int32_t v; if ( left<4) goto Fail; memcpy(&v,thumb,4); thumb+=4; left -= 4; v; })
 #define OGET_U64() ({ uint64_t v; if ( left<8) goto Fail; memcpy(&v,thumb,8); thumb+=8; left -= 8; v; })
 
     uint32_t vers = OGET_U32();
-    if ( vers != 0x36360001) goto Fail;
+    if ( vers != OOK_VERSION_PLAIN && vers != OOK_VERSION_EXTENDED) goto Fail;
 
     uint64_t pos = OGET_U64();
     uint32_t pulses = OGET_U32();
+    if ( pulses > left/OOK_PULSE_BYTES) goto Fail;     // don't allocate for pulses which can't be there
 
     burst = ook_allocate_burst( pulses);
     if ( !burst) goto Fail;
@@ -204,7 +421,49 @@ int ook_decode_from_socket( int sock, struct ook_burst **burstReturn, struct soc
 	if ( ook_add_pulse( burst, hi, low, freq) < 0) goto Fail;
     }
 
-    if ( left > 0) goto Fail;
+    if ( vers == OOK_VERSION_PLAIN && left > 0) goto Fail;
+    while ( left > 0) {
+	uint32_t tag = OGET_U32();
+	uint32_t len = OGET_U32();
+	if ( left < len) goto Fail;
+
+	if ( tag == OOK_EXTENSION_TIMES && len >= 32) {
+	    burst->times.captureMonotonicNs = OGET_U64();
+	    burst->times.captureRealtimeNs = OGET_U64();
+	    burst->times.endRealtimeNs = OGET_U64();
+	    burst->times.sentRealtimeNs = OGET_U64();
+	    len -= 32;
+	} else if ( tag == OOK_EXTENSION_FRAGMENT && len >= 16) {
+	    burst->fragment.flags = OGET_U32();
+	    burst->fragment.burstId = OGET_U32();
+	    burst->fragment.sequence = OGET_U32();
+	    burst->fragment.firstPulse = OGET_U32();
+	    len -= 16;
+	} else if ( tag == OOK_EXTENSION_SEGMENT && len >= 20) {
+	    seg->id = OGET_U32();
+	    seg->index = OGET_U32();
+	    seg->count = OGET_U32();
+	    seg->firstPulse = OGET_U32();
+	    seg->totalPulses = OGET_U32();
+	    len -= 20;
+	} else if ( tag == OOK_EXTENSION_SEQUENCE && len >= 8) {
+	    burst->sequence.source = OGET_U32();
+	    burst->sequence.number = OGET_U32();
+	    len -= 8;
+	} else if ( tag == OOK_EXTENSION_QUALITY && len >= 4 + 4*(uint64_t)pulses) {
+	    burst->noiseFloor = OGET_U32();
+	    for ( uint32_t i = 0; i < pulses; i++) {
+		burst->pulse[i].peakPower = OGET_U16();
+		burst->pulse[i].meanPower = OGET_U16();
+	    }
+	    len -= 4 + 4*pulses;
+	} else if ( tag == OOK_EXTENSION_CLOCK && len >= 4) {
+	    burst->times.uncertaintyNs = OGET_U32();
+	    len -= 4;
+	}
+	thumb += len;    // skip what we don't understand
+	left -= len;
+    }
 
     *burstReturn = burst;
 
@@ -217,157 +476,1444 @@ int ook_decode_from_socket( int sock, struct ook_burst **burstReturn, struct soc
     return 0;
 }
 
-int ook_decode_pulse_width( struct ook_burst *burst, 
-			    uint32_t minZeroHi, uint32_t maxZeroHi, 
-			    uint32_t minOneHi, uint32_t maxOneHi, 
-			    uint32_t minLow, uint32_t maxLow, 
-			    unsigned char **dataReturn, size_t *dataLenReturn,
-			    int verbose)
+static const char *humanName( struct sockaddr *addr, size_t len)
 {
-    size_t dataLen = (burst->pulses + 7)/8;
-    unsigned char *data = (unsigned char *)malloc( dataLen);
-    if ( data == 0) goto Fail;
+    static char buf[INET6_ADDRSTRLEN];
+    int e = getnameinfo( addr, len, buf, sizeof(buf),0,0,NI_NUMERICHOST);
+    if (e) return gai_strerror(e);
+    return buf;
+}
 
-    unsigned char accum = 0;
-    unsigned char *thumb = data;
-    unsigned char bitsInAccum = 0;
-    unsigned bits = 0;
-    for ( int i = 0; i < burst->pulses; i++) {
-	uint32_t hi = burst->pulse[i].hiNanoseconds;
-	uint32_t low = burst->pulse[i].lowNanoseconds;
+// contain OS specific nonsense here
+static int setMulticastIF( int sock, const struct sockaddr *addr, size_t len)
+{
+#if __APPLE__
+    switch ( addr->sa_family) {
+      case AF_INET:
+	return setsockopt( sock, IPPROTO_IP, IP_MULTICAST_IF, 
+			   (char *)&(((struct sockaddr_in *)addr)->sin_addr), sizeof(struct in_addr));
+      default:
+	errno = EINVAL;
+	return -1;
+    }
+#elif __linux__
+    // Shouldn't this be a ip_mreqn or ip_mreq structure??
+    return setsockopt( sock, IPPROTO_IP, IP_MULTICAST_IF, (char *)addr, len);
+#else
+#error Unsupported OS in setMulticastIF
+#endif
+}
 
-	if ( low < minLow || low > maxLow) {
-	    if ( verbose) fprintf(stderr,"low of %u was %u, not between %u and %u\n", i, low, minLow, maxLow);
-	    goto Fail;
-	}
+int ook_open_sender( const char *address, const char *port, const char *interface,
+		     struct sockaddr **toReturn, socklen_t *toLenReturn)
+{
+    int sock = -1;
+    struct addrinfo *multicast_ai = 0;
+    struct addrinfo *interface_ai = 0;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+			      .ai_socktype = SOCK_DGRAM,
+    };
 
-	if ( hi >= minZeroHi && hi <= maxZeroHi) {
-	    accum = (accum<<1);
-	    bitsInAccum++;
-	    bits++;
-	} else if ( hi >= minOneHi && hi <= maxOneHi) {
-	    accum = ((accum<<1)|1);
-	    bitsInAccum++;
-	    bits++;
-	} else {
-	    if ( verbose) fprintf(stderr,"high of %u was %u, not between %u and %u or %u and %u\n", 
-				  i, hi, minZeroHi, maxZeroHi, minOneHi, maxOneHi);
-	    goto Fail;
-	}
+    int err = getaddrinfo( address, port, &hints, &multicast_ai);
+    if (err){
+	fprintf(stderr,"Illegal multicast address (addr=%s port=%s):%s\n", address, port, gai_strerror(err));
+	goto Fail;
+    }
 
-	if ( bitsInAccum == 8) {
-	    *thumb++ = accum;
-	    bitsInAccum = 0;
-	}
+    sock = socket( multicast_ai->ai_family, SOCK_DGRAM, 0);
+    if ( sock < 0) {
+	fprintf(stderr,"Failed to create socket: %s\n", strerror(errno));
+	goto Fail;
     }
-    if ( bitsInAccum != 0) {
-	*thumb++ = accum;
-	bitsInAccum = 0;
+
+    err = getaddrinfo( interface, "0", &hints, &interface_ai);
+    if (err){
+	fprintf(stderr,"Illegal interface address (addr=%s):%s\n", interface, gai_strerror(err));
+	goto Fail;
     }
 
-    *dataReturn = data;
-    *dataLenReturn = dataLen;
-    return bits;
+    if ( setMulticastIF( sock, interface_ai->ai_addr, interface_ai->ai_addrlen) < 0) {
+	fprintf(stderr, "Failed to set multicast interface to %s (%s): %s\n", 
+		interface, humanName(interface_ai->ai_addr, interface_ai->ai_addrlen), strerror(errno));
+	goto Fail;
+    }
+
+    // enable loopback so clients can be on this host
+    uint8_t loop=1;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    // Leave TTL defaulted to 1 for now, stay on subnet.
+
+    *toReturn = malloc( multicast_ai->ai_addrlen);
+    if ( !*toReturn) goto Fail;
+    memcpy( *toReturn, multicast_ai->ai_addr, multicast_ai->ai_addrlen);
+    *toLenReturn = multicast_ai->ai_addrlen;
+
+    freeaddrinfo( multicast_ai);
+    freeaddrinfo( interface_ai);
+    return sock;
 
   Fail:
-    if ( data) free(data);
+    if ( multicast_ai) freeaddrinfo( multicast_ai);
+    if ( interface_ai) freeaddrinfo( interface_ai);
+    if ( sock >= 0) close(sock);
+
     return -1;
 }
 
+int ook_send( struct ook_sender *s, struct ook_burst *burst)
+{
+    s->datagrams = s->failures = 0;
+    s->bytes = 0;
+    s->encodeNs = s->sendNs = 0;
 
-int ook_decode_manchester( struct ook_burst *burst, 
-			    uint32_t minShortHi, uint32_t maxShortHi, 
-			    uint32_t minLongHi, uint32_t maxLongHi, 
-			    uint32_t minShortLow, uint32_t maxShortLow, 
-			    uint32_t minLongLow, uint32_t maxLongLow, 
-			    unsigned char **dataReturn, size_t *dataLenReturn,
-			    int verbose)
+    burst->sequence = s->sequence;    // before counting segments, the number takes room in each
+    uint32_t segments = s->plain ? 1 : ook_segments( burst, s->maxDatagram);   // old clients can't join segments
+    if ( segments == 0) {
+	fprintf(stderr, "Burst of %u pulses is too big to send.\n", burst->pulses);
+	return -1;
+    }
+    if ( segments > 1) s->segmentId++;
+
+    // numbers are used up even if sending fails, clients should know they missed something
+    s->sequence.number += segments;
+
+    for ( uint32_t i = 0; i < segments; i++) {
+	uint64_t now = ook_now( CLOCK_MONOTONIC);
+	void *data = 0;
+	size_t len;
+	int e = s->plain ? ook_encode_plain( burst, &data, &len)
+			 : ook_encode_segment( burst, s->maxDatagram, s->segmentId, i, &data, &len);
+	if ( e != 0 || data == 0) {
+	    fprintf(stderr, "Failed to encode a pulse burst.\n");
+	    free(data);
+	    return -1;
+	}
+
+	uint64_t encoded = ook_now( CLOCK_MONOTONIC);
+	s->encodeNs += encoded - now;
+
+	e = sendto( s->sock, data, len, 0, s->to, s->toLen);
+	s->sendNs += ook_now( CLOCK_MONOTONIC) - encoded;
+	if ( e < 0) {
+	    fprintf(stderr, "Failed to multicast pulse (%zu bytes): %s\n", len, strerror(errno));
+	    s->failures++;
+	} else {
+	    s->datagrams++;
+	    s->bytes += len;
+	}
+	free(data);
+    }
+    return s->failures ? -2 : 0;
+}
+
+int ook_decode( const void *data, size_t len, struct ook_burst **burstReturn)
 {
-    size_t dataLen = burst->pulses*2;  // this is an upper limit
-    unsigned char *data = (unsigned char *)malloc( dataLen);
-    if ( data == 0) goto Fail;
+    struct segment seg;
+    return decodeDatagram( data, len, burstReturn, &seg);
+}
 
-    enum signal { shortHi=0, longHi, shortLow, longLow, endLow, indeterminate};
-    #define NUMSIG 6
+int ook_set_receive_buffer( int sock, int bytes)
+{
+    int e = -1;
+#ifdef SO_RCVBUFFORCE
+    e = setsockopt( sock, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes));   // root may pass the limit
+#endif
+    if ( e < 0) e = setsockopt( sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    if ( e < 0) {
+	fprintf(stderr, "Failed to set receive buffer to %d bytes: %s\n", bytes, strerror(errno));
+	return -1;
+    }
 
-#if 0
-    static const char *signalName[] = {
-	[shortHi]="-",
-	[longHi]="--",
-	[shortLow]="_",
-	[longLow]="__",
-	[endLow]=".__.",
-	[indeterminate]="="
-    };
+    int got = 0;
+    socklen_t len = sizeof(got);
+    if ( getsockopt( sock, SOL_SOCKET, SO_RCVBUF, &got, &len) < 0) {
+	fprintf(stderr, "Failed to read back receive buffer size: %s\n", strerror(errno));
+	return -1;
+    }
+#ifdef __linux__
+    got /= 2;     // it doubles what it is given, to leave room for its own bookkeeping
 #endif
+    if ( got < bytes) fprintf(stderr, "Receive buffer is only %d bytes of the %d asked for, the system limits it\n", got, bytes);
+    return got;
+}
 
-    /*
-      var machine = [4 * 8]actionNext{
-      byte(d1) + byte(LowShort):          actionNext{noAction, c0},
-      byte(d1) + byte(LowLong):           actionNext{emitZeroAction, d0},
-      byte(d1) + byte(EndOfTransmission): actionNext{endAction, c0},
-      byte(c0) + byte(HighShort):         actionNext{emitOneAction, d1},
+uint32_t ook_sequence_source( void)
+{
+    uint64_t x = ook_now( CLOCK_REALTIME) ^ ook_now( CLOCK_MONOTONIC) ^ ((uint64_t)getpid() << 32);
 
-      byte(d0) + byte(HighShort):         actionNext{noAction, c1},
-      byte(d0) + byte(HighLong):          actionNext{emitOneAction, d1},
-      byte(c1) + byte(LowShort):          actionNext{emitZeroAction, d0},
-      byte(c1) + byte(EndOfTransmission): actionNext{endAction, c0},
-      }
-    */
-	
-    enum state { c0=NUMSIG*0, c1=NUMSIG*1, d0=NUMSIG*2, d1=NUMSIG*3};
-#define NUMSTATE 4
-    enum action { errorAction=0, noAction, emitZero, emitOne, endAction };
+    // splitmix64's finalizer, so near times make very different numbers
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
 
-    enum state currentState = c0;
+    uint32_t source = x;
+    return source ? source : 1;
+}
 
-#if 0
-    static const char *stateName[] = {
-	[c0] = "c0",
-	[c1] = "c1",
-	[d0] = "d0",
-	[d1] = "d1",
-    };
-#endif
+// Counts for ook_get_stats(), and the filter from ook_set_filter(), by socket
+static struct socketStats {
+    int used;
+    int sock;
+    uint32_t overflowed;           // the kernel's count, it only goes up from when the socket was made
+    uint64_t gaps;                 // in the senders' numbering, overflows leave them too
+    struct ook_stats stats;        // all but lost, which is the gaps the overflows don't account for
+    int filtered;                  // filter is set
+    struct ook_filter filter;
+} socketStats[OOK_STATS_SOCKETS];
 
-    static const struct {
-	unsigned char action; // enum action, but I want it one byte
-	unsigned char next; // enum state, but I want it one byte
-    } state[NUMSTATE*NUMSIG] = {
-	// clang detects overlaps and out of bounds entries so this is safe
-	// uninitialzed entries are going to get a zero and be an errorAction
-	[d1 + shortLow] = { noAction, c0 },
-	[d1 + longLow] = { emitZero, d0 },
-	[d1 + endLow] = { endAction, c0 },
-	[c0 + shortHi] = { emitOne, d1 },
+// Where each sender's numbering is up to, by socket, address and source
+static struct sourceSlot {
+    int used;
+    int sock;
+    struct sockaddr_storage from;
+    socklen_t fromLen;
+    uint32_t source;
+    uint32_t next;                 // the number we expect next
+    uint64_t window;               // bit i is set if next-1-i has arrived
+    uint64_t heardNs;              // CLOCK_MONOTONIC of its last datagram, the stalest goes when we need room
+} sourceSlot[OOK_SOURCE_SLOTS];
 
-	[d0 + shortHi] = { noAction, c1 },
-	[d0 + longHi] = { emitOne, d1 },
-	[c1 + shortLow] = { emitZero, d0 },
-	[c1 + endLow] = { endAction, c0},
-    };
+static void forgetSocket( int sock)
+{
+    for ( int i = 0; i < OOK_STATS_SOCKETS; i++) {
+	if ( socketStats[i].used && socketStats[i].sock == sock) memset( &socketStats[i], 0, sizeof(socketStats[i]));
+    }
+    for ( int i = 0; i < OOK_SOURCE_SLOTS; i++) {
+	if ( sourceSlot[i].used && sourceSlot[i].sock == sock) memset( &sourceSlot[i], 0, sizeof(sourceSlot[i]));
+    }
+}
 
+// The counts for a socket, a scratch one if there are too many sockets to keep track of
+static struct socketStats *statsFor( int sock)
+{
+    static struct socketStats overflowing;
+    struct socketStats *unused = 0;
 
-    unsigned bits = 0;
+    for ( int i = 0; i < OOK_STATS_SOCKETS; i++) {
+	if ( socketStats[i].used && socketStats[i].sock == sock) return &socketStats[i];
+	if ( !socketStats[i].used && !unused) unused = &socketStats[i];
+    }
+    if ( !unused) return &overflowing;
 
-    for ( int i = 0; i < burst->pulses; i++) {
-	enum signal signal[2];
+    unused->used = 1;
+    unused->sock = sock;
+    return unused;
+}
 
-	// turn the high pulse into a signal symbol
-	uint32_t hi = burst->pulse[i].hiNanoseconds;
-	if ( hi >= minShortHi && hi <= maxShortHi) {
-	    signal[0] = shortHi;
-	} else if ( hi >= minLongHi && hi <= maxLongHi) {
-	    signal[0] = longHi;
-	} else {
-	    signal[0] = indeterminate;
-	}
+int ook_get_stats( int sock, struct ook_stats *stats)
+{
+    memset( stats, 0, sizeof(*stats));
+    for ( int i = 0; i < OOK_STATS_SOCKETS; i++) {
+	struct socketStats *s = &socketStats[i];
+	if ( !s->used || s->sock != sock) continue;
 
-	// turn the low pulse into a signal symbol
-	uint32_t low = burst->pulse[i].lowNanoseconds;
-	if ( low >= minShortLow && low <= maxShortLow) {
-	    signal[1] = shortLow;
-	} else if ( low >= minLongLow && low <= maxLongLow) {
+	*stats = s->stats;
+	stats->lost = s->gaps > s->stats.overflows ? s->gaps - s->stats.overflows : 0;
+    }
+    return 0;
+}
+
+// Take the kernel's count of datagrams dropped on a socket, from a message's control data.
+// It comes with the first datagram queued after them, the one which shows the gap they left.
+static void countOverflows( struct socketStats *s, struct msghdr *msg, int verbose)
+{
+#ifdef SO_RXQ_OVFL
+    for ( struct cmsghdr *c = CMSG_FIRSTHDR( msg); c; c = CMSG_NXTHDR( msg, c)) {
+	if ( c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_RXQ_OVFL) continue;
+
+	uint32_t overflowed;
+	memcpy( &overflowed, CMSG_DATA( c), sizeof(overflowed));
+	if ( overflowed == s->overflowed) continue;
+
+	if ( verbose) fprintf(stderr,"Receive buffer overflowed, %u datagrams dropped\n", overflowed - s->overflowed);
+	s->stats.overflows += overflowed - s->overflowed;
+	s->overflowed = overflowed;
+    }
+#endif
+}
+
+// Check a datagram's number against those its sender sent before
+static void countSequence( int sock, const struct sockaddr_storage *from, socklen_t fromLen,
+			   const struct ook_sequence *seq, uint64_t now, struct socketStats *stats, int verbose)
+{
+    struct sourceSlot *slot = 0;
+    struct sourceSlot *stalest = 0;
+
+    for ( int i = 0; i < OOK_SOURCE_SLOTS; i++) {
+	struct sourceSlot *s = &sourceSlot[i];
+	if ( s->used && s->sock == sock && s->source == seq->source && s->fromLen == fromLen &&
+	     memcmp( &s->from, from, fromLen) == 0) {
+	    slot = s;
+	    break;
+	}
+	if ( !stalest || !s->used || (stalest->used && s->heardNs < stalest->heardNs)) stalest = s;
+    }
+
+    if ( !slot) {
+	// a new sender, anything before this is none of our business
+	slot = stalest;
+	slot->used = 1;
+	slot->sock = sock;
+	memcpy( &slot->from, from, fromLen);
+	slot->fromLen = fromLen;
+	slot->source = seq->source;
+	slot->next = seq->number + 1;
+	slot->window = ~0ULL;
+	slot->heardNs = now;
+	stats->stats.sources++;
+	return;
+    }
+    slot->heardNs = now;
+
+    uint32_t ahead = seq->number - slot->next;
+    if ( ahead < 0x80000000u) {
+	if ( ahead && verbose) fprintf(stderr,"Missing %u datagrams from %s\n", ahead, humanName( (struct sockaddr *)from, fromLen));
+	stats->gaps += ahead;
+	slot->window = ahead+1 >= OOK_SEQUENCE_WINDOW ? 0 : slot->window << (ahead+1);
+	slot->window |= 1;
+	slot->next = seq->number + 1;
+	return;
+    }
+
+    uint32_t behind = slot->next - 1 - seq->number;
+    if ( behind >= OOK_SEQUENCE_WINDOW) {
+	stats->stats.late++;        // too late to tell, it stays lost too
+    } else if ( slot->window & (1ULL << behind)) {
+	stats->stats.duplicates++;
+    } else {
+	slot->window |= 1ULL << behind;
+	stats->stats.late++;
+	stats->gaps--;
+    }
+}
+
+// Bursts being put back together from segments, by socket, sender and id.
+// Old ones are dropped, a lost segment would otherwise hold its slot forever.
+static struct segmentSlot {
+    struct ook_burst *burst;       // NULL if the slot is free
+    int sock;
+    struct sockaddr_storage from;
+    socklen_t fromLen;
+    uint32_t id;
+    uint32_t count;
+    uint32_t received;
+    uint64_t startedNs;            // CLOCK_MONOTONIC of its first segment
+    struct segmentPiece {          // count of them, where each segment we have went
+	uint32_t firstPulse;
+	uint32_t pulses;
+	int have;
+    } *piece;
+} segmentSlot[OOK_SEGMENT_SLOTS];
+
+static void freeSlot( struct segmentSlot *slot)
+{
+    free( slot->burst);
+    free( slot->piece);
+    slot->burst = 0;
+    slot->piece = 0;
+}
+
+// Each segment must start where the one before it ended and the last end the burst, or a
+// sender which overlapped them would leave pulses of the burst unset
+static int tiled( const struct segmentSlot *slot)
+{
+    uint32_t next = 0;
+    for ( uint32_t i = 0; i < slot->count; i++) {
+	if ( slot->piece[i].firstPulse != next) return 0;
+	next += slot->piece[i].pulses;
+    }
+    return next == slot->burst->pulses;
+}
+
+// Give up on bursts whose segments stopped arriving a while ago
+static void expireSegments( uint64_t now, int verbose)
+{
+    for ( int i = 0; i < OOK_SEGMENT_SLOTS; i++) {
+	struct segmentSlot *s = &segmentSlot[i];
+	if ( s->burst && now - s->startedNs > OOK_SEGMENT_TIMEOUT_NS) {
+	    if ( verbose) fprintf(stderr,"Gave up on burst %u, %u of %u segments arrived\n", s->id, s->received, s->count);
+	    statsFor( s->sock)->stats.incomplete++;
+	    freeSlot( s);
+	}
+    }
+}
+
+void ook_expire_segments( int verbose)
+{
+    expireSegments( ook_now( CLOCK_MONOTONIC), verbose);
+}
+
+// Add a segment, taking ownership of it. Returns the whole burst once every segment is in.
+static struct ook_burst *addSegment( int sock, const struct sockaddr_storage *from, socklen_t fromLen,
+				     struct ook_burst *b, const struct segment *seg, int verbose)
+{
+    uint64_t now = b->times.receivedMonotonicNs;
+    struct segmentSlot *slot = 0;
+    struct segmentSlot *unused = 0;
+    struct segmentSlot *oldest = 0;
+
+    if ( seg->index >= seg->count || seg->count > OOK_MAX_SEGMENTS || seg->totalPulses > OOK_MAX_PULSES ||
+	 seg->firstPulse > seg->totalPulses || b->pulses > seg->totalPulses - seg->firstPulse) {
+	if ( verbose) fprintf(stderr,"Bad segment %u of %u\n", seg->index, seg->count);
+	free(b);
+	return 0;
+    }
+
+    expireSegments( now, verbose);
+    for ( int i = 0; i < OOK_SEGMENT_SLOTS; i++) {
+	struct segmentSlot *s = &segmentSlot[i];
+	if ( s->burst && s->sock == sock && s->id == seg->id && s->fromLen == fromLen && memcmp( &s->from, from, fromLen) == 0) {
+	    slot = s;
+	}
+	if ( !s->burst) {
+	    if ( !unused) unused = s;
+	} else if ( !oldest || s->startedNs < oldest->startedNs) {
+	    oldest = s;
+	}
+    }
+
+    if ( slot && (slot->count != seg->count || slot->burst->allocatedPulses != seg->totalPulses)) {
+	freeSlot( slot);           // the sender restarted and reused the id
+	unused = slot;
+	slot = 0;
+    }
+
+    if ( !slot) {
+	slot = unused ? unused : oldest;
+	if ( slot->burst) {
+	    if ( verbose) fprintf(stderr,"Too many bursts arriving, gave up on %u\n", slot->id);
+	    statsFor( slot->sock)->stats.incomplete++;
+	    freeSlot( slot);
+	}
+	slot->burst = ook_allocate_burst( seg->totalPulses);
+	slot->piece = calloc( seg->count, sizeof(slot->piece[0]));
+	if ( !slot->burst || !slot->piece) {
+	    freeSlot( slot);
+	    free(b);
+	    return 0;
+	}
+	slot->burst->positionNanoseconds = b->positionNanoseconds;
+	slot->burst->times = b->times;
+	slot->burst->fragment = b->fragment;
+	slot->burst->sequence = b->sequence;
+	slot->burst->sequence.number -= seg->index;     // the whole burst has its first segment's
+	slot->burst->noiseFloor = b->noiseFloor;
+	slot->burst->pulses = seg->totalPulses;
+	slot->sock = sock;
+	memcpy( &slot->from, from, fromLen);
+	slot->fromLen = fromLen;
+	slot->id = seg->id;
+	slot->count = seg->count;
+	slot->received = 0;
+	slot->startedNs = now;
+    }
+
+    if ( !slot->piece[seg->index].have) {
+	memcpy( &slot->burst->pulse[seg->firstPulse], b->pulse, b->pulses*sizeof(b->pulse[0]));
+	slot->piece[seg->index] = (struct segmentPiece){ seg->firstPulse, b->pulses, 1 };
+	slot->received++;
+    }
+    free(b);
+
+    if ( slot->received < slot->count) return 0;
+    if ( !tiled( slot)) {
+	if ( verbose) fprintf(stderr,"Segments of %u overlap or leave gaps, dropped it\n", slot->id);
+	statsFor( slot->sock)->stats.corrupt++;
+	freeSlot( slot);
+	return 0;
+    }
+
+    // it is received when the last piece of it is
+    struct ook_burst *whole = slot->burst;
+    whole->times.receivedRealtimeNs = ook_now( CLOCK_REALTIME);
+    whole->times.receivedMonotonicNs = now;
+    slot->burst = 0;
+    freeSlot( slot);
+    return whole;
+}
+
+// What the kernel's filter couldn't check, see ook_set_filter()
+static int wanted( const struct socketStats *s, const struct ook_burst *burst)
+{
+    if ( !s->filtered || burst->fragment.flags) return 1;
+    if ( burst->pulses < s->filter.minPulses) return 0;
+    if ( s->filter.maxPulses && burst->pulses > s->filter.maxPulses) return 0;
+    return 1;
+}
+
+#ifdef __linux__
+// The filter sees the UDP header, then what ookd sent. The wire format is little endian in
+// practice, the Go listener assumes it too, but BPF loads words big endian. So tags and the
+// version are compared byte swapped, and the pulse count is put together a byte at a time.
+#define FILTER_UDP 8
+#define FILTER_VERSION_PLAIN 0x01003636
+#define FILTER_VERSION_EXTENDED 0x02003636
+#define FILTER_TAG(T) ((uint32_t)(T) << 24)
+
+static int attachFilter( int sock, const struct ook_filter *filter)
+{
+    uint32_t maxPulses = filter->maxPulses ? filter->maxPulses : UINT32_MAX;
+    struct sock_filter code[] = {
+	/*  0 */ BPF_STMT( BPF_LD|BPF_W|BPF_ABS, FILTER_UDP+0),
+	/*  1 */ BPF_JUMP( BPF_JMP|BPF_JEQ|BPF_K, FILTER_VERSION_PLAIN, 1, 0),
+	/*  2 */ BPF_JUMP( BPF_JMP|BPF_JEQ|BPF_K, FILTER_VERSION_EXTENDED, 0, 55),   // not ours, DROP
+
+	// the pulse count, into M[0]
+	/*  3 */ BPF_STMT( BPF_LD|BPF_B|BPF_ABS, FILTER_UDP+15),
+	/*  4 */ BPF_STMT( BPF_ALU|BPF_LSH|BPF_K, 24),
+	/*  5 */ BPF_STMT( BPF_MISC|BPF_TAX, 0),
+	/*  6 */ BPF_STMT( BPF_LD|BPF_B|BPF_ABS, FILTER_UDP+14),
+	/*  7 */ BPF_STMT( BPF_ALU|BPF_LSH|BPF_K, 16),
+	/*  8 */ BPF_STMT( BPF_ALU|BPF_OR|BPF_X, 0),
+	/*  9 */ BPF_STMT( BPF_MISC|BPF_TAX, 0),
+	/* 10 */ BPF_STMT( BPF_LD|BPF_B|BPF_ABS, FILTER_UDP+13),
+	/* 11 */ BPF_STMT( BPF_ALU|BPF_LSH|BPF_K, 8),
+	/* 12 */ BPF_STMT( BPF_ALU|BPF_OR|BPF_X, 0),
+	/* 13 */ BPF_STMT( BPF_MISC|BPF_TAX, 0),
+	/* 14 */ BPF_STMT( BPF_LD|BPF_B|BPF_ABS, FILTER_UDP+12),
+	/* 15 */ BPF_STMT( BPF_ALU|BPF_OR|BPF_X, 0),
+	/* 16 */ BPF_STMT( BPF_ST, 0),
+
+	// X is where the extensions start. The times come first if there are any, then a fragment
+	// or segment. Streamed fragments all go through, a segment has its burst's pulse count.
+	/* 17 */ BPF_STMT( BPF_ALU|BPF_MUL|BPF_K, 12),
+	/* 18 */ BPF_STMT( BPF_ALU|BPF_ADD|BPF_K, FILTER_UDP+16),
+	/* 19 */ BPF_STMT( BPF_MISC|BPF_TAX, 0),
+	/* 20 */ BPF_STMT( BPF_LD|BPF_W|BPF_LEN, 0),
+	/* 21 */ BPF_STMT( BPF_ALU|BPF_SUB|BPF_K, 8),
+	/* 22 */ BPF_JUMP( BPF_JMP|BPF_JGE|BPF_X, 0, 0, 31),                    // no extensions, CHECK
+	/* 23 */ BPF_STMT( BPF_LD|BPF_W|BPF_IND, 0),
+	/* 24 */ BPF_JUMP( BPF_JMP|BPF_JEQ|BPF_K, FILTER_TAG(OOK_EXTENSION_TIMES), 0, 7),   // to 32
+	/* 25 */ BPF_STMT( BPF_MISC|BPF_TXA, 0),
+	/* 26 */ BPF_STMT( BPF_ALU|BPF_ADD|BPF_K, 8+32),
+	/* 27 */ BPF_STMT( BPF_MISC|BPF_TAX, 0),
+	/* 28 */ BPF_STMT( BPF_LD|BPF_W|BPF_LEN, 0),
+	/* 29 */ BPF_STMT( BPF_ALU|BPF_SUB|BPF_K, 8),
+	/* 30 */ BPF_JUMP( BPF_JMP|BPF_JGE|BPF_X, 0, 0, 23),                    // just the times, CHECK
+	/* 31 */ BPF_STMT( BPF_LD|BPF_W|BPF_IND, 0),
+	/* 32 */ BPF_JUMP( BPF_JMP|BPF_JEQ|BPF_K, FILTER_TAG(OOK_EXTENSION_FRAGMENT), 24, 0),  // ACCEPT
+	/* 33 */ BPF_JUMP( BPF_JMP|BPF_JEQ|BPF_K, FILTER_TAG(OOK_EXTENSION_SEGMENT), 0, 20),   // CHECK
+
+	// a segment, its totalPulses into M[0], keeping X in M[1] and building it up in M[2]
+	/* 34 */ BPF_STMT( BPF_STX, 1),
+	/* 35 */ BPF_STMT( BPF_LD|BPF_B|BPF_IND, 8+16+3),
+	/* 36 */ BPF_STMT( BPF_ALU|BPF_LSH|BPF_K, 24),
+	/* 37 */ BPF_STMT( BPF_ST, 2),
+	/* 38 */ BPF_STMT( BPF_LD|BPF_B|BPF_IND, 8+16+2),
+	/* 39 */ BPF_STMT( BPF_ALU|BPF_LSH|BPF_K, 16),
+	/* 40 */ BPF_STMT( BPF_LDX|BPF_MEM, 2),
+	/* 41 */ BPF_STMT( BPF_ALU|BPF_OR|BPF_X, 0),
+	/* 42 */ BPF_STMT( BPF_ST, 2),
+	/* 43 */ BPF_STMT( BPF_LDX|BPF_MEM, 1),
+	/* 44 */ BPF_STMT( BPF_LD|BPF_B|BPF_IND, 8+16+1),
+	/* 45 */ BPF_STMT( BPF_ALU|BPF_LSH|BPF_K, 8),
+	/* 46 */ BPF_STMT( BPF_LDX|BPF_MEM, 2),
+	/* 47 */ BPF_STMT( BPF_ALU|BPF_OR|BPF_X, 0),
+	/* 48 */ BPF_STMT( BPF_ST, 2),
+	/* 49 */ BPF_STMT( BPF_LDX|BPF_MEM, 1),
+	/* 50 */ BPF_STMT( BPF_LD|BPF_B|BPF_IND, 8+16),
+	/* 51 */ BPF_STMT( BPF_LDX|BPF_MEM, 2),
+	/* 52 */ BPF_STMT( BPF_ALU|BPF_OR|BPF_X, 0),
+	/* 53 */ BPF_STMT( BPF_ST, 0),
+
+	// CHECK the pulse count
+	/* 54 */ BPF_STMT( BPF_LD|BPF_MEM, 0),
+	/* 55 */ BPF_JUMP( BPF_JMP|BPF_JGE|BPF_K, filter->minPulses, 0, 2),     // DROP
+	/* 56 */ BPF_JUMP( BPF_JMP|BPF_JGT|BPF_K, maxPulses, 1, 0),             // DROP
+	/* 57 */ BPF_STMT( BPF_RET|BPF_K, UINT32_MAX),                          // ACCEPT
+	/* 58 */ BPF_STMT( BPF_RET|BPF_K, 0),                                   // DROP
+    };
+    struct sock_fprog program = { .len = sizeof(code)/sizeof(code[0]), .filter = code };
+
+    if ( setsockopt( sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+	fprintf(stderr, "Failed to attach socket filter: %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+#endif
+
+int ook_set_filter( int sock, const struct ook_filter *filter)
+{
+    struct socketStats *s = statsFor( sock);
+    if ( !s->used) {
+	fprintf(stderr, "Too many sockets to filter\n");
+	return -1;
+    }
+
+#ifdef __linux__
+    if ( attachFilter( sock, filter) < 0) return -1;
+#endif
+    s->filter = *filter;
+    s->filtered = 1;
+    return 0;
+}
+
+// The body of ook_decode_from_socket(). With MSG_DONTWAIT in flags it returns -1 with errno EAGAIN
+// when nothing more has arrived instead of waiting, see ook_loop_run().
+static int decodeFromSocket( int sock, struct ook_burst **burstReturn, struct sockaddr *from, socklen_t *fromLen,
+			     int flags, int verbose)
+{
+    unsigned char buf[65536];
+
+    for (;;) {
+	struct sockaddr_storage src;
+	union {
+	    struct cmsghdr align;
+	    char buf[CMSG_SPACE(sizeof(uint32_t))];
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = { .msg_name = &src, .msg_namelen = sizeof(src), .msg_iov = &iov, .msg_iovlen = 1,
+			      .msg_control = &control, .msg_controllen = sizeof(control) };
+	int e = recvmsg( sock, &msg, flags);
+	if ( e == -1 && (errno == EINTR || (errno == EAGAIN && !(flags & MSG_DONTWAIT)))) continue;
+	if ( e == -1) return -1;
+	socklen_t srcLen = msg.msg_namelen;
+
+	if ( from && fromLen) {
+	    memcpy( from, &src, srcLen < *fromLen ? srcLen : *fromLen);
+	    *fromLen = srcLen;
+	}
+
+	uint64_t receivedRealtime = ook_now( CLOCK_REALTIME);
+	uint64_t receivedMonotonic = ook_now( CLOCK_MONOTONIC);
+
+	if ( verbose) fprintf(stderr,"Received %u bytes\n", e);
+
+	struct socketStats *stats = statsFor( sock);
+	stats->stats.datagrams++;
+	countOverflows( stats, &msg, verbose);
+
+	struct segment seg;
+	int r = decodeDatagram( buf, e, burstReturn, &seg);
+	if ( r <= 0) {
+	    stats->stats.corrupt++;
+	    return r;
+	}
+
+	(*burstReturn)->times.receivedRealtimeNs = receivedRealtime;
+	(*burstReturn)->times.receivedMonotonicNs = receivedMonotonic;
+	if ( (*burstReturn)->sequence.source && !stats->filtered) {
+	    countSequence( sock, &src, srcLen, &(*burstReturn)->sequence, receivedMonotonic, stats, verbose);
+	}
+
+	// A piece of a burst too big for one datagram, wait for the rest of it
+	if ( seg.count) *burstReturn = addSegment( sock, &src, srcLen, *burstReturn, &seg, verbose);
+	if ( !*burstReturn) continue;
+
+	if ( wanted( stats, *burstReturn)) return 1;
+	free( *burstReturn);
+	*burstReturn = 0;
+    }
+}
+
+int ook_decode_from_socket( int sock, struct ook_burst **burstReturn, struct sockaddr *from, socklen_t *fromLen, int verbose)
+{
+    return decodeFromSocket( sock, burstReturn, from, fromLen, 0, verbose);
+}
+
+int ook_decode_from_socket_nowait( int sock, struct ook_burst **burstReturn, struct sockaddr *from, socklen_t *fromLen,
+				   int verbose)
+{
+    *burstReturn = 0;
+    int e = decodeFromSocket( sock, burstReturn, from, fromLen, MSG_DONTWAIT, verbose);
+    return e < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : e;
+}
+
+struct ook_ring {
+    struct ringHeader *header;
+    const uint8_t *data;           // the records, header->size bytes
+    size_t mapped;
+    uint64_t cursor;               // ring position of the next record to read
+    uint64_t sequence;             // of the burst we expect next
+    int started;                   // sequence is set
+    uint64_t viewed;               // ring position of the last burst handed out
+    uint32_t viewedPulses;         // the most its record has room for
+};
+
+struct ook_ring *ook_ring_attach( const char *name)
+{
+    int fd = shm_open( name, O_RDWR, 0);
+    if ( fd < 0) {
+	fprintf(stderr, "Failed to open shared memory '%s': %s\n", name, strerror(errno));
+	return 0;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st) < 0 || st.st_size < RING_DATA_OFFSET) {
+	fprintf(stderr, "Shared memory '%s' is not a ring\n", name);
+	close(fd);
+	return 0;
+    }
+
+    void *m = mmap( 0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( m == MAP_FAILED) {
+	fprintf(stderr, "Failed to map shared memory '%s': %s\n", name, strerror(errno));
+	return 0;
+    }
+
+    struct ringHeader *h = m;
+    if ( __atomic_load_n( &h->magic, __ATOMIC_ACQUIRE) != RING_MAGIC || h->version != RING_VERSION ||
+	 st.st_size < RING_DATA_OFFSET + h->size) {
+	fprintf(stderr, "Shared memory '%s' is not a version %d ring\n", name, RING_VERSION);
+	munmap( m, st.st_size);
+	return 0;
+    }
+
+    struct ook_ring *ring = calloc( sizeof(*ring), 1);
+    if ( !ring) {
+	munmap( m, st.st_size);
+	return 0;
+    }
+    ring->header = h;
+    ring->data = (const uint8_t *)m + RING_DATA_OFFSET;
+    ring->mapped = st.st_size;
+    ring->cursor = __atomic_load_n( &h->head, __ATOMIC_ACQUIRE);   // only new bursts
+    return ring;
+}
+
+void ook_ring_detach( struct ook_ring *ring)
+{
+    if ( !ring) return;
+    munmap( ring->header, ring->mapped);
+    free( ring);
+}
+
+// Nothing we read at position can have been overwritten yet, call after reading it
+static int ringIntact( const struct ook_ring *ring, uint64_t position)
+{
+    __atomic_thread_fence( __ATOMIC_ACQUIRE);
+    return __atomic_load_n( &ring->header->reserved, __ATOMIC_RELAXED) - position <= ring->header->size;
+}
+
+int ook_ring_next( struct ook_ring *ring, const struct ook_burst **view, uint64_t *lost)
+{
+    struct ringHeader *h = ring->header;
+    uint64_t size = h->size;
+
+    if ( lost) *lost = 0;
+
+    for (;;) {
+	uint32_t wake = __atomic_load_n( &h->wake, __ATOMIC_SEQ_CST);
+	uint64_t head = __atomic_load_n( &h->head, __ATOMIC_ACQUIRE);
+
+	if ( ring->cursor == head) {
+	    if ( __atomic_load_n( &h->closed, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "ookd closed the ring\n");
+		return -1;
+	    }
+	    ringWait( h, wake, 1000);
+	    if ( __atomic_load_n( &h->wake, __ATOMIC_SEQ_CST) == wake && kill( h->producer, 0) < 0 && errno == ESRCH) {
+		fprintf(stderr, "ookd went away without closing the ring\n");
+		return -1;
+	    }
+	    continue;
+	}
+
+	if ( head - ring->cursor > size) {
+	    // overrun, the sequence numbers will tell how much we lost
+	    ring->cursor = __atomic_load_n( &h->tail, __ATOMIC_ACQUIRE);
+	    continue;
+	}
+
+	uint64_t offset = ring->cursor & (size-1);
+	if ( size - offset < sizeof(struct ringRecord)) {
+	    ring->cursor += size - offset;
+	    continue;
+	}
+
+	struct ringRecord record;
+	memcpy( &record, ring->data + offset, sizeof(record));
+	const struct ook_burst *b = (const struct ook_burst *)(ring->data + offset + sizeof(record));
+	uint32_t pulses = record.type == RING_RECORD_BURST ? b->pulses : 0;
+
+	if ( !ringIntact( ring, ring->cursor) || record.position != ring->cursor ||
+	     record.length < sizeof(record) || record.length > size - offset ||
+	     sizeof(record) + sizeof(*b) + (uint64_t)pulses*sizeof(b->pulse[0]) > record.length) {
+	    ring->cursor = __atomic_load_n( &h->tail, __ATOMIC_ACQUIRE);   // lapped while reading it
+	    continue;
+	}
+
+	if ( record.type != RING_RECORD_BURST) {
+	    ring->cursor += record.length;
+	    continue;
+	}
+
+	if ( ring->started && record.sequence != ring->sequence && lost) *lost += record.sequence - ring->sequence;
+	ring->started = 1;
+	ring->sequence = record.sequence + 1;
+	ring->viewed = ring->cursor;
+	ring->viewedPulses = (record.length - sizeof(record) - sizeof(*b)) / sizeof(b->pulse[0]);
+	ring->cursor += record.length;
+
+	*view = b;
+	return 1;
+    }
+}
+
+int ook_ring_valid( const struct ook_ring *ring)
+{
+    return ringIntact( ring, ring->viewed);
+}
+
+int ook_ring_pending( const struct ook_ring *ring)
+{
+    return __atomic_load_n( &ring->header->head, __ATOMIC_ACQUIRE) != ring->cursor;
+}
+
+int ook_decode_from_ring( struct ook_ring *ring, struct ook_burst **burstReturn, int verbose)
+{
+    for (;;) {
+	const struct ook_burst *view;
+	uint64_t lost;
+	if ( ook_ring_next( ring, &view, &lost) < 0) return -1;
+
+	uint64_t receivedRealtime = ook_now( CLOCK_REALTIME);
+	uint64_t receivedMonotonic = ook_now( CLOCK_MONOTONIC);
+
+	// Once, it may be changing under us if ookd laps us, and never more than the record holds
+	uint32_t pulses = __atomic_load_n( &view->pulses, __ATOMIC_RELAXED);
+	if ( pulses > ring->viewedPulses) pulses = ring->viewedPulses;
+	struct ook_burst *b = ook_allocate_burst( pulses);
+	if ( !b) return -1;
+	memcpy( b, view, sizeof(*b));
+	memcpy( b->pulse, view->pulse, pulses*sizeof(b->pulse[0]));
+	b->pulses = pulses;
+	b->allocatedPulses = pulses;
+
+	int intact = ook_ring_valid( ring);
+	if ( !intact) lost++;          // overwritten while we copied it
+	if ( lost) fprintf(stderr, "Fell behind the ring, lost %llu bursts\n", (unsigned long long)lost);
+	if ( !intact) {
+	    free(b);
+	    continue;
+	}
+
+	if ( verbose) fprintf(stderr,"Received %u pulses from the ring\n", b->pulses);
+	b->times.receivedRealtimeNs = receivedRealtime;
+	b->times.receivedMonotonicNs = receivedMonotonic;
+	*burstReturn = b;
+	return 1;
+    }
+}
+
+// Archives, see ook.h for the layout. Fields are written in host order, as the datagrams are, which is
+// the little endian ook.h describes on any little endian host.
+#define OOK_ARCHIVE_MAGIC 0x414B4F4F           // 'OOKA'
+#define OOK_ARCHIVE_SYNC 0x534B4F4F            // 'OOKS'
+#define OOK_ARCHIVE_INDEX_MAGIC 0x494B4F4F     // 'OOKI'
+#define OOK_ARCHIVE_VERSION 1
+#define OOK_ARCHIVE_HEADER_BYTES 8
+#define OOK_ARCHIVE_SYNC_BYTES 16
+#define OOK_ARCHIVE_SEGMENT_BYTES 65536        // a sync marker starts a segment after this much
+#define OOK_ARCHIVE_MAX_RECORD (1<<24)         // longer lengths are corruption
+
+struct ook_archive {
+    int fd;
+    int indexFd;                   // appending, -1 when reading
+    uint64_t size;                 // of the archive, where the next record goes
+    uint64_t segmentBytes;         // appended since the last sync marker
+    struct ook_archive_entry *entry;   // reading, sorted by time
+    size_t entries;
+    size_t allocated;
+};
+
+static int readFully( int fd, void *buf, size_t len, uint64_t offset)
+{
+    while ( len) {
+	ssize_t n = pread( fd, buf, len, offset);
+	if ( n < 0 && errno == EINTR) continue;
+	if ( n <= 0) return -1;
+	buf = (uint8_t *)buf + n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+static uint64_t archiveTime( const struct ook_burst *burst)
+{
+    return burst->times.captureRealtimeNs ? burst->times.captureRealtimeNs : burst->positionNanoseconds;
+}
+
+// What is at offset, 1 for a burst and e is filled in, 2 a sync marker, 0 neither, -1 a read error
+static int recordAt( int fd, uint64_t offset, uint64_t size, struct ook_archive_entry *e)
+{
+    uint32_t head[2];
+    if ( size - offset < sizeof(head)) return 0;
+    if ( readFully( fd, head, sizeof(head), offset) < 0) return -1;
+
+    if ( head[0] == 0xffffffff) {
+	return head[1] == OOK_ARCHIVE_SYNC && size - offset >= OOK_ARCHIVE_SYNC_BYTES ? 2 : 0;
+    }
+    if ( head[0] > OOK_ARCHIVE_MAX_RECORD || head[0] > size - offset - 4) return 0;
+
+    uint8_t *data = malloc( head[0]);
+    if ( !data) return -1;
+    struct ook_burst *burst = 0;
+    int e2 = readFully( fd, data, head[0], offset + 4);
+    int ok = e2 == 0 && ook_decode( data, head[0], &burst) > 0;
+    free(data);
+    if ( e2 < 0) return -1;
+    if ( !ok) return 0;
+
+    *e = (struct ook_archive_entry){ .timeNs = archiveTime( burst), .offset = offset,
+				      .pulses = burst->pulses, .length = head[0] };
+    free(burst);
+    return 1;
+}
+
+// Offset of the first sync marker at or after offset, size if there isn't one
+static uint64_t findSync( int fd, uint64_t offset, uint64_t size)
+{
+    static const uint8_t marker[8] = { 0xff, 0xff, 0xff, 0xff, 'O', 'O', 'K', 'S' };
+    uint8_t buf[65536];
+
+    while ( offset < size && size - offset >= sizeof(marker)) {
+	size_t n = size - offset < sizeof(buf) ? size - offset : sizeof(buf);
+	if ( readFully( fd, buf, n, offset) < 0) return size;
+	for ( size_t i = 0; i + sizeof(marker) <= n; i++) {
+	    if ( buf[i] == 0xff && memcmp( buf+i, marker, sizeof(marker)) == 0) return offset + i;
+	}
+	if ( n < sizeof(buf)) break;
+	offset += n - (sizeof(marker)-1);
+    }
+    return size;
+}
+
+// Appending, entries go into the index file. Reading, into the table.
+static int addEntry( struct ook_archive *a, const struct ook_archive_entry *e)
+{
+    if ( a->indexFd >= 0) {
+	if ( write( a->indexFd, e, sizeof(*e)) != sizeof(*e)) {
+	    fprintf(stderr, "Failed to write archive index: %s\n", strerror(errno));
+	    return -1;
+	}
+	return 0;
+    }
+
+    if ( a->entries == a->allocated) {
+	size_t n = a->allocated ? 2*a->allocated : 1024;
+	struct ook_archive_entry *bigger = realloc( a->entry, n*sizeof(*bigger));
+	if ( !bigger) return -1;
+	a->entry = bigger;
+	a->allocated = n;
+    }
+    a->entry[a->entries++] = *e;
+    return 0;
+}
+
+// Add the bursts from offset to size, those the index doesn't know of, skipping anything
+// corrupt up to the next sync marker
+static int scanArchive( struct ook_archive *a, const char *path, uint64_t offset, uint64_t size)
+{
+    while ( offset < size) {
+	struct ook_archive_entry e;
+	switch ( recordAt( a->fd, offset, size, &e)) {
+	  case -1:
+	    fprintf(stderr, "Failed to read archive '%s': %s\n", path, strerror(errno));
+	    return -1;
+	  case 1:
+	    if ( addEntry( a, &e) < 0) return -1;
+	    offset += 4 + e.length;
+	    break;
+	  case 2:
+	    offset += OOK_ARCHIVE_SYNC_BYTES;
+	    break;
+	  default:
+	    {
+		uint64_t next = findSync( a->fd, offset+1, size);
+		fprintf(stderr, "Skipped %llu corrupt bytes at %llu of archive '%s'\n",
+			(unsigned long long)(next - offset), (unsigned long long)offset, path);
+		offset = next;
+	    }
+	    break;
+	}
+    }
+    return 0;
+}
+
+// Check or write the header of an archive or its index
+static int archiveHeader( int fd, uint32_t magic, uint64_t size, const char *path)
+{
+    uint32_t header[2] = { magic, OOK_ARCHIVE_VERSION };
+
+    if ( size == 0) {
+	if ( write( fd, header, sizeof(header)) == sizeof(header)) return 0;
+	fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+	return -1;
+    }
+
+    uint32_t found[2];
+    if ( size < sizeof(found) || readFully( fd, found, sizeof(found), 0) < 0 || found[0] != magic) {
+	fprintf(stderr, "'%s' is not a burst archive\n", path);
+	return -1;
+    }
+    if ( found[1] != OOK_ARCHIVE_VERSION) {
+	fprintf(stderr, "'%s' is version %u, we only know %u\n", path, found[1], OOK_ARCHIVE_VERSION);
+	return -1;
+    }
+    return 0;
+}
+
+static char *indexPath( const char *path)
+{
+    char *p = malloc( strlen(path) + 5);
+    if ( p) sprintf( p, "%s.idx", path);
+    return p;
+}
+
+struct ook_archive *ook_archive_create( const char *path)
+{
+    struct ook_archive *a = calloc( sizeof(*a), 1);
+    char *idx = indexPath( path);
+    if ( !a || !idx) goto Fail;
+    a->fd = a->indexFd = -1;
+
+    a->fd = open( path, O_RDWR|O_CREAT|O_APPEND, 0644);
+    if ( a->fd < 0) {
+	fprintf(stderr, "Failed to open archive '%s': %s\n", path, strerror(errno));
+	goto Fail;
+    }
+    struct stat st;
+    if ( fstat( a->fd, &st) < 0 || archiveHeader( a->fd, OOK_ARCHIVE_MAGIC, st.st_size, path) < 0) goto Fail;
+    a->size = st.st_size ? st.st_size : OOK_ARCHIVE_HEADER_BYTES;
+
+    int indexFd = open( idx, O_RDWR|O_CREAT|O_APPEND, 0644);
+    if ( indexFd < 0) {
+	fprintf(stderr, "Failed to open archive index '%s': %s\n", idx, strerror(errno));
+	goto Fail;
+    }
+    if ( fstat( indexFd, &st) < 0 || archiveHeader( indexFd, OOK_ARCHIVE_INDEX_MAGIC, st.st_size, idx) < 0) {
+	close(indexFd);
+	goto Fail;
+    }
+
+    // Drop a torn last entry, then index whatever was written after it before a crash
+    uint64_t entries = st.st_size > OOK_ARCHIVE_HEADER_BYTES ?
+	(st.st_size - OOK_ARCHIVE_HEADER_BYTES) / sizeof(struct ook_archive_entry) : 0;
+    uint64_t indexed = OOK_ARCHIVE_HEADER_BYTES;
+    if ( entries) {
+	struct ook_archive_entry last;
+	uint64_t at = OOK_ARCHIVE_HEADER_BYTES + (entries-1)*sizeof(last);
+	if ( readFully( indexFd, &last, sizeof(last), at) == 0) indexed = last.offset + 4 + last.length;
+	if ( indexed > a->size) {
+	    entries = 0;     // the archive lost what it indexes, start over
+	    indexed = OOK_ARCHIVE_HEADER_BYTES;
+	}
+    }
+    if ( st.st_size && ftruncate( indexFd, OOK_ARCHIVE_HEADER_BYTES + entries*sizeof(struct ook_archive_entry)) < 0) {
+	fprintf(stderr, "Failed to trim archive index '%s': %s\n", idx, strerror(errno));
+	close(indexFd);
+	goto Fail;
+    }
+    a->indexFd = indexFd;
+    if ( scanArchive( a, path, indexed, a->size) < 0) goto Fail;
+
+    a->segmentBytes = OOK_ARCHIVE_SEGMENT_BYTES;      // start a segment, what came before may be torn
+    free(idx);
+    return a;
+
+  Fail:
+    free(idx);
+    ook_archive_close(a);
+    return 0;
+}
+
+int ook_archive_append( struct ook_archive *a, struct ook_burst *burst)
+{
+    // datagram numbering means nothing in an archive
+    struct ook_sequence sequence = burst->sequence;
+    burst->sequence = (struct ook_sequence){ 0 };
+    void *data = 0;
+    size_t len = 0;
+    int e = ook_encode( burst, &data, &len);
+    burst->sequence = sequence;
+    if ( e != 0 || !data) return -1;
+    if ( len > OOK_ARCHIVE_MAX_RECORD) {
+	free(data);
+	return -1;
+    }
+
+    uint32_t sync[4] = { 0xffffffff, OOK_ARCHIVE_SYNC };
+    uint64_t now = ook_now( CLOCK_REALTIME);
+    memcpy( &sync[2], &now, sizeof(now));
+    uint32_t length = len;
+    struct iovec iov[3];
+    int n = 0;
+    if ( a->segmentBytes >= OOK_ARCHIVE_SEGMENT_BYTES) {
+	iov[n++] = (struct iovec){ sync, sizeof(sync) };
+    }
+    iov[n++] = (struct iovec){ &length, sizeof(length) };
+    iov[n++] = (struct iovec){ data, len };
+
+    size_t total = 0;
+    for ( int i = 0; i < n; i++) total += iov[i].iov_len;
+    struct ook_archive_entry entry = { .timeNs = archiveTime( burst),
+				       .offset = a->size + total - len - sizeof(length),
+				       .pulses = burst->pulses, .length = len };
+
+    ssize_t written = writev( a->fd, iov, n);
+    free(data);
+    if ( written != total) {
+	if ( written >= 0) errno = ENOSPC;
+	fprintf(stderr, "Failed to write to archive: %s\n", strerror(errno));
+	off_t end = lseek( a->fd, 0, SEEK_END);     // a torn record, the next segment starts after it
+	if ( end > 0) a->size = end;
+	a->segmentBytes = OOK_ARCHIVE_SEGMENT_BYTES;
+	return -1;
+    }
+    a->size += total;
+    a->segmentBytes = n == 3 ? total - sizeof(sync) : a->segmentBytes + total;
+
+    return addEntry( a, &entry);
+}
+
+static int compareEntries( const void *a, const void *b)
+{
+    const struct ook_archive_entry *x = a, *y = b;
+    if ( x->timeNs != y->timeNs) return x->timeNs < y->timeNs ? -1 : 1;
+    if ( x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+struct ook_archive *ook_archive_open( const char *path)
+{
+    struct ook_archive *a = calloc( sizeof(*a), 1);
+    char *idx = indexPath( path);
+    if ( !a || !idx) goto Fail;
+    a->fd = a->indexFd = -1;
+
+    a->fd = open( path, O_RDONLY);
+    if ( a->fd < 0) {
+	fprintf(stderr, "Failed to open archive '%s': %s\n", path, strerror(errno));
+	goto Fail;
+    }
+    struct stat st;
+    if ( fstat( a->fd, &st) < 0 || archiveHeader( a->fd, OOK_ARCHIVE_MAGIC, st.st_size ? st.st_size : 1, path) < 0) goto Fail;
+    a->size = st.st_size;
+
+    // Take what the index has, it is only missing anything written after a crash
+    uint64_t indexed = OOK_ARCHIVE_HEADER_BYTES;
+    int indexFd = open( idx, O_RDONLY);
+    if ( indexFd >= 0) {
+	if ( fstat( indexFd, &st) == 0 && archiveHeader( indexFd, OOK_ARCHIVE_INDEX_MAGIC, st.st_size ? st.st_size : 1, idx) == 0) {
+	    size_t n = (st.st_size - OOK_ARCHIVE_HEADER_BYTES) / sizeof(struct ook_archive_entry);
+	    a->entry = malloc( (n ? n : 1)*sizeof(struct ook_archive_entry));
+	    if ( !a->entry || readFully( indexFd, a->entry, n*sizeof(struct ook_archive_entry), OOK_ARCHIVE_HEADER_BYTES) < 0) {
+		close(indexFd);
+		goto Fail;
+	    }
+	    a->allocated = n ? n : 1;
+	    for ( size_t i = 0; i < n; i++) {
+		const struct ook_archive_entry *e = &a->entry[i];
+		if ( e->offset + 4 + e->length > a->size) continue;
+		if ( e->offset + 4 + e->length > indexed) indexed = e->offset + 4 + e->length;
+		a->entry[a->entries++] = *e;
+	    }
+	}
+	close(indexFd);
+    }
+    if ( scanArchive( a, path, indexed, a->size) < 0) goto Fail;
+
+    qsort( a->entry, a->entries, sizeof(a->entry[0]), compareEntries);
+    free(idx);
+    return a;
+
+  Fail:
+    free(idx);
+    ook_archive_close(a);
+    return 0;
+}
+
+size_t ook_archive_entries( const struct ook_archive *a, const struct ook_archive_entry **entries)
+{
+    if ( entries) *entries = a->entry;
+    return a->entries;
+}
+
+size_t ook_archive_find( const struct ook_archive *a, uint64_t timeNs)
+{
+    size_t lo = 0, hi = a->entries;
+    while ( lo < hi) {
+	size_t mid = lo + (hi - lo)/2;
+	if ( a->entry[mid].timeNs < timeNs) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo;
+}
+
+int ook_archive_read( struct ook_archive *a, size_t entry, struct ook_burst **burstReturn)
+{
+    if ( entry >= a->entries) return 0;
+    const struct ook_archive_entry *e = &a->entry[entry];
+
+    uint8_t *data = malloc( 4 + e->length);
+    if ( !data) return -1;
+    if ( readFully( a->fd, data, 4 + e->length, e->offset) < 0) {
+	free(data);
+	return -1;
+    }
+
+    uint32_t length;
+    memcpy( &length, data, sizeof(length));
+    int r = length == e->length ? ook_decode( data + 4, e->length, burstReturn) : 0;
+    free(data);
+    return r;
+}
+
+void ook_archive_close( struct ook_archive *a)
+{
+    if ( !a) return;
+    if ( a->fd >= 0) close( a->fd);
+    if ( a->indexFd >= 0) close( a->indexFd);
+    free( a->entry);
+    free( a);
+}
+
+struct ook_reassembly {
+    struct ook_burst *burst;       // being put together, NULL if none
+    int done;                      // burst was returned complete, start over next time
+    int skipping;                  // ignore the rest of skipId, we lost part of it
+    uint32_t skipId;
+};
+
+struct ook_reassembly *ook_reassembly_new( void)
+{
+    return calloc( sizeof(struct ook_reassembly), 1);
+}
+
+void ook_reassembly_free( struct ook_reassembly *r)
+{
+    if ( !r) return;
+    if ( r->burst) free( r->burst);
+    free( r);
+}
+
+struct ook_burst *ook_reassemble( struct ook_reassembly *r, struct ook_burst *b, int *complete)
+{
+    *complete = 0;
+
+    if ( !(b->fragment.flags & OOK_FRAGMENT)) {
+	*complete = 1;
+	return b;
+    }
+
+    if ( r->done || (r->burst && r->burst->fragment.burstId != b->fragment.burstId)) {
+	free( r->burst);           // finished, or its last fragment never came
+	r->burst = 0;
+	r->done = 0;
+    }
+    if ( r->skipping && r->skipId == b->fragment.burstId) return 0;
+    r->skipping = 0;
+
+    uint32_t have = r->burst ? r->burst->pulses : 0;
+    uint32_t next = r->burst ? r->burst->fragment.sequence+1 : 0;
+    if ( b->fragment.sequence != next || b->fragment.firstPulse != have) {
+	free( r->burst);           // we missed one, the pulses would be misplaced
+	r->burst = 0;
+	r->skipping = 1;
+	r->skipId = b->fragment.burstId;
+	return 0;
+    }
+
+    if ( !r->burst || have + b->pulses > r->burst->allocatedPulses) {
+	uint32_t want = r->burst ? 2*r->burst->allocatedPulses : 256;
+	if ( want < have + b->pulses) want = have + b->pulses;
+	struct ook_burst *grown = realloc( r->burst, sizeof(*grown) + want*sizeof(grown->pulse[0]));
+	if ( !grown) {
+	    free( r->burst);
+	    r->burst = 0;
+	    return 0;
+	}
+	if ( !r->burst) {
+	    grown->positionNanoseconds = b->positionNanoseconds;
+	    grown->times = b->times;
+	    grown->sequence = b->sequence;     // numbered from its first datagram
+	    grown->noiseFloor = b->noiseFloor;
+	    grown->pulses = 0;
+	}
+	grown->allocatedPulses = want;
+	r->burst = grown;
+    }
+
+    memcpy( &r->burst->pulse[have], b->pulse, b->pulses*sizeof(b->pulse[0]));
+    r->burst->pulses += b->pulses;
+    r->burst->fragment = b->fragment;
+
+    // keep when it started, everything after that is from the latest fragment
+    r->burst->times.endRealtimeNs = b->times.endRealtimeNs;
+    r->burst->times.sentRealtimeNs = b->times.sentRealtimeNs;
+    r->burst->times.receivedRealtimeNs = b->times.receivedRealtimeNs;
+    r->burst->times.receivedMonotonicNs = b->times.receivedMonotonicNs;
+
+    if ( b->fragment.flags & OOK_FRAGMENT_LAST) {
+	r->done = 1;
+	*complete = 1;
+    }
+    return r->burst;
+}
+
+int ook_decode_pulse_width( struct ook_burst *burst, 
+			    uint32_t minZeroHi, uint32_t maxZeroHi, 
+			    uint32_t minOneHi, uint32_t maxOneHi, 
+			    uint32_t minLow, uint32_t maxLow, 
+			    unsigned char **dataReturn, size_t *dataLenReturn,
+			    int verbose)
+{
+    size_t dataLen = (burst->pulses + 7)/8;
+    unsigned char *data = (unsigned char *)malloc( dataLen);
+    if ( data == 0) goto Fail;
+
+    unsigned char accum = 0;
+    unsigned char *thumb = data;
+    unsigned char bitsInAccum = 0;
+    unsigned bits = 0;
+    for ( int i = 0; i < burst->pulses; i++) {
+	uint32_t hi = burst->pulse[i].hiNanoseconds;
+	uint32_t low = burst->pulse[i].lowNanoseconds;
+
+	if ( low < minLow || low > maxLow) {
+	    if ( verbose) fprintf(stderr,"low of %u was %u, not between %u and %u\n", i, low, minLow, maxLow);
+	    goto Fail;
+	}
+
+	if ( hi >= minZeroHi && hi <= maxZeroHi) {
+	    accum = (accum<<1);
+	    bitsInAccum++;
+	    bits++;
+	} else if ( hi >= minOneHi && hi <= maxOneHi) {
+	    accum = ((accum<<1)|1);
+	    bitsInAccum++;
+	    bits++;
+	} else {
+	    if ( verbose) fprintf(stderr,"high of %u was %u, not between %u and %u or %u and %u\n", 
+				  i, hi, minZeroHi, maxZeroHi, minOneHi, maxOneHi);
+	    goto Fail;
+	}
+
+	if ( bitsInAccum == 8) {
+	    *thumb++ = accum;
+	    bitsInAccum = 0;
+	}
+    }
+    if ( bitsInAccum != 0) {
+	*thumb++ = accum;
+	bitsInAccum = 0;
+    }
+
+    *dataReturn = data;
+    *dataLenReturn = dataLen;
+    return bits;
+
+  Fail:
+    if ( data) free(data);
+    return -1;
+}
+
+
+// The body of ook_decode_manchester(), which keeps where each bit came from if pulseReturn is set
+static int decodeManchester( struct ook_burst *burst,
+			     uint32_t minShortHi, uint32_t maxShortHi,
+			     uint32_t minLongHi, uint32_t maxLongHi,
+			     uint32_t minShortLow, uint32_t maxShortLow,
+			     uint32_t minLongLow, uint32_t maxLongLow,
+			     unsigned char **dataReturn, size_t *dataLenReturn, uint32_t **pulseReturn)
+{
+    size_t dataLen = burst->pulses*2;  // this is an upper limit
+    uint32_t *pulse = 0;
+    unsigned char *data = (unsigned char *)malloc( dataLen);
+    if ( data == 0) goto Fail;
+    if ( pulseReturn) {
+	pulse = malloc( dataLen*sizeof(pulse[0]));
+	if ( pulse == 0) goto Fail;
+    }
+
+    enum signal { shortHi=0, longHi, shortLow, longLow, endLow, indeterminate};
+    #define NUMSIG 6
+
+#if 0
+    static const char *signalName[] = {
+	[shortHi]="-",
+	[longHi]="--",
+	[shortLow]="_",
+	[longLow]="__",
+	[endLow]=".__.",
+	[indeterminate]="="
+    };
+#endif
+
+    /*
+      var machine = [4 * 8]actionNext{
+      byte(d1) + byte(LowShort):          actionNext{noAction, c0},
+      byte(d1) + byte(LowLong):           actionNext{emitZeroAction, d0},
+      byte(d1) + byte(EndOfTransmission): actionNext{endAction, c0},
+      byte(c0) + byte(HighShort):         actionNext{emitOneAction, d1},
+
+      byte(d0) + byte(HighShort):         actionNext{noAction, c1},
+      byte(d0) + byte(HighLong):          actionNext{emitOneAction, d1},
+      byte(c1) + byte(LowShort):          actionNext{emitZeroAction, d0},
+      byte(c1) + byte(EndOfTransmission): actionNext{endAction, c0},
+      }
+    */
+	
+    enum state { c0=NUMSIG*0, c1=NUMSIG*1, d0=NUMSIG*2, d1=NUMSIG*3};
+#define NUMSTATE 4
+    enum action { errorAction=0, noAction, emitZero, emitOne, endAction };
+
+    enum state currentState = c0;
+
+#if 0
+    static const char *stateName[] = {
+	[c0] = "c0",
+	[c1] = "c1",
+	[d0] = "d0",
+	[d1] = "d1",
+    };
+#endif
+
+    static const struct {
+	unsigned char action; // enum action, but I want it one byte
+	unsigned char next; // enum state, but I want it one byte
+    } state[NUMSTATE*NUMSIG] = {
+	// clang detects overlaps and out of bounds entries so this is safe
+	// uninitialzed entries are going to get a zero and be an errorAction
+	[d1 + shortLow] = { noAction, c0 },
+	[d1 + longLow] = { emitZero, d0 },
+	[d1 + endLow] = { endAction, c0 },
+	[c0 + shortHi] = { emitOne, d1 },
+
+	[d0 + shortHi] = { noAction, c1 },
+	[d0 + longHi] = { emitOne, d1 },
+	[c1 + shortLow] = { emitZero, d0 },
+	[c1 + endLow] = { endAction, c0},
+    };
+
+
+    unsigned bits = 0;
+
+    for ( int i = 0; i < burst->pulses; i++) {
+	enum signal signal[2];
+
+	// turn the high pulse into a signal symbol
+	uint32_t hi = burst->pulse[i].hiNanoseconds;
+	if ( hi >= minShortHi && hi <= maxShortHi) {
+	    signal[0] = shortHi;
+	} else if ( hi >= minLongHi && hi <= maxLongHi) {
+	    signal[0] = longHi;
+	} else {
+	    signal[0] = indeterminate;
+	}
+
+	// turn the low pulse into a signal symbol
+	uint32_t low = burst->pulse[i].lowNanoseconds;
+	if ( low >= minShortLow && low <= maxShortLow) {
+	    signal[1] = shortLow;
+	} else if ( low >= minLongLow && low <= maxLongLow) {
 	    signal[1] = longLow;
 	} else if ( i == burst->pulses - 1) {
 	    signal[1] = endLow;
@@ -382,10 +1928,12 @@ int ook_decode_manchester( struct ook_burst *burst,
 		break;
 	      case emitZero:
 		if ( bits >= dataLen) goto Fail;
+		if ( pulse) pulse[bits] = i;
 		data[bits++] = 1;
 		break;
 	      case emitOne:
 		if ( bits >= dataLen) goto Fail;
+		if ( pulse) pulse[bits] = i;
 		data[bits++] = 0;
 		break;
 	      case endAction:
@@ -401,9 +1949,714 @@ int ook_decode_manchester( struct ook_burst *burst,
   Finish:
     *dataReturn = data;  // don't bother to realloc to right length, it goes away fast
     *dataLenReturn = dataLen;
+    if ( pulseReturn) *pulseReturn = pulse;
     return bits;
 
   Fail:
     if ( data) free(data);
+    if ( pulse) free(pulse);
+    return -1;
+}
+
+int ook_decode_manchester( struct ook_burst *burst, 
+			    uint32_t minShortHi, uint32_t maxShortHi, 
+			    uint32_t minLongHi, uint32_t maxLongHi, 
+			    uint32_t minShortLow, uint32_t maxShortLow, 
+			    uint32_t minLongLow, uint32_t maxLongLow, 
+			    unsigned char **dataReturn, size_t *dataLenReturn,
+			    int verbose)
+{
+    return decodeManchester( burst, minShortHi, maxShortHi, minLongHi, maxLongHi,
+			     minShortLow, maxShortLow, minLongLow, maxLongLow, dataReturn, dataLenReturn, 0);
+}
+
+int ook_decode_manchester_pulses( struct ook_burst *burst,
+				  uint32_t minShortHi, uint32_t maxShortHi,
+				  uint32_t minLongHi, uint32_t maxLongHi,
+				  uint32_t minShortLow, uint32_t maxShortLow,
+				  uint32_t minLongLow, uint32_t maxLongLow,
+				  unsigned char **dataReturn, size_t *dataLenReturn, uint32_t **pulseReturn,
+				  int verbose)
+{
+    return decodeManchester( burst, minShortHi, maxShortHi, minLongHi, maxLongHi,
+			     minShortLow, maxShortLow, minLongLow, maxLongLow, dataReturn, dataLenReturn, pulseReturn);
+}
+
+// Sort widths a byte at a time, least significant first, using scratch of n more.
+// Bytes which are the same in every width, like the top one, take no pass. Short
+// bursts are done quicker by insertion.
+static void sortWidths( uint32_t *width, uint32_t *scratch, uint32_t n)
+{
+    if ( n <= 64) {
+	for ( uint32_t i = 1; i < n; i++) {
+	    uint32_t v = width[i], j = i;
+	    for ( ; j > 0 && width[j-1] > v; j--) width[j] = width[j-1];
+	    width[j] = v;
+	}
+	return;
+    }
+
+    uint32_t *from = width, *to = scratch;
+
+    for ( int shift = 0; shift < 32; shift += 8) {
+	uint32_t count[256] = { 0 };
+	for ( uint32_t i = 0; i < n; i++) count[(from[i] >> shift) & 0xff]++;
+	if ( count[(from[0] >> shift) & 0xff] == n) continue;
+
+	uint32_t at = 0;
+	for ( int b = 0; b < 256; b++) {
+	    uint32_t c = count[b];
+	    count[b] = at;
+	    at += c;
+	}
+	for ( uint32_t i = 0; i < n; i++) to[count[(from[i] >> shift) & 0xff]++] = from[i];
+
+	uint32_t *t = from;
+	from = to;
+	to = t;
+    }
+    if ( from != width) memcpy( width, from, n*sizeof(width[0]));
+}
+
+// Cluster sorted widths in one sweep, a cluster ends where the next is more than tolerance wider.
+// Returns how many, -1 if there are more than OOK_MAX_CLUSTERS.
+static int clusterWidths( const uint32_t *width, uint32_t n, double tolerance, struct ook_cluster *cluster)
+{
+    int clusters = 0;
+    uint64_t sum = 0;
+
+    for ( uint32_t i = 0; i < n; i++) {
+	if ( i == 0 || width[i] > width[i-1] + width[i-1]*tolerance) {
+	    if ( clusters) cluster[clusters-1].mean = sum / cluster[clusters-1].count;
+	    if ( clusters == OOK_MAX_CLUSTERS) return -1;
+	    cluster[clusters++] = (struct ook_cluster){ .min = width[i] };
+	    sum = 0;
+	}
+	struct ook_cluster *c = &cluster[clusters-1];
+	c->max = width[i];
+	c->count++;
+	sum += width[i];
+    }
+    if ( clusters) cluster[clusters-1].mean = sum / cluster[clusters-1].count;
+    return clusters;
+}
+
+static int findCluster( const struct ook_cluster *cluster, uint32_t clusters, uint32_t width)
+{
+    for ( uint32_t i = 0; i+1 < clusters; i++) {
+	if ( width <= cluster[i].max) return i;
+    }
+    return clusters-1;
+}
+
+static void setWindows( struct ook_cluster *cluster, uint32_t clusters)
+{
+    for ( uint32_t i = 0; i < clusters; i++) {
+	cluster[i].windowMin = i ? cluster[i-1].windowMax + 1 : 0;
+	cluster[i].windowMax = i+1 < clusters ? cluster[i].max + (cluster[i+1].min - cluster[i].max)/2 : UINT32_MAX;
+    }
+}
+
+int ook_quantify( const struct ook_burst *burst, double tolerance, struct ook_quantification *q,
+		  uint8_t *highSymbols, uint8_t *lowSymbols, uint32_t *scratch)
+{
+    uint32_t n = burst->pulses;
+    if ( n == 0) return -1;
+
+    uint32_t onStack[OOK_QUANTIFY_SCRATCH(OOK_QUANTIFY_ON_STACK)];
+    uint32_t *width = scratch ? scratch :
+	n <= OOK_QUANTIFY_ON_STACK ? onStack : malloc( OOK_QUANTIFY_SCRATCH(n)*sizeof(uint32_t));
+    if ( !width) return -1;
+    uint32_t *highs = width, *lows = width + n, *spare = width + 2*n;
+
+    for ( uint32_t i = 0; i < n; i++) {
+	highs[i] = burst->pulse[i].hiNanoseconds;
+	lows[i] = burst->pulse[i].lowNanoseconds;
+    }
+    sortWidths( highs, spare, n);
+    sortWidths( lows, spare, n);
+
+    int h = clusterWidths( highs, n, tolerance, q->high);
+    int l = clusterWidths( lows, n, tolerance, q->low);
+    if ( width != onStack && width != scratch) free(width);
+    if ( h < 0 || l < 0) return -1;
+    q->highs = h;
+    q->lows = l;
+
+    // A first pulse all on its own belongs with the next cluster up
+    uint32_t first = burst->pulse[0].hiNanoseconds;
+    for ( uint32_t i = 0; i+1 < q->highs && q->high[i].min <= first; i++) {
+	struct ook_cluster *c = &q->high[i];
+	if ( c->count != 1 || c->min != first) continue;
+
+	struct ook_cluster *next = c+1;
+	uint64_t sum = (uint64_t)c->mean*c->count + (uint64_t)next->mean*next->count;
+	next->min = c->min;
+	next->count += c->count;
+	next->mean = sum / next->count;
+	memmove( c, next, (q->highs - i - 1)*sizeof(*c));
+	q->highs--;
+	break;
+    }
+
+    setWindows( q->high, q->highs);
+    setWindows( q->low, q->lows);
+
+    for ( uint32_t i = 0; i < n; i++) {
+	if ( highSymbols) highSymbols[i] = findCluster( q->high, q->highs, burst->pulse[i].hiNanoseconds);
+	if ( lowSymbols) lowSymbols[i] = findCluster( q->low, q->lows, burst->pulse[i].lowNanoseconds);
+    }
+    return 0;
+}
+
+void ook_vote_reset( struct ook_vote *vote)
+{
+    memset( vote, 0, sizeof(*vote));
+}
+
+int ook_vote_add( struct ook_vote *vote, const uint8_t *data, uint32_t bits, const uint8_t *weight,
+		  uint64_t positionNs, uint64_t windowNs)
+{
+    if ( bits == 0 || bits > OOK_VOTE_MAX_BITS) return -1;
+    if ( vote->copies && positionNs - vote->lastNs > windowNs) ook_vote_reset( vote);
+    if ( vote->copies && bits != vote->bits) return -1;
+
+    if ( vote->copies == 0) {
+	vote->bits = bits;
+	memcpy( vote->first, data, (bits+7)/8);
+    }
+    for ( uint32_t i = 0; i < bits; i++) {
+	uint8_t mask = 1 << (7 - i%8);
+	int32_t w = weight ? weight[i] : 1;
+	vote->tally[i] += data[i/8] & mask ? w : -w;
+	vote->differ[i/8] |= (data[i/8] ^ vote->first[i/8]) & mask;
+    }
+    vote->copies++;
+    vote->lastNs = positionNs;
+    return 0;
+}
+
+uint32_t ook_vote_result( const struct ook_vote *vote, uint8_t *data, uint32_t *contested)
+{
+    if ( contested) *contested = 0;
+    if ( vote->copies == 0) return 0;
+
+    memset( data, 0, (vote->bits+7)/8);
+    for ( uint32_t i = 0; i < vote->bits; i++) {
+	uint8_t mask = 1 << (7 - i%8);
+	if ( vote->tally[i] > 0 || (vote->tally[i] == 0 && (vote->first[i/8] & mask))) data[i/8] |= mask;
+	if ( contested && (vote->differ[i/8] & mask)) (*contested)++;
+    }
+    return vote->copies;
+}
+
+// Flip the candidate bits set in mask
+static void flipBits( uint8_t *data, const uint32_t *candidate, uint32_t mask)
+{
+    for ( uint32_t c = 0; mask; c++, mask >>= 1) {
+	if ( mask & 1) data[candidate[c]/8] ^= 1 << (7 - candidate[c]%8);
+    }
+}
+
+int ook_flip_search( uint8_t *data, uint32_t bits, const uint8_t *confidence, uint32_t maxFlips, uint32_t budget,
+		     int (*check)( const uint8_t *data, uint32_t bits, void *ctx), void *ctx)
+{
+    // The least certain bits, kept in order by insertion
+    uint32_t candidate[OOK_FLIP_CANDIDATES];
+    uint32_t candidates = 0;
+    for ( uint32_t i = 0; i < bits; i++) {
+	if ( confidence[i] >= OOK_FLIP_UNSURE) continue;
+	if ( candidates == OOK_FLIP_CANDIDATES && confidence[i] >= confidence[candidate[candidates-1]]) continue;
+
+	uint32_t j = candidates < OOK_FLIP_CANDIDATES ? candidates++ : candidates-1;
+	for ( ; j > 0 && confidence[candidate[j-1]] > confidence[i]; j--) candidate[j] = candidate[j-1];
+	candidate[j] = i;
+    }
+
+    // Each number of flips in turn, the masks with that many bits set in increasing order, so
+    // the least certain bits are tried first
+    for ( uint32_t flips = 1; flips <= candidates && flips <= maxFlips; flips++) {
+	for ( uint32_t mask = (1u << flips) - 1; mask < (1u << candidates); ) {
+	    if ( budget-- == 0) return -1;
+
+	    flipBits( data, candidate, mask);
+	    if ( check( data, bits, ctx)) return flips;
+	    flipBits( data, candidate, mask);
+
+	    uint32_t lowest = mask & -mask;       // the next mask with as many bits set
+	    uint32_t ripple = mask + lowest;
+	    mask = ripple | (((mask ^ ripple) >> 2) / lowest);
+	}
+    }
     return -1;
 }
+
+//
+// The client event loop
+//
+
+enum { SOURCE_SOCKET, SOURCE_RING, SOURCE_FD, SOURCE_SIGNALS};
+
+struct loopSource {
+    int type;                      // SOURCE_*
+    int fd;                        // -1 for a ring
+    struct ook_ring *ring;
+    ook_burst_handler handler;
+    void (*ready)( int fd, void *ctx);
+    void *ctx;
+    int verbose;
+};
+
+struct ook_timer {
+    struct ook_timer *next;        // in its slot of the wheel, dueTick % OOK_LOOP_SLOTS
+    struct ook_timer **prev;
+    uint64_t dueTick;
+    uint64_t periodTicks;          // 0 to fire once
+    ook_task task;
+    void *ctx;
+    int cancelled;                 // while its task runs
+};
+
+struct ook_loop {
+    struct loopSource source[OOK_LOOP_SOURCES];
+    unsigned sources;
+    unsigned rings;
+    int pollFd;                    // epoll on Linux, -1 elsewhere
+
+    struct ook_timer *slot[OOK_LOOP_SLOTS];
+    uint64_t startNs;              // CLOCK_MONOTONIC of tick 0
+    uint64_t tick;                 // every timer due before this has fired
+    struct ook_timer *firing;
+
+    struct {
+	void (*handler)( int signum, void *ctx);
+	void *ctx;
+    } signal[OOK_LOOP_SIGNALS];
+    sigset_t signals;
+    int signalFd;                  // the signalfd on Linux, the read end of signalPipe elsewhere
+
+    struct ook_timer *expiry;      // of segments which stopped arriving, once there is a socket
+
+    int stopping;
+    int failed;
+};
+
+#ifndef __linux__
+// Off Linux signals come through a pipe, the handler can only write to it
+static int signalPipe[2] = { -1, -1};
+
+static void signalToPipe( int signum)
+{
+    unsigned char b = signum;
+    int saved = errno;
+    if ( write( signalPipe[1], &b, 1) < 0) {}    // full, some are already waiting
+    errno = saved;
+}
+#endif
+
+struct ook_loop *ook_loop_new( void)
+{
+    struct ook_loop *loop = calloc( 1, sizeof(*loop));
+    if ( !loop) return 0;
+
+    loop->pollFd = -1;
+    loop->signalFd = -1;
+    loop->startNs = ook_now( CLOCK_MONOTONIC);
+    sigemptyset( &loop->signals);
+
+#ifdef __linux__
+    loop->pollFd = epoll_create1( EPOLL_CLOEXEC);
+    if ( loop->pollFd < 0) {
+	fprintf(stderr, "Failed to create epoll: %s\n", strerror(errno));
+	free( loop);
+	return 0;
+    }
+#endif
+    return loop;
+}
+
+void ook_loop_free( struct ook_loop *loop)
+{
+    if ( !loop) return;
+
+    for ( unsigned s = 0; s < OOK_LOOP_SLOTS; s++) {
+	while ( loop->slot[s]) {
+	    struct ook_timer *t = loop->slot[s];
+	    loop->slot[s] = t->next;
+	    free( t);
+	}
+    }
+#ifdef __linux__
+    if ( loop->signalFd >= 0) close( loop->signalFd);
+#endif
+    if ( loop->pollFd >= 0) close( loop->pollFd);
+    free( loop);
+}
+
+static int addSource( struct ook_loop *loop, const struct loopSource *source)
+{
+    if ( loop->sources >= OOK_LOOP_SOURCES) {
+	fprintf(stderr, "Too many inputs for one loop, at most %d\n", OOK_LOOP_SOURCES);
+	return -1;
+    }
+#ifdef __linux__
+    if ( source->fd >= 0) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = loop->sources };
+	if ( epoll_ctl( loop->pollFd, EPOLL_CTL_ADD, source->fd, &ev) < 0) {
+	    fprintf(stderr, "Failed to watch descriptor %d: %s\n", source->fd, strerror(errno));
+	    return -1;
+	}
+    }
+#endif
+    loop->source[loop->sources++] = *source;
+    if ( source->type == SOURCE_RING) loop->rings++;
+    return 0;
+}
+
+static void expireTask( void *ctx)
+{
+    ook_expire_segments( *(int *)ctx);
+}
+
+int ook_loop_add_socket( struct ook_loop *loop, int sock, ook_burst_handler handler, void *ctx, int verbose)
+{
+    struct loopSource s = { .type = SOURCE_SOCKET, .fd = sock, .handler = handler, .ctx = ctx, .verbose = verbose };
+    if ( addSource( loop, &s) < 0) return -1;
+
+    // a burst whose last segments never come would otherwise wait for the next one to arrive
+    if ( !loop->expiry) {
+	loop->expiry = ook_loop_every( loop, OOK_SEGMENT_TIMEOUT_NS/4, expireTask, &loop->source[loop->sources-1].verbose);
+	if ( !loop->expiry) return -1;
+    }
+    return 0;
+}
+
+int ook_loop_add_ring( struct ook_loop *loop, struct ook_ring *ring, ook_burst_handler handler, void *ctx, int verbose)
+{
+    struct loopSource s = { .type = SOURCE_RING, .fd = -1, .ring = ring, .handler = handler, .ctx = ctx, .verbose = verbose };
+    return addSource( loop, &s);
+}
+
+int ook_loop_add_fd( struct ook_loop *loop, int fd, void (*ready)( int fd, void *ctx), void *ctx)
+{
+    struct loopSource s = { .type = SOURCE_FD, .fd = fd, .ready = ready, .ctx = ctx };
+    return addSource( loop, &s);
+}
+
+static void insertTimer( struct ook_loop *loop, struct ook_timer *t)
+{
+    struct ook_timer **head = &loop->slot[t->dueTick % OOK_LOOP_SLOTS];
+    t->next = *head;
+    t->prev = head;
+    if ( *head) (*head)->prev = &t->next;
+    *head = t;
+}
+
+static void removeTimer( struct ook_timer *t)
+{
+    *t->prev = t->next;
+    if ( t->next) t->next->prev = t->prev;
+}
+
+static uint64_t nowTick( const struct ook_loop *loop)
+{
+    return (ook_now( CLOCK_MONOTONIC) - loop->startNs) / OOK_LOOP_TICK_NS;
+}
+
+static struct ook_timer *addTimer( struct ook_loop *loop, uint64_t delayNs, uint64_t periodNs, ook_task task, void *ctx)
+{
+    struct ook_timer *t = calloc( 1, sizeof(*t));
+    if ( !t) return 0;
+
+    uint64_t ticks = (delayNs + OOK_LOOP_TICK_NS - 1) / OOK_LOOP_TICK_NS;
+    t->dueTick = nowTick( loop) + (ticks ? ticks : 1);
+    t->periodTicks = periodNs ? (periodNs + OOK_LOOP_TICK_NS - 1) / OOK_LOOP_TICK_NS : 0;
+    t->task = task;
+    t->ctx = ctx;
+    insertTimer( loop, t);
+    return t;
+}
+
+struct ook_timer *ook_loop_every( struct ook_loop *loop, uint64_t periodNs, ook_task task, void *ctx)
+{
+    return addTimer( loop, periodNs, periodNs ? periodNs : 1, task, ctx);
+}
+
+struct ook_timer *ook_loop_after( struct ook_loop *loop, uint64_t delayNs, ook_task task, void *ctx)
+{
+    return addTimer( loop, delayNs, 0, task, ctx);
+}
+
+void ook_loop_cancel( struct ook_loop *loop, struct ook_timer *timer)
+{
+    if ( !timer) return;
+    if ( timer == loop->firing) {
+	timer->cancelled = 1;       // its task is running, it is freed after
+	return;
+    }
+    removeTimer( timer);
+    free( timer);
+}
+
+// Fire whatever is due in the slot for tick. Timers a turn or more later stay put.
+static void fireSlot( struct ook_loop *loop, uint64_t tick)
+{
+    struct ook_timer **head = &loop->slot[tick % OOK_LOOP_SLOTS];
+
+    for ( struct ook_timer *t = *head; t; ) {
+	if ( t->dueTick > tick) {
+	    t = t->next;
+	    continue;
+	}
+
+	removeTimer( t);
+	loop->firing = t;
+	t->task( t->ctx);
+	loop->firing = 0;
+
+	if ( t->periodTicks && !t->cancelled) {
+	    while ( t->dueTick <= tick) t->dueTick += t->periodTicks;
+	    insertTimer( loop, t);
+	} else {
+	    free( t);
+	}
+	t = *head;                 // the task may have changed the slot, look again
+    }
+}
+
+static void fireTimers( struct ook_loop *loop)
+{
+    uint64_t now = nowTick( loop);
+    if ( now < loop->tick) return;
+
+    if ( now - loop->tick >= OOK_LOOP_SLOTS) {
+	// asleep for a whole turn, every slot may have something due
+	for ( unsigned s = 0; s < OOK_LOOP_SLOTS; s++) fireSlot( loop, now - s);
+    } else {
+	for ( uint64_t t = loop->tick; t <= now; t++) fireSlot( loop, t);
+    }
+    loop->tick = now + 1;
+}
+
+// Milliseconds until the next timer is due, at most limit, -1 for no limit
+static int timerWait( const struct ook_loop *loop, int limit)
+{
+    uint64_t due = UINT64_MAX;
+    for ( unsigned s = 0; s < OOK_LOOP_SLOTS; s++) {
+	for ( const struct ook_timer *t = loop->slot[s]; t; t = t->next) {
+	    if ( t->dueTick < due) due = t->dueTick;
+	}
+    }
+    if ( due == UINT64_MAX) return limit;
+
+    uint64_t dueNs = loop->startNs + due*OOK_LOOP_TICK_NS;
+    uint64_t now = ook_now( CLOCK_MONOTONIC);
+    uint64_t ms = dueNs > now ? (dueNs - now + 999999) / 1000000 : 0;
+    if ( limit >= 0 && ms > limit) return limit;
+    return ms > INT32_MAX ? INT32_MAX : ms;
+}
+
+int ook_loop_signal( struct ook_loop *loop, int signum, void (*handler)( int signum, void *ctx), void *ctx)
+{
+    if ( signum <= 0 || signum >= OOK_LOOP_SIGNALS) {
+	fprintf(stderr, "Can't handle signal %d\n", signum);
+	return -1;
+    }
+    loop->signal[signum].handler = handler;
+    loop->signal[signum].ctx = ctx;
+    sigaddset( &loop->signals, signum);
+
+#ifdef __linux__
+    if ( sigprocmask( SIG_BLOCK, &loop->signals, 0) < 0) return -1;
+    int fresh = loop->signalFd < 0;
+    loop->signalFd = signalfd( loop->signalFd, &loop->signals, SFD_NONBLOCK|SFD_CLOEXEC);
+    if ( loop->signalFd < 0) {
+	fprintf(stderr, "Failed to make signalfd: %s\n", strerror(errno));
+	return -1;
+    }
+#else
+    int fresh = loop->signalFd < 0;
+    if ( signalPipe[0] < 0) {
+	if ( pipe( signalPipe) < 0) {
+	    fprintf(stderr, "Failed to make signal pipe: %s\n", strerror(errno));
+	    return -1;
+	}
+	fcntl( signalPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl( signalPipe[1], F_SETFL, O_NONBLOCK);
+    }
+    loop->signalFd = signalPipe[0];
+    struct sigaction sa = { .sa_handler = signalToPipe };
+    sigemptyset( &sa.sa_mask);
+    if ( sigaction( signum, &sa, 0) < 0) return -1;
+#endif
+
+    if ( fresh) {
+	struct loopSource s = { .type = SOURCE_SIGNALS, .fd = loop->signalFd };
+	if ( addSource( loop, &s) < 0) return -1;
+    }
+    return 0;
+}
+
+void ook_loop_stop( struct ook_loop *loop)
+{
+    loop->stopping = 1;
+}
+
+static void readSignals( struct ook_loop *loop)
+{
+    for (;;) {
+	int signum;
+#ifdef __linux__
+	struct signalfd_siginfo info;
+	if ( read( loop->signalFd, &info, sizeof(info)) != sizeof(info)) return;
+	signum = info.ssi_signo;
+#else
+	unsigned char b;
+	if ( read( loop->signalFd, &b, 1) != 1) return;
+	signum = b;
+#endif
+	if ( signum < OOK_LOOP_SIGNALS && loop->signal[signum].handler) {
+	    loop->signal[signum].handler( signum, loop->signal[signum].ctx);
+	}
+    }
+}
+
+static void readSocket( struct ook_loop *loop, struct loopSource *s)
+{
+    while ( !loop->stopping) {
+	struct ook_burst *burst;
+	struct sockaddr_storage addr;
+	socklen_t addrLen = sizeof(addr);
+
+	int e = decodeFromSocket( s->fd, &burst, (struct sockaddr *)&addr, &addrLen, MSG_DONTWAIT, s->verbose);
+	if ( e < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if ( e < 0) {
+	    fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
+	    loop->failed = 1;
+	    return;
+	}
+	if ( e == 0) {
+	    fprintf(stderr,"Corrupt burst\n");
+	    continue;
+	}
+	s->handler( burst, s->fd, s->ctx);
+	free( burst);
+    }
+}
+
+// 1 if ookd closed the ring or died without closing it
+static int ringGone( const struct ook_ring *ring)
+{
+    struct ringHeader *h = ring->header;
+    if ( __atomic_load_n( &h->closed, __ATOMIC_ACQUIRE)) {
+	fprintf(stderr, "ookd closed the ring\n");
+	return 1;
+    }
+    if ( kill( h->producer, 0) < 0 && errno == ESRCH) {
+	fprintf(stderr, "ookd went away without closing the ring\n");
+	return 1;
+    }
+    return 0;
+}
+
+static void readRing( struct ook_loop *loop, struct loopSource *s)
+{
+    while ( !loop->stopping && ook_ring_pending( s->ring)) {
+	struct ook_burst *burst;
+	if ( ook_decode_from_ring( s->ring, &burst, s->verbose) < 0) {
+	    loop->failed = 1;
+	    return;
+	}
+	s->handler( burst, -1, s->ctx);
+	free( burst);
+    }
+}
+
+static void dispatch( struct ook_loop *loop, unsigned i)
+{
+    struct loopSource *s = &loop->source[i];
+    switch( s->type) {
+      case SOURCE_SOCKET:
+	readSocket( loop, s);
+	break;
+      case SOURCE_FD:
+	s->ready( s->fd, s->ctx);
+	break;
+      case SOURCE_SIGNALS:
+	readSignals( loop);
+	break;
+    }
+}
+
+// Wait up to timeoutMs, -1 for ever, for descriptors and handle the ones which are ready
+static void waitForDescriptors( struct ook_loop *loop, int timeoutMs)
+{
+#ifdef __linux__
+    struct epoll_event ev[OOK_LOOP_SOURCES];
+    int n = epoll_wait( loop->pollFd, ev, OOK_LOOP_SOURCES, timeoutMs);
+    if ( n < 0 && errno != EINTR) {
+	fprintf(stderr, "Failed to wait for input: %s\n", strerror(errno));
+	loop->failed = 1;
+    }
+    for ( int i = 0; i < n && !loop->stopping; i++) dispatch( loop, ev[i].data.u32);
+#else
+    struct pollfd fds[OOK_LOOP_SOURCES];
+    unsigned which[OOK_LOOP_SOURCES];
+    nfds_t n = 0;
+    for ( unsigned i = 0; i < loop->sources; i++) {
+	if ( loop->source[i].fd < 0) continue;
+	fds[n] = (struct pollfd){ .fd = loop->source[i].fd, .events = POLLIN };
+	which[n++] = i;
+    }
+    int r = poll( fds, n, timeoutMs);
+    if ( r < 0 && errno != EINTR) {
+	fprintf(stderr, "Failed to wait for input: %s\n", strerror(errno));
+	loop->failed = 1;
+    }
+    for ( nfds_t i = 0; r > 0 && i < n && !loop->stopping; i++) {
+	if ( fds[i].revents) dispatch( loop, which[i]);
+    }
+#endif
+}
+
+int ook_loop_run( struct ook_loop *loop)
+{
+    loop->stopping = 0;
+    loop->failed = 0;
+    loop->tick = nowTick( loop);
+
+    // A lone ring, with nothing but signals beside it, is waited on directly
+    struct ook_ring *lone = 0;
+    if ( loop->rings == 1 && loop->sources == 1 + (loop->signalFd >= 0)) {
+	for ( unsigned i = 0; i < loop->sources; i++) {
+	    if ( loop->source[i].type == SOURCE_RING) lone = loop->source[i].ring;
+	}
+    }
+
+    while ( !loop->stopping && !loop->failed) {
+	fireTimers( loop);
+
+	uint32_t wake = lone ? __atomic_load_n( &lone->header->wake, __ATOMIC_SEQ_CST) : 0;
+	int quiet = 1;
+	for ( unsigned i = 0; i < loop->sources && !loop->stopping && !loop->failed; i++) {
+	    struct loopSource *s = &loop->source[i];
+	    if ( s->type != SOURCE_RING) continue;
+	    if ( ook_ring_pending( s->ring)) {
+		readRing( loop, s);
+		quiet = 0;
+	    } else if ( ringGone( s->ring)) {
+		loop->failed = 1;
+	    }
+	}
+	if ( loop->stopping || loop->failed) break;
+
+	if ( lone) {
+	    if ( quiet) ringWait( lone->header, wake, timerWait( loop, OOK_LOOP_RING_WAIT_MS));
+	    waitForDescriptors( loop, 0);
+	} else {
+	    waitForDescriptors( loop, quiet ? timerWait( loop, loop->rings ? OOK_LOOP_RING_POLL_MS : -1) : 0);
+	}
+    }
+
+    return loop->failed ? -1 : 0;
+}
@@ -4,15 +4,58 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 
 struct ook_pulse {
     uint32_t hiNanoseconds;
     uint32_t lowNanoseconds;
     int32_t frequencyOffsetHz;
+    uint16_t peakPower;            // strongest and average I^2+Q^2 of the high part's 8 bit samples,
+    uint16_t meanPower;            // .. 0 if unknown, see ook_pulse_confidence()
+};
+
+// When a burst happened and when it passed each stage on its way to a client, in nanoseconds.
+// Zero means unknown, e.g. bursts read from a file. Realtime is CLOCK_REALTIME, and comparable
+// between machines as well as their clocks agree. Monotonic is CLOCK_MONOTONIC of the host which
+// set it. ookd sets the first four and they travel with the burst, the rest are for the client.
+struct ook_times {
+    uint64_t captureMonotonicNs;   // the first sample of the burst came off the radio
+    uint64_t captureRealtimeNs;
+    uint64_t endRealtimeNs;        // the last sample of the burst came off the radio
+    uint64_t sentRealtimeNs;       // ookd started encoding and sending it
+    uint32_t uncertaintyNs;        // of the capture and end times, 0 if ookd didn't say
+
+    uint64_t receivedRealtimeNs;   // set by ook_decode_from_socket()
+    uint64_t receivedMonotonicNs;
+    uint64_t decodedMonotonicNs;   // clients may mark when they have decoded it
+};
+
+// ookd can stream a burst in fragments as it is received, see ook_reassemble().
+#define OOK_FRAGMENT 1             // this is part of a burst
+#define OOK_FRAGMENT_LAST 2        // the final part, the burst is complete
+
+struct ook_fragment {
+    uint32_t flags;                // OOK_FRAGMENT_*, 0 for a whole burst
+    uint32_t burstId;              // the same for every fragment of a burst
+    uint32_t sequence;             // 0, 1, 2... within the burst
+    uint32_t firstPulse;           // where this fragment's pulses go in the whole burst
+};
+
+// ookd numbers the datagrams it sends to each port, so clients can tell bursts lost between the
+// hosts from ones the radio never heard, see ook_get_stats().
+struct ook_sequence {
+    uint32_t source;               // different for each run of the sender, 0 if it doesn't number them
+    uint32_t number;               // of the burst's first datagram, the rest of its segments follow on
 };
 
 struct ook_burst {
-    uint64_t positionNanoseconds;  // relative to when the daemon started
+    uint64_t positionNanoseconds;  // relative to when the daemon started by counting samples, fragments have
+				   // their burst's. times.captureRealtimeNs is the one to compare across ookds.
+    struct ook_times times;
+    struct ook_fragment fragment;
+    struct ook_sequence sequence;
+    uint32_t noiseFloor;           // average power while the detector was idle, in the pulses' units, 0 if
+				   // they don't carry their power
     uint32_t pulses;
     uint32_t allocatedPulses;      // how many pulses can be stored in here
     struct ook_pulse pulse[];
@@ -21,23 +64,253 @@ struct ook_burst {
 // Free with free(), return NULL on error
 struct ook_burst *ook_allocate_burst( uint32_t maximumPulses);
 
-// -1 if tried to overflow or bad burst, 0 if ok
+// -1 if tried to overflow or bad burst, 0 if ok. The pulse's power is left unknown.
 int ook_add_pulse( struct ook_burst *burst, uint32_t hiNs, uint32_t lowNs, int32_t freqOffsetHz);
 
+// How sure the detector was of a pulse, 0 to 255, 8 for each dB its mean power stood above the
+// noise floor. Every pulse of a burst without power, e.g. from a file or an older ookd, gets 255.
+uint8_t ook_pulse_confidence( const struct ook_burst *burst, uint32_t pulse);
+
 // Serialize an ook_pulse into a sequence of bytes. 
+// If the burst has capture times, or its pulses' power, they are appended as extensions, which
+// clients that don't know a particular one skip. A datagram with extensions is marked as version 2,
+// and clients built before there were any, which only understand version 1, drop it.
 // return 0 if ok
 // dataReturn should be free()d if it is set.
 int ook_encode( struct ook_burst *burst, void **dataReturn, size_t *sizeReturn);
 
+// Just the pulses as version 1, for clients built before the extensions, see ookd --old-format.
+int ook_encode_plain( struct ook_burst *burst, void **dataReturn, size_t *sizeReturn);
+
+// A burst too big for one datagram would be fragmented by IP, and losing any piece loses all of it.
+// Instead it can be split into segments of whole pulses, each a datagram of at most maxDatagram bytes,
+// which ook_decode_from_socket() puts back together. Leave room for the IP and UDP headers.
+#define OOK_MAX_SEGMENTS 4096
+#define OOK_MAX_PULSES (1<<20)     // in a burst sent in segments
+
+// How many datagrams ook_encode_segment() makes of the burst, 0 if it can't be done in OOK_MAX_SEGMENTS.
+// A burst which fits in one is sent as ook_encode() would, so clients which don't know segments still get it.
+uint32_t ook_segments( const struct ook_burst *burst, size_t maxDatagram);
+
+// Encode datagram index of ook_segments(), id must differ for each burst you send.
+// return 0 if ok, dataReturn should be free()d if it is set.
+int ook_encode_segment( struct ook_burst *burst, size_t maxDatagram, uint32_t id, uint32_t index,
+			void **dataReturn, size_t *sizeReturn);
+
+// Put the fragments of streamed bursts back together. Use one per ookd you listen to.
+// Free with ook_reassembly_free(), NULL on error.
+struct ook_reassembly *ook_reassembly_new( void);
+void ook_reassembly_free( struct ook_reassembly *r);
+
+// Add a burst from ook_decode_from_socket(). Returns the burst it belongs to with every pulse
+// received so far, *complete is set if that is all of it. A whole burst is returned as it is.
+// NULL means the fragment was dropped, e.g. an earlier one of its burst was lost.
+// The returned burst belongs to the reassembler until the next call, unless it is the one passed in.
+// Decoders can try the partial bursts and act before the burst is over.
+struct ook_burst *ook_reassemble( struct ook_reassembly *r, struct ook_burst *burst, int *complete);
+
 // Get a socket bound for listening for pulse bursts, -1 on error
 // This handles the rather tedious UDP multicast jiggery
+// On Linux it only hears its own group, not every group joined on the port by anyone on the host.
 int ook_open( const char *address, const char *port, const char *interface);
 
-// -1 socket error, 0 bad packet (from/fromLen valid), >0 good burst (burstReturn/from/fromLen valid)
-// Will block awaiting data. You should use select() if that isn't for you.
+// Ask for a bigger kernel buffer on a socket from ook_open(), so a client which stalls for a moment
+// doesn't lose datagrams. Returns the size given, which the system may cap (net.core.rmem_max on
+// Linux), -1 on error. It says on stderr if it got less than it asked for.
+int ook_set_receive_buffer( int sock, int bytes);
+
+// Which bursts a socket is for, see ook_set_filter()
+struct ook_filter {
+    uint32_t minPulses;
+    uint32_t maxPulses;            // 0 for no limit
+};
+
+// Only take bursts a decoder can use from a socket from ook_open(). On Linux a classic BPF
+// filter is attached, and the kernel drops the rest before they wake us, elsewhere
+// ook_decode_from_socket() quietly skips them. Datagrams not in ookd's format are dropped too.
+// Segments are judged by their whole burst's pulses. Streamed fragments all get through.
+// The filter leaves gaps in ookd's numbering of its own, a filtered socket counts none lost.
+// 0 if ok, -1 on error.
+int ook_set_filter( int sock, const struct ook_filter *filter);
+
+// A number for struct ook_sequence's source, unlikely to be the same for two runs of a sender
+uint32_t ook_sequence_source( void);
+
+// Get a socket for multicasting pulse bursts to address:port out of interface, -1 on error.
+// *toReturn is the address to sendto(), free() it when done.
+int ook_open_sender( const char *address, const char *port, const char *interface,
+		     struct sockaddr **toReturn, socklen_t *toLenReturn);
+
+// Where ook_send() sends bursts, and how it numbers them. Fill in the first five and the
+// sequence's source, ook_send() keeps the rest.
+struct ook_sender {
+    int sock;                      // from ook_open_sender(), as are to and toLen
+    struct sockaddr *to;
+    socklen_t toLen;
+    size_t maxDatagram;            // the MTU less the IP and UDP headers
+    int plain;                     // one ook_encode_plain() datagram a burst, for clients built before the extensions
+    struct ook_sequence sequence;  // the next burst's
+    uint32_t segmentId;
+    uint32_t datagrams;            // what the last ook_send() did, to count
+    uint32_t failures;             // datagrams sendto() refused
+    size_t bytes;
+    uint64_t encodeNs;
+    uint64_t sendNs;
+};
+
+// Number a burst, encode it in as many datagrams as ook_segments() says and send them. 0 if they
+// all went, -1 if it couldn't be encoded, it is too big for OOK_MAX_SEGMENTS or memory ran out,
+// -2 if some didn't send. Either way why is on stderr. The burst's sequence is set.
+int ook_send( struct ook_sender *sender, struct ook_burst *burst);
+
+// 0 bad packet, 1 good burst (burstReturn valid). This is the datagram format ookd sends.
+// Only the times which travel with the burst are set. A segment decodes as just its own pulses.
 // If burstReturn is set, it must be free()ed.
+int ook_decode( const void *data, size_t len, struct ook_burst **burstReturn);
+
+// -1 socket error, 0 bad packet (from/fromLen valid), >0 good burst (burstReturn/from/fromLen valid)
+// Will block awaiting data, even after select() says there is some, if what came was only a segment.
+// Use ook_decode_from_socket_nowait() if that isn't for you.
+// If burstReturn is set, it must be free()ed. The received times are set.
+// Segments of a bigger burst are held until the rest arrive, it keeps waiting for them. Eight bursts
+// can be in progress at once, those not complete within a second are dropped. What arrives, and
+// what should have but didn't, is counted for ook_get_stats().
+// This state is shared by all sockets, so only call it from one thread.
 int ook_decode_from_socket( int sock, struct ook_burst **burstReturn, struct sockaddr *from, socklen_t *fromLen, int verbose);
 
+// For clients which poll() the socket themselves, never waits. 1 with a burst as ook_decode_from_socket()
+// gives it, 0 if nothing whole has arrived yet, e.g. just a segment, a burst the filter dropped or a corrupt
+// datagram, -1 on a socket error.
+int ook_decode_from_socket_nowait( int sock, struct ook_burst **burstReturn, struct sockaddr *from, socklen_t *fromLen,
+				   int verbose);
+
+// Give up on bursts whose missing segments are more than a second late, counting them incomplete.
+// Otherwise that only happens when another segment arrives. ook_loop_run() does it for you, clients
+// which poll() should call it every quarter second or so.
+void ook_expire_segments( int verbose);
+
+// What ook_decode_from_socket() has seen on a socket since ook_open() made it. Overflows are
+// datagrams our kernel threw away because we didn't read them fast enough, only Linux reports
+// those. Lost ones are the other gaps in the senders' numbering, they went missing on the network
+// or the sender failed to send them. A reading missing when neither count moved was never heard.
+struct ook_stats {
+    uint64_t datagrams;            // received, including corrupt ones
+    uint64_t corrupt;              // not in the format ookd sends
+    uint64_t lost;
+    uint64_t late;                 // arrived out of order after being counted lost, and taken back out of
+				   // it unless more than 64 later
+    uint64_t duplicates;
+    uint64_t overflows;
+    uint64_t incomplete;           // bursts sent in segments given up on with some missing
+    uint32_t sources;              // senders heard from, a restarted ookd is a new one
+};
+
+// Fill in stats for a socket, all zero if nothing has arrived on it. 0 if ok.
+int ook_get_stats( int sock, struct ook_stats *stats);
+
+// ookd can also publish bursts in a shared memory ring (ookd --ring), which decoders on the same
+// host can read without the network. Each reader has its own place in it, ookd doesn't wait for
+// them, one too slow is told how many bursts it lost. NULL on error.
+struct ook_ring *ook_ring_attach( const char *name);
+void ook_ring_detach( struct ook_ring *ring);
+
+// Blocks for the next burst, -1 if ookd has gone away, 1 and *view points at the burst in the ring.
+// *lost, if not NULL, gets how many bursts were missed before it. The view is only good until
+// ookd laps us, check ook_ring_valid() after using it, and don't use what you got if it says no.
+// Even its pulse count can change, ook_decode_from_ring() takes a safe copy.
+int ook_ring_next( struct ook_ring *ring, const struct ook_burst **view, uint64_t *lost);
+
+// 1 if the last view from ook_ring_next() hasn't been overwritten.
+int ook_ring_valid( const struct ook_ring *ring);
+
+// 1 if ook_ring_next() has another burst without waiting, for batching work until the ring goes quiet.
+int ook_ring_pending( const struct ook_ring *ring);
+
+// Like ook_decode_from_socket(), -1 if ookd has gone away, 1 with a copy of the next burst you must
+// free() and which has its received times set. Lost bursts are reported on stderr.
+int ook_decode_from_ring( struct ook_ring *ring, struct ook_burst **burstReturn, int verbose);
+
+/*
+** An event loop for clients, so one thread can take bursts from several sockets and rings, run
+** periodic work whether or not bursts are arriving, and see signals, e.g. to exit cleanly. Bursts
+** are handed to the handler of their input, and freed when it returns.
+**
+** On Linux it waits in epoll, with signals through a signalfd, elsewhere in poll(). A lone ring waits
+** on the ring itself, a ring alongside other inputs is looked at every 10mS. Timers are kept in a
+** wheel of 10mS ticks, and are late by up to a tick.
+*/
+struct ook_loop;
+struct ook_timer;
+
+typedef void (*ook_burst_handler)( struct ook_burst *burst, int sock, void *ctx);   // sock is -1 for a ring
+typedef void (*ook_task)( void *ctx);
+
+// NULL on error. Free with ook_loop_free(), which closes nothing it was given.
+struct ook_loop *ook_loop_new( void);
+void ook_loop_free( struct ook_loop *loop);
+
+// Inputs, a socket from ook_open(), a ring from ook_ring_attach(), or any other descriptor, whose
+// ready() is called when it can be read. 0 if ok, -1 if the loop is full (16 of them) or on error.
+int ook_loop_add_socket( struct ook_loop *loop, int sock, ook_burst_handler handler, void *ctx, int verbose);
+int ook_loop_add_ring( struct ook_loop *loop, struct ook_ring *ring, ook_burst_handler handler, void *ctx, int verbose);
+int ook_loop_add_fd( struct ook_loop *loop, int fd, void (*ready)( int fd, void *ctx), void *ctx);
+
+// Run task every periodNs, or once after delayNs. NULL on error. A timer may be cancelled until it
+// has fired, or at any time if it repeats, even from its own task.
+struct ook_timer *ook_loop_every( struct ook_loop *loop, uint64_t periodNs, ook_task task, void *ctx);
+struct ook_timer *ook_loop_after( struct ook_loop *loop, uint64_t delayNs, ook_task task, void *ctx);
+void ook_loop_cancel( struct ook_loop *loop, struct ook_timer *timer);
+
+// Call handler from the loop when signum arrives, instead of whatever it would do. Call it before
+// starting any threads, the signal is blocked in this one. 0 if ok.
+int ook_loop_signal( struct ook_loop *loop, int signum, void (*handler)( int signum, void *ctx), void *ctx);
+
+// Run until ook_loop_stop(), 0, or an input fails, e.g. ookd closed its ring, -1.
+int ook_loop_run( struct ook_loop *loop);
+void ook_loop_stop( struct ook_loop *loop);
+
+/*
+** Archives of bursts, which ookd --archive appends to and ookarchive makes from ooklog's tar files.
+**
+** The archive is a header, u32 'OOKA' and u32 version, then segments, each a sync marker of
+** u32 0xffffffff, u32 'OOKS' and the u64 realtime it was started, followed by bursts, each its
+** u32 length and what ook_encode() makes of it. Everything is little endian, as the datagrams are.
+** The library writes host order, so an archive made on a big endian host can only be read there.
+** A torn write only loses the segment it is in, readers find the next sync marker and carry on.
+**
+** Beside it, with .idx added to the name, is an index of u32 'OOKI', u32 version, then for each
+** burst the u64 time it was captured, u64 offset of its record, u32 pulses and u32 length, so
+** bursts can be picked out by time or size without reading the rest. Bursts missing from it,
+** after a crash, are found by scanning the end of the archive.
+*/
+struct ook_archive_entry {
+    uint64_t timeNs;               // realtime of capture, or the position if ookd didn't know it
+    uint64_t offset;               // of the burst's record in the archive
+    uint32_t pulses;
+    uint32_t length;               // of the encoded burst, after the record's length
+};
+
+// Open an archive to append bursts to, making it if need be. NULL on error.
+struct ook_archive *ook_archive_create( const char *path);
+
+// Add a burst to the end of an archive from ook_archive_create(). 0 if ok.
+int ook_archive_append( struct ook_archive *archive, struct ook_burst *burst);
+
+// Open an archive to read. NULL on error.
+struct ook_archive *ook_archive_open( const char *path);
+
+// The bursts of an archive from ook_archive_open(), in order of time, and how many there are.
+size_t ook_archive_entries( const struct ook_archive *archive, const struct ook_archive_entry **entries);
+
+// Index of the first entry captured at or after timeNs, ook_archive_entries() if none were.
+size_t ook_archive_find( const struct ook_archive *archive, uint64_t timeNs);
+
+// Read the burst of an entry, like ook_decode(), -1 for a read error, 0 corrupt, 1 if ok
+// and *burstReturn must be free()d.
+int ook_archive_read( struct ook_archive *archive, size_t entry, struct ook_burst **burstReturn);
+
+void ook_archive_close( struct ook_archive *archive);
+
 // This is for decoding pulse width encoding. The bits are determined by the length of the high part
 // of the pulse, the lows are important for timing, but not data bits.
 // -1 illegal pulse in there, otherwise number bits!! read that again, bits, in data. datLen is in bytes.
@@ -58,9 +331,7 @@ int ook_decode_pulse_width( struct ook_burst *burst,
 //
 // The returned data is one bit per byte.
 //
-// It is possible to analyze an 
-// arbitrary pulse stream to determine these bounds, but that is not part of this function. That logic 
-// is present in the golang analysis tools.
+// ook_quantify() can find these bounds in the burst itself.
 int ook_decode_manchester( struct ook_burst *burst, 
 			    uint32_t minShortHi, uint32_t maxShortHi, 
 			    uint32_t minLongHi, uint32_t maxLongHi, 
@@ -69,4 +340,95 @@ int ook_decode_manchester( struct ook_burst *burst,
 			    unsigned char **dataReturn, size_t *dataLenReturn,
 			    int verbose);
 
+// ook_decode_manchester(), and the pulse each bit came from in *pulseReturn, which must be free()d too,
+// so the decoder can tell how sure it is of each bit with ook_pulse_confidence().
+int ook_decode_manchester_pulses( struct ook_burst *burst,
+				  uint32_t minShortHi, uint32_t maxShortHi,
+				  uint32_t minLongHi, uint32_t maxLongHi,
+				  uint32_t minShortLow, uint32_t maxShortLow,
+				  uint32_t minLongLow, uint32_t maxLongLow,
+				  unsigned char **dataReturn, size_t *dataLenReturn, uint32_t **pulseReturn,
+				  int verbose);
+
+// A cluster of similar pulse widths, as ook_quantify() finds them
+struct ook_cluster {
+    uint32_t min;                  // narrowest and widest members, nanoseconds
+    uint32_t max;
+    uint32_t mean;
+    uint32_t count;
+    uint32_t windowMin;            // halfway to the neighbouring clusters, 0 and UINT32_MAX at the ends,
+    uint32_t windowMax;            // .. to hand to ook_decode_manchester() and the like
+};
+
+#define OOK_MAX_CLUSTERS 8         // a burst with more widths than this is noise
+
+struct ook_quantification {
+    uint32_t highs;                // clusters of the high widths, narrowest first
+    uint32_t lows;
+    struct ook_cluster high[OOK_MAX_CLUSTERS];
+    struct ook_cluster low[OOK_MAX_CLUSTERS];
+};
+
+// Cluster the high and the low widths of a burst, so decoders can calibrate their timing to the
+// transmitter instead of hard coding it. Widths are radix sorted and a new cluster starts wherever one is
+// more than tolerance, e.g. 0.2, wider than the one before. A first high pulse in a cluster of its own,
+// as many transmitters stretch it, is folded into the next cluster up. These are the clusters the Go
+// GuessAndGrow() finds, but in one pass over the sorted widths instead of a pass for each cluster.
+//
+// If highSymbols or lowSymbols are not NULL they get the cluster of each pulse, burst->pulses of them.
+// The sort works in scratch, OOK_QUANTIFY_SCRATCH(burst->pulses) of it. Without it, bursts of up to
+// OOK_QUANTIFY_ON_STACK pulses are sorted on the stack and longer ones malloc() for the call, so a
+// decoder which can't allocate per burst should keep scratch for the longest it takes.
+// -1 for an empty burst, more than OOK_MAX_CLUSTERS of either, or no memory, 0 if ok.
+#define OOK_QUANTIFY_SCRATCH(pulses) (3*(size_t)(pulses))
+#define OOK_QUANTIFY_ON_STACK 256
+int ook_quantify( const struct ook_burst *burst, double tolerance, struct ook_quantification *q,
+		  uint8_t *highSymbols, uint8_t *lowSymbols, uint32_t *scratch);
+
+// Many transmitters repeat a frame, in one burst or a few in quick succession. A copy too damaged
+// to pass its checksum alone can still be recovered by voting, bit by bit, across all of them.
+// Each copy's bits count with a weight for how sure the decoder was of them, 1 each makes it a plain
+// majority. The copies must be aligned, it is up to the decoder to find where each frame starts.
+#define OOK_VOTE_MAX_BITS 256
+
+struct ook_vote {
+    uint32_t bits;                     // in each copy, 0 until one is added
+    uint32_t copies;
+    uint64_t lastNs;                   // burst position of the latest copy
+    int32_t tally[OOK_VOTE_MAX_BITS];  // the weight for a 1 less the weight for a 0
+    uint8_t first[OOK_VOTE_MAX_BITS/8];    // ties go to the first copy
+    uint8_t differ[OOK_VOTE_MAX_BITS/8];   // set for bits where some copy differs from the first
+};
+
+// Forget all copies
+void ook_vote_reset( struct ook_vote *vote);
+
+// Add a copy of bits bits, packed most significant first, from a burst at positionNs. weight[i] is how
+// sure the decoder is of bit i, or NULL for 1 each. If the last copy was more than windowNs before this
+// one the vote starts over with this. -1 and it isn't counted if it is too long, or a different length
+// from the others, 0 if ok.
+int ook_vote_add( struct ook_vote *vote, const uint8_t *data, uint32_t bits, const uint8_t *weight,
+		  uint64_t positionNs, uint64_t windowNs);
+
+// Fill data with the winning bits, returns how many copies voted, 0 if none. *contested, if not NULL,
+// gets how many bits the copies didn't all agree on.
+uint32_t ook_vote_result( const struct ook_vote *vote, uint8_t *data, uint32_t *contested);
+
+// A frame which fails its check by a bit or two can often be saved by flipping the bits the decoder was
+// least sure of, e.g. from ook_pulse_confidence(). Up to OOK_FLIP_CANDIDATES of the bits with a confidence
+// under OOK_FLIP_UNSURE are tried, least certain first, one at a time, then in pairs and so on up to
+// maxFlips at once. Every try is another chance to pass a weak check by accident, about 1 in 256 for an
+// 8 bit CRC or sum, so budget, the most tries, should be small. For an 8 bit check, single flips are
+// as far as it is worth going.
+#define OOK_FLIP_CANDIDATES 8
+#define OOK_FLIP_UNSURE 96         // 12dB
+
+// data is bits bits packed most significant first, confidence has one for each. Returns how many bits
+// were flipped to make check() return non-zero, with data left that way, or -1 with data as it was.
+int ook_flip_search( uint8_t *data, uint32_t bits, const uint8_t *confidence, uint32_t maxFlips, uint32_t budget,
+		     int (*check)( const uint8_t *data, uint32_t bits, void *ctx), void *ctx);
+
+// Nanoseconds on a clock, e.g. CLOCK_MONOTONIC or CLOCK_REALTIME
+uint64_t ook_now( clockid_t clock);
+
 #endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ook.h"
+#include "corpus.h"
+
+/*
+** Make burst archives, see ook_archive_create(), from the tar files ooklog
+** writes, and list what is in them. An archive is less than half the size of
+** the tar file, which spends a 512 byte header and padding on each burst, and
+** its index finds bursts by time without reading the rest.
+*/
+
+int verbose=0;
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ookarchive [-h] [-?] [-v] [-l] [-f seconds] [-t seconds] [-m pulses] archive [corpus.tar ...]\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -l | --list                           list the bursts in the archive\n"
+	    "  -f secs | --from secs                 only list bursts captured at or after this time\n"
+	    "  -t secs | --to secs                   only list bursts captured before this time\n"
+	    "  -m n | --min-pulses n                 only list bursts with at least this many pulses\n"
+	    "  Tar files named after the archive are added to the end of it.\n"
+	    );
+}
+
+static off_t fileSize( const char *name)
+{
+    struct stat st;
+    return stat( name, &st) == 0 ? st.st_size : 0;
+}
+
+static int convert( struct ook_archive *archive, const char *tarName)
+{
+    struct corpus c;
+    if ( corpusLoad( tarName, &c) < 0) return -1;
+
+    for ( size_t i = 0; i < c.count; i++) {
+	// Bursts ooklog wrote have no capture time of their own, and their position only counts from
+	// when their ookd started, so they are indexed by when ooklog wrote them down
+	struct ook_burst *burst = c.entry[i].burst;
+	if ( !burst->times.captureRealtimeNs) burst->times.captureRealtimeNs = c.entry[i].timeNs;
+	if ( ook_archive_append( archive, burst) < 0) {
+	    fprintf(stderr, "Failed to archive burst %s of '%s'\n", c.entry[i].name, tarName);
+	    corpusFree( &c);
+	    return -1;
+	}
+    }
+
+    if ( verbose) fprintf(stderr, "Added %zu bursts from '%s'\n", c.count, tarName);
+    corpusFree( &c);
+    return 0;
+}
+
+static int list( const char *archiveName, uint64_t from, uint64_t to, uint32_t minPulses)
+{
+    struct ook_archive *archive = ook_archive_open( archiveName);
+    if ( !archive) return -1;
+
+    const struct ook_archive_entry *entry;
+    size_t entries = ook_archive_entries( archive, &entry);
+
+    printf("time                  pulses  length  offset\n");
+    for ( size_t i = ook_archive_find( archive, from); i < entries && entry[i].timeNs < to; i++) {
+	if ( entry[i].pulses < minPulses) continue;
+	printf("%10llu.%09llu %7u %7u %7llu\n",
+	       (unsigned long long)(entry[i].timeNs / 1000000000ULL), (unsigned long long)(entry[i].timeNs % 1000000000ULL),
+	       entry[i].pulses, entry[i].length, (unsigned long long)entry[i].offset);
+    }
+
+    ook_archive_close( archive);
+    return 0;
+}
+
+int main( int argc, char **argv)
+{
+    int listing = 0;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    uint32_t minPulses = 0;
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "list", no_argument, 0, 'l' },
+	    { "from", required_argument, 0, 'f' },
+	    { "to", required_argument, 0, 't' },
+	    { "min-pulses", required_argument, 0, 'm' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?lf:t:m:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 'l':
+	    listing = 1;
+	    break;
+	  case 'f':
+	    from = strtod( optarg, 0) * 1e9;
+	    break;
+	  case 't':
+	    to = strtod( optarg, 0) * 1e9;
+	    break;
+	  case 'm':
+	    minPulses = atoi(optarg);
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    if ( optind >= argc) {
+	showHelp(stderr);
+	exit(1);
+    }
+    const char *archiveName = argv[optind++];
+
+    if ( optind < argc) {
+	off_t tarBytes = 0;
+	off_t before = fileSize( archiveName);
+	char index[strlen(archiveName) + 5];
+	sprintf( index, "%s.idx", archiveName);
+	off_t indexBefore = fileSize( index);
+
+	struct ook_archive *archive = ook_archive_create( archiveName);
+	if ( !archive) exit(1);
+	for ( ; optind < argc; optind++) {
+	    if ( convert( archive, argv[optind]) < 0) {
+		ook_archive_close( archive);
+		exit(1);
+	    }
+	    tarBytes += fileSize( argv[optind]);
+	}
+	ook_archive_close( archive);
+
+	off_t added = fileSize( archiveName) - before + fileSize( index) - indexBefore;
+	fprintf(stderr, "%lld bytes of tar made %lld bytes of archive and index, %.0f%%\n",
+		(long long)tarBytes, (long long)added, tarBytes ? 100.0*added/tarBytes : 0.0);
+    }
+
+    if ( listing && list( archiveName, from, to, minPulses) < 0) exit(1);
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ook.h"
+#include "detector.h"
+#include "dsp.h"
+#include "synth.h"
+
+/*
+** Benchmark ookd's signal path, the detector and encoding of bursts, against
+** a synthesized capture where we know what was sent.
+*/
+
+int verbose=0;
+
+static int minPacket = 16;
+static int fixedPoint = 0;
+
+struct detected {
+    uint64_t startSample;
+    uint32_t pulses;
+};
+
+struct results {
+    struct detected *bursts;
+    size_t count, allocated;
+    size_t encodedBytes;
+    uint32_t sampleRate;
+};
+
+// The same work ookd does for a finished burst, less the sendto()
+static void encodeBurst( struct ook_burst *burst, uint64_t endSample, void *ctx)
+{
+    struct results *r = (struct results *)ctx;
+
+    if ( burst->pulses <= minPacket) return;
+
+    void *data = 0;
+    size_t len;
+    if ( ook_encode( burst, &data, &len) != 0 || data == 0) {
+	fprintf(stderr, "Failed to encode a pulse burst.\n");
+	return;
+    }
+    r->encodedBytes += len;
+    free(data);
+
+    if ( r->count == r->allocated) {
+	r->allocated = r->allocated ? 2*r->allocated : 256;
+	r->bursts = realloc( r->bursts, r->allocated*sizeof(r->bursts[0]));
+	if ( !r->bursts) {
+	    fprintf(stderr,"Failed to allocate results\n");
+	    exit(1);
+	}
+    }
+    r->bursts[r->count].startSample = burst->positionNanoseconds / (1000000000/r->sampleRate);
+    r->bursts[r->count].pulses = burst->pulses;
+    r->count++;
+}
+
+static double elapsed( const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec)/1e9;
+}
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ookbench [-h] [-?] [-v] [-d seconds] [-n snr] [-f offset] [-c rate] [-g gap] [-P protocols] [-S seed] [-R runs] [-k kernels] [-x]\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -d secs | --duration secs             length of the synthesized capture, default 30\n"
+	    "  -n db | --snr db                      signal to noise ratio, default 20\n"
+	    "  -f hz | --offset hz                   maximum carrier frequency offset, default 20000\n"
+	    "  -c rate | --collisions rate           fraction of transmissions which collide, default 0\n"
+	    "  -g secs | --gap secs                  mean quiet time between transmissions, default 0.25\n"
+	    "  -P list | --protocols list            comma separated, wh1080,oregonsci,acurite,nexa, default all\n"
+	    "  -S n | --seed n                       random seed, default 1\n"
+	    "  -R n | --runs n                       timed passes over the capture, default 5\n"
+	    "  -m nnnn | --min-packet nnnn           minimum number of pulses for a packet, default 16\n"
+	    "  -k name | --kernels name              DSP kernels to use, scalar, sse2, avx2 or neon, default the best this CPU has\n"
+	    "  -x | --fixed-point                    use the integer only detector\n"
+	    );
+}
+
+int main( int argc, char **argv)
+{
+    struct synthConfig config;
+    int runs = 5;
+
+    synthDefaults( &config);
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "duration", required_argument, 0, 'd' },
+	    { "snr", required_argument, 0, 'n' },
+	    { "offset", required_argument, 0, 'f' },
+	    { "collisions", required_argument, 0, 'c' },
+	    { "gap", required_argument, 0, 'g' },
+	    { "protocols", required_argument, 0, 'P' },
+	    { "seed", required_argument, 0, 'S' },
+	    { "runs", required_argument, 0, 'R' },
+	    { "min-packet", required_argument, 0, 'm' },
+	    { "kernels", required_argument, 0, 'k' },
+	    { "fixed-point", no_argument, 0, 'x' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?xd:n:f:c:g:P:S:R:m:k:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 'd':
+	    config.seconds = atof(optarg);
+	    break;
+	  case 'n':
+	    config.snrDb = atof(optarg);
+	    break;
+	  case 'f':
+	    config.maxOffsetHz = atof(optarg);
+	    break;
+	  case 'c':
+	    config.collisionRate = atof(optarg);
+	    break;
+	  case 'g':
+	    config.meanGapSeconds = atof(optarg);
+	    break;
+	  case 'P':
+	    config.protocols = synthProtocolsByName(optarg);
+	    if ( config.protocols == 0) exit(1);
+	    break;
+	  case 'S':
+	    config.seed = strtoull( optarg, 0, 0);
+	    break;
+	  case 'R':
+	    runs = atoi(optarg);
+	    if ( runs < 1) runs = 1;
+	    break;
+	  case 'm':
+	    minPacket = atoi(optarg);
+	    break;
+	  case 'x':
+	    fixedPoint = 1;
+	    break;
+	  case 'k':
+	    if ( dspSelect( optarg) < 0) exit(1);
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    struct synthCapture capture;
+    if ( synthGenerate( &config, &capture) < 0) exit(1);
+
+    size_t collided = 0;
+    for ( size_t i = 0; i < capture.count; i++) collided += capture.bursts[i].collided;
+
+    printf("capture    %.1fs, %zu samples, %zu transmissions (%zu collided), snr %.1fdB\n",
+	   config.seconds, capture.len/2, capture.count, collided, config.snrDb);
+
+    // Time the detector and encoder, handed USB sized buffers like ookd gets
+    const uint32_t bufferLen = 16384;
+    struct results results = { .sampleRate = config.sampleRate };
+    double best = 0;
+
+    for ( int run = 0; run < runs; run++) {
+	struct detector d;
+	results.count = 0;
+	results.encodedBytes = 0;
+	detectorInit( &d, config.sampleRate, 0.2, encodeBurst, &results);
+	d.fixedPoint = fixedPoint;
+
+	struct timespec start, end;
+	clock_gettime( CLOCK_MONOTONIC, &start);
+	for ( size_t off = 0; off < capture.len; off += bufferLen) {
+	    uint32_t len = capture.len - off < bufferLen ? capture.len - off : bufferLen;
+	    findPulses( &d, capture.iq + off, len);
+	}
+	clock_gettime( CLOCK_MONOTONIC, &end);
+	detectorFree( &d);
+
+	double t = elapsed( &start, &end);
+	if ( verbose) fprintf(stderr,"run %d: %.3fs\n", run+1, t);
+	if ( run == 0 || t < best) best = t;
+    }
+
+    double rate = (capture.len/2)/best;
+    printf("throughput %.0f samples/sec, %.1fx real time at %usamples/sec (best of %d, %s kernels%s)\n",
+	   rate, rate/config.sampleRate, config.sampleRate, runs, dspKernelName(), fixedPoint ? ", fixed point" : "");
+
+    // Pair each injected transmission with a detected burst starting near it
+    const int64_t window = config.sampleRate/500;   // 2ms
+    size_t matched = 0, cleanMatched = 0;
+    size_t perProtocol[SYNTH_PROTOCOLS] = {0}, perProtocolMatched[SYNTH_PROTOCOLS] = {0};
+    double sumError = 0, sumAbsError = 0, maxAbsError = 0;
+    size_t d = 0;
+
+    for ( size_t i = 0; i < capture.count; i++) {
+	const struct synthBurst *b = &capture.bursts[i];
+	perProtocol[b->protocol]++;
+
+	while ( d < results.count && (int64_t)results.bursts[d].startSample < (int64_t)b->startSample - window) d++;
+	if ( d < results.count && (int64_t)results.bursts[d].startSample <= (int64_t)b->startSample + window) {
+	    double errorUs = ((int64_t)results.bursts[d].startSample - (int64_t)b->startSample) * 1e6 / config.sampleRate;
+	    double absError = errorUs < 0 ? -errorUs : errorUs;
+	    sumError += errorUs;
+	    sumAbsError += absError;
+	    if ( absError > maxAbsError) maxAbsError = absError;
+	    matched++;
+	    if ( !b->collided) cleanMatched++;
+	    perProtocolMatched[b->protocol]++;
+	    d++;
+	}
+    }
+
+    printf("bursts     %zu injected, %zu detected, %zu matched, %zu of %zu uncollided matched\n",
+	   capture.count, results.count, matched, cleanMatched, capture.count - collided);
+    for ( int p = 0; p < SYNTH_PROTOCOLS; p++) {
+	if ( perProtocol[p]) printf("  %-10s %zu of %zu\n", synthProtocolName(p), perProtocolMatched[p], perProtocol[p]);
+    }
+    if ( matched) {
+	printf("timing     start error mean %+.1fus, mean absolute %.1fus, max %.1fus\n",
+	       sumError/matched, sumAbsError/matched, maxAbsError);
+    }
+    printf("encoded    %zu bytes\n", results.encodedBytes);
+
+    free( results.bursts);
+    synthFree( &capture);
+    return 0;
+}
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "ook.h"
+#include "protocols.h"
+#include "checksum.h"
+#include "corpus.h"
+
+/*
+** Benchmark the client side decoders against corpora of recorded bursts, the
+** tar files ooklog writes. Each decoding stage is run over every burst and
+** timed, and its output can be compared against a golden file so a faster
+** decoder can be shown to decode the same things.
+**
+** ook.c and protocols.c are linked in compiled with malloc() and friends
+** pointing at the counters below, so we can report allocations per burst.
+**
+** The table driven checks in checksum.c can be compared with the bit by bit
+** ways of doing them on random data, since a corpus only exercises the few
+** polynomials and lengths its decoders use.
+*/
+
+int verbose=0;
+
+static size_t allocations = 0;
+
+void *counted_malloc( size_t size)
+{
+    allocations++;
+    return malloc(size);
+}
+
+void *counted_calloc( size_t n, size_t size)
+{
+    allocations++;
+    return calloc(n, size);
+}
+
+void *counted_realloc( void *p, size_t size)
+{
+    allocations++;
+    return realloc(p, size);
+}
+
+// A decoding stage. Decodes one burst, and if out is set, writes what it found to it.
+struct stage {
+    const char *name;
+    void (*run)( const struct corpusEntry *e, FILE *out);
+};
+
+static void printHex( FILE *out, const unsigned char *data, size_t len)
+{
+    for ( size_t i = 0; i < len; i++) fprintf(out, "%02x", data[i]);
+}
+
+static void runDecode( const struct corpusEntry *e, FILE *out)
+{
+    struct ook_burst *burst = 0;
+    int r = ook_decode( e->data, e->len, &burst);
+    if ( out) fprintf(out, " %d %u %llu", r, burst ? burst->pulses : 0,
+		      burst ? (unsigned long long)burst->positionNanoseconds : 0ULL);
+    if ( burst) free(burst);
+}
+
+static void pulseWidth( const struct corpusEntry *e, FILE *out,
+			uint32_t minZeroHi, uint32_t maxZeroHi, uint32_t minOneHi, uint32_t maxOneHi, uint32_t minLow, uint32_t maxLow)
+{
+    unsigned char *data = 0;
+    size_t dataLen = 0;
+    int bits = ook_decode_pulse_width( e->burst, minZeroHi, maxZeroHi, minOneHi, maxOneHi, minLow, maxLow,
+				       &data, &dataLen, verbose);
+    if ( out) {
+	fprintf(out, " %d", bits);
+	if ( bits > 0) {
+	    fputc( ' ', out);
+	    printHex( out, data, dataLen);
+	}
+    }
+    if ( data) free(data);
+}
+
+static void runPulseWidthWh1080( const struct corpusEntry *e, FILE *out)
+{
+    pulseWidth( e, out, 1400000,1600000, 400000,600000, 900000,UINT_MAX);
+}
+
+static void runPulseWidthWs2300( const struct corpusEntry *e, FILE *out)
+{
+    pulseWidth( e, out, 1300000,1500000, 250000,400000, 900000,UINT_MAX);
+}
+
+static void runManchesterOregon( const struct corpusEntry *e, FILE *out)
+{
+    unsigned char *data = 0;
+    size_t dataLen = 0;
+    int bits = ook_decode_manchester( e->burst,
+				      200000, 715000, 715000, 1200000,
+				      200000, 650000, 650000, 1200000,
+				      &data, &dataLen, verbose);
+    if ( out) {
+	fprintf(out, " %d", bits);
+	if ( bits > 0) fputc( ' ', out);
+	for ( int i = 0; i < bits; i++) fputc( data[i] ? '1' : '0', out);
+    }
+    if ( data) free(data);
+}
+
+static void runQuantify( const struct corpusEntry *e, FILE *out)
+{
+    struct ook_quantification q;
+    int r = ook_quantify( e->burst, 0.2, &q, 0, 0, 0);
+    if ( out) {
+	fprintf(out, " %d", r);
+	if ( r < 0) return;
+	for ( uint32_t i = 0; i < q.highs; i++) fprintf(out, " h%u-%u/%u", q.high[i].min, q.high[i].max, q.high[i].count);
+	for ( uint32_t i = 0; i < q.lows; i++) fprintf(out, " l%u-%u/%u", q.low[i].min, q.low[i].max, q.low[i].count);
+    }
+}
+
+// Manchester with its windows from the burst's own clusters: short and long highs, then short,
+// long if there are any, and the last low alone at the end
+static void runManchesterQuantified( const struct corpusEntry *e, FILE *out)
+{
+    struct ook_quantification q;
+    int bits = -1;
+    unsigned char *data = 0;
+    size_t dataLen = 0;
+
+    if ( ook_quantify( e->burst, 0.2, &q, 0, 0, 0) == 0 && q.highs == 2 && q.low[q.lows-1].count == 1 &&
+	 (q.lows == 2 || q.lows == 3)) {
+	const struct ook_cluster *h = q.high, *l = q.low;
+	bits = ook_decode_manchester( e->burst,
+				      h[0].windowMin, h[0].windowMax, h[1].windowMin, h[1].windowMax,
+				      l[0].windowMin, l[0].windowMax,
+				      q.lows == 3 ? l[1].windowMin : 1, q.lows == 3 ? l[1].windowMax : 0,
+				      &data, &dataLen, verbose);
+    }
+    if ( out) {
+	fprintf(out, " %d", bits);
+	if ( bits > 0) fputc( ' ', out);
+	for ( int i = 0; i < bits; i++) fputc( data[i] ? '1' : '0', out);
+    }
+    if ( data) free(data);
+}
+
+static void runWh1080( const struct corpusEntry *e, FILE *out)
+{
+    uint8_t frame[11];
+    int good = wh1080_decode( e->burst, frame, verbose);
+    if ( out) {
+	fprintf(out, " %d", good);
+	if ( good) {
+	    fputc( ' ', out);
+	    printHex( out, frame, sizeof(frame));
+	}
+    }
+}
+
+static void runWs2300( const struct corpusEntry *e, FILE *out)
+{
+    uint8_t frame[7];
+    int good = ws2300_decode( e->burst, frame, verbose);
+    if ( out) {
+	fprintf(out, " %d", good);
+	if ( good) {
+	    fputc( ' ', out);
+	    printHex( out, frame, sizeof(frame));
+	}
+    }
+}
+
+static void runOregonsci( const struct corpusEntry *e, FILE *out)
+{
+    unsigned char *nibble = 0;
+    int nibbles = oregonsci_decode( e->burst, &nibble, verbose);
+    if ( out) {
+	fprintf(out, " %d", nibbles);
+	if ( nibbles > 0) fputc( ' ', out);
+	for ( int i = 0; i < nibbles; i++) fprintf(out, "%x", nibble[i]);
+    }
+    if ( nibble) free(nibble);
+}
+
+static void runAcurite( const struct corpusEntry *e, FILE *out)
+{
+    uint8_t data[8];
+    uint32_t position = 0;
+    int bits;
+    int frames = 0;
+
+    while ( (bits = acurite_next_frame( e->burst, &position, data, verbose)) > 0) {
+	if ( out) {
+	    fprintf(out, " %d:", bits);
+	    printHex( out, data, bits/8);
+	}
+	frames++;
+    }
+    if ( out && frames == 0) fprintf(out, " 0");
+}
+
+static void runNexa( const struct corpusEntry *e, FILE *out)
+{
+    struct nexa_p packet;
+    int good = nexa_decode( e->burst, &packet, verbose);
+    if ( out) {
+	fprintf(out, " %d", good);
+	if ( good) fprintf(out, " %07x %d %d %d %d", packet.transmitter_code, packet.group_code,
+			   packet.on_off, packet.channel_bits, packet.unit_bits);
+    }
+}
+
+static const struct stage stages[] = {
+    { "decode", runDecode },
+    { "pulse_width/wh1080", runPulseWidthWh1080 },
+    { "pulse_width/ws2300", runPulseWidthWs2300 },
+    { "manchester/oregonsci", runManchesterOregon },
+    { "quantify", runQuantify },
+    { "manchester/quantified", runManchesterQuantified },
+    { "wh1080", runWh1080 },
+    { "ws2300", runWs2300 },
+    { "oregonsci", runOregonsci },
+    { "acurite", runAcurite },
+    { "nexa", runNexa },
+};
+#define STAGES (sizeof(stages)/sizeof(stages[0]))
+
+//
+// Checks done the slow way, to compare checksum.c with
+//
+
+static uint8_t crc8Bitwise( uint8_t polynomial, uint8_t crc, const uint8_t *data, size_t len)
+{
+    for ( size_t i = 0; i < len; i++) {
+	crc ^= data[i];
+	for ( int b = 0; b < 8; b++) crc = crc & 0x80 ? (crc << 1) ^ polynomial : crc << 1;
+    }
+    return crc;
+}
+
+static uint16_t crc16Bitwise( uint16_t polynomial, uint16_t crc, const uint8_t *data, size_t len)
+{
+    for ( size_t i = 0; i < len; i++) {
+	crc ^= data[i] << 8;
+	for ( int b = 0; b < 8; b++) crc = crc & 0x8000 ? (crc << 1) ^ polynomial : crc << 1;
+    }
+    return crc;
+}
+
+static uint32_t sumBytewise( uint32_t sum, const uint8_t *data, size_t len, int nibbles)
+{
+    for ( size_t i = 0; i < len; i++) sum += nibbles ? (data[i] >> 4) + (data[i] & 0xf) : data[i];
+    return sum;
+}
+
+// Compare the table driven checks with the bit by bit ones on buffers of random data, lengths,
+// polynomials and starting values, each done in two pieces. 0 if they all agree.
+static int checkChecksums( unsigned buffers)
+{
+    uint8_t data[256];
+    unsigned mismatches = 0;
+    srandom( 3636);
+
+    for ( unsigned n = 0; n < buffers; n++) {
+	size_t len = random() % (sizeof(data) + 1);
+	size_t split = random() % (len + 1);
+	for ( size_t i = 0; i < len; i++) data[i] = random();
+
+	// Fine Offset's and CCITT's, then any
+	uint8_t poly8 = n % 2 ? random() : 0x31;
+	uint16_t poly16 = n % 2 ? random() : 0x1021;
+	struct crc8 c8;
+	struct crc16 c16;
+	crc8Init( &c8, poly8);
+	crc16Init( &c16, poly16);
+
+	uint8_t start8 = random();
+	uint16_t start16 = random();
+	uint32_t startSum = random();
+
+	uint8_t want8 = crc8Bitwise( poly8, start8, data, len);
+	uint16_t want16 = crc16Bitwise( poly16, start16, data, len);
+	uint32_t wantBytes = sumBytewise( startSum, data, len, 0);
+	uint32_t wantNibbles = sumBytewise( startSum, data, len, 1);
+
+	uint8_t got8 = crc8Update( &c8, crc8Update( &c8, start8, data, split), data+split, len-split);
+	uint16_t got16 = crc16Update( &c16, crc16Update( &c16, start16, data, split), data+split, len-split);
+	uint32_t gotBytes = checksumBytes( checksumBytes( startSum, data, split), data+split, len-split);
+	uint32_t gotNibbles = checksumNibbles( checksumNibbles( startSum, data, split), data+split, len-split);
+
+	int bad = got8 != want8 || got16 != want16 || gotBytes != wantBytes || gotNibbles != wantNibbles;
+	if ( poly8 == 0x31 && len < 256) bad |= wh1080_crc8( data, len) != crc8Bitwise( 0x31, 0, data, len);
+	if ( bad && mismatches++ < 10) {
+	    fprintf(stderr, "Checks disagree on %zu bytes split at %zu, crc8 %02x/%02x crc16 %04x/%04x sums %x/%x %x/%x\n",
+		    len, split, got8, want8, got16, want16, gotBytes, wantBytes, gotNibbles, wantNibbles);
+	}
+    }
+
+    printf("checksums: %u random buffers, %s\n", buffers, mismatches ? "DO NOT AGREE" : "all agree");
+    return mismatches ? 1 : 0;
+}
+
+static double elapsed( const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec)/1e9;
+}
+
+// Write every stage's output for every burst, this is what golden files hold
+static void writeOutputs( const struct corpus *c, FILE *out)
+{
+    for ( size_t i = 0; i < c->count; i++) {
+	for ( size_t s = 0; s < STAGES; s++) {
+	    fprintf(out, "%s %s", c->entry[i].name, stages[s].name);
+	    stages[s].run( &c->entry[i], out);
+	    fprintf(out, "\n");
+	}
+    }
+}
+
+// Compare our outputs to a golden file, 0 if they match
+static int checkGolden( const struct corpus *c, const char *goldenName)
+{
+    FILE *golden = fopen( goldenName, "r");
+    if ( !golden) {
+	fprintf(stderr, "Failed to open golden file '%s': %s\n", goldenName, strerror(errno));
+	return -1;
+    }
+
+    char *ours = 0;
+    size_t oursLen = 0;
+    FILE *out = open_memstream( &ours, &oursLen);
+    if ( !out) {
+	fprintf(stderr, "Failed to open memory stream: %s\n", strerror(errno));
+	fclose(golden);
+	return -1;
+    }
+    writeOutputs( c, out);
+    fclose(out);
+
+    int mismatches = 0;
+    char line[65536];
+    const char *thumb = ours;
+    unsigned lineNumber = 0;
+
+    while ( fgets( line, sizeof(line), golden)) {
+	lineNumber++;
+	const char *eol = strchr( thumb, '\n');
+	size_t len = eol ? eol - thumb + 1 : strlen(thumb);
+
+	if ( len != strlen(line) || memcmp( line, thumb, len) != 0) {
+	    if ( mismatches++ < 10) {
+		fprintf(stderr, "%s:%u: expected %s", goldenName, lineNumber, line);
+		fprintf(stderr, "%s:%u:      got %.*s%s", goldenName, lineNumber, (int)len, thumb, eol ? "" : "\n");
+	    }
+	}
+	thumb += len;
+    }
+    if ( *thumb) {
+	fprintf(stderr, "%s: has fewer lines than we produced\n", goldenName);
+	mismatches++;
+    }
+
+    fclose(golden);
+    free(ours);
+
+    if ( mismatches) fprintf(stderr, "%s: %d mismatched lines\n", goldenName, mismatches);
+    return mismatches ? 1 : 0;
+}
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ookcorpus [-h] [-?] [-v] [-R runs] [-g golden | -G golden] [-C buffers] corpus.dat ...\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -R n | --runs n                       timed passes over each corpus, default 100\n"
+	    "  -g file | --golden file               compare decoded output against file, one per corpus\n"
+	    "  -G file | --write-golden file         write decoded output to file, one per corpus\n"
+	    "  -C n | --check-checksums n            compare the table driven checks with bit by bit ones on n random buffers\n"
+	    );
+}
+
+int main( int argc, char **argv)
+{
+    int runs = 100;
+    const char *golden[argc];
+    int goldens = 0;
+    int writeGolden = 0;
+    int checkBuffers = 0;
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "runs", required_argument, 0, 'R' },
+	    { "golden", required_argument, 0, 'g' },
+	    { "write-golden", required_argument, 0, 'G' },
+	    { "check-checksums", required_argument, 0, 'C' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?R:g:G:C:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 'R':
+	    runs = atoi(optarg);
+	    if ( runs < 1) runs = 1;
+	    break;
+	  case 'G':
+	    writeGolden = 1;
+	    // FALLTHROUGH
+	  case 'g':
+	    golden[goldens++] = optarg;
+	    break;
+	  case 'C':
+	    checkBuffers = atoi(optarg);
+	    if ( checkBuffers < 1) {
+		fprintf(stderr,"Bad number of buffers: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    int failed = 0;
+    if ( checkBuffers) failed = checkChecksums( checkBuffers);
+
+    int files = argc - optind;
+    if ( files < 1 && checkBuffers) return failed;
+    if ( files < 1) {
+	fprintf(stderr,"No corpus files given\n");
+	showHelp(stderr);
+	exit(1);
+    }
+    if ( goldens && goldens != files) {
+	fprintf(stderr,"Need one golden file per corpus, got %d for %d\n", goldens, files);
+	exit(1);
+    }
+
+    for ( int f = 0; f < files; f++) {
+	const char *fileName = argv[optind+f];
+	struct corpus c;
+
+	if ( corpusLoad( fileName, &c) < 0) exit(1);
+	printf("%s: %zu bursts\n", fileName, c.count);
+	if ( c.count == 0) {
+	    corpusFree(&c);
+	    continue;
+	}
+
+	for ( size_t s = 0; s < STAGES; s++) {
+	    size_t allocationsBefore = allocations;
+	    struct timespec start, end;
+
+	    clock_gettime( CLOCK_MONOTONIC, &start);
+	    for ( int run = 0; run < runs; run++) {
+		for ( size_t i = 0; i < c.count; i++) stages[s].run( &c.entry[i], 0);
+	    }
+	    clock_gettime( CLOCK_MONOTONIC, &end);
+
+	    double perBurst = (double)runs * c.count;
+	    printf("  %-22s %8.0f ns/burst %6.2f allocations/burst\n", stages[s].name,
+		   elapsed( &start, &end)*1e9/perBurst, (allocations - allocationsBefore)/perBurst);
+	}
+
+	if ( goldens && writeGolden) {
+	    FILE *out = fopen( golden[f], "w");
+	    if ( !out) {
+		fprintf(stderr, "Failed to open golden file '%s': %s\n", golden[f], strerror(errno));
+		exit(1);
+	    }
+	    writeOutputs( &c, out);
+	    fclose(out);
+	    printf("  wrote %s\n", golden[f]);
+	} else if ( goldens) {
+	    int e = checkGolden( &c, golden[f]);
+	    if ( e != 0) failed = 1;
+	    printf("  %s %s\n", golden[f], e == 0 ? "matches" : "DOES NOT MATCH");
+	}
+
+	corpusFree(&c);
+    }
+
+    return failed;
+}
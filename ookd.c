@@ -10,17 +10,28 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
+#include <time.h>
 
 #include "ook.h"
 #include "rtl.h"
+#include "replay.h"
+#include "detector.h"
+#include "parallel.h"
+#include "metrics.h"
+#include "ring.h"
+#include "dsp.h"
+#include "realtime.h"
+#include "sampleclock.h"
 
 int verbose=0;
 static uint32_t centerFrequency = 433910000;
 static uint32_t sampleRate = 250000;
 
-static uint64_t sampleCounter = 0;
+static struct detector detector;
+static struct sampleClock sampleClock;    // fitted to radio buffer arrivals, not replays as fast as they go
 
 static struct rtldev *rtlToStop = 0;   // used by signal handlers to stop cleanly.
+static struct replay *replayToStop = 0;
 
 static int multicastSocket = -1;
 static struct sockaddr *multicastSockaddr = 0;
@@ -28,7 +39,77 @@ static size_t multicastSockaddrLen = 0;
 
 static int minPacket = 16;
 
+// Bursts bigger than a datagram of the MTU are sent in segments, see --mtu
+#define IP_UDP_HEADERS 48                // IPv6 and UDP, IPv4's are smaller
+static unsigned mtu = 1500;
+static int oldFormat = 0;                // just the pulses, for clients built before the extensions
+
+// Datagrams to each port are numbered, so clients can count those they miss
+static struct ook_sender multicastSender;
+static struct ook_sender streamSender;
+
 static const char *inputFileName = 0;
+static double replaySpeed = 0;         // multiple of real time, 0 is as fast as possible
+static unsigned replayJobs = 1;        // threads for unthrottled replay
+
+static struct metrics *metrics = 0;     // only if asked for with --stats-shm or --metrics-port
+static const char *statsShmName = 0;
+static const char *metricsAddress = "127.0.0.1";
+static const char *metricsPort = 0;
+
+// Local decoders can read bursts from shared memory instead, see --ring
+static const char *ringName = 0;
+static struct ring *ring = 0;
+
+// Bursts can be kept in an archive too, see --archive
+static const char *archiveName = 0;
+static struct ook_archive *archive = 0;
+
+// Streaming bursts in fragments while they are still being received, see --stream-port
+static const char *streamPort = 0;
+static struct sockaddr *streamSockaddr = 0;
+static size_t streamSockaddrLen = 0;
+static unsigned streamPulses = 16;       // send a fragment once this many pulses are waiting
+static unsigned streamMs = 10;           // .. or this long after the last one
+static struct {
+    int active;                          // the burst in progress is being streamed
+    uint32_t burstId;
+    uint32_t sequence;
+    uint32_t sent;                       // pulses of it already sent
+    uint64_t lastSample;                 // when the last fragment was sent
+} stream;
+
+// When the buffer being processed arrived, so bursts found in it can be given capture times
+static uint64_t arrivalMonotonicNs = 0;  // 0 if we don't know, e.g. with --jobs or unpaced -r
+static uint64_t arrivalRealtimeNs = 0;
+static uint64_t arrivalEndNs = 0;        // position of the end of that buffer
+
+// Radio buffering, and watching for samples it loses
+#define AUTO_BUFFERS_START 16
+#define AUTO_BUFFERS_MAX 128
+#define AUTO_BUFFER_LENGTH_MAX (4*RTL_DEFAULT_BUFFER_LENGTH)
+
+static uint32_t rtlBuffers = 0;           // 0 for the rtl-sdr defaults
+static uint32_t rtlBufferLength = 0;
+static int autoBuffers = 0;               // grow the buffering when samples are dropped
+static int restartRadio = 0;              // set when iqHandler stops the radio to change buffering
+static int restarted = 0;                 // the next gap is our own doing
+static volatile sig_atomic_t stopping = 0;
+
+static uint64_t anchorNs = 0;             // arrival of the last buffer we had to wait for, 0 for none
+static uint64_t anchorSamples = 0;        // samples up to the end of it
+static uint64_t lastHandledNs = 0;        // when we finished with the previous buffer
+static uint64_t droppedSamples = 0;
+
+static int fixedPoint = 0;               // integer only detector
+
+// See realtime.h
+#define REALTIME_HEAP_BYTES (16*1024*1024)
+#define REALTIME_STACK_BYTES (256*1024)
+static int realtime = 0;                 // lock and pre-fault memory
+static const char *realtimeCpus = 0;     // run detection on these CPUs
+static int realtimePriority = 0;         // .. at this SCHED_FIFO priority
+static struct realtimeLatency lateness;
 
 static int showHistogram = 0;
 static int showModes = 0;
@@ -45,178 +126,151 @@ static void showHelp( FILE *f)
 	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
 	    "  -m nnnn | --min-packet nnnn           minimum number of pulses for a packet, default 10\n"
 	    "  -r filename | --read-file filename    read from input file instead of radio, for testing\n"
+	    "  -S speed | --replay-speed speed       pace -r input at a multiple of real time, default 0 (unthrottled)\n"
+	    "  -j n | --jobs n                       detect unthrottled -r input with n threads, default 1\n"
+	    "  -s name | --stats-shm name            publish metrics in shared memory with this name, e.g. /ookd\n"
+	    "  -P port | --metrics-port port         serve Prometheus metrics over HTTP on this port\n"
+	    "  -A addr | --metrics-address addr      address to serve metrics on, default 127.0.0.1\n"
+	    "  -b n | --buffers n                    radio buffers to queue, or auto to grow them when samples drop, default 15\n"
+	    "  -B bytes | --buffer-length bytes      radio buffer length, a multiple of 16384, default 262144\n"
+	    "  -t port | --stream-port port          also stream bursts in fragments as they arrive to this port\n"
+	    "  -n nnnn | --stream-pulses nnnn        pulses per streamed fragment, default 16\n"
+	    "  -T ms | --stream-ms ms                longest wait between streamed fragments, default 10\n"
+	    "  -R name | --ring name                 also publish bursts in a shared memory ring, e.g. /ookd-ring\n"
+	    "  -w file | --archive file              also append bursts to this archive, and file.idx\n"
+	    "  -u bytes | --mtu bytes                split bursts into datagrams which fit this MTU, default 1500\n"
+	    "  -o | --old-format                     send just the pulses, for clients built before the extensions\n"
+	    "  -x | --fixed-point                    integer only detector, for CPUs without floating point\n"
+	    "  -z | --realtime                       lock memory and fault it in first, so detection never waits on paging\n"
+	    "  -c cpus | --cpus cpus                 run detection only on these CPUs, e.g. 3 or 2-3\n"
+	    "  -F n | --fifo-priority n              run detection at this SCHED_FIFO priority, 1 to 99\n"
 	    "  -H | --histogram                      show diagnostic histogram\n"
 	    "  -M | --modes                          show diagnostic modes\n"
 	    );
 }
 
-static uint64_t samplesToNs( uint64_t s)
+// Give a burst, or a fragment of one ending at endSample, the times it came off the radio.
+// Returns the monotonic time of its end, 0 if we don't know.
+static uint64_t stampTimes( struct ook_burst *burst, uint64_t endSample)
 {
-    return s*(1000000000/sampleRate);  // that math could be better, but for 250000 is is exactly 4000, so ok.
+    if ( !arrivalMonotonicNs) return 0;
+
+    if ( sampleClockLocked( &sampleClock)) {
+	uint64_t startSample = detectorNsToSamples( &detector, burst->positionNanoseconds);
+	burst->times.captureMonotonicNs = sampleClockMonotonic( &sampleClock, startSample);
+	burst->times.captureRealtimeNs = sampleClockRealtime( &sampleClock, startSample);
+	burst->times.endRealtimeNs = sampleClockRealtime( &sampleClock, endSample);
+	burst->times.sentRealtimeNs = ook_now( CLOCK_REALTIME);
+	burst->times.uncertaintyNs = sampleClock.uncertaintyNs < 1 ? 1 : sampleClock.uncertaintyNs;
+	return sampleClockMonotonic( &sampleClock, endSample);
+    }
+
+    // The buffer arrived as its last sample came off the radio, work back from there
+    uint64_t sinceStart = arrivalEndNs - burst->positionNanoseconds;
+    uint64_t sinceEnd = arrivalEndNs - detectorSamplesToNs( &detector, endSample);
+
+    burst->times.captureMonotonicNs = arrivalMonotonicNs - sinceStart;
+    burst->times.captureRealtimeNs = arrivalRealtimeNs - sinceStart;
+    burst->times.endRealtimeNs = arrivalRealtimeNs - sinceEnd;
+    burst->times.sentRealtimeNs = ook_now( CLOCK_REALTIME);
+    return arrivalMonotonicNs - sinceEnd;
 }
 
-static void recordPulse( unsigned n, unsigned rise, unsigned drop, unsigned end,
-			 unsigned cw, unsigned ccw, unsigned crazy, unsigned terminal)
+// Multicast a burst or fragment and count what happened, returns <0 on failure
+static int transmit( struct ook_sender *sender, struct ook_burst *burst)
 {
-    static struct ook_burst *burst = 0;
-    unsigned hiLen = drop-rise;
-    unsigned lowLen = end-drop;
-    
-    // The frequency calculation could be a lot better. There is a lot of noise
-    // in there which leads to misinterpretations of cw and ccw. There is a significant
-    // variance in the pulse to pulse results of the same transmitter.
-    float cycles = ((int)cw-(int)ccw)/4.0;
-    if ( cycles > 0) cycles += crazy/2.0;  // figure we are going fast enough to sometimes skip
-    if ( cycles < 0) cycles -= crazy/2.0;  // .. might ought to check that.
-    float frequency = cycles/(hiLen/(float)sampleRate);
-
-    if ( !burst) {
-	burst = ook_allocate_burst(512*8);     // first pulse of new burst
-	if ( !burst) {
-	    fprintf(stderr,"Failed to allocate burst\n");
-	    exit(-1);
-	} else {
-	    burst->positionNanoseconds = samplesToNs( sampleCounter + rise);
-	}
+    int e = ook_send( sender, burst);
+    if ( e == -1) {
+	metricsCount( metrics, METRIC_ENCODE_FAILURES, 1);
+	return -1;
     }
+    metricsCount( metrics, METRIC_SEND_FAILURES, sender->failures);
+    metricsCount( metrics, METRIC_BYTES_SENT, sender->bytes);
+    metricsCount( metrics, METRIC_DATAGRAMS_SENT, sender->datagrams);
+    metricsObserve( metrics, METRIC_LATENCY_ENCODE, sender->encodeNs);
+    metricsObserve( metrics, METRIC_LATENCY_SEND, sender->sendNs);
 
-    if ( ook_add_pulse(burst, samplesToNs(hiLen), samplesToNs(lowLen), lrint(frequency))) {
-	fprintf(stderr,"Failed to add pulse to burst! Too long?\n");
-    }
+    if ( verbose) fprintf(stderr,"Multicast %u pulse%s, %zu bytes in %u datagram%s\n", burst->pulses,
+			  burst->fragment.flags ? " fragment" : "", sender->bytes, sender->datagrams,
+			  sender->datagrams == 1 ? "" : "s");
 
-    if ( terminal) {
-	if ( burst) {
-	    if ( burst->pulses > minPacket) {
-		void *data=0;
-		size_t len;
-		if ( ook_encode( burst, &data, &len) != 0 || data == 0) {
-		    fprintf(stderr, "Failed to encode a pulse burst.\n");
-		} else {
-		    int e = sendto( multicastSocket, data, len, 0, multicastSockaddr, multicastSockaddrLen);
-		    if ( e < 0) {
-			fprintf(stderr, "Failed to multicast pulse (%zu bytes): %s\n", len, strerror(errno));
-		    }
-		    if ( verbose) fprintf(stderr,"Multicast %u pulse, %zu bytes\n", burst->pulses, len);
-		    
-		    free(data);
-		}
-	    } else {
-		if ( verbose) fprintf(stderr,"Skipped run burst of %d pulses\n", burst->pulses);
-	    }
+    return e;
+}
 
-	    free(burst);
-	    burst = 0;
-	}
+// Stream the pulses of a burst not sent yet
+static void streamFragment( struct ook_burst *burst, uint64_t endSample, int last)
+{
+    uint32_t n = burst->pulses - stream.sent;
+    struct ook_burst *f = ook_allocate_burst( n);
+    if ( !f) {
+	fprintf(stderr, "Failed to allocate a burst fragment\n");
+	return;
     }
+
+    f->positionNanoseconds = burst->positionNanoseconds;
+    f->noiseFloor = burst->noiseFloor;
+    memcpy( f->pulse, &burst->pulse[stream.sent], n*sizeof(f->pulse[0]));
+    f->pulses = n;
+    f->fragment.flags = OOK_FRAGMENT | (last ? OOK_FRAGMENT_LAST : 0);
+    f->fragment.burstId = stream.burstId;
+    f->fragment.sequence = stream.sequence++;
+    f->fragment.firstPulse = stream.sent;
+    stampTimes( f, endSample);
+
+    if ( transmit( &streamSender, f) == 0) metricsCount( metrics, METRIC_FRAGMENTS_SENT, 1);
+    free(f);
+
+    stream.sent = burst->pulses;
+    stream.lastSample = endSample;
 }
 
-static void findPulses( const unsigned char *data, uint32_t len, const float alpha)
+static void startStream( void)
 {
-    enum motionType { NONE, CRAZY, CW, CCW };
-    static const unsigned char motion[16] = {   // indexed by 4*oldquadrant+newquadrant
-	NONE, CCW, CRAZY, CW,
-	CW, NONE, CCW, CRAZY,
-	CRAZY, CW, NONE, CCW,
-	CCW, CRAZY, CW, NONE 
-    };
-
-    const int showAll = 0;
-    static float lowPassPowerSquared = 0;
-
-    static double totalPowerSquared = 0;
-    static int powerSamples = 0;
-
-    /*
-    ** All of this static data is so we keep our state across
-    ** invocations, it comes from being called in callbacks
-    */
-    static enum { IDLE, HIGH, LOW} state = IDLE;
-    static int quadrant = 0;         // range 0-3
-
-    static unsigned crazyMotion = 0;  // these three are signal rotation during pulse high period
-    static unsigned cwMotion = 0;
-    static unsigned ccwMotion = 0;
-
-    const float riseThreshold = 0.250;
-    const float dropThreshold = 0.100;
-    const unsigned lowLengthLimit = 2000;
-
-    static int riseSample = 0;
-    static int dropSample = 0;
-    static unsigned pulseNumber = 0;
-
-    for ( int i = 0; i < len; i += 2) {
-	float I = (data[i]-128)/128.0;
-	float Q = (data[i+1]-128)/128.0;
-	float powerSquared = I*I+Q*Q;
+    stream.active = 1;
+    stream.burstId++;
+    stream.sequence = 0;
+    stream.sent = 0;
+}
 
-	totalPowerSquared += powerSquared;
-	powerSamples++;
+// Called by the detector as each pulse of a burst is finished, except the last
+static void streamProgress( struct ook_burst *burst, uint64_t endSample, void *ctx)
+{
+    if ( burst->pulses <= minPacket) return;      // it may yet turn out to be noise
+
+    if ( !stream.active) {
+	startStream();
+	streamFragment( burst, endSample, 0);
+    } else if ( burst->pulses - stream.sent >= streamPulses ||
+		detectorSamplesToNs( &detector, endSample - stream.lastSample) >= streamMs*1000000ULL) {
+	streamFragment( burst, endSample, 0);
+    }
+}
 
-	if ( verbose && powerSamples >= 100000) {
-	    fprintf(stderr,"average power is %5.2f\n", sqrt(totalPowerSquared/powerSamples));
-	    powerSamples = 0;
-	    totalPowerSquared = 0;
-	}
+// Send a finished burst to our listeners, if it is long enough to bother with
+static void sendBurst( struct ook_burst *burst, uint64_t endSample, void *ctx)
+{
+    metricsObserve( metrics, METRIC_BURST_PULSES, burst->pulses);
 
-	unsigned newQuadrant =0;
+    if ( burst->pulses > minPacket) {
+	uint64_t now = ook_now( CLOCK_MONOTONIC);
+	uint64_t ended = stampTimes( burst, endSample);
+	if ( ended) metricsObserve( metrics, METRIC_LATENCY_DETECT, now - ended);
 
-	if ( I >= 0) {
-	    if ( Q >= 0) newQuadrant = 0;
-	    else newQuadrant = 3;
-	} else {
-	    if ( Q >= 0) newQuadrant = 1;
-	    else newQuadrant = 2;
-	}
-	if ( state==HIGH) {
-	    if (showAll) fprintf(stderr,"%u->%u %5.2f %5.2f ", quadrant, newQuadrant, I, Q);
-	    switch( motion[4*quadrant + newQuadrant]) {
-	      case CRAZY:
-		if ( showAll) fprintf(stderr," crazy\n");
-		crazyMotion++;
-		break;
-	      case CW:
-		if ( showAll) fprintf(stderr," cw\n");
-		cwMotion++;
-		break;
-	      case CCW:
-		if ( showAll) fprintf(stderr," ccw\n");
-		ccwMotion++;
-		break;
-	      default:
-		if ( showAll) fprintf(stderr,"\n");
-		break;
-	    }
+	if ( ring && ringPublish( ring, burst) == 0) metricsCount( metrics, METRIC_RING_BURSTS, 1);
+	if ( archive) ook_archive_append( archive, burst);
+	if ( transmit( &multicastSender, burst) == 0) {
+	    metricsCount( metrics, METRIC_BURSTS_SENT, 1);
 	}
-	quadrant = newQuadrant;
-
-	lowPassPowerSquared = alpha*powerSquared + (1.0-alpha)*lowPassPowerSquared;
 
-	if ( state==HIGH && lowPassPowerSquared < dropThreshold) {
-	    dropSample = i/2;
-	    state = LOW;
-	} else if ( (state==IDLE || state==LOW) && lowPassPowerSquared > riseThreshold) {
-	    if ( state==LOW) {  // if IDLE, the pulse was already pushed
-		recordPulse( pulseNumber++, riseSample, dropSample, i/2, cwMotion, ccwMotion, crazyMotion, 0);
-	    }
-	    state = HIGH;
-	    riseSample = i/2;
-	    dropSample = 0;
-	    cwMotion = 0;
-	    ccwMotion = 0;
-	    crazyMotion = 0;
-	} else if ( state==LOW && i/2 - dropSample > lowLengthLimit ) {
-	    state = IDLE;
-	    recordPulse( pulseNumber, riseSample, dropSample, i/2, cwMotion, ccwMotion, crazyMotion, 1);
-	    pulseNumber = 0;
-	    // ok to leave counters and timers, they get set on transition to HIGH
+	if ( streamSockaddr) {
+	    if ( !stream.active) startStream();     // too short to have streamed, it all goes now
+	    streamFragment( burst, endSample, 1);
 	}
+    } else {
+	if ( verbose) fprintf(stderr,"Skipped run burst of %d pulses\n", burst->pulses);
+	metricsCount( metrics, METRIC_BURSTS_SKIPPED, 1);
     }
-
-    if ( state != IDLE) {         // shift them so they work on next invocation
-	riseSample -= len/2;
-	if ( state == LOW) dropSample -= len/2;
-    }
+    stream.active = 0;
 }
 
 static void debugHistogram( const unsigned char *data, uint32_t len, uint8_t bins, const float alpha)
@@ -313,115 +367,162 @@ static void debugModes( const unsigned char *data, uint32_t len)
 
 }
 
-static void iqHandler(const unsigned char *data, uint32_t len, void *ctx, struct rtldev *rtl)
+static void noteLateness( uint64_t lateNs)
 {
-    if ( showHistogram) debugHistogram( data, len, 16, 0.2);
-    if ( showModes) debugModes( data, len);
-
-    findPulses( data, len, 0.2);
-    sampleCounter += len/2;
+    realtimeObserve( &lateness, lateNs);
+    metricsObserve( metrics, METRIC_BUFFER_LATE_NS, lateNs);
 }
 
-static void exitNicely(int signum)
+// More buffers ride out longer stalls, longer ones cost latency, so grow the count first.
+static void growBuffers( void)
 {
-    if ( rtlToStop) {
-	rtlStop( rtlToStop);
-	rtlToStop = 0;
+    if ( rtlBuffers < AUTO_BUFFERS_MAX) {
+	rtlBuffers *= 2;
+    } else if ( rtlBufferLength < AUTO_BUFFER_LENGTH_MAX) {
+	rtlBufferLength *= 2;
     } else {
-	exit(0);      // we are stuck on something else
+	return;
     }
+    metricsSet( metrics, METRIC_RADIO_BUFFERS, rtlBuffers);
+    metricsSet( metrics, METRIC_RADIO_BUFFER_BYTES, rtlBufferLength);
+    restartRadio = 1;
 }
 
-static const char *humanName( struct sockaddr *addr, size_t len)
+// The radio delivers samples at sampleRate. If fewer have arrived than the time since the
+// anchor buffer says, they were lost in USB or the kernel. Only buffers we had to wait for
+// are judged, when we fall behind the queued ones arrive at once and look late, but nothing
+// is lost until the queue overflows. Comparing with a recent buffer instead of the start
+// keeps the radio's crystal error out of it.
+static void checkForDrops( uint32_t len, struct rtldev *rtl)
 {
-    static char buf[INET6_ADDRSTRLEN];
-    int e = getnameinfo( addr, len, buf, sizeof(buf),0,0,NI_NUMERICHOST);
-    if (e) return gai_strerror(e);
-    return buf;
-}
+    uint64_t samples = len/2;
+    uint64_t bufferNs = samples * 1000000000ULL / sampleRate;
+
+    if ( anchorNs && arrivalMonotonicNs - lastHandledNs < bufferNs/2) return;
+
+    if ( anchorNs) {
+	uint64_t expected = (uint64_t)((arrivalMonotonicNs - anchorNs) * 1e-9 * sampleRate);
+	uint64_t received = detector.sampleCounter + samples - anchorSamples;
+	uint64_t dueNs = anchorNs + received * 1000000000ULL / sampleRate;
+	noteLateness( arrivalMonotonicNs > dueNs ? arrivalMonotonicNs - dueNs : 0);
+	uint64_t slack = samples/4 + sampleRate/50;    // arrival jitter
+
+	if ( expected > received + slack) {
+	    uint64_t lost = expected - received;
+
+	    droppedSamples += lost;
+	    metricsCount( metrics, METRIC_SAMPLES_DROPPED, lost);
+	    detector.sampleCounter += lost;            // keep burst positions on the clock
+	    if ( verbose || !restarted) {
+		fprintf(stderr, "Dropped about %llu samples (%.3fs)%s\n", (unsigned long long)lost,
+			(double)lost/sampleRate, restarted ? " while restarting the radio" : "");
+	    }
 
-// contain OS specific nonsense here
-static int setMulticastIF( int sock, const struct sockaddr *addr, size_t len)
-{
-#if __APPLE__
-    switch ( addr->sa_family) {
-      case AF_INET:
-	return setsockopt( sock, IPPROTO_IP, IP_MULTICAST_IF, 
-			   (char *)&(((struct sockaddr_in *)addr)->sin_addr), sizeof(struct in_addr));
-      default:
-	errno = EINVAL;
-	return -1;
+	    if ( autoBuffers && !restarted) {
+		growBuffers();
+		if ( restartRadio) {
+		    fprintf(stderr, "Restarting the radio with %u buffers of %u bytes\n", rtlBuffers, rtlBufferLength);
+		    rtlStop( rtl);
+		}
+	    }
+	}
     }
-#elif __linux__
-    // Shouldn't this be a ip_mreqn or ip_mreq structure??
-    return setsockopt( sock, IPPROTO_IP, IP_MULTICAST_IF, (char *)addr, len);
-#else
-#error Unsupported OS in setMulticastIF
-#endif
+
+    restarted = 0;
+    anchorNs = arrivalMonotonicNs;
+    anchorSamples = detector.sampleCounter + samples;
 }
 
-// exit() on error
-static void setupNetworking( const char *address, const char *port, const char *interface)
+static unsigned clockResets = 0;          // already counted in the metrics
+
+static void iqHandler(const unsigned char *data, uint32_t len, void *ctx, struct rtldev *rtl)
 {
-    // Parse our multicast address
-    {
-	struct addrinfo *ai = 0;
-	struct addrinfo hints = { .ai_family = AF_UNSPEC,
-				  .ai_socktype = SOCK_DGRAM,
-	};
+    if ( showHistogram) debugHistogram( data, len, 16, 0.2);
+    if ( showModes) debugModes( data, len);
 
-	int err = getaddrinfo( address, port, &hints, &ai);
-	if (err){
-	    fprintf(stderr,"Illegal multicast address (addr=%s port=%s):%s\n", address, port, gai_strerror(err));
-	    exit(1);
+    // A file read as fast as we can has no times of its own, its bursts get none, as with --jobs
+    uint64_t arrivedNs = ook_now( CLOCK_MONOTONIC);
+    int paced = rtl || replaySpeed > 0;
+    arrivalMonotonicNs = paced ? arrivedNs : 0;
+    arrivalRealtimeNs = paced ? ook_now( CLOCK_REALTIME) : 0;
+    if ( rtl) checkForDrops( len, rtl);
+    if ( paced) {
+	if ( sampleClockArrival( &sampleClock, detector.sampleCounter + len/2, arrivalMonotonicNs, arrivalRealtimeNs)) {
+	    metricsSet( metrics, METRIC_CLOCK_ERROR_PPB, sampleClockErrorPpb( &sampleClock));
+	    metricsSet( metrics, METRIC_CLOCK_UNCERTAINTY_NS, sampleClock.uncertaintyNs);
+	    metricsSet( metrics, METRIC_CLOCK_POINTS, sampleClock.points);
+	    metricsCount( metrics, METRIC_CLOCK_RESETS, sampleClock.resets - clockResets);
+	    clockResets = sampleClock.resets;
 	}
-	// add a verbose print here
-	
-	multicastSockaddr = (struct sockaddr *)malloc( ai->ai_addrlen);
-	memcpy( multicastSockaddr, ai->ai_addr, ai->ai_addrlen);
-	multicastSockaddrLen = ai->ai_addrlen;
+    }
+    arrivalEndNs = detectorSamplesToNs( &detector, detector.sampleCounter + len/2);
 
-	freeaddrinfo(ai);
-    }    
+    findPulses( &detector, data, len);
 
-    // create our socket
-    int sock = socket( multicastSockaddr->sa_family, SOCK_DGRAM, 0);
-    if ( sock < 0) {
-	fprintf(stderr,"Failed to create socket: %s\n", strerror(errno));
-	exit(1);
+    lastHandledNs = ook_now( CLOCK_MONOTONIC);
+    if ( metrics) {
+	metricsCount( metrics, METRIC_BUFFERS, 1);
+	metricsCount( metrics, METRIC_SAMPLES, len/2);
+	metricsObserve( metrics, METRIC_BUFFER_NS, lastHandledNs - arrivedNs);
+    }
+}
+
+static void replayHandler(const unsigned char *data, uint32_t len, void *ctx)
+{
+    const struct replay *replay = ctx;
+    if ( replay->dueNs) {
+	uint64_t now = ook_now( CLOCK_MONOTONIC);
+	noteLateness( now > replay->dueNs ? now - replay->dueNs : 0);
     }
+    iqHandler( data, len, ctx, 0);
+}
 
-    // Set our multicast interface
-    {
+static void exitNicely(int signum)
+{
+    stopping = 1;
+    if ( rtlToStop) {
+	rtlStop( rtlToStop);
+	rtlToStop = 0;
+    } else if ( replayToStop) {
+	replayStop( replayToStop);
+	replayToStop = 0;
+    } else {
+	exit(0);      // we are stuck on something else
+    }
+}
+
+// exit() on error
+static void setupNetworking( const char *address, const char *port, const char *interface)
+{
+    socklen_t len;
+    multicastSocket = ook_open_sender( address, port, interface, &multicastSockaddr, &len);
+    if ( multicastSocket < 0) exit(1);
+    multicastSockaddrLen = len;
+    multicastSender = (struct ook_sender){ .sock = multicastSocket, .to = multicastSockaddr, .toLen = len,
+					   .maxDatagram = mtu - IP_UDP_HEADERS, .plain = oldFormat };
+    multicastSender.sequence.source = ook_sequence_source();
+
+    // and the same address on the stream port, if streaming
+    if ( streamPort) {
 	struct addrinfo *ai = 0;
-	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+	struct addrinfo hints = { .ai_family = multicastSockaddr->sa_family,
 				  .ai_socktype = SOCK_DGRAM,
 	};
 
-	int err = getaddrinfo( interface, "0", &hints, &ai);
+	int err = getaddrinfo( address, streamPort, &hints, &ai);
 	if (err){
-	    fprintf(stderr,"Illegal interface address (addr=%s):%s\n", address, gai_strerror(err));
+	    fprintf(stderr,"Illegal stream port (addr=%s port=%s):%s\n", address, streamPort, gai_strerror(err));
 	    exit(1);
 	}
-	// add a verbose print here
-
-	if ( setMulticastIF( sock, ai->ai_addr, ai->ai_addrlen) < 0) {
-	    fprintf(stderr, "Failed to set multicast interface to %s (%s): %s\n", 
-		    interface, humanName(ai->ai_addr, ai->ai_addrlen), strerror(errno));
-	    exit(1);
-	}
-
-	// enable loopback so clients can be on this host
-	uint8_t loop=1;
-	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	streamSockaddr = (struct sockaddr *)malloc( ai->ai_addrlen);
+	memcpy( streamSockaddr, ai->ai_addr, ai->ai_addrlen);
+	streamSockaddrLen = ai->ai_addrlen;
+	streamSender = multicastSender;
+	streamSender.to = streamSockaddr;
+	streamSender.toLen = streamSockaddrLen;
 
 	freeaddrinfo(ai);
     }
-
-    // Leave TTL defaulted to 1 for now, stay on subnet.
-
-
-    multicastSocket = sock;
 }
 
 int main( int argc, char **argv)
@@ -442,12 +543,30 @@ int main( int argc, char **argv)
 	    { "multicast-interface", required_argument, 0, 'i' },
 	    { "min-packet", required_argument, 0, 'm' },
 	    { "read-file", required_argument, 0, 'r' },
+	    { "replay-speed", required_argument, 0, 'S' },
+	    { "jobs", required_argument, 0, 'j' },
+	    { "stats-shm", required_argument, 0, 's' },
+	    { "metrics-port", required_argument, 0, 'P' },
+	    { "metrics-address", required_argument, 0, 'A' },
+	    { "buffers", required_argument, 0, 'b' },
+	    { "buffer-length", required_argument, 0, 'B' },
+	    { "stream-port", required_argument, 0, 't' },
+	    { "stream-pulses", required_argument, 0, 'n' },
+	    { "stream-ms", required_argument, 0, 'T' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "archive", required_argument, 0, 'w' },
+	    { "mtu", required_argument, 0, 'u' },
+	    { "old-format", no_argument, 0, 'o' },
+	    { "fixed-point", no_argument, 0, 'x' },
+	    { "realtime", no_argument, 0, 'z' },
+	    { "cpus", required_argument, 0, 'c' },
+	    { "fifo-priority", required_argument, 0, 'F' },
 	    { "histogram", no_argument, 0, 'H' },
 	    { "modes", no_argument, 0, 'M' },
 	    { 0,0,0,0}
 	};
 
-	int c = getopt_long( argc, argv, "vh?HMf:a:p:i:m:r:", options, &optionIndex );
+	int c = getopt_long( argc, argv, "vh?xzHMof:a:p:i:m:r:S:j:s:P:A:b:B:t:n:T:u:R:w:c:F:", options, &optionIndex );
 	if ( c == -1) break;
 
 	switch(c) {
@@ -458,6 +577,55 @@ int main( int argc, char **argv)
 	  case 'v':
 	    verbose = 1;
 	    break;
+	  case 'x':
+	    fixedPoint = 1;
+	    break;
+	  case 'z':
+	    realtime = 1;
+	    break;
+	  case 'c':
+	    realtimeCpus = optarg;
+	    break;
+	  case 'F':
+	    realtimePriority = atoi(optarg);
+	    if ( realtimePriority < 1 || realtimePriority > 99) {
+		fprintf(stderr,"Bad SCHED_FIFO priority, 1 to 99: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  case 't':
+	    streamPort = optarg;
+	    break;
+	  case 'n':
+	    if ( atoi(optarg) < 1) {
+		fprintf(stderr,"Bad number of stream pulses: %s\n", optarg);
+		exit(1);
+	    }
+	    streamPulses = atoi(optarg);
+	    break;
+	  case 'T':
+	    if ( atoi(optarg) < 1) {
+		fprintf(stderr,"Bad stream interval: %s\n", optarg);
+		exit(1);
+	    }
+	    streamMs = atoi(optarg);
+	    break;
+	  case 'R':
+	    ringName = optarg;
+	    break;
+	  case 'w':
+	    archiveName = optarg;
+	    break;
+	  case 'u':
+	    if ( atoi(optarg) < 576 || atoi(optarg) > 65535) {
+		fprintf(stderr,"Bad MTU, it must be from 576 to 65535: %s\n", optarg);
+		exit(1);
+	    }
+	    mtu = atoi(optarg);
+	    break;
+	  case 'o':
+	    oldFormat = 1;
+	    break;
 	  case 'H':
 	    showHistogram = 1;
 	    break;
@@ -490,6 +658,54 @@ int main( int argc, char **argv)
 	  case 'r':
 	    inputFileName = optarg;
 	    break;
+	  case 'S':
+	    replaySpeed = atof(optarg);
+	    if ( replaySpeed < 0) {
+		fprintf(stderr,"Bad replay speed: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  case 'j':
+	      {
+		  int j = atoi(optarg);
+		  if ( j < 1) {
+		      fprintf(stderr,"Bad number of jobs: %s\n", optarg);
+		      exit(1);
+		  }
+		  replayJobs = j;
+	      }
+	    break;
+	  case 's':
+	    statsShmName = optarg;
+	    break;
+	  case 'P':
+	    metricsPort = optarg;
+	    break;
+	  case 'A':
+	    metricsAddress = optarg;
+	    break;
+	  case 'b':
+	    if ( strcmp( optarg, "auto") == 0) {
+		autoBuffers = 1;
+	    } else {
+		int b = atoi(optarg);
+		if ( b < 1) {
+		    fprintf(stderr,"Bad number of buffers: %s\n", optarg);
+		    exit(1);
+		}
+		rtlBuffers = b;
+	    }
+	    break;
+	  case 'B':
+	      {
+		  int b = atoi(optarg);
+		  if ( b < RTL_BUFFER_UNIT || b % RTL_BUFFER_UNIT) {
+		      fprintf(stderr,"Bad buffer length, it must be a multiple of %u: %s\n", RTL_BUFFER_UNIT, optarg);
+		      exit(1);
+		  }
+		  rtlBufferLength = b;
+	      }
+	    break;
 	  default:
 	    fprintf(stderr,"Illegal option\n");
 	    showHelp(stderr);
@@ -497,10 +713,50 @@ int main( int argc, char **argv)
 	}
     }
 
+    if ( replayJobs > 1 && (inputFileName == 0 || replaySpeed != 0)) {
+	fprintf(stderr,"--jobs only applies to unthrottled --read-file\n");
+	exit(1);
+    }
+    if ( oldFormat && streamPort) {
+	fprintf(stderr,"--stream-port needs the extensions, --old-format clients couldn't tell fragments from bursts\n");
+	exit(1);
+    }
+
     setupNetworking(multicastAddress, multicastPort, multicastInterface);
 
+    if ( statsShmName || metricsPort) {
+	metrics = metricsOpen( statsShmName);
+	if ( !metrics) exit(1);
+	if ( metricsPort && metricsServe( metrics, metricsAddress, metricsPort) < 0) exit(1);
+    }
+
+    if ( ringName) {
+	ring = ringOpen( ringName, RING_DEFAULT_BYTES);
+	if ( !ring) exit(1);
+    }
+
+    if ( archiveName) {
+	archive = ook_archive_create( archiveName);
+	if ( !archive) exit(1);
+    }
+
+    detectorInit( &detector, sampleRate, 0.2, sendBurst, 0);
+    sampleClockInit( &sampleClock, sampleRate);
+    detector.verbose = verbose;
+    detector.fixedPoint = fixedPoint;
+    if ( streamPort) detector.progress = streamProgress;
+    if ( verbose) fprintf(stderr,"Using the %s DSP kernels\n", dspKernelName());
+    detector.metrics = metrics;
+
     signal(SIGINT, exitNicely);
 
+    // Everything is set up, what runs from here on should only wait for samples
+    if ( realtime) {
+	if ( detectorReserve( &detector) < 0) exit(1);
+	if ( realtimeLockMemory( REALTIME_HEAP_BYTES, REALTIME_STACK_BYTES) < 0) exit(1);
+    }
+    if ( realtimeSchedule( realtimeCpus, realtimePriority) < 0) exit(1);
+
     if ( inputFileName == 0) {
 	struct rtldev *rtl = rtlOpen(NULL,0);
 	if ( !rtl) {
@@ -512,35 +768,80 @@ int main( int argc, char **argv)
 	    fprintf(stderr,"Failed to setup RTL SDR for %uHz %usamp/sec\n", centerFrequency, sampleRate);
 	}
 
-	// something must call rtlStop(rtl) to kill this, to this end we stash in a global, ick
-	rtlToStop = rtl;
-	if ( rtlRun( rtl, iqHandler, 0)) {
-	    fprintf(stderr, "Failed to run iqHandler\n");
+	if ( autoBuffers) {
+	    // start with about 32ms buffers for latency, they grow if samples are dropped
+	    if ( !rtlBuffers) rtlBuffers = AUTO_BUFFERS_START;
+	    if ( !rtlBufferLength) {
+		uint32_t bytes = sampleRate*2/32;
+		rtlBufferLength = (bytes + RTL_BUFFER_UNIT-1) / RTL_BUFFER_UNIT * RTL_BUFFER_UNIT;
+	    }
 	}
+	metricsSet( metrics, METRIC_RADIO_BUFFERS, rtlBuffers ? rtlBuffers : RTL_DEFAULT_BUFFERS);
+	metricsSet( metrics, METRIC_RADIO_BUFFER_BYTES, rtlBufferLength ? rtlBufferLength : RTL_DEFAULT_BUFFER_LENGTH);
+
+	do {
+	    restartRadio = 0;
+	    // something must call rtlStop(rtl) to kill this, to this end we stash in a global, ick
+	    rtlToStop = rtl;
+	    if ( rtlRun( rtl, rtlBuffers, rtlBufferLength, iqHandler, 0)) {
+		fprintf(stderr, "Failed to run iqHandler\n");
+		break;
+	    }
+	    rtlToStop = 0;
+	    restarted = 1;
+	} while ( restartRadio && !stopping);
 	rtlToStop = 0;
 
+	if ( droppedSamples) {
+	    fprintf(stderr, "Dropped about %llu samples in all\n", (unsigned long long)droppedSamples);
+	}
+
 	rtlClose(rtl);
     } else {
-	FILE *in = fopen( inputFileName, "r");
-	if ( !in) {
-	    fprintf(stderr, "Failed to open input file '%s': %s\n", inputFileName, strerror(errno));
-	    exit(1);
+	struct replay *replay = replayOpen( inputFileName, sampleRate, replaySpeed);
+	if ( !replay) exit(1);
+
+	if ( replayJobs > 1) {
+	    struct timespec start, end;
+	    clock_gettime( CLOCK_MONOTONIC, &start);
+	    if ( parallelRun( replay->base, replay->size, replayJobs, sampleRate, detector.alpha, fixedPoint, sendBurst, 0)) {
+		fprintf(stderr, "Failed to process '%s'\n", inputFileName);
+	    }
+	    clock_gettime( CLOCK_MONOTONIC, &end);
+	    replay->samples = replay->size/2;
+	    metricsCount( metrics, METRIC_SAMPLES, replay->samples);   // the threads' detectors are not instrumented
+	    replay->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+	} else {
+	    replayToStop = replay;
+	    if ( replayRun( replay, replayHandler, replay)) {
+		fprintf(stderr, "Failed to replay '%s'\n", inputFileName);
+	    }
+	    replayToStop = 0;
 	}
 
-	for(;;) {
-	    unsigned char buf[16384];
-	    size_t got = fread( buf, 1, sizeof(buf), in);
-	    if ( got == 0 && feof(in)) break;
-	    if ( got == 0) {
-		fprintf(stderr, "Error while reading input file: %s\n", strerror(errno));
-		exit(1);
-	    }
-	    iqHandler( buf, got, 0, 0);
+	if ( replaySpeed == 0 || verbose) {
+	    fprintf(stderr, "Replayed %llu samples in %.3fs, %.0f samples/sec\n",
+		    (unsigned long long)replay->samples, replay->seconds,
+		    replay->seconds > 0 ? replay->samples/replay->seconds : 0.0);
 	}
 
-	fclose(in);
+	replayClose(replay);
+    }
+
+    if ( verbose || realtime) realtimeReport( &lateness, stderr);
+    if ( verbose && sampleClockLocked( &sampleClock)) {
+	fprintf(stderr, "Sample clock is %+.3fppm from nominal, capture times good to %.3fmS, from %u points\n",
+		sampleClockErrorPpb( &sampleClock)/1e3, sampleClock.uncertaintyNs/1e6, sampleClock.points);
     }
 
+    detectorFree( &detector);
+    ringClose( ring, ringName);
+    ring = 0;
+    ook_archive_close( archive);
+    archive = 0;
+    metricsClose( metrics, statsShmName);
+    metrics = 0;
+
     //
     // the rest of this is just in case someone is running a leak detector on us.
     //
@@ -553,6 +854,11 @@ int main( int argc, char **argv)
 	multicastSockaddr = 0;
 	multicastSockaddrLen = 0;
     }
+    if ( streamSockaddr) {
+	free(streamSockaddr);
+	streamSockaddr = 0;
+	streamSockaddrLen = 0;
+    }
 
     return 0;
 }
@@ -4,20 +4,287 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "ook.h"
 
 int verbose=0;
 
+/*
+** Output is formatted by hand into one big buffer, written when it fills or when
+** no more bursts are waiting, so a busy band costs a write() per batch of bursts
+** rather than a printf() per pulse.
+*/
+
+enum format { FORMAT_TEXT, FORMAT_RAW, FORMAT_CSV, FORMAT_JSON, FORMAT_SUMMARY };
+
+static const char *formatName[] = {
+    [FORMAT_TEXT] = "text",
+    [FORMAT_RAW] = "raw",
+    [FORMAT_CSV] = "csv",
+    [FORMAT_JSON] = "json",
+    [FORMAT_SUMMARY] = "summary",
+};
+
+#define OUT_BYTES (1<<20)
+#define OUT_FLUSH (1<<16)          // write once this much is waiting, even if bursts are
+
+static char out[OUT_BYTES];
+static size_t outUsed = 0;
+
+static void flushOut( void)
+{
+    size_t done = 0;
+    while ( done < outUsed) {
+	ssize_t e = write( STDOUT_FILENO, out + done, outUsed - done);
+	if ( e < 0 && errno == EINTR) continue;
+	if ( e < 0) {
+	    fprintf(stderr,"Failed to write output: %s\n", strerror(errno));
+	    exit(1);
+	}
+	done += e;
+    }
+    outUsed = 0;
+}
+
+// Room for n more bytes, n must be well short of OUT_BYTES
+static char *reserve( size_t n)
+{
+    if ( outUsed + n > OUT_BYTES) flushOut();
+    return out + outUsed;
+}
+
+static void putBytes( const void *b, size_t n)
+{
+    if ( n > OUT_BYTES/2) {        // too big to bother buffering
+	flushOut();
+	while ( n) {
+	    ssize_t e = write( STDOUT_FILENO, b, n);
+	    if ( e < 0 && errno == EINTR) continue;
+	    if ( e < 0) {
+		fprintf(stderr,"Failed to write output: %s\n", strerror(errno));
+		exit(1);
+	    }
+	    b = (const char *)b + e;
+	    n -= e;
+	}
+	return;
+    }
+    memcpy( reserve( n), b, n);
+    outUsed += n;
+}
+
+static void putString( const char *str)
+{
+    putBytes( str, strlen(str));
+}
+
+// v in decimal, right aligned in width with pad in front, like printf's %*u or %0*u
+static void putUnsigned( uint64_t v, int width, char pad)
+{
+    char digits[20];
+    int n = 0;
+    do {
+	digits[n++] = '0' + v%10;
+	v /= 10;
+    } while ( v);
+
+    char *p = reserve( n > width ? n : width);
+    for ( int i = n; i < width; i++) *p++ = pad;
+    while ( n) *p++ = digits[--n];
+    outUsed = p - out;
+}
+
+static void putSigned( int64_t v)
+{
+    if ( v < 0) putBytes( "-", 1);
+    putUnsigned( v < 0 ? -(uint64_t)v : v, 0, ' ');
+}
+
+// v/1000 with three decimals, right aligned in width, like printf's %*.3f of v/1000.0
+static void putThousandths( int64_t v, int width)
+{
+    uint64_t a = v < 0 ? -(uint64_t)v : v;
+    char digits[24];
+    int n = 0;
+    for ( int i = 0; i < 3; i++) {
+	digits[n++] = '0' + a%10;
+	a /= 10;
+    }
+    digits[n++] = '.';
+    do {
+	digits[n++] = '0' + a%10;
+	a /= 10;
+    } while ( a);
+    if ( v < 0) digits[n++] = '-';
+
+    char *p = reserve( n > width ? n : width);
+    for ( int i = n; i < width; i++) *p++ = ' ';
+    while ( n) *p++ = digits[--n];
+    outUsed = p - out;
+}
+
+static void writeText( const struct ook_burst *burst)
+{
+    // %014.6fs of the position in seconds
+    uint64_t us = (burst->positionNanoseconds + 500) / 1000;
+    putUnsigned( us / 1000000, 7, '0');
+    putBytes( ".", 1);
+    putUnsigned( us % 1000000, 6, '0');
+    putString( "s ### ");
+    putUnsigned( burst->pulses, 3, ' ');
+    putString( " pulses\nnum high   low      freq\n");
+
+    for ( uint32_t i = 0; i < burst->pulses; i++) {
+	const struct ook_pulse *p = &burst->pulse[i];
+	putUnsigned( i+1, 3, ' ');
+	putBytes( " ", 1);
+	putUnsigned( p->hiNanoseconds/1000, 4, ' ');
+	putBytes( "uS ", 3);
+	putUnsigned( p->lowNanoseconds/1000, 6, ' ');
+	putBytes( "uS ", 3);
+	putThousandths( p->frequencyOffsetHz, 8);
+	putBytes( "kHz\n", 4);
+    }
+}
+
+// Each burst as ook_encode() makes it, after its length, as ookrelay batches them
+static void writeRaw( struct ook_burst *burst)
+{
+    void *data = 0;
+    size_t len;
+    if ( ook_encode( burst, &data, &len) != 0 || !data) {
+	fprintf(stderr,"Failed to encode a burst\n");
+	return;
+    }
+    uint32_t length = len;
+    putBytes( &length, sizeof(length));
+    putBytes( data, len);
+    free(data);
+}
+
+static void writeCsv( const struct ook_burst *burst)
+{
+    for ( uint32_t i = 0; i < burst->pulses; i++) {
+	const struct ook_pulse *p = &burst->pulse[i];
+	putUnsigned( burst->positionNanoseconds, 0, ' ');
+	putBytes( ",", 1);
+	putUnsigned( i+1, 0, ' ');
+	putBytes( ",", 1);
+	putUnsigned( p->hiNanoseconds, 0, ' ');
+	putBytes( ",", 1);
+	putUnsigned( p->lowNanoseconds, 0, ' ');
+	putBytes( ",", 1);
+	putSigned( p->frequencyOffsetHz);
+	putBytes( "\n", 1);
+    }
+}
+
+static void writeJson( const struct ook_burst *burst)
+{
+    putString( "{\"position_ns\":");
+    putUnsigned( burst->positionNanoseconds, 0, ' ');
+    if ( burst->times.captureRealtimeNs) {
+	putString( ",\"capture_realtime_ns\":");
+	putUnsigned( burst->times.captureRealtimeNs, 0, ' ');
+    }
+    if ( burst->times.uncertaintyNs) {
+	putString( ",\"capture_uncertainty_ns\":");
+	putUnsigned( burst->times.uncertaintyNs, 0, ' ');
+    }
+    putString( ",\"pulses\":[");
+    for ( uint32_t i = 0; i < burst->pulses; i++) {
+	const struct ook_pulse *p = &burst->pulse[i];
+	putString( i ? ",[" : "[");
+	putUnsigned( p->hiNanoseconds, 0, ' ');
+	putBytes( ",", 1);
+	putUnsigned( p->lowNanoseconds, 0, ' ');
+	putBytes( ",", 1);
+	putSigned( p->frequencyOffsetHz);
+	putBytes( "]", 1);
+    }
+    putString( "]}\n");
+}
+
+// The summary is of each second of bursts, by their position, with histograms of
+// the pulse widths in 100uS bins. It is written when the next second's first burst arrives.
+#define SUMMARY_BIN_NS 100000
+#define SUMMARY_BINS 30             // the last is everything longer
+
+static struct {
+    uint64_t second;
+    uint32_t bursts;
+    uint64_t pulses;
+    uint32_t high[SUMMARY_BINS];
+    uint32_t low[SUMMARY_BINS];
+} summary;
+
+static void putHistogram( const char *name, const uint32_t *bins)
+{
+    putString( name);
+    for ( int i = 0; i < SUMMARY_BINS; i++) {
+	if ( !bins[i]) continue;
+	putBytes( "  ", 2);
+	putUnsigned( i*(SUMMARY_BIN_NS/1000), 0, ' ');
+	putString( i == SUMMARY_BINS-1 ? "uS+:" : "uS:");
+	putUnsigned( bins[i], 0, ' ');
+    }
+    putBytes( "\n", 1);
+}
+
+static void writeSummary( void)
+{
+    if ( !summary.bursts) return;
+
+    putUnsigned( summary.second, 7, '0');
+    putString( "s ");
+    putUnsigned( summary.bursts, 5, ' ');
+    putString( " bursts ");
+    putUnsigned( summary.pulses, 7, ' ');
+    putString( " pulses\n");
+    putHistogram( "  high", summary.high);
+    putHistogram( "  low ", summary.low);
+    memset( &summary, 0, sizeof(summary));
+}
+
+static void addToSummary( const struct ook_burst *burst)
+{
+    uint64_t second = burst->positionNanoseconds / 1000000000ULL;
+    if ( second != summary.second) writeSummary();
+
+    summary.second = second;
+    summary.bursts++;
+    summary.pulses += burst->pulses;
+    for ( uint32_t i = 0; i < burst->pulses; i++) {
+	uint32_t h = burst->pulse[i].hiNanoseconds / SUMMARY_BIN_NS;
+	uint32_t l = burst->pulse[i].lowNanoseconds / SUMMARY_BIN_NS;
+	summary.high[h < SUMMARY_BINS ? h : SUMMARY_BINS-1]++;
+	summary.low[l < SUMMARY_BINS ? l : SUMMARY_BINS-1]++;
+    }
+}
+
+// 1 if another burst is already waiting, so output can wait for it
+static int pending( int sock, const struct ook_ring *ring)
+{
+    if ( ring) return ook_ring_pending( ring);
+
+    struct pollfd p = { .fd = sock, .events = POLLIN };
+    return poll( &p, 1, 0) > 0;
+}
+
 static void showHelp( FILE *f)
 {
     fprintf(f, 
-	    "Usage: ookdump [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface]\n"
+	    "Usage: ookdump [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-R ring] [-B bytes] [-o format]\n"
 	    "  -h | -? | --help                      display usage and exit\n"
 	    "  -v | --verbose                        verbose logging\n"
 	    "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
 	    "  -p port | --multicast-port port       multicast port, default 3636\n"
 	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -R name | --ring name                 read bursts from ookd's shared memory ring instead, e.g. /ookd-ring\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving faster than we decode them\n"
+	    "  -o format | --output format           text, raw (encoded bursts for capture), csv, json (a line a burst),\n"
+	    "                                        or summary (pulse width histograms each second), default text\n"
 	    );
 }
 
@@ -27,6 +294,9 @@ int main( int argc, char **argv)
     const char *multicastAddress = "236.0.0.1";
     const char *multicastPort = "3636";
     const char *multicastInterface = "127.0.0.1";
+    const char *ringName = 0;
+    int receiveBuffer = 0;
+    enum format format = FORMAT_TEXT;
 
     // Handle options
     for(;;) {
@@ -37,10 +307,13 @@ int main( int argc, char **argv)
 	    { "multicast-address", required_argument, 0, 'a'},
 	    { "multicast-port", required_argument, 0, 'p' },
 	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "receive-buffer", required_argument, 0, 'B' },
+	    { "output", required_argument, 0, 'o' },
 	    { 0,0,0,0}
 	};
 
-	int c = getopt_long( argc, argv, "vh?f:a:p:i:", options, &optionIndex );
+	int c = getopt_long( argc, argv, "vh?f:a:p:i:R:B:o:", options, &optionIndex );
 	if ( c == -1) break;
 
 	switch(c) {
@@ -60,6 +333,23 @@ int main( int argc, char **argv)
 	  case 'i':
 	    multicastInterface = optarg;
 	    break;
+	  case 'R':
+	    ringName = optarg;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  case 'o':
+	    for ( format = 0; format <= FORMAT_SUMMARY && strcmp( optarg, formatName[format]) != 0; format++);
+	    if ( format > FORMAT_SUMMARY) {
+		fprintf(stderr,"Unknown output format: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	  default:
 	    fprintf(stderr,"Illegal option\n");
 	    showHelp(stderr);
@@ -68,39 +358,78 @@ int main( int argc, char **argv)
     }
 
 
-    // Parse our multicast address
-    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
-    if ( sock < 0) {
-	fprintf(stderr,"Failed to open multicast interface\n");
-	exit(1);
+    // Bursts come from ookd's ring if we share its host and were asked to, otherwise multicast
+    struct ook_ring *ring = 0;
+    int sock = -1;
+    if ( ringName) {
+	ring = ook_ring_attach( ringName);
+	if ( !ring) exit(1);
+    } else {
+	sock = ook_open( multicastAddress, multicastPort, multicastInterface);
+	if ( sock < 0) {
+	    fprintf(stderr,"Failed to open multicast interface\n");
+	    exit(1);
+	}
+	if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) exit(1);
     }
 
+    uint64_t missed = 0;     // lost or overflowed datagrams we have told of
+
+    if ( format == FORMAT_CSV) putString( "position_ns,pulse,high_ns,low_ns,frequency_hz\n");
+
     for (;;) {
 	struct ook_burst *burst;
 	struct sockaddr_storage addr;
 	socklen_t addrLen = sizeof(addr);
 
-	int e = ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
+	int e = ring ? ook_decode_from_ring( ring, &burst, verbose)
+		    : ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
 	if ( e < 0) {
-	    fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
+	    if ( sock >= 0) fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
 	    break;
 	}
 	if ( e == 0) {
 	    fprintf(stderr,"Corrupt burst\n");
 	    continue;
 	}
+
+	// say when datagrams went missing, so a gap in the bursts isn't blamed on the radio
+	struct ook_stats stats;
+	if ( sock >= 0 && ook_get_stats( sock, &stats) == 0) {
+	    if ( stats.lost + stats.overflows > missed) {
+		fprintf(stderr,"Missed %llu datagrams, %llu lost on the way and %llu overflowed our receive buffer so far\n",
+			(unsigned long long)(stats.lost + stats.overflows - missed),
+			(unsigned long long)stats.lost, (unsigned long long)stats.overflows);
+	    }
+	    missed = stats.lost + stats.overflows;      // it goes down when a late one turns up
+	}
 	
-	printf("%014.6fs ### %3u pulses\n", burst->positionNanoseconds/1000000000.0, burst->pulses);
-	printf("num high   low      freq\n");
-	for ( int i = 0; i < burst->pulses; i++) {
-	    printf( "%3u %4uuS %6uuS %8.3fkHz\n", i+1, burst->pulse[i].hiNanoseconds/1000, 
-		    burst->pulse[i].lowNanoseconds/1000, burst->pulse[i].frequencyOffsetHz/1000.0);
+	switch ( format) {
+	  case FORMAT_TEXT:
+	    writeText( burst);
+	    break;
+	  case FORMAT_RAW:
+	    writeRaw( burst);
+	    break;
+	  case FORMAT_CSV:
+	    writeCsv( burst);
+	    break;
+	  case FORMAT_JSON:
+	    writeJson( burst);
+	    break;
+	  case FORMAT_SUMMARY:
+	    addToSummary( burst);
+	    break;
 	}
-
-	fflush(stdin);
 	free(burst);
+
+	if ( outUsed >= OUT_FLUSH || !pending( sock, ring)) flushOut();
     }
 
-    close(sock);
+    writeSummary();
+    flushOut();
+
+    if ( sock >= 0) close(sock);
+    ook_ring_detach( ring);
     return 0;
 }
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "ook.h"
+
+/*
+** Merge the bursts of several ookds whose radios hear the same transmitters.
+** Each ookd multicasts to its own group, ookfuse joins them all and multicasts
+** one copy of each transmission to another, so decoders do the work once however
+** many receivers heard it, and a transmission one radio missed still gets through
+** from another.
+**
+** Copies are matched by capture time, which the ookds' disciplined sample clocks
+** make comparable to within their uncertainty and how well their hosts agree on
+** the time, and by their pulses. A transmission is held for a window after its
+** first copy arrives, or until every receiver has given one. The copy sent is the
+** one whose pulses most of the others agree with, then the one with the most
+** confident pulses.
+*/
+
+#define FUSE_MAX_SOURCES 8
+
+struct source {
+    const char *name;
+    int sock;                           // -1 for a ring
+    struct ook_ring *ring;
+    struct ook_reassembly *reassembly;
+    uint64_t copies;
+    uint64_t chosen;
+    uint64_t alone;                     // transmissions only this one heard
+};
+
+struct copy {
+    struct ook_burst *burst;
+    struct source *source;
+    uint8_t *symbols;                   // one per pulse, after the pulses in the same allocation
+    uint64_t fingerprint;
+    uint32_t confidence;                // mean ook_pulse_confidence() of its pulses
+};
+
+struct transmission {
+    struct transmission *next;
+    uint64_t timeNs;                    // of the first copy's capture
+    uint32_t uncertaintyNs;
+    struct ook_timer *timer;
+    unsigned copies;
+    struct copy copy[FUSE_MAX_SOURCES];
+};
+
+int verbose=0;
+
+static struct source source[FUSE_MAX_SOURCES];
+static unsigned sources = 0;
+static struct transmission *pending = 0;
+static struct ook_loop *loop = 0;
+static uint64_t windowNs = 50000000;
+static uint64_t skewNs = 10000000;
+static uint64_t transmissions = 0;
+
+// We number the merged stream ourselves
+static struct ook_sender out = { .sock = -1, .maxDatagram = 1500 - 48 };  // less IPv6 and UDP headers
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ookfuse [-h] [-?] [-v] (-j group[:port] | -R ring) ... [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-B bytes]\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -j grp[:port] | --join grp[:port]     take the bursts of an ookd multicasting here, port 3636 if not given\n"
+	    "  -R name | --ring name                 take the bursts of an ookd on this host from its ring\n"
+	    "  -a addr | --multicast-address addr    multicast address for the merged bursts, default 236.0.0.1\n"
+	    "  -p port | --multicast-port port       multicast port for the merged bursts, default 3636\n"
+	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for each group's bursts\n"
+	    "  -w ms | --window ms                   wait this long for the other copies of a transmission, default 50\n"
+	    "  -s ms | --skew ms                     most the receivers' capture times differ by, default 10\n"
+	    "  -u bytes | --mtu bytes                MTU to multicast with, default 1500\n"
+	    "  Except on Linux, give each receiver's group its own port, and the merged bursts another.\n"
+	    );
+}
+
+//
+// Telling copies apart
+//
+
+// Each pulse's high and low widths as long or short, taking the midpoint of the burst's own
+// widths as the line. Receivers hearing the same transmission well get the same symbols,
+// however their timing differs. The last low is the gap after the burst.
+static void symbolize( const struct ook_burst *burst, uint8_t *symbol)
+{
+    uint32_t minHi = UINT32_MAX, maxHi = 0, minLow = UINT32_MAX, maxLow = 0;
+    for ( uint32_t i = 0; i < burst->pulses; i++) {
+	const struct ook_pulse *p = &burst->pulse[i];
+	if ( p->hiNanoseconds < minHi) minHi = p->hiNanoseconds;
+	if ( p->hiNanoseconds > maxHi) maxHi = p->hiNanoseconds;
+	if ( i + 1 == burst->pulses) break;
+	if ( p->lowNanoseconds < minLow) minLow = p->lowNanoseconds;
+	if ( p->lowNanoseconds > maxLow) maxLow = p->lowNanoseconds;
+    }
+    uint64_t hiLine = ((uint64_t)minHi + maxHi) / 2;
+    uint64_t lowLine = ((uint64_t)minLow + maxLow) / 2;
+
+    for ( uint32_t i = 0; i < burst->pulses; i++) {
+	const struct ook_pulse *p = &burst->pulse[i];
+	symbol[i] = (p->hiNanoseconds > hiLine) | (i + 1 < burst->pulses && p->lowNanoseconds > lowLine) << 1;
+    }
+}
+
+// The symbols hashed with the count, so most copies are matched without comparing them
+static uint64_t fingerprint( const uint8_t *symbol, uint32_t n)
+{
+    uint64_t h = 14695981039346656037ULL ^ n;   // FNV-1a
+    for ( uint32_t i = 0; i < n; i++) h = (h ^ symbol[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Are two symbol sequences within limit insertions, deletions and substitutions of each
+// other? Only the band of the edit distance table within limit of its diagonal can be,
+// so that is all that is filled in, and it gives up once a whole row is over.
+static int withinEdits( const uint8_t *a, uint32_t n, const uint8_t *b, uint32_t m, uint32_t limit)
+{
+    if ( (n > m ? n - m : m - n) > limit) return 0;
+    uint32_t *row = malloc( 2 * (m + 1) * sizeof(*row));
+    if ( !row) return 0;
+    uint32_t *prev = row, *cur = row + m + 1;
+    uint32_t over = limit + 1;
+
+    for ( uint32_t j = 0; j <= m; j++) prev[j] = j <= limit ? j : over;
+    int within = 1;
+    for ( uint32_t i = 1; i <= n && within; i++) {
+	uint32_t from = i > limit ? i - limit : 1;
+	uint32_t to = i + limit < m ? i + limit : m;
+	for ( uint32_t j = 0; j <= m; j++) cur[j] = over;
+	if ( i <= limit) cur[0] = i;
+	uint32_t best = cur[0];
+	for ( uint32_t j = from; j <= to; j++) {
+	    uint32_t d = prev[j-1] + (a[i-1] != b[j-1]);
+	    if ( prev[j] + 1 < d) d = prev[j] + 1;
+	    if ( cur[j-1] + 1 < d) d = cur[j-1] + 1;
+	    cur[j] = d < over ? d : over;
+	    if ( cur[j] < best) best = cur[j];
+	}
+	within = best <= limit;
+	uint32_t *t = prev; prev = cur; cur = t;
+    }
+    within = within && prev[m] <= limit;
+    free( row);
+    return within;
+}
+
+static uint32_t confidence( const struct ook_burst *burst)
+{
+    uint64_t sum = 0;
+    for ( uint32_t i = 0; i < burst->pulses; i++) sum += ook_pulse_confidence( burst, i);
+    return burst->pulses ? sum / burst->pulses : 0;
+}
+
+static uint64_t captureTime( const struct ook_burst *burst)
+{
+    return burst->times.captureRealtimeNs ? burst->times.captureRealtimeNs : burst->times.receivedRealtimeNs;
+}
+
+// Could a copy be of this transmission? One receiver may have lost or misjudged a pulse
+// or two of a weak copy, so when the fingerprints differ the symbols need only be a few
+// edits apart, an eighth of them but at least two. Two transmitters of the same protocol
+// heard at once have the count in common but not the symbols.
+static int alike( const struct transmission *t, const struct copy *c)
+{
+    for ( unsigned i = 0; i < t->copies; i++) {
+	const struct copy *o = &t->copy[i];
+	if ( o->source == c->source) return 0;   // one receiver's next burst is another transmission
+    }
+    const struct copy *first = &t->copy[0];
+    if ( first->fingerprint == c->fingerprint) return 1;
+    uint32_t a = first->burst->pulses, b = c->burst->pulses;
+    uint32_t slack = (a > b ? a : b) / 8;
+    if ( slack < 2) slack = 2;
+    return withinEdits( first->symbols, a, c->symbols, b, slack);
+}
+
+//
+// Merging
+//
+
+// Send the best copy and forget the transmission
+static void flush( struct transmission *t)
+{
+    struct transmission **p = &pending;
+    while ( *p != t) p = &(*p)->next;
+    *p = t->next;
+
+    int best = 0;
+    unsigned bestAgreement = 0;
+    for ( unsigned i = 0; i < t->copies; i++) {
+	unsigned agreement = 0;
+	for ( unsigned j = 0; j < t->copies; j++) {
+	    agreement += t->copy[j].fingerprint == t->copy[i].fingerprint &&
+		t->copy[j].burst->pulses == t->copy[i].burst->pulses;
+	}
+	if ( agreement > bestAgreement ||
+	     (agreement == bestAgreement && t->copy[i].confidence > t->copy[best].confidence)) {
+	    best = i;
+	    bestAgreement = agreement;
+	}
+    }
+
+    struct copy *c = &t->copy[best];
+    if ( verbose) fprintf(stderr, "%u pulses heard by %u of %u receivers, sent %s's, %u agreed, confidence %u\n",
+			  c->burst->pulses, t->copies, sources, c->source->name, bestAgreement, c->confidence);
+    ook_send( &out, c->burst);
+    c->source->chosen++;
+    if ( t->copies == 1) c->source->alone++;
+    transmissions++;
+
+    for ( unsigned i = 0; i < t->copies; i++) free( t->copy[i].burst);
+    free(t);
+}
+
+static void windowOver( void *ctx)
+{
+    flush( ctx);
+}
+
+static void handleBurst( struct ook_burst *received, int sock, void *ctx)
+{
+    struct source *s = ctx;
+    struct ook_burst *burst = received;
+    int complete = 1;
+    if ( s->reassembly) burst = ook_reassemble( s->reassembly, received, &complete);
+    if ( !burst || !complete || burst->pulses == 0) return;
+
+    // The burst is only lent to us, and fragments' belong to the reassembler
+    size_t size = sizeof(*burst) + burst->pulses * sizeof(struct ook_pulse);
+    struct copy c = { .burst = malloc( size + burst->pulses), .source = s };
+    if ( !c.burst) {
+	fprintf(stderr, "Failed to allocate a copy of a burst, dropped it\n");
+	return;
+    }
+    memcpy( c.burst, burst, size);
+    c.burst->allocatedPulses = burst->pulses;
+    c.burst->fragment = (struct ook_fragment){ 0 };
+    c.symbols = (uint8_t *)c.burst + size;
+    symbolize( c.burst, c.symbols);
+    c.fingerprint = fingerprint( c.symbols, c.burst->pulses);
+    c.confidence = confidence( c.burst);
+    s->copies++;
+
+    // The closest transmission in time this could be another copy of
+    uint64_t when = captureTime( c.burst);
+    struct transmission *match = 0;
+    uint64_t matchDistance = 0;
+    for ( struct transmission *t = pending; t; t = t->next) {
+	uint64_t distance = when > t->timeNs ? when - t->timeNs : t->timeNs - when;
+	if ( distance > skewNs + t->uncertaintyNs + c.burst->times.uncertaintyNs) continue;
+	if ( !alike( t, &c)) continue;
+	if ( !match || distance < matchDistance) {
+	    match = t;
+	    matchDistance = distance;
+	}
+    }
+
+    if ( !match) {
+	match = calloc( 1, sizeof(*match));
+	if ( match) match->timer = ook_loop_after( loop, windowNs, windowOver, match);
+	if ( !match || !match->timer) {
+	    fprintf(stderr, "Failed to start a transmission, dropped a burst\n");
+	    free( match);
+	    free( c.burst);
+	    return;
+	}
+	match->timeNs = when;
+	match->uncertaintyNs = c.burst->times.uncertaintyNs;
+	match->next = pending;
+	pending = match;
+    }
+    match->copy[match->copies++] = c;
+
+    if ( match->copies == sources) {
+	ook_loop_cancel( loop, match->timer);
+	flush( match);
+    }
+}
+
+static void stopOnSignal( int signum, void *ctx)
+{
+    ook_loop_stop( ctx);
+}
+
+// Add an ookd's group, address[:port] or [v6address]:port
+static int join( const char *group, const char *interface, int receiveBuffer)
+{
+    char address[256];
+    const char *port = "3636";
+    const char *colon = strrchr( group, ':');
+    size_t len = strlen( group);
+
+    if ( group[0] == '[') {
+	const char *close = strchr( group, ']');
+	if ( !close) {
+	    fprintf(stderr, "Illegal group: %s\n", group);
+	    return -1;
+	}
+	if ( close[1] == ':') port = close + 2;
+	group++;
+	len = close - group;
+    } else if ( colon && colon == strchr( group, ':')) {   // just one, not a bare v6 address
+	port = colon + 1;
+	len = colon - group;
+    }
+    if ( len >= sizeof(address)) {
+	fprintf(stderr, "Illegal group: %s\n", group);
+	return -1;
+    }
+    memcpy( address, group, len);
+    address[len] = 0;
+
+    struct source *s = &source[sources];
+    s->sock = ook_open( address, port, interface);
+    if ( s->sock < 0) {
+	fprintf(stderr, "Failed to join %s\n", group);
+	return -1;
+    }
+    if ( receiveBuffer && ook_set_receive_buffer( s->sock, receiveBuffer) < 0) return -1;
+    return 0;
+}
+
+int main( int argc, char **argv)
+{
+    const char *multicastAddress = "236.0.0.1";
+    const char *multicastPort = "3636";
+    const char *multicastInterface = "127.0.0.1";
+    const char *groups[FUSE_MAX_SOURCES];
+    const char *rings[FUSE_MAX_SOURCES];
+    unsigned groupCount = 0, ringCount = 0;
+    int receiveBuffer = 0;
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "join", required_argument, 0, 'j' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "multicast-address", required_argument, 0, 'a'},
+	    { "multicast-port", required_argument, 0, 'p' },
+	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "receive-buffer", required_argument, 0, 'B' },
+	    { "window", required_argument, 0, 'w' },
+	    { "skew", required_argument, 0, 's' },
+	    { "mtu", required_argument, 0, 'u' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?j:R:a:p:i:B:w:s:u:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 'j':
+	  case 'R':
+	    if ( groupCount + ringCount == FUSE_MAX_SOURCES) {
+		fprintf(stderr,"No more than %d receivers\n", FUSE_MAX_SOURCES);
+		exit(1);
+	    }
+	    if ( c == 'j') groups[groupCount++] = optarg;
+	    else rings[ringCount++] = optarg;
+	    break;
+	  case 'a':
+	    multicastAddress = optarg;
+	    break;
+	  case 'p':
+	    multicastPort = optarg;
+	    break;
+	  case 'i':
+	    multicastInterface = optarg;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  case 'w':
+	    if ( atoi(optarg) < 1) {
+		fprintf(stderr,"Bad window: %s\n", optarg);
+		exit(1);
+	    }
+	    windowNs = atoi(optarg) * 1000000ULL;
+	    break;
+	  case 's':
+	    if ( atoi(optarg) < 0) {
+		fprintf(stderr,"Bad skew: %s\n", optarg);
+		exit(1);
+	    }
+	    skewNs = atoi(optarg) * 1000000ULL;
+	    break;
+	  case 'u':
+	    if ( atoi(optarg) < 576 || atoi(optarg) > 65535) {
+		fprintf(stderr,"Bad MTU, it must be from 576 to 65535: %s\n", optarg);
+		exit(1);
+	    }
+	    out.maxDatagram = atoi(optarg) - 48;
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    if ( groupCount + ringCount < 2) {
+	fprintf(stderr,"Give at least two receivers to merge with --join or --ring\n");
+	showHelp(stderr);
+	exit(1);
+    }
+
+    // Hearing what we send would merge it back in forever
+    for ( unsigned i = 0; i < groupCount; i++) {
+	char ours[strlen(multicastAddress) + strlen(multicastPort) + 4];
+	sprintf( ours, strchr( multicastAddress, ':') ? "[%s]:%s" : "%s:%s", multicastAddress, multicastPort);
+	if ( strcmp( groups[i], ours) == 0 ||
+	     (strcmp( multicastPort, "3636") == 0 && strcmp( groups[i], multicastAddress) == 0)) {
+	    fprintf(stderr,"Joined %s, which is where the merged bursts go, give another --multicast-address\n", groups[i]);
+	    exit(1);
+	}
+    }
+
+    loop = ook_loop_new();
+    if ( !loop) exit(1);
+
+    for ( unsigned i = 0; i < groupCount; i++) {
+	if ( join( groups[i], multicastInterface, receiveBuffer) < 0) exit(1);
+	source[sources].name = groups[i];
+	source[sources].reassembly = ook_reassembly_new();
+	if ( !source[sources].reassembly ||
+	     ook_loop_add_socket( loop, source[sources].sock, handleBurst, &source[sources], verbose) < 0) exit(1);
+	sources++;
+    }
+    for ( unsigned i = 0; i < ringCount; i++) {
+	source[sources] = (struct source){ .name = rings[i], .sock = -1 };
+	source[sources].ring = ook_ring_attach( rings[i]);
+	if ( !source[sources].ring) exit(1);
+	source[sources].reassembly = ook_reassembly_new();
+	if ( !source[sources].reassembly ||
+	     ook_loop_add_ring( loop, source[sources].ring, handleBurst, &source[sources], verbose) < 0) exit(1);
+	sources++;
+    }
+
+    out.sock = ook_open_sender( multicastAddress, multicastPort, multicastInterface, &out.to, &out.toLen);
+    if ( out.sock < 0) exit(1);
+    out.sequence.source = ook_sequence_source();
+
+    if ( ook_loop_signal( loop, SIGINT, stopOnSignal, loop) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGTERM, stopOnSignal, loop) < 0) exit(1);
+
+    int e = ook_loop_run( loop);
+
+    // Don't lose what was waiting for its other copies
+    while ( pending) {
+	ook_loop_cancel( loop, pending->timer);
+	flush( pending);
+    }
+
+    if ( verbose) {
+	uint64_t copies = 0;
+	for ( unsigned i = 0; i < sources; i++) copies += source[i].copies;
+	fprintf(stderr, "%llu transmissions from %llu copies\n", (unsigned long long)transmissions, (unsigned long long)copies);
+	for ( unsigned i = 0; i < sources; i++) {
+	    fprintf(stderr, "  %s: %llu copies, %llu sent, %llu heard by it alone\n", source[i].name,
+		    (unsigned long long)source[i].copies, (unsigned long long)source[i].chosen,
+		    (unsigned long long)source[i].alone);
+	}
+    }
+
+    ook_loop_free( loop);
+    for ( unsigned i = 0; i < sources; i++) {
+	if ( source[i].sock >= 0) close( source[i].sock);
+	ook_ring_detach( source[i].ring);
+	ook_reassembly_free( source[i].reassembly);
+    }
+    close( out.sock);
+    free( out.to);
+    return e < 0 ? 1 : 0;
+}
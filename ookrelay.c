@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ook.h"
+#include "lz.h"
+
+/*
+** Carry bursts between sites. ookd's multicast stays on its subnet, so at the
+** radio's end `ookrelay -c far.host:3640` listens to it, gathers the bursts of
+** each window into a batch, compresses it and sends it over TCP. At the far end
+** `ookrelay -l 3640` multicasts them again for the decoders there.
+**
+** The connection is remade whenever it drops. Batches wait in a backlog while it
+** is down, and if that fills up the oldest are thrown away.
+*/
+
+#define RELAY_MAGIC 0x4F4F4B5A          // 'OOKZ'
+#define RELAY_MAX_BATCH (1<<20)         // uncompressed bytes, receivers refuse more
+#define RELAY_MAX_PEERS 16
+#define RELAY_RETRY_MS 1000             // first wait before reconnecting, doubled each failure
+#define RELAY_RETRY_MAX_MS 30000
+#define RELAY_EXPIRE_MS 250             // longest poll, see ook_expire_segments()
+
+// Each batch on the wire is this, then the payload. The payload is stored rather
+// than compressed when that doesn't make it smaller, compressedLength == rawLength.
+// Uncompressed it is each burst as ook_encode() makes it, preceded by its length.
+struct batchHeader {
+    uint32_t magic;
+    uint32_t rawLength;
+    uint32_t compressedLength;
+    uint32_t bursts;
+};
+
+int verbose=0;
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ookrelay [-h] [-?] [-v] (-c host:port | -l port) [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-B bytes]\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -c host:port | --connect host:port    forward the bursts multicast here to the relay listening there\n"
+	    "  -l port | --listen port               take bursts from other relays and multicast them here\n"
+	    "  -L addr | --listen-address addr       address to listen on, default all of them\n"
+	    "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
+	    "  -p port | --multicast-port port       multicast port, default 3636\n"
+	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving while we are sending\n"
+	    "  -w ms | --window ms                   batch the bursts of this many milliseconds, default 100\n"
+	    "  -b bytes | --backlog bytes            most to hold while disconnected, default 1048576\n"
+	    "  -u bytes | --mtu bytes                MTU to multicast with when listening, default 1500\n"
+	    );
+}
+
+static uint64_t nowMs( void)
+{
+    return ook_now( CLOCK_MONOTONIC) / 1000000;
+}
+
+//
+// Forwarding
+//
+
+struct batch {
+    struct batch *next;
+    size_t length;                      // header and payload
+    uint32_t bursts;
+    uint8_t data[];
+};
+
+static struct {
+    struct batch *head;
+    struct batch *tail;
+    size_t bytes;
+    size_t maxBytes;
+    size_t sent;                        // of head, on the current connection
+} backlog = { .maxBytes = 1<<20 };
+
+// Compress a batch of bursts onto the end of the backlog, making room if we must
+static void queueBatch( const uint8_t *raw, size_t rawLength, uint32_t bursts)
+{
+    struct batch *b = malloc( sizeof(*b) + sizeof(struct batchHeader) + LZ_BOUND(rawLength));
+    if ( !b) {
+	fprintf(stderr, "Failed to allocate a batch, dropped %u bursts\n", bursts);
+	return;
+    }
+
+    uint8_t *payload = b->data + sizeof(struct batchHeader);
+    size_t compressed = lzCompress( raw, rawLength, payload, LZ_BOUND(rawLength));
+    if ( compressed == 0 || compressed >= rawLength) {
+	memcpy( payload, raw, rawLength);
+	compressed = rawLength;
+    }
+
+    struct batchHeader h = { .magic = RELAY_MAGIC, .rawLength = rawLength, .compressedLength = compressed, .bursts = bursts };
+    memcpy( b->data, &h, sizeof(h));
+    b->length = sizeof(h) + compressed;
+    b->bursts = bursts;
+    b->next = 0;
+
+    if ( verbose) fprintf(stderr, "Batch of %u bursts, %zu bytes compressed to %zu\n", bursts, rawLength, compressed);
+
+    if ( backlog.tail) backlog.tail->next = b;
+    else backlog.head = b;
+    backlog.tail = b;
+    backlog.bytes += b->length;
+
+    // Drop the oldest, but not one we are part way through sending
+    uint32_t dropped = 0;
+    struct batch **p = backlog.sent ? &backlog.head->next : &backlog.head;
+    while ( backlog.bytes > backlog.maxBytes && *p && *p != b) {
+	struct batch *old = *p;
+	*p = old->next;
+	backlog.bytes -= old->length;
+	dropped += old->bursts;
+	free(old);
+    }
+    if ( dropped) fprintf(stderr, "Backlog full, dropped %u bursts\n", dropped);
+}
+
+// Start a non-blocking connection to host:port, -1 if it can't even start
+static int startConnect( const char *target)
+{
+    char host[256];
+    const char *colon = strrchr( target, ':');
+    if ( !colon || colon == target || colon - target >= sizeof(host)) {
+	fprintf(stderr, "Relay must be host:port: %s\n", target);
+	exit(1);
+    }
+    const char *h = target;
+    size_t len = colon - target;
+    if ( h[0] == '[' && h[len-1] == ']') {   // [v6::address]:port
+	h++;
+	len -= 2;
+    }
+    memcpy( host, h, len);
+    host[len] = 0;
+
+    struct addrinfo *ai = 0;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int err = getaddrinfo( host, colon+1, &hints, &ai);
+    if ( err) {
+	fprintf(stderr, "Failed to look up relay %s: %s\n", target, gai_strerror(err));
+	return -1;
+    }
+
+    int sock = socket( ai->ai_family, SOCK_STREAM, 0);
+    if ( sock < 0) {
+	fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+	freeaddrinfo(ai);
+	return -1;
+    }
+    fcntl( sock, F_SETFL, fcntl( sock, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // we do our own batching
+
+    if ( connect( sock, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+	fprintf(stderr, "Failed to connect to relay %s: %s\n", target, strerror(errno));
+	close(sock);
+	sock = -1;
+    }
+    freeaddrinfo(ai);
+    return sock;
+}
+
+static int receiveBuffer = 0;           // see --receive-buffer
+
+static int forward( const char *target, const char *multicastAddress, const char *multicastPort,
+		    const char *multicastInterface, unsigned windowMs)
+{
+    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
+    if ( sock < 0) {
+	fprintf(stderr,"Failed to open multicast interface\n");
+	return -1;
+    }
+    if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) return -1;
+
+    uint8_t *raw = malloc( RELAY_MAX_BATCH);
+    if ( !raw) return -1;
+    size_t rawLength = 0;
+    uint32_t bursts = 0;
+    uint64_t batchStarted = 0;
+
+    int tcp = -1;
+    int connected = 0;
+    uint64_t retryAt = 0;
+    unsigned retryMs = RELAY_RETRY_MS;
+
+    for (;;) {
+	uint64_t now = nowMs();
+
+	if ( tcp < 0 && now >= retryAt) {
+	    tcp = startConnect( target);
+	    connected = 0;
+	    backlog.sent = 0;           // a batch part sent on the last connection goes again whole
+	    if ( tcp < 0) {
+		retryAt = now + retryMs;
+		if ( retryMs < RELAY_RETRY_MAX_MS) retryMs *= 2;
+	    }
+	}
+
+	// wake for the end of the batch window, or to reconnect, and now and then to give up on
+	// bursts whose last segments never came
+	int timeout = RELAY_EXPIRE_MS;
+	if ( bursts) {
+	    int wait = batchStarted + windowMs > now ? batchStarted + windowMs - now : 0;
+	    if ( wait < timeout) timeout = wait;
+	}
+	if ( tcp < 0) {
+	    int wait = retryAt > now ? retryAt - now : 0;
+	    if ( wait < timeout) timeout = wait;
+	}
+
+	struct pollfd fds[2] = { { .fd = sock, .events = POLLIN },
+				 { .fd = tcp, .events = POLLIN | (!connected || backlog.head ? POLLOUT : 0) } };
+	if ( poll( fds, tcp >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+	    fprintf(stderr, "Failed to poll: %s\n", strerror(errno));
+	    return -1;
+	}
+	now = nowMs();
+
+	ook_expire_segments( verbose);
+
+	if ( fds[0].revents & POLLIN) {
+	    struct ook_burst *burst;
+	    int e = ook_decode_from_socket_nowait( sock, &burst, 0, 0, verbose);
+	    if ( e < 0) {
+		fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
+		return -1;
+	    }
+	    void *data = 0;
+	    size_t len;
+	    if ( e > 0 && ook_encode( burst, &data, &len) == 0) {
+		if ( rawLength + 4 + len > RELAY_MAX_BATCH && bursts) {
+		    queueBatch( raw, rawLength, bursts);
+		    rawLength = bursts = 0;
+		}
+		if ( rawLength + 4 + len <= RELAY_MAX_BATCH) {
+		    uint32_t l = len;
+		    memcpy( raw + rawLength, &l, 4);
+		    memcpy( raw + rawLength + 4, data, len);
+		    rawLength += 4 + len;
+		    if ( bursts++ == 0) batchStarted = now;
+		}
+		free(data);
+	    }
+	    if ( e > 0) free(burst);
+	}
+
+	if ( bursts && now >= batchStarted + windowMs) {
+	    queueBatch( raw, rawLength, bursts);
+	    rawLength = bursts = 0;
+	}
+
+	if ( tcp < 0) continue;
+
+	short revents = fds[1].revents;
+	int failed = 0;
+	if ( !connected && (revents & (POLLOUT|POLLERR|POLLHUP))) {
+	    int err = 0;
+	    socklen_t errLen = sizeof(err);
+	    getsockopt( tcp, SOL_SOCKET, SO_ERROR, &err, &errLen);
+	    if ( err) {
+		fprintf(stderr, "Failed to connect to relay %s: %s\n", target, strerror(err));
+		failed = 1;
+	    } else {
+		fprintf(stderr, "Connected to relay %s\n", target);
+		connected = 1;
+		retryMs = RELAY_RETRY_MS;
+	    }
+	} else if ( connected && (revents & (POLLIN|POLLERR|POLLHUP))) {
+	    char junk[256];   // the far end never says anything, this is it closing
+	    ssize_t got = recv( tcp, junk, sizeof(junk), 0);
+	    if ( got <= 0 && !(got < 0 && (errno == EAGAIN || errno == EINTR))) {
+		fprintf(stderr, "Lost relay %s: %s\n", target, got == 0 ? "closed" : strerror(errno));
+		failed = 1;
+	    }
+	}
+
+	while ( connected && !failed && backlog.head) {
+	    struct batch *b = backlog.head;
+	    ssize_t e = send( tcp, b->data + backlog.sent, b->length - backlog.sent, 0);
+	    if ( e < 0) {
+		if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+		fprintf(stderr, "Lost relay %s: %s\n", target, strerror(errno));
+		failed = 1;
+		break;
+	    }
+	    backlog.sent += e;
+	    if ( backlog.sent < b->length) break;
+
+	    backlog.head = b->next;
+	    if ( !backlog.head) backlog.tail = 0;
+	    backlog.bytes -= b->length;
+	    backlog.sent = 0;
+	    free(b);
+	}
+
+	if ( failed) {
+	    close(tcp);
+	    tcp = -1;
+	    retryAt = now + retryMs;
+	    if ( retryMs < RELAY_RETRY_MAX_MS) retryMs *= 2;
+	}
+    }
+}
+
+//
+// Listening
+//
+
+struct peer {
+    int fd;                             // -1 if unused
+    uint8_t *buf;                       // a whole batch fits
+    size_t have;
+};
+
+static int listenOn( const char *address, const char *port)
+{
+    struct addrinfo *ai = 0;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    int err = getaddrinfo( address, port, &hints, &ai);
+    if ( err) {
+	fprintf(stderr, "Illegal listen address (addr=%s port=%s):%s\n", address ? address : "*", port, gai_strerror(err));
+	return -1;
+    }
+
+    int sock = socket( ai->ai_family, SOCK_STREAM, 0);
+    int one = 1;
+    if ( sock < 0 || setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+	 bind( sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen( sock, 4) < 0) {
+	fprintf(stderr, "Failed to listen on port %s: %s\n", port, strerror(errno));
+	if ( sock >= 0) close(sock);
+	sock = -1;
+    }
+    freeaddrinfo(ai);
+    return sock;
+}
+
+// We number what we multicast ourselves, our listeners can't see the link
+static struct ook_sender out = { .sock = -1, .maxDatagram = 1500 - 48 };  // less IPv6 and UDP headers
+
+// Multicast the bursts of every whole batch a peer has sent, -1 if it is talking nonsense
+static int unpackBatches( struct peer *p, uint8_t *raw)
+{
+    size_t used = 0;
+    while ( p->have - used >= sizeof(struct batchHeader)) {
+	struct batchHeader h;
+	memcpy( &h, p->buf + used, sizeof(h));
+	if ( h.magic != RELAY_MAGIC || h.rawLength > RELAY_MAX_BATCH || h.compressedLength > h.rawLength) {
+	    fprintf(stderr, "Bad batch from relay, disconnecting\n");
+	    return -1;
+	}
+	if ( p->have - used < sizeof(h) + h.compressedLength) break;
+
+	const uint8_t *payload = p->buf + used + sizeof(h);
+	if ( h.compressedLength == h.rawLength) {
+	    memcpy( raw, payload, h.rawLength);
+	} else if ( lzDecompress( payload, h.compressedLength, raw, RELAY_MAX_BATCH) != h.rawLength) {
+	    fprintf(stderr, "Corrupt batch from relay, disconnecting\n");
+	    return -1;
+	}
+	used += sizeof(h) + h.compressedLength;
+
+	uint32_t n = 0;
+	for ( size_t at = 0; at + 4 <= h.rawLength; ) {
+	    uint32_t len;
+	    memcpy( &len, raw + at, 4);
+	    at += 4;
+	    if ( len > h.rawLength - at) break;
+
+	    struct ook_burst *burst;
+	    if ( ook_decode( raw + at, len, &burst)) {
+		ook_send( &out, burst);
+		free(burst);
+		n++;
+	    }
+	    at += len;
+	}
+	if ( verbose) fprintf(stderr, "Relayed a batch of %u bursts\n", n);
+    }
+
+    memmove( p->buf, p->buf + used, p->have - used);
+    p->have -= used;
+    return 0;
+}
+
+static int receive( const char *listenAddress, const char *listenPort, const char *multicastAddress,
+		    const char *multicastPort, const char *multicastInterface)
+{
+    int lsock = listenOn( listenAddress, listenPort);
+    if ( lsock < 0) return -1;
+
+    out.sock = ook_open_sender( multicastAddress, multicastPort, multicastInterface, &out.to, &out.toLen);
+    if ( out.sock < 0) return -1;
+    out.sequence.source = ook_sequence_source();
+
+    uint8_t *raw = malloc( RELAY_MAX_BATCH);
+    if ( !raw) return -1;
+
+    struct peer peers[RELAY_MAX_PEERS];
+    for ( int i = 0; i < RELAY_MAX_PEERS; i++) peers[i].fd = -1;
+    const size_t bufSize = sizeof(struct batchHeader) + RELAY_MAX_BATCH;
+
+    for (;;) {
+	struct pollfd fds[RELAY_MAX_PEERS+1];
+	fds[0] = (struct pollfd){ .fd = lsock, .events = POLLIN };
+	for ( int i = 0; i < RELAY_MAX_PEERS; i++) fds[i+1] = (struct pollfd){ .fd = peers[i].fd, .events = POLLIN };
+
+	if ( poll( fds, RELAY_MAX_PEERS+1, -1) < 0) {
+	    if ( errno == EINTR) continue;
+	    fprintf(stderr, "Failed to poll: %s\n", strerror(errno));
+	    return -1;
+	}
+
+	if ( fds[0].revents & POLLIN) {
+	    int fd = accept( lsock, 0, 0);
+	    int slot = -1;
+	    for ( int i = 0; i < RELAY_MAX_PEERS && slot < 0; i++) if ( peers[i].fd < 0) slot = i;
+	    if ( fd >= 0 && slot < 0) {
+		fprintf(stderr, "Too many relays connected, refused one\n");
+		close(fd);
+	    } else if ( fd >= 0) {
+		peers[slot].buf = malloc( bufSize);
+		if ( !peers[slot].buf) {
+		    close(fd);
+		} else {
+		    if ( verbose) fprintf(stderr, "Relay connected\n");
+		    peers[slot].fd = fd;
+		    peers[slot].have = 0;
+		}
+	    }
+	}
+
+	for ( int i = 0; i < RELAY_MAX_PEERS; i++) {
+	    struct peer *p = &peers[i];
+	    if ( p->fd < 0 || !(fds[i+1].revents & (POLLIN|POLLERR|POLLHUP))) continue;
+
+	    ssize_t got = recv( p->fd, p->buf + p->have, bufSize - p->have, 0);
+	    if ( got < 0 && errno == EINTR) continue;
+	    if ( got > 0) p->have += got;
+	    if ( got <= 0 || unpackBatches( p, raw) < 0) {
+		if ( verbose) fprintf(stderr, "Relay disconnected\n");
+		close( p->fd);
+		free( p->buf);
+		p->fd = -1;
+	    }
+	}
+    }
+}
+
+int main( int argc, char **argv)
+{
+    const char *multicastAddress = "236.0.0.1";
+    const char *multicastPort = "3636";
+    const char *multicastInterface = "127.0.0.1";
+    const char *target = 0;
+    const char *listenPort = 0;
+    const char *listenAddress = 0;
+    unsigned windowMs = 100;
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "connect", required_argument, 0, 'c' },
+	    { "listen", required_argument, 0, 'l' },
+	    { "listen-address", required_argument, 0, 'L' },
+	    { "multicast-address", required_argument, 0, 'a'},
+	    { "multicast-port", required_argument, 0, 'p' },
+	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "window", required_argument, 0, 'w' },
+	    { "backlog", required_argument, 0, 'b' },
+	    { "mtu", required_argument, 0, 'u' },
+	    { "receive-buffer", required_argument, 0, 'B' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?c:l:L:a:p:i:w:b:u:B:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 'c':
+	    target = optarg;
+	    break;
+	  case 'l':
+	    listenPort = optarg;
+	    break;
+	  case 'L':
+	    listenAddress = optarg;
+	    break;
+	  case 'a':
+	    multicastAddress = optarg;
+	    break;
+	  case 'p':
+	    multicastPort = optarg;
+	    break;
+	  case 'i':
+	    multicastInterface = optarg;
+	    break;
+	  case 'w':
+	    if ( atoi(optarg) < 1) {
+		fprintf(stderr,"Bad window: %s\n", optarg);
+		exit(1);
+	    }
+	    windowMs = atoi(optarg);
+	    break;
+	  case 'b':
+	    if ( atol(optarg) < 1) {
+		fprintf(stderr,"Bad backlog: %s\n", optarg);
+		exit(1);
+	    }
+	    backlog.maxBytes = atol(optarg);
+	    break;
+	  case 'u':
+	    if ( atoi(optarg) < 576 || atoi(optarg) > 65535) {
+		fprintf(stderr,"Bad MTU, it must be from 576 to 65535: %s\n", optarg);
+		exit(1);
+	    }
+	    out.maxDatagram = atoi(optarg) - 48;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    if ( !target == !listenPort) {
+	fprintf(stderr,"Give one of --connect or --listen\n");
+	showHelp(stderr);
+	exit(1);
+    }
+
+    signal( SIGPIPE, SIG_IGN);   // a dropped connection is an error from send()
+
+    int e = target ? forward( target, multicastAddress, multicastPort, multicastInterface, windowMs)
+		   : receive( listenAddress, listenPort, multicastAddress, multicastPort, multicastInterface);
+    return e < 0 ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+** Show the metrics of a running ookd, read from its shared memory
+** stats block (ookd --stats-shm), or of clients given --stats-shm.
+**
+** With --latency the stage latency histograms of all the blocks given are
+** added up, so ookd's and a client's make the whole trip of a burst.
+*/
+
+int verbose=0;
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ookstats [-h] [-?] [-v] [-l] [-s name]... [-i seconds]\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -s name | --stats-shm name            shared memory name ookd or a client was given, default /ookd\n"
+	    "                                        may be repeated\n"
+	    "  -l | --latency                        show a table of stage latencies instead of all metrics\n"
+	    "  -i secs | --interval secs             print again every secs seconds, default just once\n"
+	    );
+}
+
+int main( int argc, char **argv)
+{
+    const char *statsShmName[argc+1];
+    int names = 0;
+    int interval = 0;
+    int latency = 0;
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "stats-shm", required_argument, 0, 's' },
+	    { "interval", required_argument, 0, 'i' },
+	    { "latency", no_argument, 0, 'l' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?ls:i:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 's':
+	    statsShmName[names++] = optarg;
+	    break;
+	  case 'l':
+	    latency = 1;
+	    break;
+	  case 'i':
+	    interval = atoi(optarg);
+	    if ( interval < 1) {
+		fprintf(stderr,"Bad interval: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    if ( names == 0) statsShmName[names++] = "/ookd";
+
+    const struct metrics *m[names];
+    for ( int i = 0; i < names; i++) {
+	m[i] = metricsAttach( statsShmName[i]);
+	if ( !m[i]) exit(1);
+    }
+
+    for (;;) {
+	if ( latency) {
+	    metricsFormatLatency( m, names, stdout);
+	} else {
+	    for ( int i = 0; i < names; i++) {
+		if ( names > 1) printf("# %s\n", statsShmName[i]);
+		metricsFormat( m[i], stdout);
+	    }
+	}
+	fflush(stdout);
+	if ( interval == 0) break;
+	sleep( interval);
+	printf("\n");
+    }
+
+    return 0;
+}
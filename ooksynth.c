@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "synth.h"
+
+int verbose=0;
+
+static void showHelp( FILE *f)
+{
+    fprintf(f,
+	    "Usage: ooksynth [-h] [-?] [-v] [-o file] [-l file] [-d seconds] [-n snr] [-f offset] [-c rate] [-g gap] [-P protocols] [-S seed]\n"
+	    "  -h | -? | --help                      display usage and exit\n"
+	    "  -v | --verbose                        verbose logging\n"
+	    "  -o file | --output file               where to write the IQ data, default stdout\n"
+	    "  -l file | --log file                  where to list the injected transmissions, default none\n"
+	    "  -d secs | --duration secs             length of the capture, default 30\n"
+	    "  -n db | --snr db                      signal to noise ratio, default 20\n"
+	    "  -f hz | --offset hz                   maximum carrier frequency offset, default 20000\n"
+	    "  -c rate | --collisions rate           fraction of transmissions which collide, default 0\n"
+	    "  -g secs | --gap secs                  mean quiet time between transmissions, default 0.25\n"
+	    "  -P list | --protocols list            comma separated, wh1080,oregonsci,acurite,nexa, default all\n"
+	    "  -S n | --seed n                       random seed, default 1\n"
+	    );
+}
+
+int main( int argc, char **argv)
+{
+    const char *outputFileName = 0;
+    const char *logFileName = 0;
+    struct synthConfig config;
+
+    synthDefaults( &config);
+
+    // Handle options
+    for(;;) {
+	int optionIndex = 0;
+	static struct option options[] = {
+	    { "verbose", no_argument, 0, 'v' },
+	    { "help",    no_argument, 0, 'h' },
+	    { "output", required_argument, 0, 'o' },
+	    { "log", required_argument, 0, 'l' },
+	    { "duration", required_argument, 0, 'd' },
+	    { "snr", required_argument, 0, 'n' },
+	    { "offset", required_argument, 0, 'f' },
+	    { "collisions", required_argument, 0, 'c' },
+	    { "gap", required_argument, 0, 'g' },
+	    { "protocols", required_argument, 0, 'P' },
+	    { "seed", required_argument, 0, 'S' },
+	    { 0,0,0,0}
+	};
+
+	int c = getopt_long( argc, argv, "vh?o:l:d:n:f:c:g:P:S:", options, &optionIndex );
+	if ( c == -1) break;
+
+	switch(c) {
+	  case 'h':
+	  case '?':
+	    showHelp(stdout);
+	    return 0;
+	  case 'v':
+	    verbose = 1;
+	    break;
+	  case 'o':
+	    outputFileName = optarg;
+	    break;
+	  case 'l':
+	    logFileName = optarg;
+	    break;
+	  case 'd':
+	    config.seconds = atof(optarg);
+	    break;
+	  case 'n':
+	    config.snrDb = atof(optarg);
+	    break;
+	  case 'f':
+	    config.maxOffsetHz = atof(optarg);
+	    break;
+	  case 'c':
+	    config.collisionRate = atof(optarg);
+	    break;
+	  case 'g':
+	    config.meanGapSeconds = atof(optarg);
+	    break;
+	  case 'P':
+	    config.protocols = synthProtocolsByName(optarg);
+	    if ( config.protocols == 0) exit(1);
+	    break;
+	  case 'S':
+	    config.seed = strtoull( optarg, 0, 0);
+	    break;
+	  default:
+	    fprintf(stderr,"Illegal option\n");
+	    showHelp(stderr);
+	    exit(1);
+	}
+    }
+
+    struct synthCapture capture;
+    if ( synthGenerate( &config, &capture) < 0) exit(1);
+
+    FILE *out = stdout;
+    if ( outputFileName) {
+	out = fopen( outputFileName, "w");
+	if ( !out) {
+	    fprintf(stderr, "Failed to open output file '%s': %s\n", outputFileName, strerror(errno));
+	    exit(1);
+	}
+    }
+    if ( fwrite( capture.iq, 1, capture.len, out) != capture.len) {
+	fprintf(stderr, "Failed to write IQ data: %s\n", strerror(errno));
+	exit(1);
+    }
+    if ( out != stdout) fclose(out);
+
+    if ( logFileName) {
+	FILE *log = fopen( logFileName, "w");
+	if ( !log) {
+	    fprintf(stderr, "Failed to open log file '%s': %s\n", logFileName, strerror(errno));
+	    exit(1);
+	}
+	fprintf(log, "# start_sample end_sample protocol pulses offset_hz collided\n");
+	for ( size_t i = 0; i < capture.count; i++) {
+	    const struct synthBurst *b = &capture.bursts[i];
+	    fprintf(log, "%llu %llu %s %u %d %d\n", (unsigned long long)b->startSample, (unsigned long long)b->endSample,
+		    synthProtocolName(b->protocol), b->pulses, b->offsetHz, b->collided);
+	}
+	fclose(log);
+    }
+
+    if ( verbose) fprintf(stderr,"Synthesized %zu samples with %zu transmissions\n", capture.len/2, capture.count);
+
+    synthFree( &capture);
+    return 0;
+}
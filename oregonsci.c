@@ -6,10 +6,13 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <signal.h>
 #include <math.h>
 #include <sys/stat.h>
 
 #include "ook.h"
+#include "protocols.h"
+#include "metrics.h"
 #include "datum.h"
 
 int verbose=0;
@@ -160,26 +163,186 @@ static void recordPeriodic( const char *file)
 static void showHelp( FILE *f)
 {
     fprintf(f, 
-	    "Usage: oregonsci [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface]\n"
+	    "Usage: oregonsci [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-R ring] [-B bytes]\n"
 	    "  -h | -? | --help                      display usage and exit\n"
 	    "  -v | --verbose                        verbose logging\n"
 	    "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
 	    "  -p port | --multicast-port port       multicast port, default 3636\n"
 	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -R name | --ring name                 read bursts from ookd's shared memory ring instead, e.g. /ookd-ring\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving faster than we decode them\n"
 	    "  -r path | --recent path               path to most recent data, /tmp/current-weather.json\n"
 	    "  -P path | --periodic path             path to the periodic data, /tmp/weather\n"
 	    "                                        timestamp.json gets appended.\n"
 	    "  -m period | --minutes period          number of minutes between periodic data files.\n"
+	    "  -s name | --stats-shm name            publish latency metrics in shared memory with this name, for ookstats\n"
 	    );
 }
 
-static int okChecksum( unsigned char *nibbles, unsigned int csumLocation) {
-    unsigned int sum = 0;
-    for ( int n = 7; n < csumLocation; n++) {  // skips sync and preamble
-	sum += nibbles[n];
+static int okChecksum( struct ook_burst *burst, unsigned char *nibbles, int count, unsigned int csumLocation) {
+    return oregonsci_checksum_ok( nibbles, csumLocation) || oregonsci_repair( burst, nibbles, count, csumLocation, verbose);
+}
+
+// What the handlers need from main()
+static struct metrics *metrics = 0;
+static const char *recentFileName = "/tmp/current-weather.json";
+static const char *periodicFileName = "/tmp/weather";
+static int minutes = 5;
+
+static double recentTemp[3] = {-500.0, -500.0, -500.0};
+static double recentHum[3] = {-1,-1,-1};
+static double recentWind = -1;
+static double recentGust = -1;
+static double recentRain = -1;
+static int recentBattery = 0;
+static int recentDirection = -1;
+
+static int lastRainCounter = -1;
+
+// Write the periodic file on time even if the station has gone quiet
+static void periodicTask( void *ctx)
+{
+    if ( oldestDatum && time(0)-oldestDatum > minutes*60) {
+	recordPeriodic( periodicFileName);
+    }
+}
+
+static void handleBurst( struct ook_burst *burst, int sock, void *ctx)
+{
+    metricsBurstReceived( metrics, burst);
+    metricsReceiveStats( metrics, sock);
+
+    // Data never comes faster than 5 seconds, we are looking at the second of a pair
+    // of redundant transmissions
+    //if ( oldestDatum && time(0)-oldestDatum < 5) continue;
+
+    unsigned char *nibble = 0;
+    int nibbles = oregonsci_decode( burst, &nibble, verbose);
+
+    if ( nibbles > 0) {
+	metricsBurstDecoded( metrics, burst);
+
+	unsigned int sensorId = (nibble[7]<<12) + (nibble[8]<<8) + (nibble[9]<<4) + nibble[10];
+	unsigned int channel = nibble[11];
+	unsigned int rollingCode = (nibble[12]<<4)+nibble[13];
+	unsigned int flags = nibble[14];
+	if ( verbose) fprintf(stderr,"sensor=%04x channel=%d rollingcode=%d flags=0x%x\n", sensorId, channel, rollingCode, flags);
+
+	// Sensor specific data begins at 15.
+	switch( sensorId) {
+	  case 0xf824:
+	  case 0x1220:
+	  case 0xf8b4:
+	      {
+		  if ( nibbles != 26) {
+		      if ( verbose) fprintf(stderr,"Temperature/Humidity sensor data is wrong length, sensorid=%04x, lenght=%d needed 26\n", sensorId, nibbles);
+		      break;
+		  }
+		  if ( okChecksum( burst, nibble, nibbles, 22)) {
+		      int tempTenthsC = nibble[17]*100+nibble[16]*10+nibble[15];
+		      if (nibble[18] != 0) tempTenthsC *= -1;
+		      int relativeHum = nibble[20]*10 + nibble[19];
+		      if ( verbose) fprintf(stderr,"Temp=%4.1fC Hum=%02d%% %d\n", tempTenthsC/10.0, relativeHum, nibbles);
+		      if ( channel <= 2) {
+			  addSample( &temperature[channel], tempTenthsC/10.0);
+			  addSample( &humidity[channel], relativeHum);
+			  recentTemp[channel] = tempTenthsC/10.0;
+			  recentHum[channel] = relativeHum;
+		      } else {
+			  fprintf(stderr,"Bad channel on sensor %04x, channel %d\n", sensorId, channel);
+		      }
+		      if (oldestDatum == 0) oldestDatum = time(0);
+
+		  } else {
+		      fprintf(stderr,"Bad checksum on sensor %04x\n", sensorId);
+		  }
+
+	      }
+	      break;
+	  case 0x2914:
+	      {
+		  if ( nibbles != 29) {
+		      if ( verbose) fprintf(stderr,"Rain sensor data is wrong length, sensorid=%04x, lenght=%d needed 29\n", sensorId, nibbles);
+		      break;
+		  }
+		  if ( okChecksum( burst, nibble, nibbles, 25)) {
+		      const int inchesPerMeter = 1000.0/25.4;
+		      int rainHundrethsPerHour = nibble[18]*1000+nibble[17]*100+nibble[16]*10+nibble[15]; // inch/100
+		      int rainCount = nibble[24]*100000 + nibble[23]*10000 + nibble[22]*1000 +
+			  nibble[21]*100 + nibble[20]*10 + nibble[19];                                    // inch/1000
+		      if ( verbose) fprintf(stderr,"Rain=%4.1fin/hr Tot=%6d thousandths\n", rainHundrethsPerHour/100.0, rainCount);
+		      if ( lastRainCounter < 0 || lastRainCounter > rainCount ) {  // if first or wrapped, just set for later
+			  lastRainCounter = rainCount;
+		      } else {
+			  int r = (rainCount - lastRainCounter) * inchesPerMeter;
+			  lastRainCounter = rainCount;
+			  recentRain = r;
+			  addSample(&rainfall, r);
+			  if (oldestDatum == 0) oldestDatum = time(0);
+		      }
+		  } else {
+		      fprintf(stderr,"Bad checksum on sensor %04x\n", sensorId);
+		  }
+
+	      }
+	      break;
+	  case 0x1984:
+	  case 0x1994:
+	      {
+		  if ( nibbles != 28) {
+		      if ( verbose) fprintf(stderr,"Wind sensor data is wrong length, sensorid=%04x, lenght=%d needed 28\n", sensorId, nibbles);
+		      break;
+		  }
+		  if ( okChecksum( burst, nibble, nibbles, 24)) {
+		      int direction = nibble[15];
+		      int directionDegrees = (int)(direction*22.5);
+
+		      // 16 and 17 are unknown
+		      int currentSpeed = nibble[20]*100 + nibble[19]*10 + nibble[18];
+		      int averageSpeed = nibble[23]*100 + nibble[22]*10 + nibble[21];
+
+		      if ( verbose) fprintf(stderr,"Wind=%4.1fm/s avg=%4.1fm/s dir=%ds\n", currentSpeed/10.0, averageSpeed/10.0, directionDegrees);
+
+		      addSample( &averageWindSpeed, averageSpeed/10.0);
+		      addSample( &gustWindSpeed, currentSpeed/10.0);
+		      addSample( &windDirection, directionDegrees);
+		      addCSampleMA( &windVector, averageSpeed/10.0, directionDegrees/360.0*M_2_PI);
+
+		      recentWind = averageSpeed/10.0;
+		      recentGust = currentSpeed/10.0;
+		      recentDirection = directionDegrees;
+
+		      if (oldestDatum == 0) oldestDatum = time(0);
+		  } else {
+		      fprintf(stderr,"Bad checksum on sensor %04x\n", sensorId);
+		  }
+
+	      }
+	      break;
+	    break;
+	  default:
+	    if (verbose) fprintf(stderr,"Unknown sensor: %04x\n", sensorId);
+	}
+
+	periodicTask( 0);
+
+	if ( verbose) dumpWeather();
+
+	recordRecent( recentFileName, 
+		      recentTemp[0], recentTemp[1], recentTemp[2], 
+		      recentHum[0], recentHum[1], recentHum[2], 
+		      recentWind, recentGust, recentRain, recentBattery, recentDirection);
+	metricsBurstOutput( metrics, burst);
     }
-    unsigned int csum = nibbles[csumLocation+1]*16 + nibbles[csumLocation];
-    return sum == csum;
+
+    if (nibble) free(nibble);
+
+    fflush(stdout);
+}
+
+static void stopOnSignal( int signum, void *ctx)
+{
+    ook_loop_stop( ctx);
 }
 
 int main( int argc, char **argv)
@@ -187,19 +350,9 @@ int main( int argc, char **argv)
     const char *multicastAddress = "236.0.0.1";
     const char *multicastPort = "3636";
     const char *multicastInterface = "127.0.0.1";
-    const char *recentFileName = "/tmp/current-weather.json";
-    const char *periodicFileName = "/tmp/weather";
-    int minutes = 5;
-
-    double recentTemp[3] = {-500.0, -500.0, -500.0};
-    double recentHum[3] = {-1,-1,-1};
-    double recentWind = -1;
-    double recentGust = -1;
-    double recentRain = -1;
-    int recentBattery = 0;
-    int recentDirection = -1;
-
-    int lastRainCounter = -1;
+    const char *ringName = 0;
+    int receiveBuffer = 0;
+    const char *statsShmName = 0;
 
     // Handle options
     for(;;) {
@@ -210,13 +363,16 @@ int main( int argc, char **argv)
 	    { "multicast-address", required_argument, 0, 'a'},
 	    { "multicast-port", required_argument, 0, 'p' },
 	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "receive-buffer", required_argument, 0, 'B' },
 	    { "recent", required_argument, 0, 'r' },
 	    { "periodic", required_argument, 0, 'P' },
 	    { "minutes", required_argument, 0, 'm' },
+	    { "stats-shm", required_argument, 0, 's' },
 	    { 0,0,0,0}
 	};
 
-	int c = getopt_long( argc, argv, "vh?f:a:p:i:m:r:P:", options, &optionIndex );
+	int c = getopt_long( argc, argv, "vh?f:a:p:i:m:r:P:s:R:B:", options, &optionIndex );
 	if ( c == -1) break;
 
 	switch(c) {
@@ -236,6 +392,16 @@ case '?':
 	  case 'i':
 	    multicastInterface = optarg;
 	    break;
+	  case 'R':
+	    ringName = optarg;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	  case 'r':
 	    recentFileName = optarg;
 	    break;
@@ -252,6 +418,9 @@ case '?':
 		  minutes = m;
 	      }
 	      break;
+	  case 's':
+	    statsShmName = optarg;
+	    break;
 	  default:
 	    fprintf(stderr,"Illegal option\n");
 	    showHelp(stderr);
@@ -261,200 +430,39 @@ case '?':
 
     if ( verbose) fprintf(stderr,"Periodic file is %s\n", periodicFileName);
 
-    // Parse our multicast address
-    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
-    if ( sock < 0) {
-	fprintf(stderr,"Failed to open multicast interface\n");
-	exit(1);
+    if ( statsShmName) {
+	metrics = metricsOpen( statsShmName);
+	if ( !metrics) exit(1);
     }
 
-    for (;;) {
-	struct ook_burst *burst;
-	struct sockaddr_storage addr;
-	socklen_t addrLen = sizeof(addr);
-
-	int e = ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
-	if ( e < 0) {
-	    fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
-	    break;
-	}
-	if ( e == 0) {
-	    fprintf(stderr,"Corrupt burst\n");
-	    continue;
+    // Bursts come from ookd's ring if we share its host and were asked to, otherwise multicast
+    struct ook_ring *ring = 0;
+    int sock = -1;
+    if ( ringName) {
+	ring = ook_ring_attach( ringName);
+	if ( !ring) exit(1);
+    } else {
+	sock = ook_open( multicastAddress, multicastPort, multicastInterface);
+	if ( sock < 0) {
+	    fprintf(stderr,"Failed to open multicast interface\n");
+	    exit(1);
 	}
+	if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) exit(1);
+    }
 
-	// Data never comes faster than 5 seconds, we are looking at the second of a pair
-	// of redundant transmissions
-	//if ( oldestDatum && time(0)-oldestDatum < 5) continue;
-
-	{
-	    unsigned char *data = 0;
-	    size_t dataLen = 0;
-	    int bits = ook_decode_manchester( burst, 
-					      200000, 715000,  // on short
-					      715000, 1200000, // on long
-					      200000, 650000,  // off short
-					      650000, 1200000, //off long
-					      &data, &dataLen,
-					      verbose);
-	    
-	    if ( bits > 0) {
-		unsigned nibbles = (bits+3)/4;
-		unsigned char nibble[ nibbles];
-		memset( nibble, 0, nibbles);
-		for ( int i = 0; i < bits; i++) {
-		    if (data[i]==0) {
-			nibble[ i/4] += (1<<(i%4));  // least significant first
-		    }
-		}
-		if ( verbose) {
-		    fprintf(stderr, "Decoded manchester %d bits, %d nibbles ", bits, nibbles);
-		    for ( int n = 0; n < nibbles; n++) {
-			fprintf(stderr,"%x", nibble[n]);
-		    }
-		    fprintf(stderr,"\n");
-		}
-
-		if ( nibbles < 16) {
-		    if ( verbose) fprintf(stderr,"too short to be valid data\n");
-		    continue;
-		}
-
-		for ( int i = 0; i < 6; i++) {
-		    if ( nibble[i] != 0x0f) {
-			if ( verbose) fprintf(stderr,"sync bits were not all 0xf\n");
-			continue;
-		    }
-		}
-
-		if ( nibble[6] != 0xa) {
-		    if ( verbose) fprintf(stderr,"preamble was not 0xa\n");
-		    continue;
-		}
-
-		unsigned int sensorId = (nibble[7]<<12) + (nibble[8]<<8) + (nibble[9]<<4) + nibble[10];
-		unsigned int channel = nibble[11];
-		unsigned int rollingCode = (nibble[12]<<4)+nibble[13];
-		unsigned int flags = nibble[14];
-		if ( verbose) fprintf(stderr,"sensor=%04x channel=%d rollingcode=%d flags=0x%x\n", sensorId, channel, rollingCode, flags);
-
-		// Sensor specific data begins at 15.
-		switch( sensorId) {
-		  case 0xf824:
-		  case 0x1220:
-		  case 0xf8b4:
-		      {
-			  if ( nibbles != 26) {
-			      if ( verbose) fprintf(stderr,"Temperature/Humidity sensor data is wrong length, sensorid=%04x, lenght=%d needed 26\n", sensorId, nibbles);
-			      break;
-			  }
-			  if ( okChecksum( nibble, 22)) {
-			      int tempTenthsC = nibble[17]*100+nibble[16]*10+nibble[15];
-			      if (nibble[18] != 0) tempTenthsC *= -1;
-			      int relativeHum = nibble[20]*10 + nibble[19];
-			      if ( verbose) fprintf(stderr,"Temp=%4.1fC Hum=%02d%% %d\n", tempTenthsC/10.0, relativeHum, nibbles);
-			      if ( channel <= 2) {
-				  addSample( &temperature[channel], tempTenthsC/10.0);
-				  addSample( &humidity[channel], relativeHum);
-				  recentTemp[channel] = tempTenthsC/10.0;
-				  recentHum[channel] = relativeHum;
-			      } else {
-				  fprintf(stderr,"Bad channel on sensor %04x, channel %d\n", sensorId, channel);
-			      }
-			      if (oldestDatum == 0) oldestDatum = time(0);
-
-			  } else {
-			      fprintf(stderr,"Bad checksum on sensor %04x\n", sensorId);
-			  }
-
-		      }
-		      break;
-		  case 0x2914:
-		      {
-			  if ( nibbles != 29) {
-			      if ( verbose) fprintf(stderr,"Rain sensor data is wrong length, sensorid=%04x, lenght=%d needed 29\n", sensorId, nibbles);
-			      break;
-			  }
-			  if ( okChecksum( nibble, 25)) {
-			      const int inchesPerMeter = 1000.0/25.4;
-			      int rainHundrethsPerHour = nibble[18]*1000+nibble[17]*100+nibble[16]*10+nibble[15]; // inch/100
-			      int rainCount = nibble[24]*100000 + nibble[23]*10000 + nibble[22]*1000 +
-				  nibble[21]*100 + nibble[20]*10 + nibble[19];                                    // inch/1000
-			      if ( verbose) fprintf(stderr,"Rain=%4.1fin/hr Tot=%6d thousandths\n", rainHundrethsPerHour/100.0, rainCount);
-			      if ( lastRainCounter < 0 || lastRainCounter > rainCount ) {  // if first or wrapped, just set for later
-				  lastRainCounter = rainCount;
-			      } else {
-				  int r = (rainCount - lastRainCounter) * inchesPerMeter;
-				  lastRainCounter = rainCount;
-				  recentRain = r;
-				  addSample(&rainfall, r);
-				  if (oldestDatum == 0) oldestDatum = time(0);
-			      }
-			  } else {
-			      fprintf(stderr,"Bad checksum on sensor %04x\n", sensorId);
-			  }
-
-		      }
-		      break;
-		  case 0x1984:
-		  case 0x1994:
-		      {
-			  if ( nibbles != 28) {
-			      if ( verbose) fprintf(stderr,"Wind sensor data is wrong length, sensorid=%04x, lenght=%d needed 28\n", sensorId, nibbles);
-			      break;
-			  }
-			  if ( okChecksum( nibble, 24)) {
-			      int direction = nibble[15];
-			      int directionDegrees = (int)(direction*22.5);
-
-			      // 16 and 17 are unknown
-			      int currentSpeed = nibble[20]*100 + nibble[19]*10 + nibble[18];
-			      int averageSpeed = nibble[23]*100 + nibble[22]*10 + nibble[21];
-
-			      if ( verbose) fprintf(stderr,"Wind=%4.1fm/s avg=%4.1fm/s dir=%ds\n", currentSpeed/10.0, averageSpeed/10.0, directionDegrees);
-
-			      addSample( &averageWindSpeed, averageSpeed/10.0);
-			      addSample( &gustWindSpeed, currentSpeed/10.0);
-			      addSample( &windDirection, directionDegrees);
-			      addCSampleMA( &windVector, averageSpeed/10.0, directionDegrees/360.0*M_2_PI);
-
-			      recentWind = averageSpeed/10.0;
-			      recentGust = currentSpeed/10.0;
-			      recentDirection = directionDegrees;
-
-			      if (oldestDatum == 0) oldestDatum = time(0);
-			  } else {
-			      fprintf(stderr,"Bad checksum on sensor %04x\n", sensorId);
-			  }
-
-		      }
-		      break;
-		    break;
-		  default:
-		    if (verbose) fprintf(stderr,"Unknown sensor: %04x\n", sensorId);
-		}
-
-		if ( oldestDatum && time(0)-oldestDatum > minutes*60) {
-		    recordPeriodic( periodicFileName);
-		}
-
-		if ( verbose) dumpWeather();
-
-		recordRecent( recentFileName, 
-			      recentTemp[0], recentTemp[1], recentTemp[2], 
-			      recentHum[0], recentHum[1], recentHum[2], 
-			      recentWind, recentGust, recentRain, recentBattery, recentDirection);
-	    } else {
-		if ( verbose) fprintf(stderr,"ignored %d pulse burst\n", burst->pulses);
-	    }
-
-	    if (data) free(data);
-	}
+    struct ook_loop *loop = ook_loop_new();
+    if ( !loop) exit(1);
+    if ( (ring ? ook_loop_add_ring( loop, ring, handleBurst, 0, verbose)
+	       : ook_loop_add_socket( loop, sock, handleBurst, 0, verbose)) < 0) exit(1);
+    if ( !ook_loop_every( loop, 1000000000ULL, periodicTask, 0)) exit(1);
+    if ( ook_loop_signal( loop, SIGINT, stopOnSignal, loop) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGTERM, stopOnSignal, loop) < 0) exit(1);
 
-	fflush(stdin);
-	free(burst);
-    }
+    ook_loop_run( loop);
 
-    close(sock);
+    ook_loop_free( loop);
+    if ( sock >= 0) close(sock);
+    ook_ring_detach( ring);
+    metricsClose( metrics, statsShmName);
     return 0;
 }
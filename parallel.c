@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+static const uint64_t warmupSamples = 1<<18;       // long enough for the filters to forget, nearly always, see stitch()
+static const uint64_t minimumChunkSamples = 1<<20;
+static const uint32_t sliceLen = 16384;
+
+struct finishedBurst {
+    struct ook_burst *burst;
+    uint64_t endSample;
+};
+
+struct chunk {
+    uint64_t start;            // nominal first sample
+    uint64_t end;              // nominal first sample of the next chunk
+    int first, last;
+    struct detector detector;
+
+    struct finishedBurst *bursts;
+    size_t count, allocated;
+    int failed;
+    int done;
+};
+
+struct pool {
+    const unsigned char *data;
+    uint64_t samples;
+    uint32_t sampleRate;
+    float alpha;
+    int fixedPoint;
+
+    struct chunk *chunks;
+    size_t nChunks;
+    size_t nextChunk;
+
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+// Keep only the bursts this chunk owns, those ending after our leading quiet point
+// and no later than our trailing one.
+static void collectBurst( struct ook_burst *burst, uint64_t endSample, void *ctx)
+{
+    struct chunk *c = (struct chunk *)ctx;
+
+    if ( !c->first && c->detector.quiet[0].found < 0) return;     // still the previous chunk's
+    if ( !c->last && c->detector.quiet[1].found >= 0) return;     // already the next chunk's
+
+    if ( c->count == c->allocated) {
+	size_t n = c->allocated ? c->allocated*2 : 64;
+	struct finishedBurst *b = realloc( c->bursts, n*sizeof(*b));
+	if ( !b) {
+	    c->failed = 1;
+	    return;
+	}
+	c->bursts = b;
+	c->allocated = n;
+    }
+
+    struct ook_burst *copy = ook_allocate_burst( burst->pulses);
+    if ( !copy) {
+	c->failed = 1;
+	return;
+    }
+    copy->positionNanoseconds = burst->positionNanoseconds;
+    copy->noiseFloor = burst->noiseFloor;
+    copy->pulses = burst->pulses;
+    memcpy( copy->pulse, burst->pulse, burst->pulses*sizeof(burst->pulse[0]));
+
+    c->bursts[c->count].burst = copy;
+    c->bursts[c->count].endSample = endSample;
+    c->count++;
+}
+
+// noise is the noise floor state to impose on the leading quiet point, if useNoise
+static void runChunk( struct pool *p, struct chunk *c, int useNoise, uint32_t noise)
+{
+    uint64_t from = c->start;
+    if ( !c->first) from = c->start > warmupSamples ? c->start - warmupSamples : 0;
+
+    detectorInit( &c->detector, p->sampleRate, p->alpha, collectBurst, c);
+    c->detector.fixedPoint = p->fixedPoint;
+    c->detector.sampleCounter = from;
+    if ( !c->first) detectorSearchQuiet( &c->detector, 0, c->start);
+    if ( !c->last) detectorSearchQuiet( &c->detector, 1, c->end);
+    c->detector.quiet[0].noiseFixed = noise;
+    c->detector.quiet[0].useNoise = useNoise;
+
+    for ( uint64_t s = from; s < p->samples; ) {
+	uint64_t n = sliceLen/2;
+	if ( s + n > p->samples) n = p->samples - s;
+
+	findPulses( &c->detector, p->data + 2*s, 2*n);
+	s += n;
+
+	if ( !c->last && c->detector.quiet[1].found >= 0) break;    // the rest is the next chunk's
+    }
+
+    detectorFree( &c->detector);
+}
+
+static void *worker( void *arg)
+{
+    struct pool *p = (struct pool *)arg;
+
+    for (;;) {
+	pthread_mutex_lock( &p->lock);
+	size_t n = p->nextChunk++;
+	pthread_mutex_unlock( &p->lock);
+
+	if ( n >= p->nChunks) break;
+
+	runChunk( p, &p->chunks[n], 0, 0);
+
+	pthread_mutex_lock( &p->lock);
+	p->chunks[n].done = 1;
+	pthread_cond_broadcast( &p->finished);
+	pthread_mutex_unlock( &p->lock);
+    }
+    return 0;
+}
+
+// Everything about a detector is the same after a quiet point however it started, but the
+// noise floor, which takes long to forget and with integer steps needn't ever agree exactly.
+// If a chunk's isn't what the one before had on their shared quiet point, which it is all but
+// right after a change in the noise, run it again from there with the earlier chunk's.
+static void stitch( struct pool *p, const struct chunk *before, struct chunk *c)
+{
+    const struct quietSearch *end = &before->detector.quiet[1], *start = &c->detector.quiet[0];
+    if ( end->found < 0 || start->found != end->found || start->noiseFixed == end->noiseFixed) return;
+
+    for ( size_t b = 0; b < c->count; b++) free( c->bursts[b].burst);
+    c->count = 0;
+    c->failed = 0;
+    runChunk( p, c, 1, end->noiseFixed);
+}
+
+int parallelRun( const unsigned char *data, size_t len, unsigned jobs,
+		 uint32_t sampleRate, float alpha, int fixedPoint, burst_handler handler, void *ctx)
+{
+    if ( jobs < 1 || sampleRate == 0) {
+	fprintf(stderr,"Bad parallel parameters: %u jobs at %usamples/sec\n", jobs, sampleRate);
+	return -1;
+    }
+
+    struct pool p = { .data = data,
+		      .samples = len/2,
+		      .sampleRate = sampleRate,
+		      .alpha = alpha,
+		      .fixedPoint = fixedPoint,
+    };
+
+    uint64_t chunkSamples = p.samples/(4*jobs) + 1;     // a few per thread to even out the load
+    if ( chunkSamples < minimumChunkSamples) chunkSamples = minimumChunkSamples;
+
+    p.nChunks = (p.samples + chunkSamples - 1)/chunkSamples;
+    if ( p.nChunks == 0) return 0;
+
+    p.chunks = calloc( p.nChunks, sizeof(p.chunks[0]));
+    if ( !p.chunks) return -1;
+
+    for ( size_t i = 0; i < p.nChunks; i++) {
+	p.chunks[i].start = i*chunkSamples;
+	p.chunks[i].end = (i+1)*chunkSamples;
+	p.chunks[i].first = (i == 0);
+	p.chunks[i].last = (i == p.nChunks-1);
+    }
+
+    pthread_mutex_init( &p.lock, 0);
+    pthread_cond_init( &p.finished, 0);
+
+    if ( jobs > p.nChunks) jobs = p.nChunks;
+    pthread_t threads[jobs];
+    unsigned started = 0;
+    for ( ; started < jobs; started++) {
+	if ( pthread_create( &threads[started], 0, worker, &p) != 0) {
+	    fprintf(stderr,"Failed to start worker thread %u\n", started);
+	    break;
+	}
+    }
+    if ( started == 0) {
+	worker( &p);      // do it ourselves then
+    }
+
+    // Hand over the bursts in order as the chunks finish
+    int failed = 0;
+    for ( size_t i = 0; i < p.nChunks; i++) {
+	struct chunk *c = &p.chunks[i];
+
+	pthread_mutex_lock( &p.lock);
+	while ( !c->done) pthread_cond_wait( &p.finished, &p.lock);
+	pthread_mutex_unlock( &p.lock);
+	if ( i > 0) stitch( &p, &p.chunks[i-1], c);
+
+	if ( c->failed) {
+	    fprintf(stderr,"Ran out of memory while detecting chunk %zu\n", i);
+	    failed = 1;
+	}
+
+	for ( size_t b = 0; b < c->count; b++) {
+	    if ( !failed) handler( c->bursts[b].burst, c->bursts[b].endSample, ctx);
+	    free( c->bursts[b].burst);
+	}
+	free( c->bursts);
+    }
+
+    for ( unsigned t = 0; t < started; t++) pthread_join( threads[t], 0);
+
+    pthread_cond_destroy( &p.finished);
+    pthread_mutex_destroy( &p.lock);
+    free( p.chunks);
+
+    return failed ? -1 : 0;
+}
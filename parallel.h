@@ -0,0 +1,32 @@
+#ifndef PARALLEL_IS_IN
+#define PARALLEL_IS_IN
+
+/*
+** Run the pulse detector over a whole capture using several threads.
+**
+** The capture is cut into chunks and each chunk gets its own detector, started
+** a little early to let its filters settle. Neighboring detectors each find the
+** first place after their shared boundary where the signal forces any detector
+** to be idle; bursts finishing before that belong to the earlier chunk, later ones
+** to the next. This stitches the bursts that straddle a boundary, and the handler
+** sees exactly the bursts, in the same order, that a single detector would produce.
+** The noise floor is slower to forget than the rest, so each chunk is given the
+** one the chunk before it had at their quiet point, running it again if need be.
+**
+** The handler is called from the calling thread.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "detector.h"
+
+/*
+**   data/len is the IQ capture, jobs is the number of threads.
+**
+**   Returns <0 on failure.
+*/
+int parallelRun( const unsigned char *data, size_t len, unsigned jobs,
+		 uint32_t sampleRate, float alpha, int fixedPoint, burst_handler handler, void *ctx);
+
+#endif
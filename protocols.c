@@ -0,0 +1,590 @@
+#include "protocols.h"
+#include "checksum.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+
+// Fine Offset's CRC8 was done a bit at a time, after Luc Small's (http://lucsmall.com), itself
+// from the OneWire Arduino library, which may have come from me in the first place. The tables
+// are made the first time it is used, once, whichever thread gets there first.
+static struct crc8 fineOffset;
+static pthread_once_t fineOffsetOnce = PTHREAD_ONCE_INIT;
+
+static void fineOffsetInit( void)
+{
+    crc8Init( &fineOffset, 0x31);
+}
+
+uint8_t wh1080_crc8( const uint8_t *addr, uint8_t len)
+{
+    pthread_once( &fineOffsetOnce, fineOffsetInit);
+    return crc8Update( &fineOffset, 0, addr, len);
+}
+
+// A frame which fails its check is worth flipping its least certain bits one at a time, see ook_flip_search().
+// The checks here are all 8 bits, so each try has about a 1 in 256 chance of passing by accident when the
+// damage is elsewhere. Pairs would make that 1 in 16, single flips keep it to 1 in 32, and only frames with
+// weak bits are tried at all.
+#define FLIP_MOST 1
+#define FLIP_BUDGET OOK_FLIP_CANDIDATES
+
+static int wh1080Check( const uint8_t *data, uint32_t bits, void *ctx)
+{
+    return wh1080_crc8( data+1, 9) == data[10];
+}
+
+// Try flipping the bits of the weakest pulses, data is one bit for each pulse. 1 if it now has a good CRC.
+static int wh1080Repair( const struct ook_burst *burst, uint8_t *data, int verbose)
+{
+    uint8_t confidence[88];
+    for ( uint32_t i = 0; i < 88; i++) {
+	confidence[i] = i < 8 ? 255 : ook_pulse_confidence( burst, i);    // the 0xff preamble was right
+    }
+
+    int flipped = ook_flip_search( data, 88, confidence, FLIP_MOST, FLIP_BUDGET, wh1080Check, 0);
+    if ( flipped > 0 && verbose) fprintf(stderr,"CRC good after flipping %d weak bits\n", flipped);
+    return flipped > 0;
+}
+
+int wh1080_decode( struct ook_burst *burst, uint8_t frame[11], int verbose)
+{
+    unsigned char *data = 0;
+    size_t dataLen = 0;
+    int good = 0;
+    int bits = ook_decode_pulse_width( burst,
+				       1400000,1600000, 400000,600000, 900000,UINT_MAX,
+				       &data, &dataLen,
+				       verbose);
+
+    if ( bits == 88) {
+	if ( verbose) {
+	    for (int i = 0; i < dataLen; i++) fprintf(stderr,"%02x ", data[i]);
+	    fprintf(stderr,"\n");
+	}
+	if (data[0] != 0xff) {
+	    if ( verbose) fprintf(stderr,"Did not begin 0xff\n");
+	} else if (wh1080_crc8(data+1,9) != data[10] && !wh1080Repair( burst, data, verbose)) {
+	    if ( verbose) fprintf(stderr,"Bad CRC\n");
+	} else {
+	    memcpy( frame, data, 11);
+	    good = 1;
+	}
+    } else {
+	if ( verbose) fprintf(stderr,"ignored %d pulse burst\n", burst->pulses);
+    }
+
+    if (data) free(data);
+    return good;
+}
+
+int ws2300_decode( struct ook_burst *burst, uint8_t frame[7], int verbose)
+{
+    unsigned char *data = 0;
+    size_t dataLen = 0;
+    int good = 0;
+    int bits = ook_decode_pulse_width( burst,
+				       1300000,1500000, 250000,400000, 900000,UINT_MAX,
+				       &data, &dataLen,
+				       verbose);
+    const int tx13_id = 0x06;
+    const int ws2300_id = 0x09;
+
+    if ( bits == 52 && (data[0] == tx13_id || data[0] == ws2300_id) ) {
+	unsigned csumNibble = checksumNibbles( 0, data, 6) & 0x0f;
+	unsigned pcsumNibble = (data[6] & 0x0f);
+
+	if ( csumNibble != pcsumNibble) {
+	    if ( verbose) fprintf(stderr,"Invalid checksum computed=0x%02x - packet says 0x%02x\n", csumNibble, pcsumNibble);
+	} else {
+	    if ( verbose) {
+		for (int i = 0; i < dataLen; i++) fprintf(stderr,"%02x ", data[i]);
+		fprintf(stderr,"\n");
+	    }
+	    memcpy( frame, data, 7);
+	    good = 1;
+	}
+    } else {
+	if ( verbose) fprintf(stderr,"ignored %d pulse burst\n", burst->pulses);
+    }
+
+    if (data) free(data);
+    return good;
+}
+
+// Manchester decode an Oregon Scientific burst, and where each bit came from if pulseReturn is set
+static int oregonsciBits( struct ook_burst *burst, unsigned char **dataReturn, uint32_t **pulseReturn, int verbose)
+{
+    size_t dataLen = 0;
+    return ook_decode_manchester_pulses( burst,
+					 200000, 715000,  // on short
+					 715000, 1200000, // on long
+					 200000, 650000,  // off short
+					 650000, 1200000, //off long
+					 dataReturn, &dataLen, pulseReturn,
+					 verbose);
+}
+
+int oregonsci_decode( struct ook_burst *burst, unsigned char **nibbleReturn, int verbose)
+{
+    unsigned char *data = 0;
+    unsigned char *nibble = 0;
+    int bits = oregonsciBits( burst, &data, 0, verbose);
+
+    if ( bits <= 0) {
+	if ( verbose) fprintf(stderr,"ignored %d pulse burst\n", burst->pulses);
+	goto Fail;
+    }
+
+    unsigned nibbles = (bits+3)/4;
+    nibble = calloc( nibbles, 1);
+    if ( !nibble) goto Fail;
+
+    for ( int i = 0; i < bits; i++) {
+	if (data[i]==0) {
+	    nibble[ i/4] += (1<<(i%4));  // least significant first
+	}
+    }
+    if ( verbose) {
+	fprintf(stderr, "Decoded manchester %d bits, %d nibbles ", bits, nibbles);
+	for ( int n = 0; n < nibbles; n++) {
+	    fprintf(stderr,"%x", nibble[n]);
+	}
+	fprintf(stderr,"\n");
+    }
+
+    if ( nibbles < 16) {
+	if ( verbose) fprintf(stderr,"too short to be valid data\n");
+	goto Fail;
+    }
+
+    for ( int i = 0; i < 6; i++) {
+	if ( nibble[i] != 0x0f) {
+	    if ( verbose) fprintf(stderr,"sync bits were not all 0xf\n");
+	}
+    }
+
+    if ( nibble[6] != 0xa) {
+	if ( verbose) fprintf(stderr,"preamble was not 0xa\n");
+	goto Fail;
+    }
+
+    free(data);
+    *nibbleReturn = nibble;
+    return nibbles;
+
+  Fail:
+    if ( data) free(data);
+    if ( nibble) free(nibble);
+    return -1;
+}
+
+int oregonsci_checksum_ok( const unsigned char *nibble, unsigned checksumAt)
+{
+    if ( checksumAt < 7) return 0;
+    unsigned int sum = checksumBytes( 0, nibble+7, checksumAt-7);  // skips sync and preamble
+    unsigned int csum = nibble[checksumAt+1]*16 + nibble[checksumAt];
+    return sum == csum;
+}
+
+// The nibbles as bits, most significant first for ook_flip_search(), and the checksum's place
+struct oregonsciFrame {
+    uint8_t bits[64];
+    unsigned checksumAt;
+};
+
+static void oregonsciNibbles( const uint8_t *bits, unsigned nibbles, unsigned char *nibble)
+{
+    for ( unsigned n = 0; n < nibbles; n++) nibble[n] = (bits[n/2] >> (n%2 ? 0 : 4)) & 0xf;
+}
+
+static int oregonsciCheck( const uint8_t *data, uint32_t bits, void *ctx)
+{
+    const struct oregonsciFrame *f = ctx;
+    unsigned char nibble[128];
+    oregonsciNibbles( data, bits/4, nibble);
+    return oregonsci_checksum_ok( nibble, f->checksumAt);
+}
+
+int oregonsci_repair( struct ook_burst *burst, unsigned char *nibble, int nibbles, unsigned checksumAt, int verbose)
+{
+    unsigned char *data = 0;
+    uint32_t *pulse = 0;
+    int bits = oregonsciBits( burst, &data, &pulse, 0);
+    int repaired = 0;
+
+    if ( bits <= 0 || (bits+3)/4 != nibbles || nibbles > 128 || checksumAt+2 > nibbles) goto Done;
+
+    // Nibbles are least significant bit first, a bit's place in them is the same as in data, only
+    // its nibble's bits go the other way. The sensor id chose the checksum, so it and the sync and
+    // preamble before it are left alone.
+    struct oregonsciFrame f = { .checksumAt = checksumAt };
+    uint8_t confidence[512];
+    memset( f.bits, 0, sizeof(f.bits));
+    for ( unsigned n = 0; n < nibbles; n++) f.bits[n/2] |= nibble[n] << (n%2 ? 0 : 4);
+    for ( int i = 0; i < 4*nibbles; i++) {
+	uint32_t packed = 4*(i/4) + 3 - i%4;
+	confidence[packed] = i >= bits || i/4 < 11 ? 255 : ook_pulse_confidence( burst, pulse[i]);
+    }
+
+    int flipped = ook_flip_search( f.bits, 4*nibbles, confidence, FLIP_MOST, FLIP_BUDGET, oregonsciCheck, &f);
+    if ( flipped > 0) {
+	if ( verbose) fprintf(stderr,"Checksum good after flipping %d weak bits\n", flipped);
+	oregonsciNibbles( f.bits, nibbles, nibble);
+	repaired = 1;
+    }
+
+  Done:
+    if ( data) free(data);
+    if ( pulse) free(pulse);
+    return repaired;
+}
+
+//
+// Acurite
+//
+
+static int isStart( uint32_t high_ns, uint32_t low_ns) {
+    return high_ns >= 600000 && high_ns <= 700000 && low_ns >= 500000 && low_ns <= 600000;
+}
+static int isOne( uint32_t high_ns, uint32_t low_ns) {
+    return high_ns >= 400000 && high_ns <= 500000 && low_ns >= 100000 && low_ns <= 220000;
+}
+static int isZero( uint32_t high_ns, uint32_t low_ns) {
+    return high_ns >= 200000 && high_ns <= 300000 && low_ns >= 300000 && low_ns <= 400000;
+}
+static int isStop( uint32_t high_ns, uint32_t low_ns) {
+    return high_ns >= 200000 && high_ns <= 300000 && low_ns >= 500000;
+}
+
+// Whole bytes with a good checksum and message type parity
+static int acuriteFrameOk( const uint8_t *data, uint32_t bits, int verbose)
+{
+    if ( bits % 8 != 0 ) {
+	if (verbose) fprintf(stderr, "Not an integral number of bytes: %d bits\n", bits);
+	return 0;
+    }
+    if ( bits > 64) {
+	if (verbose) fprintf(stderr, "Bits overran buffer: %d bits\n", bits);
+	return 0;
+    }
+    if ( bits < 56) {
+	if ( verbose) fprintf(stderr, "Too short to be an acurite message: %d bits\n", bits);
+	return 0;
+    }
+
+    uint8_t sum = checksumBytes( 0, data, bits/8 - 1);
+
+    if ( sum != data[ bits/8 - 1 ] ) {
+	if (verbose) fprintf(stderr, "CRC invalid: %02x != %02x\n", sum, data[ bits/8 -1]);
+	return 0;
+    }
+
+    uint8_t battery = (data[2]>>6) & 1;
+    uint8_t message = (data[2]) & 0x3f;
+    uint8_t mParity = (data[2]>>7) & 1;
+
+    if ( mParity != checksumParity( message ^ battery)) {
+	if ( verbose) fprintf(stderr, "parity error in message code\n");
+	return 0;
+    }
+    return 1;
+}
+
+int acurite_next_frame( const struct ook_burst *burst, uint32_t *position, uint8_t data[8], int verbose)
+{
+    enum { IDLE=0, STARTS, CONTENT } state = IDLE;
+    const unsigned dataLen = 8;
+    uint32_t bits = 0;
+
+    for ( uint32_t p = *position; p < burst->pulses; p++) {
+	uint32_t hi = burst->pulse[p].hiNanoseconds;
+	uint32_t low = burst->pulse[p].lowNanoseconds;
+
+	switch( state) {
+	  case IDLE:
+	    if ( isStart( hi, low)) state = STARTS;
+	    break;
+	  case STARTS:
+	    if ( isStart( hi, low)) continue;
+	    if ( !isOne( hi, low) && !isZero( hi, low)) {
+		state = IDLE;
+		continue;
+	    }
+	    state = CONTENT;
+	    bits = 0;
+	    memset( data, 0, dataLen);
+
+	    // FALLTHROUGH!!!!!!!
+	  case CONTENT:
+	    if ( isOne( hi, low)) {
+		if ( bits < 8*dataLen) {
+		    uint8_t byte = bits/8;
+		    uint8_t bit = 1 << (7 - bits%8);
+
+		    data[byte] |= bit;
+		}
+		bits++;
+	    } else if ( isZero( hi, low)) {
+		bits++;
+	    } else if ( isStop( hi, low)) {
+		if (verbose) {
+		    fprintf(stderr, "At stop we have %d bits, ", bits);
+		    for ( uint8_t i = 0; i < bits/8 && i < dataLen; i++) fprintf(stderr, "%02x", data[i]);
+		    fprintf(stderr, "\n");
+		}
+
+		state = IDLE;
+		if ( !acuriteFrameOk( data, bits, verbose)) continue;
+
+		*position = p+1;
+		return bits;
+	    } else {
+		if ( verbose) fprintf(stderr, "Message fell apart in content.\n");
+		state = IDLE;
+	    }
+	}
+    }
+
+    *position = burst->pulses;
+    return 0;
+}
+
+// How far a pulse is towards a one rather than a zero, in nanoseconds. Ones are 450uS high and
+// 160uS low, zeros 250uS and 350uS, so we measure from halfway between each.
+static int32_t acuriteLeaning( uint32_t high_ns, uint32_t low_ns)
+{
+    return ((int32_t)high_ns - 350000) - ((int32_t)low_ns - 255000);
+}
+
+// How sure we are of a bit, on the scale of ook_pulse_confidence(), with a textbook one or zero
+// 195uS from the middle as sure as can be. A weak pulse is no surer than its power.
+static uint8_t acuriteConfidence( const struct ook_burst *burst, uint32_t p, int32_t leaning)
+{
+    int32_t timing = (leaning < 0 ? -leaning : leaning) * 255LL / 195000;
+    uint8_t power = ook_pulse_confidence( burst, p);
+    if ( timing > power) timing = power;
+    return timing < 1 ? 1 : timing;
+}
+
+static int acuriteCheck( const uint8_t *data, uint32_t bits, void *ctx)
+{
+    return acuriteFrameOk( data, bits, 0);
+}
+
+int acurite_vote_frames( const struct ook_burst *burst, struct ook_vote *vote, uint8_t data[8], int verbose)
+{
+    uint8_t copy[8];
+    uint8_t weight[64];
+    uint32_t bits = 0;
+    int inFrame = 0;
+
+    for ( uint32_t p = 0; p < burst->pulses; p++) {
+	uint32_t hi = burst->pulse[p].hiNanoseconds;
+	uint32_t low = burst->pulse[p].lowNanoseconds;
+
+	if ( isStart( hi, low)) {
+	    inFrame = 1;
+	    bits = 0;
+	    memset( copy, 0, sizeof(copy));
+	    continue;
+	}
+	if ( !inFrame) continue;
+
+	if ( low >= 500000 || p == burst->pulses-1) {
+	    // the stop, or a gap where it should be, ends the copy
+	    inFrame = 0;
+	    if ( bits % 8 == 0 && bits >= 56 && bits <= 64) {
+		ook_vote_add( vote, copy, bits, weight, burst->positionNanoseconds, ACURITE_VOTE_WINDOW_NS);
+	    }
+	    continue;
+	}
+
+	// Anything roughly the shape of a bit counts, with less weight the further it is from either
+	if ( hi < 100000 || hi > 600000 || bits >= 64) {
+	    inFrame = 0;
+	    continue;
+	}
+	int32_t leaning = acuriteLeaning( hi, low);
+	weight[bits] = acuriteConfidence( burst, p, leaning);
+	if ( leaning > 0) copy[bits/8] |= 1 << (7 - bits%8);
+	bits++;
+    }
+
+    uint32_t contested;
+    uint32_t copies = ook_vote_result( vote, data, &contested);
+    if ( copies == 0) return 0;
+    if ( verbose) fprintf(stderr, "Voted on %u copies of %u bits, %u contested\n", copies, vote->bits, contested);
+    if ( copies >= 2 && acuriteFrameOk( data, vote->bits, verbose)) return vote->bits;
+
+    // Then flip the bits the copies were least sure of between them, or the one copy was
+    uint8_t confidence[64];
+    for ( uint32_t i = 0; i < vote->bits; i++) {
+	uint32_t margin = (vote->tally[i] < 0 ? -vote->tally[i] : vote->tally[i]) / copies;
+	confidence[i] = margin > 255 ? 255 : margin;
+    }
+    int flipped = ook_flip_search( data, vote->bits, confidence, FLIP_MOST, FLIP_BUDGET, acuriteCheck, 0);
+    if ( flipped < 0) return 0;
+    if ( verbose) fprintf(stderr, "Checksum good after flipping %d weak bits\n", flipped);
+    return vote->bits;
+}
+
+//
+// Nexa, protocol specification was used from http://tech.jolowe.se/home-automation-rf-protocols/
+//
+
+#define SYNC_BIT_LEN 11
+#define PAUSE_BIT_LEN 41
+#define PHYSICAL_1_BIT_LEN 2
+#define PHYSICAL_0_BIT_LEN 6
+
+#define UPPER_LIMIT_OF_PHYSICAL_BITS 4096
+
+#define PULSE_LENGTH_NANOSEC 250000
+
+/*
+ Returns 1 if the data pointer points to a "sync" bit, 0 otherwise
+ */
+static int is_sync_bit(unsigned char** data)
+{
+    if((*data)[0] == 1) {
+        for(int i = 1; i < SYNC_BIT_LEN; ++i) {
+            if((*data)[i] != 0) {
+                return 0;
+            }
+        }
+    }
+
+    *data += SYNC_BIT_LEN;
+    return 1;
+}
+
+/*
+ Returns 1 if the data pointer points to a "pause" bit, 0 otherwise
+ */
+static int is_pause_bit(unsigned char** data)
+{
+    if((*data)[0] == 1) {
+        for(int i = 1; i < PAUSE_BIT_LEN; ++i) {
+            if((*data)[i] != 0) {
+                return 0;
+            }
+        }
+    }
+
+    *data += PAUSE_BIT_LEN;
+    return 1;
+}
+
+/*
+ Decodes physical bit from the pulses sequence
+ Returns bit value (1 or 0)
+ */
+static int decode_physical_bit(unsigned char** data)
+{
+    if((*data)[0] == 1) {
+        for(int i = 1; i < PHYSICAL_0_BIT_LEN; ++i) {
+            if((*data)[i] != 0) {
+                *data += PHYSICAL_1_BIT_LEN;
+                return 1;
+            }
+        }
+    }
+
+    *data += PHYSICAL_0_BIT_LEN;
+    return 0;
+}
+
+/*
+ Decodes logical bit from the pair of 2 physical bits
+ Returns bit value on success (1 or 0), -1 on error
+ */
+static int decode_logical_bit(unsigned char** data, int verbose)
+{
+    int first_bit = decode_physical_bit(data);
+    int second_bit = decode_physical_bit(data);
+
+    if(first_bit && !second_bit) {
+        return 1;
+    } else if(!first_bit && second_bit) {
+        return 0;
+    } else if(verbose) {
+        fprintf(stderr, "incorrect physical bit sequence %d %d\n", first_bit, second_bit);
+    }
+
+    return -1;
+}
+
+/*
+ Decodes set of physical bits to the Nexa control packet structure
+ Returns 1 on success, 0 on error
+ */
+static int decode_nexa_p(unsigned char* data, struct nexa_p *packet, int verbose)
+{
+    if(is_sync_bit(&data)) {
+        memset(packet, 0, sizeof(struct nexa_p));
+
+        for(int i = 0; i < NEXA_TRANSMITTER_CODE_LEN; ++i) {
+            uint8_t decoded_bit = decode_logical_bit(&data, verbose);
+
+            if(decoded_bit == 1) {
+                packet->transmitter_code |= (1 << i);
+            }
+        }
+
+        if(decode_logical_bit(&data, verbose) == 0) {
+            packet->group_code = 1; // inversed by protocol
+        }
+
+        if(decode_logical_bit(&data, verbose) == 0) {
+            packet->on_off = 1; // inversed by protocol
+        }
+
+        if(decode_logical_bit(&data, verbose) == 1) {
+            packet->channel_bits |= 1;
+        }
+        if(decode_logical_bit(&data, verbose) == 1) {
+            packet->channel_bits |= (1 << 1);
+        }
+
+        if(decode_logical_bit(&data, verbose) == 1) {
+            packet->unit_bits |= 1;
+        }
+        if(decode_logical_bit(&data, verbose) == 1) {
+            packet->unit_bits |= (1 << 1);
+        }
+
+        if(is_pause_bit(&data)) {
+            return 1;
+        } else if(verbose) {
+            fprintf(stderr, "no pause bit\n");
+        }
+    } else if(verbose) {
+        fprintf(stderr, "no sync bit\n");
+    }
+
+    return 0;
+}
+
+int nexa_decode( const struct ook_burst *burst, struct nexa_p *packet, int verbose)
+{
+    // Each pulse becomes a 1 followed by a 0 for each PULSE_LENGTH_NANOSEC of low.
+    // Leave room past the end for the decoder to look ahead into zeros.
+    unsigned char data[UPPER_LIMIT_OF_PHYSICAL_BITS + PAUSE_BIT_LEN];
+    size_t bits = 0;
+
+    memset( data, 0, sizeof(data));
+
+    for ( int i = 0; i < burst->pulses && bits < UPPER_LIMIT_OF_PHYSICAL_BITS; i++) {
+        data[bits++] = 1;
+
+        uint8_t zeros = burst->pulse[i].lowNanoseconds / PULSE_LENGTH_NANOSEC;
+        while(zeros-- && bits < UPPER_LIMIT_OF_PHYSICAL_BITS) {
+            data[bits++] = 0;
+        }
+    }
+
+    return decode_nexa_p( data, packet, verbose);
+}
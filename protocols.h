@@ -0,0 +1,81 @@
+#ifndef PROTOCOLS_IS_IN
+#define PROTOCOLS_IS_IN
+
+/*
+** Frame level decoders for the devices we support. These take a burst to the
+** checked bytes or bits of a message. What the message means is left to each
+** client. They live here so they can be exercised without a socket, e.g. by ookcorpus.
+**
+** If verbose is set, they print diagnostics to stderr.
+*/
+
+#include <stdint.h>
+
+#include "ook.h"
+
+// Fine Offset CRC8, polynomial 0x31
+uint8_t wh1080_crc8( const uint8_t *addr, uint8_t len);
+
+// 1 and frame filled in if the burst is a wh1080 message with a good CRC, 0 otherwise. A frame with
+// a bad one gets a few tries at flipping the bits of its weakest pulses first.
+int wh1080_decode( struct ook_burst *burst, uint8_t frame[11], int verbose);
+
+// 1 and frame filled in if the burst is a ws2300 or tx13 message with a good checksum, 0 otherwise
+int ws2300_decode( struct ook_burst *burst, uint8_t frame[7], int verbose);
+
+// Manchester decode an Oregon Scientific burst into nibbles, least significant bit first.
+// -1 if it isn't one, otherwise the number of nibbles. The sync and preamble have been checked,
+// the sensor specific checksum has not.
+// If nibbleReturn is set, it must be free()d.
+int oregonsci_decode( struct ook_burst *burst, unsigned char **nibbleReturn, int verbose);
+
+// 1 if the sum of the nibbles from the sensor id up to checksumAt is the two nibbles there
+int oregonsci_checksum_ok( const unsigned char *nibble, unsigned checksumAt);
+
+// When the checksum fails, try flipping the bits of the nibbles which came from the weakest pulses.
+// 1 if it passes now, with nibble fixed, 0 and nibble as it was otherwise.
+int oregonsci_repair( struct ook_burst *burst, unsigned char *nibble, int nibbles, unsigned checksumAt, int verbose);
+
+// Find the next Acurite message starting at pulse *position. Returns the number of bits in
+// it with data filled in and *position moved past it, or 0 if there are no more.
+// Messages returned have a good checksum and message type parity.
+int acurite_next_frame( const struct ook_burst *burst, uint32_t *position, uint8_t data[8], int verbose);
+
+// Acurite repeats each message three times in a burst. When none of the copies checks out alone,
+// add them all to vote, which may hold copies from bursts up to ACURITE_VOTE_WINDOW_NS earlier,
+// and see if the bits most of them agree on do, or do after flipping those they were least sure of.
+// Returns the number of bits with data filled in, or 0 if the vote is no good either. Reset the
+// vote once a message has been decoded.
+#define ACURITE_VOTE_WINDOW_NS 1000000000ULL
+int acurite_vote_frames( const struct ook_burst *burst, struct ook_vote *vote, uint8_t data[8], int verbose);
+
+#define NEXA_TRANSMITTER_CODE_LEN 26
+
+// A frame is a sync pulse, a pair of pulses for each of 32 bits, and a pause pulse. Nexa
+// repeats it several times in a burst, a partial burst this long holds the whole first one.
+#define NEXA_FRAME_PULSES 66
+
+struct nexa_p
+{
+    /* transmitter unique code, and it is this code that the reciever "learns" to recognize */
+    uint32_t transmitter_code:NEXA_TRANSMITTER_CODE_LEN;
+
+    /* 1 - on, 0 - off */
+    uint8_t group_code:1;
+
+    /* 1 - on, 0 - off */
+    uint8_t on_off:1;
+
+    /* Channel bits. Proove/Anslut = 00, Nexa = 11 */
+    uint8_t channel_bits:2;
+
+    /* Unit bits. Device to be turned on or off.
+     Proove/Anslut Unit #1 = 00, #2 = 01, #3 = 10.
+     Nexa Unit #1 = 11, #2 = 10, #3 = 01 */
+    uint8_t unit_bits:2;
+};
+
+// 1 and packet filled in if the burst is a Nexa control packet, 0 otherwise
+int nexa_decode( const struct ook_burst *burst, struct nexa_p *packet, int verbose);
+
+#endif
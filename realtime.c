@@ -0,0 +1,129 @@
+#ifdef __linux__
+#define _GNU_SOURCE                // for CPU_SET() and sched_setaffinity()
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "realtime.h"
+
+static const uint64_t lateLimitNs[3] = { 1000000, 10000000, 100000000 };
+
+// Touch the stack we will use, noinline so it really is below our caller
+static __attribute__((noinline)) void faultStack( size_t bytes)
+{
+    unsigned char stack[bytes];
+    memset( stack, 0, bytes);
+    __asm__ volatile( "" : : "r"(stack) : "memory");     // as far as the compiler knows it is used
+}
+
+int realtimeLockMemory( size_t heapBytes, size_t stackBytes)
+{
+#ifdef __GLIBC__
+    // Freed memory stays in the heap, and big allocations come from it too, instead of
+    // mmap()s which would have to be faulted in again each time
+    mallopt( M_TRIM_THRESHOLD, -1);
+    mallopt( M_MMAP_MAX, 0);
+#endif
+
+    if ( mlockall( MCL_CURRENT | MCL_FUTURE) < 0) {
+	fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+	return -1;
+    }
+
+    // Grow the heap now, while it doesn't matter how long it takes, and hand it back to malloc()
+    if ( heapBytes) {
+	unsigned char *heap = malloc( heapBytes);
+	if ( !heap) {
+	    fprintf(stderr, "Failed to reserve %zu bytes of heap\n", heapBytes);
+	    return -1;
+	}
+	memset( heap, 0, heapBytes);
+	free( heap);
+    }
+    if ( stackBytes) faultStack( stackBytes);
+
+    return 0;
+}
+
+#ifdef __linux__
+// Parse a list like "0,2-3", returns <0 if it is bad
+static int parseCpus( const char *cpus, cpu_set_t *set)
+{
+    CPU_ZERO( set);
+    const char *p = cpus;
+    for (;;) {
+	char *end;
+	long first = strtol( p, &end, 10);
+	if ( end == p || first < 0) return -1;
+	long last = first;
+	p = end;
+	if ( *p == '-') {
+	    last = strtol( p+1, &end, 10);
+	    if ( end == p+1 || last < first) return -1;
+	    p = end;
+	}
+	if ( last >= CPU_SETSIZE) return -1;
+	for ( long c = first; c <= last; c++) CPU_SET( c, set);
+
+	if ( *p == 0) return 0;
+	if ( *p++ != ',') return -1;
+    }
+}
+#endif
+
+int realtimeSchedule( const char *cpus, int priority)
+{
+    if ( cpus) {
+#ifdef __linux__
+	cpu_set_t set;
+	if ( parseCpus( cpus, &set) < 0) {
+	    fprintf(stderr, "Bad CPU list '%s', e.g. 3 or 0,2-3\n", cpus);
+	    return -1;
+	}
+	if ( sched_setaffinity( 0, sizeof(set), &set) < 0) {
+	    fprintf(stderr, "Failed to run on CPUs %s: %s\n", cpus, strerror(errno));
+	    return -1;
+	}
+#else
+	fprintf(stderr, "Choosing CPUs is only supported on Linux\n");
+	return -1;
+#endif
+    }
+
+    if ( priority) {
+	struct sched_param param = { .sched_priority = priority };
+	if ( sched_setscheduler( 0, SCHED_FIFO, &param) < 0) {
+	    fprintf(stderr, "Failed to run at SCHED_FIFO priority %d: %s\n", priority, strerror(errno));
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+void realtimeObserve( struct realtimeLatency *l, uint64_t lateNs)
+{
+    l->count++;
+    l->sumNs += lateNs;
+    if ( lateNs > l->maxNs) l->maxNs = lateNs;
+    for ( int i = 0; i < 3; i++) {
+	if ( lateNs > lateLimitNs[i]) l->over[i]++;
+    }
+}
+
+void realtimeReport( const struct realtimeLatency *l, FILE *f)
+{
+    if ( !l->count) return;
+
+    fprintf(f, "Buffers handled late by %.3fmS on average, at most %.3fmS, %llu over 1mS, %llu over 10mS, %llu over 100mS\n",
+	    l->sumNs/1e6/l->count, l->maxNs/1e6, (unsigned long long)l->over[0],
+	    (unsigned long long)l->over[1], (unsigned long long)l->over[2]);
+}
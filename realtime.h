@@ -0,0 +1,59 @@
+#ifndef REALTIME_IS_IN
+#define REALTIME_IS_IN
+
+/*
+** Keeping ookd's detection on time when it shares a computer with other work,
+** see --realtime. A buffer the radio fills while we are stalled waits in its
+** queue, and once the queue is full samples are lost. The usual stalls are
+** page faults on memory touched for the first time and other processes
+** holding the CPU, so memory is locked and faulted in up front, and the thread
+** doing the detection can be given its own CPUs and a SCHED_FIFO priority.
+**
+** The radio's buffers, and the detection, all run in the thread that calls
+** rtlRun(), so that is the one to schedule. Threads it starts afterwards, like
+** --jobs, inherit the same.
+**
+** It will print errors to stderr for programmer misuse or misconfiguration.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+** Lock all memory, what is mapped now and whatever is mapped later, keep freed
+** heap instead of giving it back to the system, and fault in heapBytes of heap
+** and stackBytes of stack so later allocations and calls find them present.
+** Needs CAP_IPC_LOCK or a big enough RLIMIT_MEMLOCK.
+**
+**   Returns <0 on failure.
+*/
+int realtimeLockMemory( size_t heapBytes, size_t stackBytes);
+
+/*
+** Run the calling thread only on cpus, a list like "3" or "0,2-3", if not NULL,
+** and at SCHED_FIFO priority, 1 to 99, if it is not 0. Affinity is Linux only.
+**
+**   Returns <0 on failure.
+*/
+int realtimeSchedule( const char *cpus, int priority);
+
+/*
+** How late buffers were handled by the clock they should have arrived on, which
+** is as late as the thread was woken and any stall before it got there.
+*/
+struct realtimeLatency {
+    uint64_t count;
+    uint64_t sumNs;
+    uint64_t maxNs;
+    uint64_t over[3];              // buffers later than 1mS, 10mS and 100mS
+};
+
+void realtimeObserve( struct realtimeLatency *l, uint64_t lateNs);
+
+/*
+** One line summary, nothing if no buffers were observed.
+*/
+void realtimeReport( const struct realtimeLatency *l, FILE *f);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+
+static const int magic = 0x4E91A7ED;
+
+static int replayOk( const struct replay *r)
+{
+    if ( !r || r->magic != magic) return 0;
+    return 1;
+}
+
+struct replay *replayOpen( const char *fileName, uint32_t sampleRate, double speed)
+{
+    if ( sampleRate == 0 || speed < 0) {
+	fprintf(stderr,"Bad replay parameters: %usamples/sec at %.2fx\n", sampleRate, speed);
+	return 0;
+    }
+
+    int fd = open( fileName, O_RDONLY);
+    if ( fd < 0) {
+	fprintf(stderr, "Failed to open input file '%s': %s\n", fileName, strerror(errno));
+	return 0;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st) < 0) {
+	fprintf(stderr, "Failed to stat input file '%s': %s\n", fileName, strerror(errno));
+	close(fd);
+	return 0;
+    }
+
+    void *base = 0;
+    if ( st.st_size > 0) {
+	base = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if ( base == MAP_FAILED) {
+	    fprintf(stderr, "Failed to map input file '%s': %s\n", fileName, strerror(errno));
+	    close(fd);
+	    return 0;
+	}
+	madvise( base, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);   // the mapping keeps the file
+
+    struct replay *r = calloc( sizeof(*r), 1);
+    if ( !r) {
+	if ( base) munmap( base, st.st_size);
+	return 0;
+    }
+
+    r->magic = magic;
+    r->base = base;
+    r->size = st.st_size & ~(size_t)1;   // whole IQ pairs only
+    r->mappedSize = st.st_size;
+    r->sampleRate = sampleRate;
+    r->speed = speed;
+    r->sliceLen = 16384;
+    return r;
+}
+
+void replayClose( struct replay *r)
+{
+    if (!r) return;
+    if (!replayOk(r)) {
+	fprintf(stderr,"Replay passed to replayClose is corrupted\n");
+	return;
+    }
+
+    if ( r->base) munmap( (void *)r->base, r->mappedSize);
+
+    memset(r, 0, sizeof(*r));  // make invalid
+    free(r);
+}
+
+int replayRun( struct replay *r, replay_handler handler, void *ctx)
+{
+    if ( !replayOk(r)) {
+	return -1;
+    }
+
+    struct timespec origin;
+    clock_gettime( CLOCK_MONOTONIC, &origin);
+
+    r->stop = 0;
+    r->dueNs = 0;
+    r->samples = 0;
+
+    for ( size_t off = 0; off < r->size && !r->stop; off += r->sliceLen) {
+	uint32_t len = r->sliceLen;
+	if ( off + len > r->size) len = r->size - off;
+
+	if ( r->speed > 0) {
+	    // A slice is due once its last sample would have come off the air
+	    double due = (off + len)/2 / (double)r->sampleRate / r->speed;
+	    struct timespec when = origin;
+	    when.tv_sec += (time_t)due;
+	    when.tv_nsec += (long)((due - (time_t)due)*1e9);
+	    if ( when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	    }
+	    while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &when, 0) == EINTR && !r->stop);
+	    if ( r->stop) break;
+	    r->dueNs = when.tv_sec*1000000000ULL + when.tv_nsec;
+	}
+
+	handler( r->base + off, len, ctx);
+	r->samples += len/2;
+    }
+
+    struct timespec end;
+    clock_gettime( CLOCK_MONOTONIC, &end);
+    r->seconds = (end.tv_sec - origin.tv_sec) + (end.tv_nsec - origin.tv_nsec)/1e9;
+    return 0;
+}
+
+int replayStop( struct replay *r)
+{
+    if ( !replayOk(r)) {
+	return -1;
+    }
+    r->stop = 1;
+    return 0;
+}
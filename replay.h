@@ -0,0 +1,62 @@
+#ifndef REPLAY_IS_IN
+#define REPLAY_IS_IN
+
+/*
+** Replay a recorded IQ capture (as made by rtl_sdr) as though it were
+** coming from a radio. The file is mmap()ed and handed to your handler
+** in slices that point directly into the mapping, no copies are made.
+**
+** It will print errors to stderr for programmer misuse or misconfiguration.
+**
+*/
+
+#include <stdint.h>
+
+struct replay {
+    int magic;                     // set to 0x4E91A7ED if this is live
+    const unsigned char *base;     // the mmap()ed capture
+    size_t size;                   // bytes in the capture, whole IQ pairs of it
+    size_t mappedSize;             // bytes mmap()ed, the whole file
+    uint32_t sampleRate;           // samples/sec of the capture, used for pacing
+    double speed;                  // 1.0 is real time, 0 is as fast as possible
+    uint32_t sliceLen;             // bytes handed to the handler at a time
+    volatile int stop;             // set by replayStop()
+    uint64_t dueNs;                // CLOCK_MONOTONIC when the slice being handled was due, 0 if unpaced
+
+    // These are valid after replayRun() returns
+    uint64_t samples;              // samples handed to the handler
+    double seconds;                // wall clock time it took
+};
+
+typedef void (*replay_handler)(const unsigned char *data, uint32_t len, void *ctx);
+
+/*
+** Open and map a capture file.
+**
+**   speed is a multiple of real time, e.g. 1.0 delivers slices on the original
+**   timing, 10.0 at ten times that, and 0 as fast as the handler can consume them.
+**
+**   NULL is returned for failure
+*/
+struct replay *replayOpen( const char *fileName, uint32_t sampleRate, double speed);
+
+/*
+** Unmap and free a replay, it is ok to pass in NULL
+*/
+void replayClose( struct replay *r);
+
+/*
+** Deliver the capture to your handler, slice by slice, until the
+** end of the file or a replayStop().
+**
+**   Returns <0 on failure.
+*/
+int replayRun( struct replay *r, replay_handler handler, void *ctx);
+
+/*
+** Stop a running replay.
+** Safe to call from signal() handlers.
+*/
+int replayStop( struct replay *r);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ring.h"
+
+struct ring {
+    struct ringHeader *header;
+    uint8_t *data;                     // the records, header->size bytes
+    size_t mapped;
+};
+
+struct ring *ringOpen( const char *shmName, uint64_t size)
+{
+    if ( size < 4096 || (size & (size-1))) {
+	fprintf(stderr, "Ring size must be a power of two of at least 4096: %llu\n", (unsigned long long)size);
+	return 0;
+    }
+
+    // a consumer of an old ring would never hear from us, make a new one
+    shm_unlink( shmName);
+    int fd = shm_open( shmName, O_RDWR|O_CREAT|O_EXCL, 0644);
+    if ( fd < 0) {
+	fprintf(stderr, "Failed to open shared memory '%s': %s\n", shmName, strerror(errno));
+	return 0;
+    }
+
+    size_t mapped = RING_DATA_OFFSET + size;
+    if ( ftruncate( fd, mapped) < 0) {
+	fprintf(stderr, "Failed to size shared memory '%s': %s\n", shmName, strerror(errno));
+	close(fd);
+	shm_unlink( shmName);
+	return 0;
+    }
+    void *m = mmap( 0, mapped, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);   // the mapping keeps it
+    if ( m == MAP_FAILED) {
+	fprintf(stderr, "Failed to map shared memory '%s': %s\n", shmName, strerror(errno));
+	shm_unlink( shmName);
+	return 0;
+    }
+
+    struct ring *ring = calloc( sizeof(*ring), 1);
+    if ( !ring) {
+	munmap( m, mapped);
+	shm_unlink( shmName);
+	return 0;
+    }
+    ring->header = m;
+    ring->data = (uint8_t *)m + RING_DATA_OFFSET;
+    ring->mapped = mapped;
+
+    ring->header->size = size;
+    ring->header->producer = getpid();
+    ring->header->version = RING_VERSION;
+    __atomic_store_n( &ring->header->magic, RING_MAGIC, __ATOMIC_RELEASE);   // consumers check this last
+    return ring;
+}
+
+int ringPublish( struct ring *ring, const struct ook_burst *burst)
+{
+    struct ringHeader *h = ring->header;
+    size_t burstBytes = sizeof(*burst) + burst->pulses*sizeof(burst->pulse[0]);
+    size_t length = (sizeof(struct ringRecord) + burstBytes + RING_ALIGN-1) & ~(size_t)(RING_ALIGN-1);
+    if ( length > h->size/2) {
+	fprintf(stderr, "Burst of %u pulses is too big for the ring\n", burst->pulses);
+	return -1;
+    }
+
+    uint64_t position = h->head;
+    uint64_t offset = position & (h->size-1);
+    uint64_t gap = offset + length > h->size ? h->size - offset : 0;
+
+    // Step the tail past the records we are about to overwrite, for consumers which fell behind
+    uint64_t end = position + gap + length;
+    uint64_t tail = h->tail;
+    while ( end - tail > h->size) {
+	uint64_t at = tail & (h->size-1);
+	if ( h->size - at < sizeof(struct ringRecord)) {
+	    tail += h->size - at;
+	} else {
+	    struct ringRecord old;
+	    memcpy( &old, ring->data + at, sizeof(old));
+	    if ( old.length < sizeof(old)) {
+		tail = position;     // consumers map it writable, don't trust it, just forget the old records
+		break;
+	    }
+	    tail += old.length;
+	}
+    }
+    __atomic_store_n( &h->tail, tail, __ATOMIC_RELEASE);
+
+    // Say how far we will write before touching anything, consumers check it after reading
+    __atomic_store_n( &h->reserved, end, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_RELEASE);
+
+    if ( gap >= sizeof(struct ringRecord)) {
+	struct ringRecord pad = { .position = position, .sequence = h->sequence, .length = gap, .type = RING_RECORD_PAD };
+	memcpy( ring->data + offset, &pad, sizeof(pad));
+    }
+    position += gap;
+    offset = position & (h->size-1);
+
+    struct ringRecord record = { .position = position, .sequence = h->sequence, .length = length, .type = RING_RECORD_BURST };
+    memcpy( ring->data + offset, &record, sizeof(record));
+
+    struct ook_burst *b = (struct ook_burst *)(ring->data + offset + sizeof(record));
+    memcpy( b, burst, burstBytes);
+    b->allocatedPulses = burst->pulses;
+
+    h->sequence++;
+    __atomic_store_n( &h->head, position + length, __ATOMIC_RELEASE);
+    ringWake( h);
+    return 0;
+}
+
+void ringClose( struct ring *ring, const char *shmName)
+{
+    if ( !ring) return;
+
+    __atomic_store_n( &ring->header->closed, 1, __ATOMIC_RELEASE);
+    ringWake( ring->header);
+    munmap( ring->header, ring->mapped);
+    if ( shmName) shm_unlink( shmName);
+    free( ring);
+}
@@ -0,0 +1,111 @@
+#ifndef RING_IS_IN
+#define RING_IS_IN
+
+/*
+** A broadcast ring in POSIX shared memory, so decoders on the same host as ookd
+** can read bursts without going through multicast loopback and a copy per
+** subscriber. ookd is the only producer, any number of consumers each keep
+** their own cursor, see ook_ring_attach() in ook.h.
+**
+** The producer never waits for consumers. One which falls a whole ring behind
+** has been overrun, it notices, skips to the oldest burst still in the ring and
+** is told how many it lost. Consumers sleep on a futex in the header, the producer only makes
+** the wake system call if one of them is waiting.
+**
+** It will print errors to stderr for programmer misuse or misconfiguration.
+*/
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "ook.h"
+
+#define RING_MAGIC 0x4F4F4B52          // 'OOKR'
+#define RING_VERSION 4                 // the records hold a struct ook_burst, bump it when that changes
+#define RING_DEFAULT_BYTES (1<<20)     // about eight thousand wh1080 bursts
+#define RING_ALIGN 8                   // records start on this
+#define RING_DATA_OFFSET 128           // where the records start after the header
+
+struct ringHeader {
+    uint32_t magic;                    // RING_MAGIC once initialized
+    uint32_t version;                  // RING_VERSION, consumers must check it
+    uint64_t size;                     // bytes of records after the header, a power of two
+    pid_t producer;                    // so consumers can tell if ookd died without closing
+    uint32_t closed;                   // set when ookd exits, consumers should give up
+    uint32_t wake;                     // bumped by every publish, consumers wait on it
+    uint32_t waiters;                  // consumers waiting, the producer only wakes if there are some
+    uint64_t head;                     // ring position after the last record published
+    uint64_t reserved;                 // ring position the producer may be writing up to
+    uint64_t tail;                     // ring position of the oldest record not overwritten
+    uint64_t sequence;                 // bursts published
+};
+
+#define RING_RECORD_BURST 1            // a struct ook_burst with its pulses follows
+#define RING_RECORD_PAD 2              // skip to the start of the ring
+
+// Positions only grow, the record is at position & (size-1). Length includes this header.
+// A record never wraps, a pad record fills the end of the ring, or if there isn't room
+// for even that the gap is just skipped.
+struct ringRecord {
+    uint64_t position;
+    uint64_t sequence;                 // of the burst, so consumers can count what they lost
+    uint32_t length;
+    uint32_t type;                     // RING_RECORD_*
+};
+
+struct ring;
+
+/*
+** Make a ring of size bytes, a power of two, in shared memory with this name, e.g. "/ookd-ring".
+** Any left over from an earlier run is replaced.
+**
+**   NULL is returned for failure
+*/
+struct ring *ringOpen( const char *shmName, uint64_t size);
+
+/*
+** Copy a burst into the ring and wake any consumers waiting for it. Only call from one thread.
+**
+**   Returns <0 if it is too big for the ring.
+*/
+int ringPublish( struct ring *ring, const struct ook_burst *burst);
+
+/*
+** Tell the consumers we are done, and remove the ring's name. It is ok to pass in NULL.
+*/
+void ringClose( struct ring *ring, const char *shmName);
+
+// Wait for the wake counter to move on from value, or timeoutMs to pass. Consumers use this.
+// There are no futexes off Linux, so there it just naps.
+static inline void ringWait( struct ringHeader *h, uint32_t value, unsigned timeoutMs)
+{
+#ifdef __linux__
+    struct timespec t = { .tv_sec = timeoutMs/1000, .tv_nsec = (timeoutMs%1000)*1000000L };
+    __atomic_fetch_add( &h->waiters, 1, __ATOMIC_SEQ_CST);
+    if ( __atomic_load_n( &h->wake, __ATOMIC_SEQ_CST) == value) {
+	syscall( SYS_futex, &h->wake, FUTEX_WAIT, value, &t, 0, 0);
+    }
+    __atomic_fetch_sub( &h->waiters, 1, __ATOMIC_SEQ_CST);
+#else
+    struct timespec t = { .tv_sec = 0, .tv_nsec = 1000000L };
+    if ( __atomic_load_n( &h->wake, __ATOMIC_SEQ_CST) == value) nanosleep( &t, 0);
+#endif
+}
+
+static inline void ringWake( struct ringHeader *h)
+{
+    __atomic_fetch_add( &h->wake, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    if ( __atomic_load_n( &h->waiters, __ATOMIC_SEQ_CST)) {
+	syscall( SYS_futex, &h->wake, FUTEX_WAKE, 0x7fffffff, 0, 0, 0);
+    }
+#endif
+}
+
+#endif
@@ -96,18 +96,23 @@ static void rtlHandler(unsigned char *buf, uint32_t len, void *ctx)
     state->handler( buf, len, state->ctx, state->rtl);
 }
 
-int rtlRun( struct rtldev *r, sdr_handler handler, void *ctx)
+int rtlRun( struct rtldev *r, uint32_t bufferCount, uint32_t bufferLength, sdr_handler handler, void *ctx)
 {
     if ( !rtlOk(r)) {
 	return -1;
     }
 
+    if ( bufferLength % RTL_BUFFER_UNIT) {
+	fprintf(stderr,"RTL SDR buffer length %u is not a multiple of %u\n", bufferLength, RTL_BUFFER_UNIT);
+	return -1;
+    }
+
     int re = rtlsdr_reset_buffer( r->dev);  // this is important
     if ( re) return 0;
 
     struct rtlHandlerState state = { r, handler, ctx };
 
-    int e = rtlsdr_read_async( r->dev, rtlHandler, (void *)&state, 0,0);
+    int e = rtlsdr_read_async( r->dev, rtlHandler, (void *)&state, bufferCount, bufferLength);
 
     if ( e != 0) return 0;
 
@@ -46,10 +46,20 @@ int rtlSetup( struct rtldev *r, uint32_t centerFrequency, uint32_t sampleRate);
 ** Begin processing the signal. It will repeatedly 
 ** invoke your handler and pass it buffers.
 **
+** bufferCount buffers of bufferLength bytes are queued with the device. More
+** buffers ride out longer stalls in your handler before samples are dropped,
+** shorter buffers arrive sooner after the signal. bufferLength must be a
+** multiple of RTL_BUFFER_UNIT. Either may be 0 for the rtl-sdr defaults,
+** RTL_DEFAULT_BUFFERS of RTL_DEFAULT_BUFFER_LENGTH.
+**
 ** This will continue until an rtlStop() is used. This might happen
 ** in your handler, or perhaps in a signal() handler.
 */
-int rtlRun( struct rtldev *rtl, sdr_handler handler, void *ctx);
+#define RTL_BUFFER_UNIT 16384              // one USB transfer
+#define RTL_DEFAULT_BUFFERS 15
+#define RTL_DEFAULT_BUFFER_LENGTH (16*16384)
+
+int rtlRun( struct rtldev *rtl, uint32_t bufferCount, uint32_t bufferLength, sdr_handler handler, void *ctx);
 
 /*
 ** Stop processing the signal, if running
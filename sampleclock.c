@@ -0,0 +1,133 @@
+#include <string.h>
+#include <math.h>
+
+#include "sampleclock.h"
+
+void sampleClockInit( struct sampleClock *c, uint32_t nominalRate)
+{
+    memset( c, 0, sizeof(*c));
+    c->nominalRate = nominalRate;
+    c->nsPerSample = 1e9 / nominalRate;
+    c->uncertaintyNs = SAMPLE_CLOCK_UNSURE_NS;
+}
+
+static int64_t nominalNs( const struct sampleClock *c, uint64_t sample)
+{
+    return (int64_t)(sample * 1e9 / c->nominalRate);
+}
+
+// Least squares through the points, about their means so the sums don't lose precision
+static void fit( struct sampleClock *c)
+{
+    unsigned n = c->points;
+    unsigned first = (c->next + SAMPLE_CLOCK_POINTS - n) % SAMPLE_CLOCK_POINTS;
+    uint64_t x0 = c->point[first].sample, y0 = c->point[first].monotonicNs;
+
+    double mx = 0, my = 0;
+    for ( unsigned i = 0; i < n; i++) {
+	unsigned p = (first + i) % SAMPLE_CLOCK_POINTS;
+	mx += (double)(c->point[p].sample - x0);
+	my += (double)(int64_t)(c->point[p].monotonicNs - y0);
+    }
+    mx /= n;
+    my /= n;
+
+    if ( n >= 2) {
+	double sxx = 0, sxy = 0;
+	for ( unsigned i = 0; i < n; i++) {
+	    unsigned p = (first + i) % SAMPLE_CLOCK_POINTS;
+	    double dx = (double)(c->point[p].sample - x0) - mx;
+	    double dy = (double)(int64_t)(c->point[p].monotonicNs - y0) - my;
+	    sxx += dx*dx;
+	    sxy += dx*dy;
+	}
+	if ( sxx > 0) c->nsPerSample = sxy / sxx;
+    }
+
+    c->originSample = x0 + (uint64_t)llround( mx);
+    c->originNs = y0 + (int64_t)llround( my + (c->originSample - x0 - mx) * c->nsPerSample);
+
+    if ( n >= 3) {
+	double sum = 0;
+	for ( unsigned i = 0; i < n; i++) {
+	    unsigned p = (first + i) % SAMPLE_CLOCK_POINTS;
+	    double r = (double)(int64_t)(c->point[p].monotonicNs - sampleClockMonotonic( c, c->point[p].sample));
+	    sum += r*r;
+	}
+	c->uncertaintyNs = sqrt( sum / (n-2));
+    } else {
+	c->uncertaintyNs = SAMPLE_CLOCK_UNSURE_NS;
+    }
+}
+
+static void addPoint( struct sampleClock *c, uint64_t sample, uint64_t monotonicNs)
+{
+    unsigned last = (c->next + SAMPLE_CLOCK_POINTS - 1) % SAMPLE_CLOCK_POINTS;
+    if ( c->points && c->point[last].sample == sample) return;
+
+    if ( c->points >= 2) {
+	int64_t off = (int64_t)(monotonicNs - sampleClockMonotonic( c, sample));
+	if ( off > SAMPLE_CLOCK_RESET_NS || off < -SAMPLE_CLOCK_RESET_NS) {
+	    c->points = 0;
+	    c->next = 0;
+	    c->resets++;
+	}
+    }
+
+    c->point[c->next].sample = sample;
+    c->point[c->next].monotonicNs = monotonicNs;
+    c->next = (c->next + 1) % SAMPLE_CLOCK_POINTS;
+    if ( c->points < SAMPLE_CLOCK_POINTS) c->points++;
+    fit( c);
+}
+
+int sampleClockArrival( struct sampleClock *c, uint64_t endSample, uint64_t monotonicNs, uint64_t realtimeNs)
+{
+    int changed = 0;
+    c->realtimeOffsetNs = (int64_t)(realtimeNs - monotonicNs);
+
+    if ( c->bestSample && endSample > c->blockEnd) {
+	if ( c->provisional) {
+	    c->points = 0;
+	    c->next = 0;
+	    c->provisional = 0;
+	}
+	addPoint( c, c->bestSample, c->bestNs);
+	c->bestSample = 0;
+	changed = 1;
+    }
+    if ( !c->bestSample) c->blockEnd = endSample + (uint64_t)SAMPLE_CLOCK_BLOCK_SECONDS * c->nominalRate;
+
+    int64_t lead = (int64_t)monotonicNs - nominalNs( c, endSample);
+    if ( !c->bestSample || lead < c->bestLead) {
+	c->bestSample = endSample;
+	c->bestNs = monotonicNs;
+	c->bestLead = lead;
+    }
+
+    // Times are wanted from the start, the first buffer will do until the first block is over.
+    // Starting up it is often late, so it is no good as a point of the fit after that.
+    if ( c->points == 0) {
+	addPoint( c, endSample, monotonicNs);
+	c->provisional = 1;
+	changed = 1;
+    }
+    return changed;
+}
+
+uint64_t sampleClockMonotonic( const struct sampleClock *c, uint64_t sample)
+{
+    if ( !c->points) return 0;
+    return c->originNs + (int64_t)llround( ((double)sample - (double)c->originSample) * c->nsPerSample);
+}
+
+uint64_t sampleClockRealtime( const struct sampleClock *c, uint64_t sample)
+{
+    if ( !c->points) return 0;
+    return sampleClockMonotonic( c, sample) + c->realtimeOffsetNs;
+}
+
+int64_t sampleClockErrorPpb( const struct sampleClock *c)
+{
+    return (int64_t)llround( (1e9 / c->nsPerSample / c->nominalRate - 1) * 1e9);
+}
@@ -0,0 +1,81 @@
+#ifndef SAMPLECLOCK_IS_IN
+#define SAMPLECLOCK_IS_IN
+
+/*
+** The radio's sample clock, disciplined against the computer's, so a sample
+** number can be turned into the time it came off the air. Counting samples at
+** the nominal rate drifts with the dongle's crystal, tens of ppm is usual, which
+** is seconds a day, and starts over with each run of ookd. Times from the fit
+** can be compared across restarts and across receivers whose computers keep
+** good time, e.g. with NTP.
+**
+** Each radio buffer arrives a little after its last sample, after the USB
+** transfer and however long we took to be woken, so the earliest arrival of
+** each block of SAMPLE_CLOCK_BLOCK_SECONDS is the one nearest the truth. A
+** line is fitted by least squares through the last SAMPLE_CLOCK_POINTS of
+** those. Its slope is the true sample rate, and the scatter of the points about
+** it is the uncertainty. The least delay of the USB transfer, a fraction of a
+** millisecond, is in every point and so isn't seen.
+**
+** A point far off the line, e.g. after samples were dropped or the radio was
+** restarted, starts the fit over.
+*/
+
+#include <stdint.h>
+
+#define SAMPLE_CLOCK_BLOCK_SECONDS 4
+#define SAMPLE_CLOCK_POINTS 64           // about four minutes of them
+#define SAMPLE_CLOCK_RESET_NS 5000000    // a point this far off the line starts over
+#define SAMPLE_CLOCK_UNSURE_NS 1000000   // the uncertainty until there are enough points to measure it
+
+struct sampleClock {
+    uint32_t nominalRate;
+
+    uint64_t blockEnd;             // the block in progress ends with this sample
+    uint64_t bestSample;           // its earliest arrival, by the nominal rate, 0 for none yet
+    uint64_t bestNs;
+    int64_t bestLead;              // of bestNs over the nominal time of bestSample
+
+    struct { uint64_t sample; uint64_t monotonicNs; } point[SAMPLE_CLOCK_POINTS];
+    unsigned points;               // up to SAMPLE_CLOCK_POINTS
+    unsigned next;                 // where the next point goes
+    unsigned resets;
+    int provisional;               // the only point is the first buffer's, until a block is done
+
+    int64_t realtimeOffsetNs;      // CLOCK_REALTIME less CLOCK_MONOTONIC at the last arrival
+
+    // The fit, once there is a point
+    uint64_t originSample;
+    uint64_t originNs;             // CLOCK_MONOTONIC of originSample coming off the radio
+    double nsPerSample;
+    double uncertaintyNs;
+};
+
+void sampleClockInit( struct sampleClock *c, uint32_t nominalRate);
+
+/*
+** A buffer ending with sample endSample arrived at these times. Returns 1 if the
+** fit changed.
+*/
+int sampleClockArrival( struct sampleClock *c, uint64_t endSample, uint64_t monotonicNs, uint64_t realtimeNs);
+
+/*
+** 1 once samples can be turned into times.
+*/
+static inline int sampleClockLocked( const struct sampleClock *c)
+{
+    return c->points > 0;
+}
+
+/*
+** When sample came off the radio, 0 if not locked.
+*/
+uint64_t sampleClockMonotonic( const struct sampleClock *c, uint64_t sample);
+uint64_t sampleClockRealtime( const struct sampleClock *c, uint64_t sample);
+
+/*
+** How far the sample clock is from its nominal rate, in parts per billion, positive if fast.
+*/
+int64_t sampleClockErrorPpb( const struct sampleClock *c);
+
+#endif
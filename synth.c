@@ -0,0 +1,384 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "synth.h"
+
+static const char *protocolNames[SYNTH_PROTOCOLS] = {
+    [SYNTH_WH1080] = "wh1080",
+    [SYNTH_OREGONSCI] = "oregonsci",
+    [SYNTH_ACURITE] = "acurite",
+    [SYNTH_NEXA] = "nexa",
+};
+
+const char *synthProtocolName( enum synthProtocol p)
+{
+    if ( p < 0 || p >= SYNTH_PROTOCOLS) return "unknown";
+    return protocolNames[p];
+}
+
+int synthProtocolByName( const char *name)
+{
+    for ( int p = 0; p < SYNTH_PROTOCOLS; p++) {
+	if ( strcasecmp( name, protocolNames[p]) == 0) return p;
+    }
+    return -1;
+}
+
+unsigned synthProtocolsByName( const char *list)
+{
+    unsigned mask = 0;
+    char *copy = strdup(list);
+    if ( !copy) return 0;
+
+    for ( char *name = strtok( copy, ","); name; name = strtok( 0, ",")) {
+	int p = synthProtocolByName( name);
+	if ( p < 0) {
+	    fprintf(stderr,"Unknown protocol: %s\n", name);
+	    mask = 0;
+	    break;
+	}
+	mask |= 1<<p;
+    }
+    free(copy);
+    return mask;
+}
+
+void synthDefaults( struct synthConfig *config)
+{
+    memset( config, 0, sizeof(*config));
+    config->sampleRate = 250000;
+    config->seconds = 30.0;
+    config->amplitude = 100.0;
+    config->snrDb = 20.0;
+    config->maxOffsetHz = 20000.0;
+    config->collisionRate = 0.0;
+    config->meanGapSeconds = 0.25;
+    config->protocols = (1<<SYNTH_PROTOCOLS)-1;
+    config->seed = 1;
+}
+
+//
+// A small, seedable generator so captures are repeatable everywhere
+//
+static uint64_t nextRandom( uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static double uniform( uint64_t *state)
+{
+    return (nextRandom(state) >> 11) * (1.0/9007199254740992.0);
+}
+
+static double gaussian( uint64_t *state)
+{
+    double u1 = uniform(state);
+    double u2 = uniform(state);
+    if ( u1 < 1e-300) u1 = 1e-300;
+    return sqrt(-2.0*log(u1)) * cos(2.0*M_PI*u2);
+}
+
+//
+// Pulse trains, in microseconds. The last low is the gap after the transmission
+// and is left 0.
+//
+struct train {
+    unsigned count;
+    uint32_t hiUs[1024];
+    uint32_t lowUs[1024];
+};
+
+static void addPulse( struct train *t, uint32_t hi, uint32_t low)
+{
+    if ( t->count < sizeof(t->hiUs)/sizeof(t->hiUs[0])) {
+	t->hiUs[t->count] = hi;
+	t->lowUs[t->count] = low;
+	t->count++;
+    }
+}
+
+static uint8_t crc8_31( const uint8_t *addr, unsigned len)
+{
+    uint8_t crc = 0;
+    while (len--) {
+	uint8_t inbyte = *addr++;
+	for ( unsigned i = 8; i; i--) {
+	    uint8_t mix = (crc ^ inbyte) & 0x80;
+	    crc <<= 1;
+	    if (mix) crc ^= 0x31;
+	    inbyte <<= 1;
+	}
+    }
+    return crc;
+}
+
+// Pulse width, 88 bits, 0xff then 9 data bytes and a CRC8
+static void wh1080Train( struct train *t, uint64_t *rnd)
+{
+    uint8_t data[11];
+    unsigned temperature = 400 + 150 + nextRandom(rnd)%200;   // tenths C, offset 400
+
+    data[0] = 0xff;
+    data[1] = 0x12;
+    data[2] = 0x30 | ((temperature>>8) & 0x0f);
+    data[3] = temperature & 0xff;
+    data[4] = 30 + nextRandom(rnd)%60;
+    data[5] = nextRandom(rnd)%20;
+    data[6] = data[5] + nextRandom(rnd)%10;
+    data[7] = 0;
+    data[8] = nextRandom(rnd)%100;
+    data[9] = nextRandom(rnd)%8;
+    data[10] = crc8_31( data+1, 9);
+
+    for ( unsigned b = 0; b < 88; b++) {
+	int one = (data[b/8] >> (7 - b%8)) & 1;
+	addPulse( t, one ? 500 : 1500, 1000);
+    }
+    t->lowUs[t->count-1] = 0;
+}
+
+// Manchester, a temperature/humidity message as oregonsci expects it
+static void oregonTrain( struct train *t, uint64_t *rnd)
+{
+    unsigned char nibble[26] = { 0xf,0xf,0xf,0xf,0xf,0xf, 0xa, 1,2,2,0 };
+    unsigned temp = 100 + nextRandom(rnd)%200;       // tenths C
+    unsigned hum = 20 + nextRandom(rnd)%70;
+
+    nibble[11] = 1 + nextRandom(rnd)%2;              // channel
+    nibble[12] = nextRandom(rnd)%16;                 // rolling code
+    nibble[13] = nextRandom(rnd)%16;
+    nibble[14] = 0;                                  // flags
+    nibble[15] = temp%10;
+    nibble[16] = (temp/10)%10;
+    nibble[17] = (temp/100)%10;
+    nibble[18] = 0;                                  // sign
+    nibble[19] = hum%10;
+    nibble[20] = (hum/10)%10;
+    nibble[21] = 0;
+
+    unsigned sum = 0;
+    for ( int n = 7; n < 22; n++) sum += nibble[n];
+    nibble[22] = sum & 0x0f;
+    nibble[23] = (sum >> 4) & 0x0f;
+
+    // Lay out the half bit levels, a one is high then low, a zero low then high.
+    const uint32_t half = 488;
+    unsigned char level[26*4*2];
+    unsigned levels = 0;
+    for ( unsigned b = 0; b < 26*4; b++) {
+	int one = (nibble[b/4] >> (b%4)) & 1;
+	level[levels++] = one;
+	level[levels++] = !one;
+    }
+
+    // The first bit is a one, so we start high. Merge runs into pulses.
+    unsigned i = 0;
+    while ( i < levels) {
+	uint32_t hi = 0, low = 0;
+	while ( i < levels && level[i]) { hi += half; i++; }
+	while ( i < levels && !level[i]) { low += half; i++; }
+	if ( hi == 0) continue;
+	addPulse( t, hi, i < levels ? low : 0);
+    }
+}
+
+// A 592TXR temperature/humidity message, sent three times
+static void acuriteTrain( struct train *t, uint64_t *rnd)
+{
+    uint8_t data[7];
+    uint16_t id = nextRandom(rnd) & 0x3fff;
+    uint8_t battery = 1;
+    uint8_t message = 4;
+    uint8_t humidity = 20 + nextRandom(rnd)%70;
+    uint16_t temperatureRaw = 1000 + 100 + nextRandom(rnd)%200;
+    uint8_t tempHigh = (temperatureRaw >> 7) & 0x7f;
+    uint8_t tempLow = temperatureRaw & 0x7f;
+
+    data[0] = (0x3 << 6) | (id >> 8);
+    data[1] = id & 0xff;
+    data[2] = (((__builtin_popcount(message) + battery) & 1) << 7) | (battery << 6) | message;
+    data[3] = ((__builtin_popcount(humidity) & 1) << 7) | humidity;
+    data[4] = ((__builtin_popcount(tempHigh) & 1) << 7) | tempHigh;
+    data[5] = ((__builtin_popcount(tempLow) & 1) << 7) | tempLow;
+    data[6] = 0;
+    for ( int i = 0; i < 6; i++) data[6] += data[i];
+
+    for ( int repeat = 0; repeat < 3; repeat++) {
+	for ( int s = 0; s < 4; s++) addPulse( t, 650, 550);
+	for ( unsigned b = 0; b < 56; b++) {
+	    int one = (data[b/8] >> (7 - b%8)) & 1;
+	    if ( one) addPulse( t, 450, 160);
+	    else addPulse( t, 250, 350);
+	}
+	addPulse( t, 250, repeat < 2 ? 2000 : 0);
+    }
+}
+
+// 32 logical bits, each a pair of physical bits, between a sync and a pause
+static void nexaTrain( struct train *t, uint64_t *rnd)
+{
+    uint32_t code = nextRandom(rnd) & 0x3ffffff;
+    uint32_t bits[32];
+    unsigned n = 0;
+
+    for ( int i = 0; i < 26; i++) bits[n++] = (code >> i) & 1;
+    bits[n++] = 1;                        // not group, inverted
+    bits[n++] = nextRandom(rnd) & 1;      // on/off, inverted
+    bits[n++] = 1;                        // channel
+    bits[n++] = 1;
+    bits[n++] = 1;                        // unit
+    bits[n++] = 1;
+
+    addPulse( t, 250, 2700);              // sync
+    for ( unsigned i = 0; i < n; i++) {
+	if ( bits[i]) {
+	    addPulse( t, 250, 275);
+	    addPulse( t, 250, 1300);
+	} else {
+	    addPulse( t, 250, 1300);
+	    addPulse( t, 250, 275);
+	}
+    }
+    addPulse( t, 250, 0);                 // pause
+}
+
+static void buildTrain( enum synthProtocol p, struct train *t, uint64_t *rnd)
+{
+    t->count = 0;
+    switch(p) {
+      case SYNTH_WH1080: wh1080Train( t, rnd); break;
+      case SYNTH_OREGONSCI: oregonTrain( t, rnd); break;
+      case SYNTH_ACURITE: acuriteTrain( t, rnd); break;
+      case SYNTH_NEXA: nexaTrain( t, rnd); break;
+      default: break;
+    }
+}
+
+static uint64_t trainSamples( const struct train *t, uint32_t sampleRate)
+{
+    uint64_t us = 0;
+    for ( unsigned i = 0; i < t->count; i++) us += t->hiUs[i] + t->lowUs[i];
+    return us * sampleRate / 1000000;
+}
+
+// Key the carrier on into the float buffer
+static void renderTrain( float *iq, uint64_t samples, const struct train *t, uint64_t start,
+			 uint32_t sampleRate, double amplitude, double offsetHz, double phase)
+{
+    const double step = 2.0*M_PI*offsetHz/sampleRate;
+    uint64_t us = 0;
+
+    for ( unsigned i = 0; i < t->count; i++) {
+	uint64_t on = start + us*sampleRate/1000000;
+	uint64_t off = start + (us + t->hiUs[i])*sampleRate/1000000;
+	for ( uint64_t s = on; s < off && s < samples; s++) {
+	    double ph = phase + step*(s - start);   // phase continuous across the lows
+	    iq[2*s] += amplitude*cos(ph);
+	    iq[2*s+1] += amplitude*sin(ph);
+	}
+	us += t->hiUs[i] + t->lowUs[i];
+    }
+}
+
+int synthGenerate( const struct synthConfig *config, struct synthCapture *capture)
+{
+    memset( capture, 0, sizeof(*capture));
+
+    uint64_t samples = config->seconds * config->sampleRate;
+    if ( samples == 0 || config->protocols == 0) {
+	fprintf(stderr,"Nothing to synthesize\n");
+	return -1;
+    }
+
+    float *iq = calloc( 2*samples, sizeof(float));
+    if ( !iq) {
+	fprintf(stderr,"Failed to allocate %llu samples\n", (unsigned long long)samples);
+	return -1;
+    }
+
+    uint64_t rnd = config->seed;
+    size_t allocated = 0;
+    struct train *train = malloc( sizeof(*train));
+    if ( !train) goto Fail;
+
+    enum synthProtocol enabled[SYNTH_PROTOCOLS];
+    unsigned nEnabled = 0;
+    for ( int p = 0; p < SYNTH_PROTOCOLS; p++) {
+	if ( config->protocols & (1<<p)) enabled[nEnabled++] = p;
+    }
+
+    const uint64_t margin = config->sampleRate/20;              // keep 50ms clear at the ends
+    const uint64_t minimumGap = config->sampleRate/50;          // well over the detector's 8ms
+    uint64_t next = margin;
+
+    for (;;) {
+	enum synthProtocol p = enabled[ nextRandom(&rnd) % nEnabled];
+	buildTrain( p, train, &rnd);
+	uint64_t length = trainSamples( train, config->sampleRate);
+
+	struct synthBurst *previous = capture->count ? &capture->bursts[capture->count-1] : 0;
+	uint64_t start = next;
+	int collided = 0;
+	if ( previous && uniform(&rnd) < config->collisionRate) {
+	    start = previous->startSample + uniform(&rnd)*(previous->endSample - previous->startSample);
+	    collided = 1;
+	}
+	if ( start + length + margin > samples) break;
+
+	double offset = (2.0*uniform(&rnd) - 1.0) * config->maxOffsetHz;
+	renderTrain( iq, samples, train, start, config->sampleRate, config->amplitude, offset, 2.0*M_PI*uniform(&rnd));
+
+	if ( capture->count == allocated) {
+	    allocated = allocated ? 2*allocated : 256;
+	    struct synthBurst *b = realloc( capture->bursts, allocated*sizeof(*b));
+	    if ( !b) goto Fail;
+	    capture->bursts = b;
+	    previous = capture->count ? &capture->bursts[capture->count-1] : 0;
+	}
+	struct synthBurst *b = &capture->bursts[capture->count++];
+	b->startSample = start;
+	b->endSample = start + length;
+	b->protocol = p;
+	b->pulses = train->count;
+	b->offsetHz = lrint(offset);
+	b->collided = collided;
+	if ( collided) previous->collided = 1;
+
+	uint64_t end = b->endSample > next ? b->endSample : next;
+	next = end + minimumGap - log(1.0 - uniform(&rnd)) * config->meanGapSeconds * config->sampleRate;
+    }
+
+    capture->iq = malloc( 2*samples);
+    if ( !capture->iq) goto Fail;
+    capture->len = 2*samples;
+
+    const double sigma = config->amplitude / sqrt( 2.0*pow( 10.0, config->snrDb/10.0));
+    for ( uint64_t s = 0; s < 2*samples; s++) {
+	long v = lrint( 128.0 + iq[s] + sigma*gaussian(&rnd));
+	capture->iq[s] = v < 0 ? 0 : (v > 255 ? 255 : v);
+    }
+
+    free(train);
+    free(iq);
+    return 0;
+
+  Fail:
+    fprintf(stderr,"Failed to allocate while synthesizing\n");
+    if ( train) free(train);
+    free(iq);
+    synthFree( capture);
+    return -1;
+}
+
+void synthFree( struct synthCapture *capture)
+{
+    if ( capture->iq) free( capture->iq);
+    if ( capture->bursts) free( capture->bursts);
+    memset( capture, 0, sizeof(*capture));
+}
@@ -0,0 +1,67 @@
+#ifndef SYNTH_IS_IN
+#define SYNTH_IS_IN
+
+/*
+** Synthesize 8 bit IQ captures, like those from rtl_sdr, containing transmissions
+** from the devices we have decoders for. Each one is a valid message for its
+** decoder, keyed onto a carrier at some frequency offset, with gaussian noise added.
+**
+** This is for benchmarking and checking ookd without a radio.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum synthProtocol {
+    SYNTH_WH1080 = 0,
+    SYNTH_OREGONSCI,
+    SYNTH_ACURITE,
+    SYNTH_NEXA,
+    SYNTH_PROTOCOLS
+};
+
+struct synthConfig {
+    uint32_t sampleRate;           // samples/sec
+    double seconds;                // length of the capture
+    double amplitude;              // carrier amplitude in counts, 127 is full scale
+    double snrDb;                  // carrier power over noise power
+    double maxOffsetHz;            // each transmission gets a random offset within +/- this
+    double collisionRate;          // fraction of transmissions started on top of the previous one
+    double meanGapSeconds;         // average quiet time between transmissions
+    unsigned protocols;            // bit mask of 1<<enum synthProtocol
+    uint64_t seed;
+};
+
+struct synthBurst {
+    uint64_t startSample;          // first sample of carrier
+    uint64_t endSample;            // last sample of carrier
+    enum synthProtocol protocol;
+    uint32_t pulses;
+    int32_t offsetHz;
+    int collided;                  // overlaps another transmission
+};
+
+struct synthCapture {
+    unsigned char *iq;             // interleaved I,Q, two bytes per sample
+    size_t len;                    // bytes
+    struct synthBurst *bursts;     // what was injected, in start order
+    size_t count;
+};
+
+// The defaults, then adjust what you like.
+void synthDefaults( struct synthConfig *config);
+
+// 0 on success, <0 on failure. Free the capture with synthFree().
+int synthGenerate( const struct synthConfig *config, struct synthCapture *capture);
+
+void synthFree( struct synthCapture *capture);
+
+const char *synthProtocolName( enum synthProtocol p);
+
+// -1 if not a protocol name
+int synthProtocolByName( const char *name);
+
+// A comma separated list of names to a protocols mask, 0 if any are unknown
+unsigned synthProtocolsByName( const char *list);
+
+#endif
@@ -6,9 +6,12 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/stat.h>
 
 #include "ook.h"
+#include "protocols.h"
+#include "metrics.h"
 
 int verbose=0;
 
@@ -161,57 +164,100 @@ static void recordPeriodic( const char *file)
    
 }
 
-/*
- * Function taken from Luc Small (http://lucsmall.com), itself
- * derived from the OneWire Arduino library. Modifications to
- * the polynomial according to Fine Offset's CRC8 calulations.
- * Oddly, that may have ultimately come from me. I wrote maybe the
- * original OneWire Arduino code back in the day including the CRC.
- */
-static uint8_t wh1080_crc8( uint8_t *addr, uint8_t len)
-{
-    uint8_t crc = 0;
-
-    // Indicated changes are from reference CRC-8 function in OneWire library
-    while (len--) {
-	uint8_t inbyte = *addr++;
-	uint8_t i;
-	for (i = 8; i; i--) {
-	    uint8_t mix = (crc ^ inbyte) & 0x80; // changed from & 0x01
-	    crc <<= 1; // changed from right shift
-	    if (mix) crc ^= 0x31;// changed from 0x8C;
-	    inbyte <<= 1; // changed from right shift
-	}
-    }
-    return crc;
-}
-
-
 static void showHelp( FILE *f)
 {
     fprintf(f, 
-	    "Usage: wh1080 [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface]\n"
+	    "Usage: wh1080 [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-R ring] [-B bytes]\n"
 	    "  -h | -? | --help                      display usage and exit\n"
 	    "  -v | --verbose                        verbose logging\n"
 	    "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
 	    "  -p port | --multicast-port port       multicast port, default 3636\n"
 	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -R name | --ring name                 read bursts from ookd's shared memory ring instead, e.g. /ookd-ring\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving faster than we decode them\n"
 	    "  -r path | --recent path               path to most recent data, /tmp/current-weather.json\n"
 	    "  -P path | --periodic path             path to the periodic data, /tmp/weather\n"
 	    "                                        timestamp.json gets appended.\n"
 	    "  -m period | --minutes period          number of minutes between periodic data files.\n"
+	    "  -s name | --stats-shm name            publish latency metrics in shared memory with this name, for ookstats\n"
 	    );
 }
 
 
+// What the handlers need from main()
+static struct metrics *metrics = 0;
+static const char *recentFileName = "/tmp/current-weather.json";
+static const char *periodicFileName = "/tmp/weather";
+static int minutes = 5;
+
+// Write the periodic file on time even if the station has gone quiet
+static void periodicTask( void *ctx)
+{
+    if ( oldestDatum && time(0)-oldestDatum > minutes*60) {
+	recordPeriodic( periodicFileName);
+    }
+}
+
+static void handleBurst( struct ook_burst *burst, int sock, void *ctx)
+{
+    metricsBurstReceived( metrics, burst);
+    metricsReceiveStats( metrics, sock);
+
+    // Data never comes faster than 5 seconds, we are looking at the second of a pair
+    // of redundant transmissions
+    if ( oldestDatum && time(0)-oldestDatum < 5) return;
+
+    uint8_t data[11];
+
+    if ( wh1080_decode( burst, data, verbose)) {
+	metricsBurstDecoded( metrics, burst);
+
+	//unsigned short deviceId = ( (data[1]<<4) | (data[2]>>4) );
+	unsigned short temperatureBits = (((data[2]&0xf)<<8) | data[3]);
+	double temp = (temperatureBits-400)/10.0;   // degrees C
+	unsigned short humidityBits = data[4];
+	double hum = humidityBits;                  // %rh
+	unsigned short averageWindSpeedBits = data[5];
+	double avgWind = averageWindSpeedBits*0.34; // meters per second
+	unsigned short gustWindSpeedBits = data[6];
+	double gustWind = gustWindSpeedBits*0.34;   // meters per second
+	unsigned short rainfallBits = (((data[7]&0x0f)<<8) | data[8]);
+	double rain = rainfallBits*0.3;             // millimeters
+	unsigned short batteryLowBits = (data[9]>>4);
+	unsigned short windDirectionBits = (data[9]&0x0f);
+
+	periodicTask( 0);
+
+	addSample( &temperature, temp);
+	addSample( &humidity, hum); 
+	addSample( &averageWindSpeed, avgWind);
+	addSample( &gustWindSpeed, gustWind);
+	addSample( &rainfall, rain);           
+	addSample( &batteryLow, batteryLowBits);
+	addSample( &windDirection, windDirectionBits);
+
+	if ( verbose) dumpWeather();
+
+	recordRecent( recentFileName, temp, hum, avgWind, gustWind, rain, batteryLowBits, windDirectionBits);
+	metricsBurstOutput( metrics, burst);
+    }
+
+    fflush(stdout);
+}
+
+static void stopOnSignal( int signum, void *ctx)
+{
+    ook_loop_stop( ctx);
+}
+
 int main( int argc, char **argv)
 {
     const char *multicastAddress = "236.0.0.1";
     const char *multicastPort = "3636";
     const char *multicastInterface = "127.0.0.1";
-    const char *recentFileName = "/tmp/current-weather.json";
-    const char *periodicFileName = "/tmp/weather";
-    int minutes = 5;
+    const char *ringName = 0;
+    int receiveBuffer = 0;
+    const char *statsShmName = 0;
 
     // Handle options
     for(;;) {
@@ -222,13 +268,16 @@ int main( int argc, char **argv)
 	    { "multicast-address", required_argument, 0, 'a'},
 	    { "multicast-port", required_argument, 0, 'p' },
 	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "receive-buffer", required_argument, 0, 'B' },
 	    { "recent", required_argument, 0, 'r' },
 	    { "periodic", required_argument, 0, 'P' },
 	    { "minutes", required_argument, 0, 'm' },
+	    { "stats-shm", required_argument, 0, 's' },
 	    { 0,0,0,0}
 	};
 
-	int c = getopt_long( argc, argv, "vh?f:a:p:i:m:", options, &optionIndex );
+	int c = getopt_long( argc, argv, "vh?f:a:p:i:m:s:R:B:", options, &optionIndex );
 	if ( c == -1) break;
 
 	switch(c) {
@@ -248,6 +297,16 @@ int main( int argc, char **argv)
 	  case 'i':
 	    multicastInterface = optarg;
 	    break;
+	  case 'R':
+	    ringName = optarg;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	  case 'r':
 	    recentFileName = optarg;
 	    break;
@@ -264,6 +323,9 @@ int main( int argc, char **argv)
 		  minutes = m;
 	      }
 	      break;
+	  case 's':
+	    statsShmName = optarg;
+	    break;
 	  default:
 	    fprintf(stderr,"Illegal option\n");
 	    showHelp(stderr);
@@ -273,95 +335,43 @@ int main( int argc, char **argv)
 
     if ( verbose) fprintf(stderr,"Periodic file is %s\n", periodicFileName);
 
-    // Parse our multicast address
-    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
-    if ( sock < 0) {
-	fprintf(stderr,"Failed to open multicast interface\n");
-	exit(1);
+    if ( statsShmName) {
+	metrics = metricsOpen( statsShmName);
+	if ( !metrics) exit(1);
     }
 
-    for (;;) {
-	struct ook_burst *burst;
-	struct sockaddr_storage addr;
-	socklen_t addrLen = sizeof(addr);
-
-	int e = ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
-	if ( e < 0) {
-	    fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
-	    break;
-	}
-	if ( e == 0) {
-	    fprintf(stderr,"Corrupt burst\n");
-	    continue;
+    // Bursts come from ookd's ring if we share its host and were asked to, otherwise multicast
+    struct ook_ring *ring = 0;
+    int sock = -1;
+    if ( ringName) {
+	ring = ook_ring_attach( ringName);
+	if ( !ring) exit(1);
+    } else {
+	sock = ook_open( multicastAddress, multicastPort, multicastInterface);
+	if ( sock < 0) {
+	    fprintf(stderr,"Failed to open multicast interface\n");
+	    exit(1);
 	}
+	if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) exit(1);
 
-	// Data never comes faster than 5 seconds, we are looking at the second of a pair
-	// of redundant transmissions
-	if ( oldestDatum && time(0)-oldestDatum < 5) continue;
-
-	{
-	    unsigned char *data = 0;
-	    size_t dataLen = 0;
-	    int bits = ook_decode_pulse_width( burst, 
-					       1400000,1600000, 400000,600000, 900000,UINT_MAX, 
-					       &data, &dataLen,
-					       verbose);
-
-	    if ( bits == 88) {
-		if ( verbose) {
-		    for (int i = 0; i < dataLen; i++) fprintf(stderr,"%02x ", data[i]);
-		    fprintf(stderr,"\n");
-		}
-		if (data[0] != 0xff) {
-		    if ( verbose) fprintf(stderr,"Did not begin 0xff\n");
-		    goto NotGood;
-		}
-		if (wh1080_crc8(data+1,9) != data[10]) {
-		    if ( verbose) fprintf(stderr,"Bad CRC\n");
-		    goto NotGood;
-		}
-		
-		//unsigned short deviceId = ( (data[1]<<4) | (data[2]>>4) );
-		unsigned short temperatureBits = (((data[2]&0xf)<<8) | data[3]);
-		double temp = (temperatureBits-400)/10.0;   // degrees C
-		unsigned short humidityBits = data[4];
-		double hum = humidityBits;                  // %rh
-		unsigned short averageWindSpeedBits = data[5];
-		double avgWind = averageWindSpeedBits*0.34; // meters per second
-		unsigned short gustWindSpeedBits = data[6];
-		double gustWind = gustWindSpeedBits*0.34;   // meters per second
-		unsigned short rainfallBits = (((data[7]&0x0f)<<8) | data[8]);
-		double rain = rainfallBits*0.3;             // millimeters
-		unsigned short batteryLowBits = (data[9]>>4);
-		unsigned short windDirectionBits = (data[9]&0x0f);
-
-		if ( oldestDatum && time(0)-oldestDatum > minutes*60) {
-		    recordPeriodic( periodicFileName);
-		}
-
-		addSample( &temperature, temp);
-		addSample( &humidity, hum); 
-		addSample( &averageWindSpeed, avgWind);
-		addSample( &gustWindSpeed, gustWind);
-		addSample( &rainfall, rain);           
-		addSample( &batteryLow, batteryLowBits);
-		addSample( &windDirection, windDirectionBits);
-
-		if ( verbose) dumpWeather();
-
-		recordRecent( recentFileName, temp, hum, avgWind, gustWind, rain, batteryLowBits, windDirectionBits);
-	    } else {
-		if ( verbose) fprintf(stderr,"ignored %d pulse burst\n", burst->pulses);
-	    }
+	// wh1080_decode() only takes 88 bits, a pulse each, don't wake for anything else
+	struct ook_filter filter = { .minPulses = 88, .maxPulses = 88 };
+	if ( ook_set_filter( sock, &filter) < 0) exit(1);
+    }
 
-	  NotGood:
-	    if (data) free(data);
-	}
+    struct ook_loop *loop = ook_loop_new();
+    if ( !loop) exit(1);
+    if ( (ring ? ook_loop_add_ring( loop, ring, handleBurst, 0, verbose)
+	       : ook_loop_add_socket( loop, sock, handleBurst, 0, verbose)) < 0) exit(1);
+    if ( !ook_loop_every( loop, 1000000000ULL, periodicTask, 0)) exit(1);
+    if ( ook_loop_signal( loop, SIGINT, stopOnSignal, loop) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGTERM, stopOnSignal, loop) < 0) exit(1);
 
-	fflush(stdin);
-	free(burst);
-    }
+    ook_loop_run( loop);
 
-    close(sock);
+    ook_loop_free( loop);
+    if ( sock >= 0) close(sock);
+    ook_ring_detach( ring);
+    metricsClose( metrics, statsShmName);
     return 0;
 }
@@ -6,10 +6,13 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <math.h>
 
 #include "ook.h"
+#include "protocols.h"
+#include "metrics.h"
 
 //
 // Data format comes from http://makin-things.com/articles/decoding-lacrosse-weather-sensor-rf-transmissions/
@@ -176,28 +179,118 @@ static void recordPeriodic( const char *file)
 static void showHelp( FILE *f)
 {
     fprintf(f, 
-	    "Usage: ws2300 [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface]\n"
+	    "Usage: ws2300 [-h] [-?] [-v] [-a mcastaddr] [-p mcastport] [-i mcastinterface] [-R ring] [-B bytes]\n"
 	    "  -h | -? | --help                      display usage and exit\n"
 	    "  -v | --verbose                        verbose logging\n"
 	    "  -a addr | --multicast-address addr    multicast address, default 236.0.0.1\n"
 	    "  -p port | --multicast-port port       multicast port, default 3636\n"
 	    "  -i addr | --multicast-interface addr  address of the multicast interface, default 127.0.0.1\n"
+	    "  -R name | --ring name                 read bursts from ookd's shared memory ring instead, e.g. /ookd-ring\n"
+	    "  -B bytes | --receive-buffer bytes     kernel buffer for bursts arriving faster than we decode them\n"
 	    "  -r path | --recent path               path to most recent data, /tmp/current-weather.json\n"
 	    "  -P path | --periodic path             path to the periodic data, /tmp/weather\n"
 	    "                                        timestamp.json gets appended.\n"
 	    "  -m period | --minutes period          number of minutes between periodic data files.\n"
+	    "  -s name | --stats-shm name            publish latency metrics in shared memory with this name, for ookstats\n"
 	    );
 }
 
 
+// What the handlers need from main()
+static struct metrics *metrics = 0;
+static const char *recentFileName = "/tmp/current-weather.json";
+static const char *periodicFileName = "/tmp/weather";
+static int minutes = 5;
+
+// Write the periodic file on time even if the station has gone quiet
+static void periodicTask( void *ctx)
+{
+    if ( oldestDatum && time(0)-oldestDatum > minutes*60) {
+	recordPeriodic( periodicFileName);
+    }
+}
+
+static void handleBurst( struct ook_burst *burst, int sock, void *ctx)
+{
+    metricsBurstReceived( metrics, burst);
+    metricsReceiveStats( metrics, sock);
+
+    uint8_t data[7];
+
+    if ( ws2300_decode( burst, data, verbose)) {
+	metricsBurstDecoded( metrics, burst);
+
+	periodicTask( 0);
+
+	int packetId = ((data[1]>>4)&0x03);
+	int stationId = ((data[1]&0x0f)<<4)+((data[2]&0xf0)>>4);
+
+	if ( verbose) fprintf(stderr,"packetid=%d station=%d\n", packetId, stationId);
+
+	switch( packetId) {
+	  case 0:               // temp
+	      {
+		  double temp = (data[3]&0x0f)*10 + ((data[4]&0xf0)>>4) + (data[4]&0x0f)*0.1 - 30.0;  // TX13 is -40
+		  addSample( &temperature, temp);
+		  currentTemperature = temp;
+	      }
+	    break;
+	  case 1:               // humidity
+	      {
+		  int hum = (data[3]&0x0f)*10 + ((data[4]&0xf0)>>4);
+		  addSample( &humidity, hum);
+		  currentHumidity = hum;
+	      }
+	    break;
+	  case 2:               // rainfall
+	      {
+		  int rain = ((data[3]&0x0f)<<8) + data[4];
+		  addSample( &rainfall, rain);
+	      }
+	    break;
+	  case 3:               // wind
+	      {
+		  double wind = (((data[3]&0x1f)<<4) + ((data[4]&0xf0)>>4) ) / 10.0;
+		  int windDir = (data[4] & 0x0f);
+		  if ( data[1] & 0x80) {
+		      if ( wind != 51.0) {
+			  addSample( &gustWindSpeed, wind);
+			  currentGustSpeed = wind;
+		      }
+		  } else {
+		      if ( wind != 51.0) {
+			  addSample( &averageWindSpeed, wind);
+			  addSample( &windDirection, windDir);
+			  currentWindSpeed = wind;
+			  currentWindDirection = windDir;
+		      }
+		  }
+	      }
+	    break;
+	}
+
+	if ( verbose) dumpWeather();
+
+	reportRecent(recentFileName);
+	metricsBurstOutput( metrics, burst);
+    }
+
+    fflush(stdout);
+}
+
+static void stopOnSignal( int signum, void *ctx)
+{
+    ook_loop_stop( ctx);
+}
+
 int main( int argc, char **argv)
 {
     const char *multicastAddress = "236.0.0.1";
     const char *multicastPort = "3636";
     const char *multicastInterface = "127.0.0.1";
-    const char *recentFileName = "/tmp/current-weather.json";
-    const char *periodicFileName = "/tmp/weather";
-    int minutes = 5;
+    const char *ringName = 0;
+    int receiveBuffer = 0;
+    const char *statsShmName = 0;
 
     // Handle options
     for(;;) {
@@ -208,13 +301,16 @@ int main( int argc, char **argv)
 	    { "multicast-address", required_argument, 0, 'a'},
 	    { "multicast-port", required_argument, 0, 'p' },
 	    { "multicast-interface", required_argument, 0, 'i' },
+	    { "ring", required_argument, 0, 'R' },
+	    { "receive-buffer", required_argument, 0, 'B' },
 	    { "recent", required_argument, 0, 'r' },
 	    { "periodic", required_argument, 0, 'P' },
 	    { "minutes", required_argument, 0, 'm' },
+	    { "stats-shm", required_argument, 0, 's' },
 	    { 0,0,0,0}
 	};
 
-	int c = getopt_long( argc, argv, "vh?f:a:p:i:m:r:P:", options, &optionIndex );
+	int c = getopt_long( argc, argv, "vh?f:a:p:i:m:r:P:s:R:B:", options, &optionIndex );
 	if ( c == -1) break;
 
 	switch(c) {
@@ -234,6 +330,16 @@ int main( int argc, char **argv)
 	  case 'i':
 	    multicastInterface = optarg;
 	    break;
+	  case 'R':
+	    ringName = optarg;
+	    break;
+	  case 'B':
+	    receiveBuffer = atoi(optarg);
+	    if ( receiveBuffer < 1) {
+		fprintf(stderr,"Bad receive buffer size: %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	  case 'r':
 	    recentFileName = optarg;
 	    break;
@@ -250,6 +356,9 @@ int main( int argc, char **argv)
 		  minutes = m;
 	      }
 	      break;
+	  case 's':
+	    statsShmName = optarg;
+	    break;
 	  default:
 	    fprintf(stderr,"Illegal option\n");
 	    showHelp(stderr);
@@ -259,124 +368,43 @@ int main( int argc, char **argv)
 
     if ( verbose) fprintf(stderr,"Periodic file is %s\n", periodicFileName);
 
-    // Parse our multicast address
-    int sock = ook_open( multicastAddress, multicastPort, multicastInterface);
-    if ( sock < 0) {
-	fprintf(stderr,"Failed to open multicast interface\n");
-	exit(1);
+    if ( statsShmName) {
+	metrics = metricsOpen( statsShmName);
+	if ( !metrics) exit(1);
     }
 
-    for (;;) {
-	struct ook_burst *burst;
-	struct sockaddr_storage addr;
-	socklen_t addrLen = sizeof(addr);
-
-	int e = ook_decode_from_socket( sock, &burst, (struct sockaddr *)&addr, &addrLen, verbose);
-	if ( e < 0) {
-	    fprintf(stderr,"Failed to decode from socket: %s\n", strerror(errno));
-	    break;
-	}
-	if ( e == 0) {
-	    fprintf(stderr,"Corrupt burst\n");
-	    continue;
+    // Bursts come from ookd's ring if we share its host and were asked to, otherwise multicast
+    struct ook_ring *ring = 0;
+    int sock = -1;
+    if ( ringName) {
+	ring = ook_ring_attach( ringName);
+	if ( !ring) exit(1);
+    } else {
+	sock = ook_open( multicastAddress, multicastPort, multicastInterface);
+	if ( sock < 0) {
+	    fprintf(stderr,"Failed to open multicast interface\n");
+	    exit(1);
 	}
+	if ( receiveBuffer && ook_set_receive_buffer( sock, receiveBuffer) < 0) exit(1);
 
-	{
-	    unsigned char *data = 0;
-	    size_t dataLen = 0;
-	    int bits = ook_decode_pulse_width( burst, 
-					       1300000,1500000, 250000,400000, 900000,UINT_MAX, 
-					       &data, &dataLen,
-					       verbose);
-	    const int tx13_id = 0x06;
-	    const int ws2300_id = 0x09;
-
-	    if ( bits == 52 && (data[0] == tx13_id || data[0] == ws2300_id) ) {
-		unsigned csum = 0;
-		for ( int i = 0; i < 6; i++) {
-		    unsigned highNibble = (data[i]>>4);
-		    unsigned lowNibble = (data[i]&0x0f);
-		    csum += highNibble + lowNibble;
-		}
-	        unsigned csumNibble = (csum & 0x0f);
-		unsigned pcsumNibble = (data[6] & 0x0f);
-
-		if ( csumNibble != pcsumNibble) {
-		    fprintf(stderr,"Invalid checksum computed=0x%02x - packet says 0x%02x\n", csumNibble, pcsumNibble);
-		    goto NotGood;
-		}
-
-		if ( verbose) {
-		    for (int i = 0; i < dataLen; i++) fprintf(stderr,"%02x ", data[i]);
-		    fprintf(stderr,"\n");
-		}
-		
-		if ( oldestDatum && time(0)-oldestDatum > minutes*60) {
-		    recordPeriodic( periodicFileName);
-		}
-
-		int packetId = ((data[1]>>4)&0x03);
-		int stationId = ((data[1]&0x0f)<<4)+((data[2]&0xf0)>>4);
-
-		if ( verbose) fprintf(stderr,"packetid=%d station=%d\n", packetId, stationId);
-
-		switch( packetId) {
-		  case 0:               // temp
-		      {
-			  double temp = (data[3]&0x0f)*10 + ((data[4]&0xf0)>>4) + (data[4]&0x0f)*0.1 - 30.0;  // TX13 is -40
-			  addSample( &temperature, temp);
-			  currentTemperature = temp;
-		      }
-		    break;
-		  case 1:               // humidity
-		      {
-			  int hum = (data[3]&0x0f)*10 + ((data[4]&0xf0)>>4);
-			  addSample( &humidity, hum);
-			  currentHumidity = hum;
-		      }
-		    break;
-		  case 2:               // rainfall
-		      {
-			  int rain = ((data[3]&0x0f)<<8) + data[4];
-			  addSample( &rainfall, rain);
-		      }
-		    break;
-		  case 3:               // wind
-		      {
-			  double wind = (((data[3]&0x1f)<<4) + ((data[4]&0xf0)>>4) ) / 10.0;
-			  int windDir = (data[4] & 0x0f);
-			  if ( data[1] & 0x80) {
-			      if ( wind != 51.0) {
-				  addSample( &gustWindSpeed, wind);
-				  currentGustSpeed = wind;
-			      }
-			  } else {
-			      if ( wind != 51.0) {
-				  addSample( &averageWindSpeed, wind);
-				  addSample( &windDirection, windDir);
-				  currentWindSpeed = wind;
-				  currentWindDirection = windDir;
-			      }
-			  }
-		      }
-		    break;
-		}
-
-		if ( verbose) dumpWeather();
-
-		reportRecent(recentFileName);
-	    } else {
-		if ( verbose) fprintf(stderr,"ignored %d pulse burst\n", burst->pulses);
-	    }
+	// ws2300_decode() only takes 52 bits, a pulse each, don't wake for anything else
+	struct ook_filter filter = { .minPulses = 52, .maxPulses = 52 };
+	if ( ook_set_filter( sock, &filter) < 0) exit(1);
+    }
 
-	  NotGood:
-	    if (data) free(data);
-	}
+    struct ook_loop *loop = ook_loop_new();
+    if ( !loop) exit(1);
+    if ( (ring ? ook_loop_add_ring( loop, ring, handleBurst, 0, verbose)
+	       : ook_loop_add_socket( loop, sock, handleBurst, 0, verbose)) < 0) exit(1);
+    if ( !ook_loop_every( loop, 1000000000ULL, periodicTask, 0)) exit(1);
+    if ( ook_loop_signal( loop, SIGINT, stopOnSignal, loop) < 0) exit(1);
+    if ( ook_loop_signal( loop, SIGTERM, stopOnSignal, loop) < 0) exit(1);
 
-	fflush(stdin);
-	free(burst);
-    }
+    ook_loop_run( loop);
 
-    close(sock);
+    ook_loop_free( loop);
+    if ( sock >= 0) close(sock);
+    ook_ring_detach( ring);
+    metricsClose( metrics, statsShmName);
     return 0;
 }